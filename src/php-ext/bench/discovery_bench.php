@@ -0,0 +1,185 @@
+<?php
+/*
+ * Discovery scaling benchmark for the cast portal extension, measuring the
+ * completeness of cptl_discover() against a simulated device population
+ * (src/tools/mdnssim) as the device count and the wait period grow.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ *
+ * Multicast must work on the loopback interface, best done in a network
+ * namespace (which also excludes real devices), e.g. as root:
+ *
+ *   unshare -n sh -c 'ip link set lo up multicast on; \
+ *       ip route add 224.0.0.0/4 dev lo; \
+ *       php -d extension=modules/castportal.so bench/discovery_bench.php \
+ *           --devices=100,500,1000 --sim-opts="-S 250 -l 1"'
+ *
+ * Options:
+ *   --devices=L      comma separated simulated device counts (10,100,1000)
+ *   --waits=L        comma separated discovery wait periods, in milliseconds
+ *                    (100,250,500,1000,2000)
+ *   --runs=R         discovery runs for each count and wait (3)
+ *   --mdnssim=PATH   simulator binary (../tools/mdnssim from the source tree)
+ *   --sim-opts=ARGS  additional simulator arguments (spread, loss, packing...)
+ *   --external       use an already running simulator (single device count)
+ *   --json=FILE      also write the results as JSON, for later comparison
+ *
+ * Completeness is the fraction of the simulated devices found (by unique id,
+ * duplicates and other devices are reported separately).  Time to complete
+ * is the shortest wait period for which every run found every device, as the
+ * discovery always waits out the full period.
+ */
+
+$opts = getopt('', array('devices:', 'waits:', 'runs:', 'mdnssim:',
+                         'sim-opts:', 'external', 'json:', 'help'));
+if (isset($opts['help'])) {
+    $doc = file_get_contents(__FILE__);
+    preg_match('/Multicast.*?\*\//s', $doc, $match);
+    fwrite(STDERR, preg_replace('/^ \* ?/m', '', $match[0]) . "\n");
+    exit(0);
+}
+if (!extension_loaded('castptl')) {
+    fwrite(STDERR, "castptl extension is not loaded\n");
+    exit(2);
+}
+
+$deviceCounts = array_map('intval', explode(',', isset($opts['devices']) ?
+                                          $opts['devices'] : '10,100,1000'));
+$waits = array_map('intval', explode(',', isset($opts['waits']) ?
+                                   $opts['waits'] : '100,250,500,1000,2000'));
+$runs = isset($opts['runs']) ? (int) $opts['runs'] : 3;
+$mdnssim = isset($opts['mdnssim']) ? $opts['mdnssim'] :
+                              dirname(__DIR__) . '/../tools/mdnssim';
+$simOpts = isset($opts['sim-opts']) ? $opts['sim-opts'] : '';
+$external = isset($opts['external']);
+sort($waits, SORT_NUMERIC);
+if (($runs <= 0) || (min($deviceCounts) <= 0) || (min($waits) <= 0)) {
+    fwrite(STDERR, "Device counts, waits and runs must be positive\n");
+    exit(2);
+}
+if ($external && (count($deviceCounts) != 1)) {
+    fwrite(STDERR, "A single device count must be given with --external\n");
+    exit(2);
+}
+
+function now() {
+    return function_exists('hrtime') ? hrtime(true) / 1e9 : microtime(true);
+}
+
+/* Start the simulated population, waiting for the group membership */
+function startSimulator($mdnssim, $devices, $simOpts) {
+    if (!is_executable($mdnssim)) {
+        fwrite(STDERR, "Simulator '$mdnssim' not found, build src/tools " .
+                       "(make mdnssim) or use --mdnssim/--external\n");
+        exit(2);
+    }
+    $cmd = 'exec ' . escapeshellarg($mdnssim) . ' -n ' . $devices . ' ' .
+           $simOpts;
+    $proc = proc_open($cmd, array(0 => array('file', '/dev/null', 'r'),
+                                  1 => array('file', '/dev/null', 'w'),
+                                  2 => array('pipe', 'w')), $pipes);
+    if (!is_resource($proc)) {
+        fwrite(STDERR, "Unable to start simulator\n");
+        exit(1);
+    }
+    $line = fgets($pipes[2]);
+    if (($line === false) || (strpos($line, 'listening') === false)) {
+        fwrite(STDERR, "Simulator failed to start: $line\n");
+        proc_terminate($proc);
+        exit(1);
+    }
+    return array($proc, $pipes[2]);
+}
+
+/* Stop the simulator (SIGINT), returning its totals line */
+function stopSimulator($sim) {
+    list($proc, $stderr) = $sim;
+    proc_terminate($proc, 2);
+    $totals = trim(stream_get_contents($stderr));
+    proc_close($proc);
+    return $totals;
+}
+
+/* Simulated devices have a recognizable identifier (see mdnssim) */
+function isSimulated($id) {
+    return preg_match('/^[0-9a-f]{8}0{20}5137$/', $id) == 1;
+}
+
+$results = $summary = array();
+foreach ($deviceCounts as $devices) {
+    $sim = $external ? null : startSimulator($mdnssim, $devices, $simOpts);
+    $timeToComplete = null;
+
+    foreach ($waits as $wait) {
+        $found = $duplicates = $foreign = array();
+        $elapsed = 0.0;
+        for ($run = 0; $run < $runs; $run++) {
+            $start = now();
+            $discovered = cptl_discover(CPTL_INET4, $wait);
+            $elapsed += now() - $start;
+
+            $ids = array();
+            $others = 0;
+            foreach ($discovered as $device) {
+                if (isSimulated($device['id'])) {
+                    $ids[$device['id']] = true;
+                } else {
+                    $others++;
+                }
+            }
+            $found[] = count($ids);
+            $duplicates[] = count($discovered) - count($ids) - $others;
+            $foreign[] = $others;
+        }
+
+        $complete = (min($found) >= $devices);
+        if ($complete && ($timeToComplete === null)) $timeToComplete = $wait;
+        $results[] = array(
+            'devices' => $devices,
+            'wait_ms' => $wait,
+            'runs' => $runs,
+            'completeness_mean' => round(array_sum($found) /
+                                                 ($runs * $devices), 4),
+            'completeness_min' => round(min($found) / $devices, 4),
+            'duplicates_mean' => round(array_sum($duplicates) / $runs, 1),
+            'foreign_mean' => round(array_sum($foreign) / $runs, 1),
+            'elapsed_ms_mean' => round(1000.0 * $elapsed / $runs, 1)
+        );
+    }
+
+    $summary[$devices] = array(
+        'time_to_complete_ms' => $timeToComplete,
+        'sim_totals' => ($sim !== null) ? stopSimulator($sim) : null
+    );
+}
+
+/* Report, tabular for reading and (optionally) JSON for comparison */
+printf("runs=%d sim_opts=\"%s\" php=%s\n", $runs, $simOpts, PHP_VERSION);
+printf("%8s %8s %10s %10s %10s %8s %11s\n", 'devices', 'wait_ms',
+       'complete', 'min', 'dups', 'foreign', 'elapsed_ms');
+foreach ($results as $result) {
+    printf("%8d %8d %9.2f%% %9.2f%% %10.1f %8.1f %11.1f\n",
+           $result['devices'], $result['wait_ms'],
+           100.0 * $result['completeness_mean'],
+           100.0 * $result['completeness_min'], $result['duplicates_mean'],
+           $result['foreign_mean'], $result['elapsed_ms_mean']);
+}
+foreach ($summary as $devices => $info) {
+    printf("devices=%d time_to_complete_ms=%s\n", $devices,
+           ($info['time_to_complete_ms'] === null) ?
+                       'n/a' : $info['time_to_complete_ms']);
+    if ($info['sim_totals'] !== null) echo "  mdnssim: {$info['sim_totals']}\n";
+}
+
+if (isset($opts['json'])) {
+    $report = array('runs' => $runs, 'php' => PHP_VERSION,
+                    'sim_opts' => $simOpts, 'results' => $results,
+                    'summary' => $summary);
+    if (file_put_contents($opts['json'], json_encode($report) . "\n") ===
+                                                                   false) {
+        fwrite(STDERR, "Unable to write '{$opts['json']}'\n");
+        exit(1);
+    }
+}
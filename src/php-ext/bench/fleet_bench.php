@@ -0,0 +1,335 @@
+<?php
+/*
+ * Fleet-scale load generator and throughput benchmark for the cast portal
+ * extension, driving the public functions against simulated receivers
+ * (src/tools/castsim) on loopback ports.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ *
+ * Usage (from the extension build directory, after make):
+ *
+ *   php -d extension=modules/castportal.so bench/fleet_bench.php \
+ *       --receivers=200 --rounds=20 --sim-opts="-l 5 -j 2"
+ *
+ * Options:
+ *   --receivers=N    number of simulated receivers/connections (50)
+ *   --port=P         first receiver port, receivers are consecutive (18009)
+ *   --rounds=R       rounds of each workload (20)
+ *   --workloads=L    comma separated subset of connect, heartbeat, push and
+ *                    availability (all)
+ *   --timeout=MS     overall timeout for the fleet operations (2000)
+ *   --castsim=PATH   simulator binary (../tools/castsim from the source tree)
+ *   --sim-opts=ARGS  additional simulator arguments (latency, failures...)
+ *   --external       use already running receivers (don't start castsim)
+ *   --json=FILE      also write the results as JSON, for later comparison
+ *
+ * Each workload reports the operation rate, latency percentiles, the CPU time
+ * of this process per operation and, for the steady state fleet, the resident
+ * memory per connection.  Note that the file descriptor limit (ulimit -n) must
+ * allow for the receiver count (twice that when the simulator is started).
+ */
+
+$opts = getopt('', array('receivers:', 'port:', 'rounds:', 'workloads:',
+                         'timeout:', 'castsim:', 'sim-opts:', 'external',
+                         'json:', 'help'));
+if (isset($opts['help'])) {
+    $doc = file_get_contents(__FILE__);
+    preg_match('/Usage.*?\*\//s', $doc, $match);
+    fwrite(STDERR, preg_replace('/^ \* ?/m', '', $match[0]) . "\n");
+    exit(0);
+}
+if (!extension_loaded('castptl')) {
+    fwrite(STDERR, "castptl extension is not loaded\n");
+    exit(2);
+}
+
+$receivers = isset($opts['receivers']) ? (int) $opts['receivers'] : 50;
+$firstPort = isset($opts['port']) ? (int) $opts['port'] : 18009;
+$rounds = isset($opts['rounds']) ? (int) $opts['rounds'] : 20;
+$timeout = isset($opts['timeout']) ? (int) $opts['timeout'] : 2000;
+$workloads = explode(',', isset($opts['workloads']) ? $opts['workloads'] :
+                              'connect,heartbeat,push,availability');
+$castsim = isset($opts['castsim']) ? $opts['castsim'] :
+                              dirname(__DIR__) . '/../tools/castsim';
+$simOpts = isset($opts['sim-opts']) ? $opts['sim-opts'] : '';
+if (($receivers <= 0) || ($rounds <= 0)) {
+    fwrite(STDERR, "Receiver and round counts must be positive\n");
+    exit(2);
+}
+foreach ($workloads as $workload) {
+    if (!in_array($workload, array('connect', 'heartbeat', 'push',
+                                   'availability'))) {
+        fwrite(STDERR, "Unknown workload '$workload'\n");
+        exit(2);
+    }
+}
+
+/* Wall clock in seconds, monotonic where available (7.3+) */
+function now() {
+    return function_exists('hrtime') ? hrtime(true) / 1e9 : microtime(true);
+}
+
+/* User plus system CPU of this process, in microseconds */
+function cpuUsec() {
+    $usage = getrusage();
+    return $usage['ru_utime.tv_sec'] * 1e6 + $usage['ru_utime.tv_usec'] +
+           $usage['ru_stime.tv_sec'] * 1e6 + $usage['ru_stime.tv_usec'];
+}
+
+/* Resident set size in kilobytes (Linux), false if unavailable */
+function rssKb() {
+    $status = @file_get_contents('/proc/self/status');
+    if (($status === false) ||
+            (!preg_match('/^VmRSS:\s+(\d+)\s+kB/m', $status, $match))) {
+        return false;
+    }
+    return (int) $match[1];
+}
+
+/* Nearest-rank percentile of the (sorted) latency samples */
+function percentile($sorted, $pct) {
+    $count = count($sorted);
+    if ($count == 0) return null;
+    $rank = (int) ceil(($pct / 100.0) * $count);
+    return $sorted[max(0, min($count - 1, $rank - 1))];
+}
+
+/* Summarize the timing of a workload into the reported result entry */
+function summarize($name, $ops, $failures, $elapsed, $cpu, $latencies,
+                   $latencyOf) {
+    sort($latencies, SORT_NUMERIC);
+    return array(
+        'workload' => $name,
+        'ops' => $ops,
+        'failures' => $failures,
+        'elapsed_s' => round($elapsed, 4),
+        'ops_per_sec' => ($elapsed > 0) ? round($ops / $elapsed, 1) : 0,
+        'latency_of' => $latencyOf,
+        'p50_ms' => percentile($latencies, 50),
+        'p90_ms' => percentile($latencies, 90),
+        'p99_ms' => percentile($latencies, 99),
+        'max_ms' => (count($latencies) > 0) ? end($latencies) : null,
+        'cpu_us_per_op' => ($ops > 0) ? round($cpu / $ops, 1) : null
+    );
+}
+
+/* Start the simulated receivers, waiting for the listeners to be ready */
+function startSimulator($castsim, $firstPort, $receivers, $simOpts) {
+    if (!is_executable($castsim)) {
+        fwrite(STDERR, "Simulator '$castsim' not found, build src/tools " .
+                       "(make castsim) or use --castsim/--external\n");
+        exit(2);
+    }
+    $cmd = 'exec ' . escapeshellarg($castsim) . ' -p ' . $firstPort .
+           ' -n ' . $receivers . ' ' . $simOpts;
+    $proc = proc_open($cmd, array(0 => array('file', '/dev/null', 'r'),
+                                  1 => array('file', '/dev/null', 'w'),
+                                  2 => array('pipe', 'w')), $pipes);
+    if (!is_resource($proc)) {
+        fwrite(STDERR, "Unable to start simulator\n");
+        exit(1);
+    }
+
+    /* Certificate generation and binding takes a moment */
+    $deadline = now() + 10;
+    $line = '';
+    while (now() < $deadline) {
+        $read = array($pipes[2]);
+        $write = $except = null;
+        if (stream_select($read, $write, $except, 1) > 0) {
+            $line = fgets($pipes[2]);
+            if (($line === false) || (strpos($line, 'listening') !== false)) {
+                break;
+            }
+        }
+    }
+    if (($line === false) || (strpos($line, 'listening') === false)) {
+        fwrite(STDERR, "Simulator failed to start\n");
+        proc_terminate($proc);
+        exit(1);
+    }
+    return array($proc, $pipes[2]);
+}
+
+/* Stop the simulator (SIGINT), returning its totals line */
+function stopSimulator($sim) {
+    list($proc, $stderr) = $sim;
+    proc_terminate($proc, 2);
+    $totals = trim(stream_get_contents($stderr));
+    proc_close($proc);
+    return $totals;
+}
+
+/* Connect to all of the receivers, timing each connection */
+function connectFleet($firstPort, $receivers, &$latencies, &$failures) {
+    $conns = array();
+    for ($idx = 0; $idx < $receivers; $idx++) {
+        $start = now();
+        try {
+            $conn = cptl_device_connect('127.0.0.1', $firstPort + $idx);
+        } catch (Exception $ex) {
+            $conn = false;
+        }
+        if ($conn === false) {
+            $failures++;
+            continue;
+        }
+        $latencies[] = (now() - $start) * 1000.0;
+        $conns[$firstPort + $idx] = $conn;
+    }
+    return $conns;
+}
+
+function closeFleet($conns) {
+    foreach ($conns as $conn) cptl_device_close($conn);
+}
+
+$sim = isset($opts['external']) ? null :
+            startSimulator($castsim, $firstPort, $receivers, $simOpts);
+$results = array();
+
+/* Connect storm, full fleet (TCP, TLS and CONNECT) established and closed */
+if (in_array('connect', $workloads)) {
+    $latencies = array();
+    $failures = $ops = 0;
+    $cpu = cpuUsec();
+    $start = now();
+    for ($round = 0; $round < $rounds; $round++) {
+        $conns = connectFleet($firstPort, $receivers, $latencies, $failures);
+        $ops += count($conns);
+        closeFleet($conns);
+    }
+    $results[] = summarize('connect', $ops, $failures, now() - $start,
+                           cpuUsec() - $cpu, $latencies, 'connection');
+}
+
+/* Remaining workloads share a steady state fleet */
+$steady = array_diff($workloads, array('connect'));
+if (count($steady) > 0) {
+    $rssBefore = rssKb();
+    $latencies = array();
+    $failures = 0;
+    $conns = connectFleet($firstPort, $receivers, $latencies, $failures);
+    $rssAfter = rssKb();
+    $stats = cptl_stats();
+    $fleet = array(
+        'connections' => count($conns),
+        'connect_failures' => $failures,
+        'rss_per_conn_kb' => (($rssBefore !== false) && (count($conns) > 0)) ?
+                   round(($rssAfter - $rssBefore) / count($conns), 2) : null,
+        'ext_bytes_per_conn' => (count($conns) > 0) ?
+                   (int) ($stats['connections']['bytes'] / count($conns)) : null
+    );
+    if (count($conns) == 0) {
+        fwrite(STDERR, "No receiver connections established\n");
+        if ($sim !== null) stopSimulator($sim);
+        exit(1);
+    }
+
+    /* Steady heartbeats, concurrent pings across the fleet */
+    if (in_array('heartbeat', $steady)) {
+        $latencies = array();
+        $failures = $ops = 0;
+        $cpu = cpuUsec();
+        $start = now();
+        for ($round = 0; $round < $rounds; $round++) {
+            foreach (cptl_ping_many($conns, $timeout) as $rtt) {
+                if ($rtt === false) {
+                    $failures++;
+                } else {
+                    $ops++;
+                    $latencies[] = $rtt;
+                }
+            }
+        }
+        $results[] = summarize('heartbeat', $ops, $failures, now() - $start,
+                               cpuUsec() - $cpu, $latencies, 'ping');
+    }
+
+    /* Fan-out push, one message written to every connection */
+    if (in_array('push', $steady)) {
+        $latencies = array();
+        $failures = $ops = 0;
+        $payload = json_encode(array('type' => 'BENCH_PUSH',
+                                     'content' => str_repeat('x', 256)));
+        $cpu = cpuUsec();
+        $start = now();
+        for ($round = 0; $round < $rounds; $round++) {
+            $roundStart = now();
+            $outcome = cptl_broadcast($conns,
+                                      'urn:x-cast:com.google.cast.media',
+                                      $payload, $timeout);
+            $latencies[] = (now() - $roundStart) * 1000.0;
+            foreach ($outcome as $written) {
+                if ($written) {
+                    $ops++;
+                } else {
+                    $failures++;
+                }
+            }
+        }
+        $results[] = summarize('push', $ops, $failures, now() - $start,
+                               cpuUsec() - $cpu, $latencies, 'fleet round');
+    }
+
+    /* Availability sweep, concurrent queries across the fleet */
+    if (in_array('availability', $steady)) {
+        $latencies = array();
+        $failures = $ops = 0;
+        $cpu = cpuUsec();
+        $start = now();
+        for ($round = 0; $round < $rounds; $round++) {
+            foreach (cptl_app_available_many($conns, null,
+                                             $timeout) as $result) {
+                if ($result === false) {
+                    $failures++;
+                } else {
+                    $ops++;
+                    $latencies[] = $result['latency'];
+                }
+            }
+        }
+        $results[] = summarize('availability', $ops, $failures,
+                               now() - $start, cpuUsec() - $cpu, $latencies,
+                               'query');
+    }
+
+    closeFleet($conns);
+}
+
+$simTotals = ($sim !== null) ? stopSimulator($sim) : null;
+
+/* Report, tabular for reading and (optionally) JSON for comparison */
+printf("receivers=%d rounds=%d timeout=%dms php=%s\n", $receivers, $rounds,
+       $timeout, PHP_VERSION);
+printf("%-13s %9s %6s %11s %9s %9s %9s %9s %10s\n", 'workload', 'ops',
+       'fail', 'ops/s', 'p50_ms', 'p90_ms', 'p99_ms', 'max_ms', 'cpu_us/op');
+foreach ($results as $result) {
+    printf("%-13s %9d %6d %11.1f %9.3f %9.3f %9.3f %9.3f %10.1f\n",
+           $result['workload'], $result['ops'], $result['failures'],
+           $result['ops_per_sec'], $result['p50_ms'], $result['p90_ms'],
+           $result['p99_ms'], $result['max_ms'], $result['cpu_us_per_op']);
+}
+if (isset($fleet)) {
+    printf("fleet: connections=%d connect_failures=%d rss_per_conn_kb=%s " .
+           "ext_bytes_per_conn=%s\n", $fleet['connections'],
+           $fleet['connect_failures'],
+           ($fleet['rss_per_conn_kb'] === null) ? 'n/a' :
+                                                  $fleet['rss_per_conn_kb'],
+           $fleet['ext_bytes_per_conn']);
+}
+if ($simTotals !== null) echo "castsim: $simTotals\n";
+
+if (isset($opts['json'])) {
+    $report = array('receivers' => $receivers, 'rounds' => $rounds,
+                    'timeout_ms' => $timeout, 'php' => PHP_VERSION,
+                    'sim_opts' => $simOpts, 'results' => $results,
+                    'fleet' => isset($fleet) ? $fleet : null);
+    if (file_put_contents($opts['json'], json_encode($report) . "\n") ===
+                                                                   false) {
+        fwrite(STDERR, "Unable to write '{$opts['json']}'\n");
+        exit(1);
+    }
+}
@@ -5,7 +5,7 @@
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include "json.h"
@@ -59,18 +59,103 @@ static uint8_t _appUnavailResp[] = {
    0x42, 0x49, 0x4C, 0x49, 0x54, 0x59, 0x22, 0x7D    // BILITY"}
 };
 
+/* Test response for the receiver status request */
+static uint8_t _rcvrStatusResp[] = {
+    0x00, 0x00, 0x01, 0x1A, 0x08, 0x00, 0x12, 0x0A,   // ........
+    0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72,   // receiver
+    0x2D, 0x30, 0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64,   // -0..send
+    0x65, 0x72, 0x2D, 0x30, 0x22, 0x23, 0x75, 0x72,   // er-0"#ur
+    0x6E, 0x3A, 0x78, 0x2D, 0x63, 0x61, 0x73, 0x74,   // n:x-cast
+    0x3A, 0x63, 0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F,   // :com.goo
+    0x67, 0x6C, 0x65, 0x2E, 0x63, 0x61, 0x73, 0x74,   // gle.cast
+    0x2E, 0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65,   // .receive
+    0x72, 0x28, 0x00, 0x32, 0xD8, 0x01, 0x7B, 0x22,   // r(.2..{"
+    0x72, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x49,   // requestI
+    0x64, 0x22, 0x3A, 0x31, 0x2C, 0x22, 0x73, 0x74,   // d":1,"st
+    0x61, 0x74, 0x75, 0x73, 0x22, 0x3A, 0x7B, 0x22,   // atus":{"
+    0x61, 0x70, 0x70, 0x6C, 0x69, 0x63, 0x61, 0x74,   // applicat
+    0x69, 0x6F, 0x6E, 0x73, 0x22, 0x3A, 0x5B, 0x7B,   // ions":[{
+    0x22, 0x61, 0x70, 0x70, 0x49, 0x64, 0x22, 0x3A,   // "appId":
+    0x22, 0x30, 0x32, 0x38, 0x33, 0x34, 0x36, 0x34,   // "0283464
+    0x38, 0x22, 0x2C, 0x22, 0x64, 0x69, 0x73, 0x70,   // 8","disp
+    0x6C, 0x61, 0x79, 0x4E, 0x61, 0x6D, 0x65, 0x22,   // layName"
+    0x3A, 0x22, 0x50, 0x6F, 0x72, 0x74, 0x61, 0x6C,   // :"Portal
+    0x22, 0x2C, 0x22, 0x73, 0x65, 0x73, 0x73, 0x69,   // ","sessi
+    0x6F, 0x6E, 0x49, 0x64, 0x22, 0x3A, 0x22, 0x41,   // onId":"A
+    0x31, 0x42, 0x32, 0x2D, 0x43, 0x33, 0x44, 0x34,   // 1B2-C3D4
+    0x22, 0x2C, 0x22, 0x73, 0x74, 0x61, 0x74, 0x75,   // ","statu
+    0x73, 0x54, 0x65, 0x78, 0x74, 0x22, 0x3A, 0x22,   // sText":"
+    0x52, 0x65, 0x61, 0x64, 0x79, 0x22, 0x2C, 0x22,   // Ready","
+    0x74, 0x72, 0x61, 0x6E, 0x73, 0x70, 0x6F, 0x72,   // transpor
+    0x74, 0x49, 0x64, 0x22, 0x3A, 0x22, 0x77, 0x65,   // tId":"we
+    0x62, 0x2D, 0x35, 0x22, 0x7D, 0x5D, 0x2C, 0x22,   // b-5"}],"
+    0x76, 0x6F, 0x6C, 0x75, 0x6D, 0x65, 0x22, 0x3A,   // volume":
+    0x7B, 0x22, 0x6C, 0x65, 0x76, 0x65, 0x6C, 0x22,   // {"level"
+    0x3A, 0x30, 0x2E, 0x35, 0x2C, 0x22, 0x6D, 0x75,   // :0.5,"mu
+    0x74, 0x65, 0x64, 0x22, 0x3A, 0x66, 0x61, 0x6C,   // ted":fal
+    0x73, 0x65, 0x7D, 0x7D, 0x2C, 0x22, 0x74, 0x79,   // se}},"ty
+    0x70, 0x65, 0x22, 0x3A, 0x22, 0x52, 0x45, 0x43,   // pe":"REC
+    0x45, 0x49, 0x56, 0x45, 0x52, 0x5F, 0x53, 0x54,   // EIVER_ST
+    0x41, 0x54, 0x55, 0x53, 0x22, 0x7D                // ATUS"}
+};
+
+/* Test response for the receiver status with no running application */
+static uint8_t _rcvrIdleResp[] = {
+    0x00, 0x00, 0x00, 0xAB, 0x08, 0x00, 0x12, 0x0A,   // ........
+    0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72,   // receiver
+    0x2D, 0x30, 0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64,   // -0..send
+    0x65, 0x72, 0x2D, 0x30, 0x22, 0x23, 0x75, 0x72,   // er-0"#ur
+    0x6E, 0x3A, 0x78, 0x2D, 0x63, 0x61, 0x73, 0x74,   // n:x-cast
+    0x3A, 0x63, 0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F,   // :com.goo
+    0x67, 0x6C, 0x65, 0x2E, 0x63, 0x61, 0x73, 0x74,   // gle.cast
+    0x2E, 0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65,   // .receive
+    0x72, 0x28, 0x00, 0x32, 0x6A, 0x7B, 0x22, 0x72,   // r(.2j{"r
+    0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x49, 0x64,   // equestId
+    0x22, 0x3A, 0x31, 0x2C, 0x22, 0x73, 0x74, 0x61,   // ":1,"sta
+    0x74, 0x75, 0x73, 0x22, 0x3A, 0x7B, 0x22, 0x61,   // tus":{"a
+    0x70, 0x70, 0x6C, 0x69, 0x63, 0x61, 0x74, 0x69,   // pplicati
+    0x6F, 0x6E, 0x73, 0x22, 0x3A, 0x5B, 0x5D, 0x2C,   // ons":[],
+    0x22, 0x76, 0x6F, 0x6C, 0x75, 0x6D, 0x65, 0x22,   // "volume"
+    0x3A, 0x7B, 0x22, 0x6C, 0x65, 0x76, 0x65, 0x6C,   // :{"level
+    0x22, 0x3A, 0x30, 0x2E, 0x35, 0x2C, 0x22, 0x6D,   // ":0.5,"m
+    0x75, 0x74, 0x65, 0x64, 0x22, 0x3A, 0x66, 0x61,   // uted":fa
+    0x6C, 0x73, 0x65, 0x7D, 0x7D, 0x2C, 0x22, 0x74,   // lse}},"t
+    0x79, 0x70, 0x65, 0x22, 0x3A, 0x22, 0x52, 0x45,   // ype":"RE
+    0x43, 0x45, 0x49, 0x56, 0x45, 0x52, 0x5F, 0x53,   // CEIVER_S
+    0x54, 0x41, 0x54, 0x55, 0x53, 0x22, 0x7D          // TATUS"}
+};
+
 /* Various constants of the messaging/signalling of application status */
 static char *_reqType = "GET_APP_AVAILABILITY";
 static char *_appIsAvail = "APP_AVAILABLE";
 static char *_appNotAvail = "APP_UNAVAILABLE";
+static char *_statusType = "RECEIVER_STATUS";
+
+/* Application identifiers are embedded in requests, so restrict them */
+static int validAppId(const char *appId) {
+    if (*appId == '\0') return FALSE;
+    while (*appId != '\0') {
+        if ((!isalnum((unsigned char) *appId)) && (*appId != '_') &&
+                (*appId != '-') && (*appId != '.')) return FALSE;
+        appId++;
+    }
+    return TRUE;
+}
+
+/* Shorthand for building request messages (errors caught on completion) */
+static void appendStr(WXBuffer *buffer, const char *str) {
+    (void) WXBuffer_Append(buffer, str, strlen(str), TRUE);
+}
 
 /**
  * Callback to validate application availability response.  Note that this
- * is aligned to original request id, so it either matches or errors.
+ * is aligned to original request id, so it either matches or errors.  The
+ * parsed response is returned for the extraction of the individual application
+ * status values.
  */
 static void *parseAvailabilityResponse(CastDeviceConnection *conn,
                                        void *content, size_t contentLen) {
-    WXJSONValue *respType, *availData, *availStatus;
+    WXJSONValue *respType, *availData;
     WXJSONValue *val = (WXJSONValue *) content;
 
     /* Verify that the response aligns with the request */
@@ -78,36 +163,271 @@ static void *parseAvailabilityResponse(CastDeviceConnection *conn,
                                WXHash_StrHashFn, WXHash_StrEqualsFn);
     if ((respType == NULL) || (respType->type != WXJSONVALUE_STRING) ||
             (strcmp(respType->value.sval, _reqType) != 0)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Invalid response to matched availability request");
+        castLog(CPTL_LOG_WARNING,
+                "Invalid response to matched availability request");
         return CPTL_RESP_ERROR;
     }
 
-    /* Extract availability status for the target application */
+    /* Must contain availability status details */
     availData = WXHash_GetEntry(&(val->value.oval), "availability",
                                 WXHash_StrHashFn, WXHash_StrEqualsFn);
     if ((availData == NULL) || (availData->type != WXJSONVALUE_OBJECT)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Missing/invalid availability status object");
+        castLog(CPTL_LOG_WARNING, "Missing/invalid availability status object");
         return CPTL_RESP_ERROR;
     }
 
-    availStatus = WXHash_GetEntry(&(availData->value.oval),
-                                  CPTL_G(applicationId),
-                                  WXHash_StrHashFn, WXHash_StrEqualsFn);
-    if ((availStatus == NULL) || (availStatus->type != WXJSONVALUE_STRING)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Missing/invalid application availability record");
-        return CPTL_RESP_ERROR;
+    return val;
+}
+
+/**
+ * Encode the availability request for a set of application instances into
+ * the provided buffer (wire format), for issue alone or coalesced with other
+ * messages.
+ *
+ * @param conn The connection that the request will be issued on.
+ * @param frameBuffer The buffer to append the encoded request message to.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry (status is cleared).
+ * @param appCount The number of records in the results array.
+ * @param requestIdRef Returns the request identifier of the encoded request.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castAppEncodeAvailability(CastDeviceConnection *conn,
+                              WXBuffer *frameBuffer,
+                              CastAppAvailability *results, int appCount,
+                              int32_t *requestIdRef) {
+    uint8_t msgBufferData[1024];
+    char idBuffer[64];
+    WXBuffer msgBuffer;
+    int32_t requestId;
+    int idx, rc;
+
+    if (appCount <= 0) {
+        castLog(CPTL_LOG_WARNING,
+                "No applications specified for availability request");
+        return -1;
     }
 
-    /* Available, unavailable or invalid... */
-    if (strcmp(availStatus->value.sval, _appIsAvail) == 0) return _appIsAvail;
-    if (strcmp(availStatus->value.sval, _appNotAvail) == 0) return _appNotAvail;
-    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                     "Invalid application availability status: %s",
-                     availStatus->value.sval);
-    return CPTL_RESP_ERROR;
+    /* Assemble the request content (dynamic), all applications at once */
+    requestId = ++(conn->requestId);
+    if (CPTL_CTX(testMode) != 0) requestId = 1;
+    WXBuffer_InitLocal(&msgBuffer, msgBufferData, sizeof(msgBufferData));
+    (void) snprintf(idBuffer, sizeof(idBuffer), "%d", requestId);
+    appendStr(&msgBuffer, "{\"type\": \"");
+    appendStr(&msgBuffer, _reqType);
+    appendStr(&msgBuffer, "\",\"appId\": [");
+    for (idx = 0; idx < appCount; idx++) {
+        results[idx].status[0] = '\0';
+        if (!validAppId(results[idx].appId)) {
+            castLog(CPTL_LOG_WARNING,
+                    "Invalid application identifier '%s'",
+                    results[idx].appId);
+            WXBuffer_Destroy(&msgBuffer);
+            return -1;
+        }
+        appendStr(&msgBuffer, (idx != 0) ? ", \"" : " \"");
+        appendStr(&msgBuffer, results[idx].appId);
+        appendStr(&msgBuffer, "\"");
+    }
+    appendStr(&msgBuffer, " ],\"requestId\": ");
+    appendStr(&msgBuffer, idBuffer);
+
+    /* Note that this includes the terminator, message is sent as a string */
+    if (WXBuffer_Append(&msgBuffer, "}", 2, TRUE) == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to allocate application availability request");
+        WXBuffer_Destroy(&msgBuffer);
+        return -1;
+    }
+
+    /* Wrap it for the device receiver */
+    rc = castEncodeFrame(frameBuffer, CPTL_SENDER_ID, CPTL_RECEIVER_ID,
+                         castNamespaceName(NS_RECEIVER), msgBuffer.buffer, -1);
+    WXBuffer_Destroy(&msgBuffer);
+    if (rc < 0) return -1;
+
+    *requestIdRef = requestId;
+    return 0;
+}
+
+/* Common method to assemble and issue the availability request */
+static int sendAvailabilityRequest(CastDeviceConnection *conn,
+                                   CastAppAvailability *results, int appCount,
+                                   int32_t *requestIdRef) {
+    uint8_t frameBufferData[2048];
+    WXBuffer frameBuffer;
+    int rc;
+
+    WXBuffer_InitLocal(&frameBuffer, frameBufferData, sizeof(frameBufferData));
+    rc = castAppEncodeAvailability(conn, &frameBuffer, results, appCount,
+                                   requestIdRef);
+    if (rc == 0) {
+        rc = castWriteFrames(conn, frameBuffer.buffer, frameBuffer.length);
+        if (rc < 0) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to issue application availability "
+                    "request");
+        }
+    }
+    WXBuffer_Destroy(&frameBuffer);
+    if (rc < 0) return -1;
+
+    /* Setup the simulated response for test mode */
+    if (CPTL_CTX(testMode) == 1) {
+        CPTL_CTX(testResp) = _appAvailResp;
+        CPTL_CTX(testRespLen) = sizeof(_appAvailResp);
+    } else {
+        CPTL_CTX(testResp) = _appUnavailResp;
+        CPTL_CTX(testRespLen) = sizeof(_appUnavailResp);
+    }
+
+    return 0;
+}
+
+/**
+ * Extract the application status values from an availability response.
+ *
+ * @param response The parsed JSON content of the GET_APP_AVAILABILITY
+ *                 response.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @return Zero on success, -1 if the response is invalid (logged).
+ */
+int castAppExtractAvailability(WXJSONValue *response,
+                               CastAppAvailability *results, int appCount) {
+    WXJSONValue *availData, *availStatus;
+    int idx;
+
+    availData = WXHash_GetEntry(&(response->value.oval), "availability",
+                                WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((availData == NULL) || (availData->type != WXJSONVALUE_OBJECT)) {
+        castLog(CPTL_LOG_WARNING, "Missing/invalid availability status object");
+        return -1;
+    }
+
+    /* Extract the status for each of the requested applications */
+    for (idx = 0; idx < appCount; idx++) {
+        availStatus = WXHash_GetEntry(&(availData->value.oval),
+                                      (void *) results[idx].appId,
+                                      WXHash_StrHashFn, WXHash_StrEqualsFn);
+        if ((availStatus == NULL) ||
+                (availStatus->type != WXJSONVALUE_STRING)) continue;
+        (void) strncpy(results[idx].status, availStatus->value.sval,
+                       CPTL_MAX_APP_STATUS);
+        results[idx].status[CPTL_MAX_APP_STATUS - 1] = '\0';
+    }
+
+    return 0;
+}
+
+/**
+ * Query the availability of a set of application instances on the associated
+ * device (connection), using a single request.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @return Zero on success (communicated, results populated), -1 on error
+ *         (logged).
+ */
+int castAppQueryAvailability(CastDeviceConnection *conn,
+                             CastAppAvailability *results, int appCount) {
+    int64_t traceBegin = CPTL_TRACE_BEGIN();
+    WXJSONValue *response;
+    int32_t requestId;
+
+    /* Just in case a malformed resource gets destroyed */
+    if (conn == NULL) return -1;
+
+    /* Issue the request */
+    if (sendAvailabilityRequest(conn, results, appCount, &requestId) < 0) {
+        return -1;
+    }
+
+    /* Filter the response */
+    response = castReceiveMessage(conn, FALSE, FALSE, NS_RECEIVER,
+                                  parseAvailabilityResponse, TRUE, requestId);
+    if (response == NULL) {
+        castLog(CPTL_LOG_WARNING, "Unable to obtain availability response");
+        return -1;
+    }
+    (void) castAppExtractAvailability(response, results, appCount);
+    castResponseRelease(response);
+    CPTL_TRACE_END("app.availability", NULL, traceBegin);
+
+    return 0;
+}
+
+/**
+ * Query the availability of a set of application instances across multiple
+ * devices concurrently.  Requests are issued to all devices and the responses
+ * collected through a single wait with an overall deadline.
+ *
+ * @param conns Array of device connections to query, NULL entries are skipped.
+ * @param connCount The number of connections in the conns array.
+ * @param results Array of availability records, connCount rows of appCount
+ *                records, with the appId of each populated on entry.
+ * @param appCount The number of applications queried per device.
+ * @param latencies Array (connCount entries) for the elapsed time (in
+ *                  microseconds) of each response, -1 if no valid response.
+ * @param timeout Overall time period to wait for responses (milliseconds).
+ * @return The number of devices that responded successfully.
+ */
+int castAppSweepAvailability(CastDeviceConnection **conns, int connCount,
+                             CastAppAvailability *results, int appCount,
+                             int64_t *latencies, int32_t timeout) {
+    CastPendingResponse *pending;
+    int32_t requestId;
+    int idx, completed;
+
+    pending = (CastPendingResponse *) WXCalloc(connCount *
+                                               sizeof(CastPendingResponse));
+    if (pending == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to allocate availability sweep tracking");
+        return 0;
+    }
+
+    /* Nothing is reported for anyone until the response arrives */
+    for (idx = 0; idx < connCount * appCount; idx++) {
+        results[idx].status[0] = '\0';
+    }
+
+    /* Everybody gets the request up front */
+    for (idx = 0; idx < connCount; idx++) {
+        latencies[idx] = -1;
+        if (conns[idx] == NULL) continue;
+        pending[idx].startTime = castTimeUsec();
+        if (sendAvailabilityRequest(conns[idx], results + idx * appCount,
+                                    appCount, &requestId) < 0) continue;
+        pending[idx].conn = conns[idx];
+        pending[idx].state = CPTL_PENDING_WAIT;
+        pending[idx].filter.forSenderSession = FALSE;
+        pending[idx].filter.fromPortalReceiver = FALSE;
+        pending[idx].filter.namespace = NS_RECEIVER;
+        pending[idx].filter.expJsonResponse = TRUE;
+        pending[idx].filter.requestId = requestId;
+        pending[idx].filter.responseCallback = parseAvailabilityResponse;
+    }
+
+    /* Then wait for the lot at once */
+    completed = castReceiveMultiple(pending, connCount, timeout);
+
+    for (idx = 0; idx < connCount; idx++) {
+        if (pending[idx].state != CPTL_PENDING_DONE) continue;
+        (void) castAppExtractAvailability(
+                            (WXJSONValue *) pending[idx].response,
+                            results + idx * appCount, appCount);
+        castResponseRelease((WXJSONValue *) pending[idx].response);
+        latencies[idx] = pending[idx].elapsed;
+    }
+    WXFree(pending);
+
+    return completed;
 }
 
 /**
@@ -119,47 +439,364 @@ static void *parseAvailabilityResponse(CastDeviceConnection *conn,
  *         available), -1 on error or unavailable application (logged).
  */
 int castAppCheckAvailability(CastDeviceConnection *conn) {
-    char msgBuffer[1024];
-    void *retval = NULL;
+    CastAppAvailability result;
+
+    /* Just a degenerate case of the multiple application query */
+    result.appId = CPTL_CFG(applicationId);
+    if (castAppQueryAvailability(conn, &result, 1) < 0) return -1;
+
+    /* Available, unavailable or invalid... */
+    if (strcmp(result.status, _appIsAvail) == 0) return 0;
+    if (strcmp(result.status, _appNotAvail) == 0) {
+        castLog(CPTL_LOG_WARNING,
+                "Target application is not available on device");
+        return -1;
+    }
+    if (result.status[0] == '\0') {
+        castLog(CPTL_LOG_WARNING,
+                "Missing/invalid application availability record");
+    } else {
+        castLog(CPTL_LOG_WARNING,
+                "Invalid application availability status: %s",
+                result.status);
+    }
+    return -1;
+}
+
+
+/* Shorthand for capturing (truncated) string elements of the status */
+static void copyStatusValue(char *dest, WXJSONValue *obj, const char *key) {
+    WXJSONValue *val = WXHash_GetEntry(&(obj->value.oval), (void *) key,
+                                       WXHash_StrHashFn, WXHash_StrEqualsFn);
+
+    *dest = '\0';
+    if ((val == NULL) || (val->type != WXJSONVALUE_STRING)) return;
+    (void) strncpy(dest, val->value.sval, CPTL_MAX_STATUS_VALUE);
+    dest[CPTL_MAX_STATUS_VALUE - 1] = '\0';
+}
+
+/**
+ * Update the receiver status snapshot of the connection from a RECEIVER_STATUS
+ * message (response or unsolicited broadcast).  Other messages are ignored.
+ *
+ * @param conn The connection the message was received on.
+ * @param message The parsed JSON content of the receiver namespace message.
+ */
+void castAppUpdateStatus(CastDeviceConnection *conn, WXJSONValue *message) {
+    WXJSONValue *msgType, *status, *apps, *app, *volume, *val;
+    CastReceiverStatus *rcvrStatus;
+    WXJSONValue *selected = NULL;
+    int idx;
+
+    if (message->type != WXJSONVALUE_OBJECT) return;
+    msgType = WXHash_GetEntry(&(message->value.oval), "type",
+                              WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((msgType == NULL) || (msgType->type != WXJSONVALUE_STRING) ||
+            (strcmp(msgType->value.sval, _statusType) != 0)) return;
+    status = WXHash_GetEntry(&(message->value.oval), "status",
+                             WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((status == NULL) || (status->type != WXJSONVALUE_OBJECT)) return;
+
+    /* Snapshot is allocated on the first status for the connection */
+    if (conn->receiverStatus == NULL) {
+        conn->receiverStatus =
+              (CastReceiverStatus *) WXCalloc(sizeof(CastReceiverStatus));
+        if (conn->receiverStatus == NULL) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to allocate receiver status snapshot");
+            return;
+        }
+    }
+    rcvrStatus = conn->receiverStatus;
+
+    /* Track the configured application if running, otherwise the first */
+    rcvrStatus->isAppRunning = FALSE;
+    apps = WXHash_GetEntry(&(status->value.oval), "applications",
+                           WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((apps != NULL) && (apps->type == WXJSONVALUE_ARRAY)) {
+        for (idx = 0; idx < apps->value.aval.length; idx++) {
+            app = ((WXJSONValue *) apps->value.aval.array) + idx;
+            if (app->type != WXJSONVALUE_OBJECT) continue;
+            if (selected == NULL) selected = app;
+            val = WXHash_GetEntry(&(app->value.oval), "appId",
+                                  WXHash_StrHashFn, WXHash_StrEqualsFn);
+            if ((val != NULL) && (val->type == WXJSONVALUE_STRING) &&
+                    (strcmp(val->value.sval, CPTL_CFG(applicationId)) == 0)) {
+                rcvrStatus->isAppRunning = TRUE;
+                selected = app;
+                break;
+            }
+        }
+    }
+    if (selected != NULL) {
+        copyStatusValue(rcvrStatus->appId, selected, "appId");
+        copyStatusValue(rcvrStatus->displayName, selected, "displayName");
+        copyStatusValue(rcvrStatus->sessionId, selected, "sessionId");
+        copyStatusValue(rcvrStatus->transportId, selected, "transportId");
+        copyStatusValue(rcvrStatus->statusText, selected, "statusText");
+    } else {
+        rcvrStatus->appId[0] = rcvrStatus->displayName[0] = '\0';
+        rcvrStatus->sessionId[0] = rcvrStatus->transportId[0] = '\0';
+        rcvrStatus->statusText[0] = '\0';
+    }
+
+    /* Volume is optional in the status (unchanged if missing) */
+    volume = WXHash_GetEntry(&(status->value.oval), "volume",
+                             WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((volume != NULL) && (volume->type == WXJSONVALUE_OBJECT)) {
+        val = WXHash_GetEntry(&(volume->value.oval), "level",
+                              WXHash_StrHashFn, WXHash_StrEqualsFn);
+        if ((val != NULL) && (val->type == WXJSONVALUE_DOUBLE)) {
+            rcvrStatus->volumeLevel = val->value.dval;
+        } else if ((val != NULL) && (val->type == WXJSONVALUE_INT)) {
+            rcvrStatus->volumeLevel = (double) val->value.ival;
+        }
+        val = WXHash_GetEntry(&(volume->value.oval), "muted",
+                              WXHash_StrHashFn, WXHash_StrEqualsFn);
+        if ((val != NULL) && ((val->type == WXJSONVALUE_TRUE) ||
+                              (val->type == WXJSONVALUE_FALSE))) {
+            rcvrStatus->isMuted = (val->type == WXJSONVALUE_TRUE);
+        }
+    }
+
+    rcvrStatus->updateTime = castTimeUsec();
+}
+
+/* Callback for the status request, snapshot is updated as parsed */
+static void *parseStatusResponse(CastDeviceConnection *conn,
+                                 void *content, size_t contentLen) {
+    WXJSONValue *msgType, *val = (WXJSONValue *) content;
+
+    msgType = WXHash_GetEntry(&(val->value.oval), "type",
+                              WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((msgType == NULL) || (msgType->type != WXJSONVALUE_STRING) ||
+            (strcmp(msgType->value.sval, _statusType) != 0)) {
+        castLog(CPTL_LOG_WARNING, "Invalid response to matched status request");
+        return CPTL_RESP_ERROR;
+    }
+
+    /* No snapshot only if it could not be allocated (logged) */
+    if (conn->receiverStatus == NULL) return CPTL_RESP_ERROR;
+    return conn->receiverStatus;
+}
+
+/* Drain callback, never matches (snapshot is updated as a side effect) */
+static void *ignoreResponse(CastDeviceConnection *conn,
+                            void *content, size_t contentLen) {
+    return NULL;
+}
+
+/* Apply pending status broadcasts, true if the snapshot is recent enough */
+static int freshStatus(CastDeviceConnection *conn, int32_t maxAge) {
+    CastMessageFilter filter;
+
+    /* Pick up any broadcasts that have arrived since the last exchange */
+    if (conn->ssl != NULL) {
+        if (castReadAvailable(conn) < 0) return -1;
+        (void) memset(&filter, 0, sizeof(filter));
+        filter.forSenderSession = -1;
+        filter.fromPortalReceiver = FALSE;
+        filter.namespace = NS_RECEIVER;
+        filter.expJsonResponse = TRUE;
+        filter.responseCallback = ignoreResponse;
+        (void) castProcessFiltered(conn, &filter);
+    }
+
+    return ((maxAge > 0) && (conn->receiverStatus != NULL) &&
+            (castTimeUsec() - conn->receiverStatus->updateTime <=
+                                        ((int64_t) maxAge) * 1000)) ? 1 : 0;
+}
+
+/**
+ * Obtain the receiver status of the device, from the snapshot maintained by
+ * the status broadcasts if it is recent enough, otherwise through a status
+ * request to the device.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param maxAge Maximum age (milliseconds) of a cached status to be returned,
+ *               zero to always request the current status.
+ * @return The (updated) status snapshot of the connection or NULL on error
+ *         (logged).
+ */
+CastReceiverStatus *castAppReceiverStatus(CastDeviceConnection *conn,
+                                          int32_t maxAge) {
+    CastReceiverStatus *rcvrStatus;
+    CastMessageFilter filter;
+    char msgBuffer[128];
     int32_t requestId;
+    int fresh;
 
     /* Just in case a malformed resource gets destroyed */
-    if (conn == NULL) return -1;
+    if (conn == NULL) return NULL;
+
+    /* Answer locally if the snapshot is recent enough */
+    if ((fresh = freshStatus(conn, maxAge)) < 0) return NULL;
+    if (fresh) return conn->receiverStatus;
 
-    /* Assemble the request content (dynamic) */
+    /* Otherwise, ask the device */
     requestId = ++(conn->requestId);
-    if (_cptl_tstmode != 0) requestId = 1;
+    if (CPTL_CTX(testMode) != 0) requestId = 1;
     (void) snprintf(msgBuffer, sizeof(msgBuffer),
-                    "{"
-                        "\"type\": \"%s\","
-                        "\"appId\": [ \"%s\" ],"
-                        "\"requestId\": %d"
-                     "}",
-                     _reqType, CPTL_G(applicationId), requestId);
-
-    /* And send it */
+                    "{\"type\": \"GET_STATUS\", \"requestId\": %d}",
+                    requestId);
     if (castSendMessage(conn, FALSE, FALSE, NS_RECEIVER, msgBuffer, -1) < 0) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to issue application availability request");
-        return -1;
+        castLog(CPTL_LOG_WARNING, "Failed to issue receiver status request");
+        return NULL;
     }
 
-    /* Filter the response */
-    _cptl_tstresp = (_cptl_tstmode == 1) ? _appAvailResp : _appUnavailResp;
-    _cptl_tstresplen = (_cptl_tstmode == 1) ? sizeof(_appAvailResp) :
-                                              sizeof(_appUnavailResp);
-    retval = castReceiveMessage(conn, FALSE, FALSE, NS_RECEIVER,
-                                parseAvailabilityResponse, TRUE, requestId);
-    if ((retval != _appIsAvail) && (retval != _appNotAvail)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Unable to obtain availability response");
-        return -1;
+    /* Setup the simulated response for test mode */
+    if (CPTL_CTX(testMode) == 1) {
+        CPTL_CTX(testResp) = _rcvrStatusResp;
+        CPTL_CTX(testRespLen) = sizeof(_rcvrStatusResp);
+    } else {
+        CPTL_CTX(testResp) = _rcvrIdleResp;
+        CPTL_CTX(testRespLen) = sizeof(_rcvrIdleResp);
     }
-    if (retval == _appNotAvail) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Target application is not available on device");
-        return -1;
+
+    rcvrStatus = castReceiveMessage(conn, FALSE, FALSE, NS_RECEIVER,
+                                    parseStatusResponse, TRUE, requestId);
+    if (rcvrStatus == NULL) {
+        castLog(CPTL_LOG_WARNING, "Unable to obtain receiver status response");
+        return NULL;
     }
 
-    return 0;
+    return rcvrStatus;
+}
+
+/* Callback for the launch request, waits for the application transport */
+static void *parseLaunchResponse(CastDeviceConnection *conn,
+                                 void *content, size_t contentLen) {
+    WXJSONValue *msgType, *reason, *val = (WXJSONValue *) content;
+
+    msgType = WXHash_GetEntry(&(val->value.oval), "type",
+                              WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((msgType == NULL) || (msgType->type != WXJSONVALUE_STRING)) {
+        return NULL;
+    }
+    if ((strcmp(msgType->value.sval, "LAUNCH_ERROR") == 0) ||
+            (strcmp(msgType->value.sval, "INVALID_REQUEST") == 0)) {
+        reason = WXHash_GetEntry(&(val->value.oval), "reason",
+                                 WXHash_StrHashFn, WXHash_StrEqualsFn);
+        castLog(CPTL_LOG_WARNING,
+                "Application launch failed: %s",
+                ((reason != NULL) &&
+                     (reason->type == WXJSONVALUE_STRING)) ?
+                         reason->value.sval : msgType->value.sval);
+        return CPTL_RESP_ERROR;
+    }
+
+    /* Status snapshot has already been updated, done once transport appears */
+    if ((conn->receiverStatus != NULL) &&
+            (conn->receiverStatus->isAppRunning) &&
+            (conn->receiverStatus->transportId[0] != '\0')) {
+        return conn->receiverStatus;
+    }
+    return NULL;
+}
+
+/**
+ * Launch the configured application on the device (unless a recent status
+ * shows it already running) and open a virtual channel to the application
+ * transport.  Without a recent status, the launch is issued directly (the
+ * device answers with the running session if there is one) rather than a
+ * status request first.  The channel CONNECT and the initial application
+ * message are issued as soon as the transport is reported, without waiting
+ * for any other response.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel.
+ * @param namespace Full namespace string for the initial application message,
+ *                  NULL for no initial message.
+ * @param payload String content of the initial application message.
+ * @param timeout Time period to wait for the launch to complete (milliseconds).
+ * @param reused Returns true if the already running application session was
+ *               used (known from the status or the prior session), false if
+ *               the application was launched.
+ * @return The status snapshot of the connection (with the session and
+ *         transport details of the application) or NULL on error (logged).
+ */
+CastReceiverStatus *castAppLaunch(CastDeviceConnection *conn,
+                                  const char *sourceId, const char *namespace,
+                                  const char *payload, int32_t timeout,
+                                  int *reused) {
+    char msgBuffer[256], priorSession[CPTL_MAX_STATUS_VALUE];
+    CastReceiverStatus *rcvrStatus;
+    CastMessageFilter filter;
+    CastChannel *channel;
+    int32_t requestId;
+    int fresh;
+
+    /* Just in case a malformed resource gets destroyed */
+    if (conn == NULL) return NULL;
+
+    /* A recent tracked status tells us if there is a session to join */
+    if ((fresh = freshStatus(conn, CPTL_CFG(statusCacheTtl))) < 0) return NULL;
+    rcvrStatus = conn->receiverStatus;
+    *reused = ((fresh) && (rcvrStatus->isAppRunning) &&
+                   (rcvrStatus->transportId[0] != '\0')) ? TRUE : FALSE;
+
+    if (!(*reused)) {
+        if (!validAppId(CPTL_CFG(applicationId))) {
+            castLog(CPTL_LOG_WARNING,
+                    "Invalid application identifier '%s'",
+                    CPTL_CFG(applicationId));
+            return NULL;
+        }
+        requestId = ++(conn->requestId);
+        if (CPTL_CTX(testMode) != 0) requestId = 1;
+        (void) snprintf(msgBuffer, sizeof(msgBuffer),
+                        "{\"type\": \"LAUNCH\", \"appId\": \"%s\", "
+                        "\"requestId\": %d}", CPTL_CFG(applicationId),
+                        requestId);
+        if (castSendMessage(conn, FALSE, FALSE, NS_RECEIVER,
+                            msgBuffer, -1) < 0) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to issue application launch request");
+            return NULL;
+        }
+
+        /* Stale transport must not complete the launch, but note the session */
+        priorSession[0] = '\0';
+        if (rcvrStatus != NULL) {
+            if (rcvrStatus->isAppRunning) {
+                (void) strcpy(priorSession, rcvrStatus->sessionId);
+            }
+            rcvrStatus->isAppRunning = FALSE;
+            rcvrStatus->transportId[0] = '\0';
+        }
+
+        /* Setup the simulated response for test mode */
+        CPTL_CTX(testResp) = _rcvrStatusResp;
+        CPTL_CTX(testRespLen) = sizeof(_rcvrStatusResp);
+
+        /* Intermediate status broadcasts are skipped until transport known */
+        (void) memset(&filter, 0, sizeof(filter));
+        filter.forSenderSession = -1;
+        filter.fromPortalReceiver = FALSE;
+        filter.namespace = NS_RECEIVER;
+        filter.expJsonResponse = TRUE;
+        filter.timeout = timeout;
+        filter.responseCallback = parseLaunchResponse;
+        rcvrStatus = castReceiveFiltered(conn, &filter);
+        if (rcvrStatus == NULL) {
+            castLog(CPTL_LOG_WARNING, "Application launch did not complete");
+            return NULL;
+        }
+        *reused = ((priorSession[0] != '\0') &&
+                       (strcmp(priorSession, rcvrStatus->sessionId) == 0)) ?
+                                                                TRUE : FALSE;
+    }
+
+    /* Prior channel might reference an earlier application instance */
+    channel = castChannelFind(conn, sourceId);
+    if ((channel != NULL) &&
+            (strcmp(channel->destinationId, rcvrStatus->transportId) != 0)) {
+        castChannelClose(conn, channel);
+    }
+
+    /* Connect and initial message go out together, no round trip */
+    if (castChannelOpenSend(conn, sourceId, rcvrStatus->transportId,
+                            namespace, payload) == NULL) return NULL;
+
+    return rcvrStatus;
 }
@@ -5,14 +5,423 @@
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+#include <time.h>
+#ifdef CPTL_THREADED
+#include <pthread.h>
+#endif
 #include "socket.h"
 #include "buffer.h"
 
+/* Size of the challenge nonce and of the fingerprints (SHA-256) */
+#define AUTH_NONCE_LEN 16
+#define AUTH_FINGERPRINT_LEN 32
+
+/* Limit on the number of intermediates accepted in the response */
+#define AUTH_MAX_INTERMEDIATES 8
+
+/*
+ * Verified devices, keyed by the fingerprint of the TLS peer certificate (the
+ * content the device signed), not the device certificate of the response.
+ */
+typedef struct {
+    uint8_t peerFingerprint[AUTH_FINGERPRINT_LEN];
+    time_t expiry;
+} AuthCacheEntry;
+
+/* Note that this is process-wide, survives across requests (not emalloc) */
+static AuthCacheEntry authCache[CPTL_AUTH_CACHE_SIZE];
+
+/* And therefore shared across the request threads when threaded */
+#ifdef CPTL_THREADED
+static pthread_mutex_t authCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_CACHE() (void) pthread_mutex_lock(&authCacheLock)
+#define UNLOCK_CACHE() (void) pthread_mutex_unlock(&authCacheLock)
+#else
+#define LOCK_CACHE()
+#define UNLOCK_CACHE()
+#endif
+
+/**
+ * Process-wide initialization of the (shared) authentication cache, called
+ * once from module startup.
+ */
+void castAuthInit() {
+    (void) memset(authCache, 0, sizeof(authCache));
+}
+
+/**
+ * Release the authentication cache resources, at module shutdown.
+ */
+void castAuthCleanup() {
+    LOCK_CACHE();
+    (void) memset(authCache, 0, sizeof(authCache));
+    UNLOCK_CACHE();
+}
+
+/* Elements of the (parsed) AuthResponse, references into the message */
+typedef struct {
+    uint8_t *signature;
+    size_t signatureLen;
+    uint8_t *deviceCert;
+    size_t deviceCertLen;
+    uint8_t *intermediates[AUTH_MAX_INTERMEDIATES];
+    size_t intermediateLens[AUTH_MAX_INTERMEDIATES];
+    int intermediateCount;
+    uint8_t *senderNonce;
+    size_t senderNonceLen;
+    uint32_t signatureAlgorithm;
+    uint32_t hashAlgorithm;
+} AuthResponse;
+
+/* Read a protobuf varint, returns -1 if truncated/overlong */
+static int readVarint(uint8_t **ptr, uint8_t *end, uint64_t *val) {
+    int shift = 0;
+
+    *val = 0;
+    while (*ptr < end) {
+        *val |= ((uint64_t) (**ptr & 0x7F)) << shift;
+        if ((*((*ptr)++) & 0x80) == 0) return 0;
+        if ((shift += 7) >= 64) return -1;
+    }
+    return -1;
+}
+
+/*
+ * Read the next protobuf field, either a varint or length delimited (all that
+ * the auth messages use).  Returns 1 if a field was read, 0 at the end of the
+ * content and -1 on a format error.
+ */
+static int readField(uint8_t **ptr, uint8_t *end, uint32_t *fieldIdx,
+                     uint8_t **data, size_t *dataLen, uint64_t *varint) {
+    uint64_t tag, len;
+
+    if (*ptr >= end) return 0;
+    if (readVarint(ptr, end, &tag) < 0) return -1;
+    *fieldIdx = (uint32_t) (tag >> 3);
+    switch (tag & 0x07) {
+        case 0:
+            *data = NULL;
+            *dataLen = 0;
+            return (readVarint(ptr, end, varint) < 0) ? -1 : 1;
+        case 2:
+            if (readVarint(ptr, end, &len) < 0) return -1;
+            if (len > (uint64_t) (end - *ptr)) return -1;
+            *data = *ptr;
+            *dataLen = (size_t) len;
+            *ptr += len;
+            return 1;
+    }
+    return -1;
+}
+
+/* Parse the DeviceAuthMessage from the device, -1 if error or not response */
+static int parseAuthMessage(uint8_t *msg, size_t msgLen, AuthResponse *resp) {
+    uint8_t *ptr = msg, *end = msg + msgLen, *data, *rptr, *rend;
+    uint32_t fieldIdx;
+    uint64_t varint;
+    size_t dataLen;
+    int rc, found = FALSE;
+
+    (void) memset(resp, 0, sizeof(AuthResponse));
+    while ((rc = readField(&ptr, end, &fieldIdx, &data, &dataLen,
+                           &varint)) > 0) {
+        if (fieldIdx == 3) {
+            castLog(CPTL_LOG_WARNING, "Device reported authentication error");
+            return -1;
+        }
+        if ((fieldIdx != 2) || (data == NULL)) continue;
+
+        /* And the embedded response itself */
+        found = TRUE;
+        rptr = data;
+        rend = data + dataLen;
+        while ((rc = readField(&rptr, rend, &fieldIdx, &data, &dataLen,
+                               &varint)) > 0) {
+            switch (fieldIdx) {
+                case 1:
+                    resp->signature = data;
+                    resp->signatureLen = dataLen;
+                    break;
+                case 2:
+                    resp->deviceCert = data;
+                    resp->deviceCertLen = dataLen;
+                    break;
+                case 3:
+                    if ((data == NULL) ||
+                        (resp->intermediateCount >= AUTH_MAX_INTERMEDIATES)) {
+                        break;
+                    }
+                    resp->intermediates[resp->intermediateCount] = data;
+                    resp->intermediateLens[resp->intermediateCount++] =
+                                                                    dataLen;
+                    break;
+                case 4:
+                    resp->signatureAlgorithm = (uint32_t) varint;
+                    break;
+                case 5:
+                    resp->senderNonce = data;
+                    resp->senderNonceLen = dataLen;
+                    break;
+                case 6:
+                    resp->hashAlgorithm = (uint32_t) varint;
+                    break;
+            }
+        }
+        if (rc < 0) break;
+    }
+
+    if ((rc < 0) || (!found) || (resp->signature == NULL) ||
+            (resp->deviceCert == NULL)) {
+        castLog(CPTL_LOG_WARNING,
+                "Missing/invalid device authentication response");
+        return -1;
+    }
+    return 0;
+}
+
+/* Callback to capture the (binary) auth response, copied for parsing */
+static void *captureAuthResponse(CastDeviceConnection *conn, void *content,
+                                 size_t contentLen) {
+    WXBuffer *retval;
+
+    retval = (WXBuffer *) WXMalloc(sizeof(WXBuffer));
+    if (retval == NULL) return CPTL_RESP_ERROR;
+    if (WXBuffer_Init(retval, contentLen + 1) == NULL) {
+        WXFree(retval);
+        return CPTL_RESP_ERROR;
+    }
+    (void) WXBuffer_Append(retval, content, contentLen, TRUE);
+
+    return retval;
+}
+
+/* Compute the SHA-256 fingerprint of a certificate */
+static int fingerprint(X509 *cert, uint8_t *digest) {
+    unsigned int len = AUTH_FINGERPRINT_LEN;
+
+    return (X509_digest(cert, EVP_sha256(), digest, &len) == 1) ? 0 : -1;
+}
+
+/* Check for an unexpired cache entry for the TLS peer certificate */
+static int checkCache(uint8_t *peerFingerprint) {
+    time_t now = time(NULL);
+    int idx, found = FALSE;
+
+    LOCK_CACHE();
+    for (idx = 0; idx < CPTL_AUTH_CACHE_SIZE; idx++) {
+        if (authCache[idx].expiry <= now) continue;
+        if (memcmp(authCache[idx].peerFingerprint, peerFingerprint,
+                   AUTH_FINGERPRINT_LEN) == 0) {
+            found = TRUE;
+            break;
+        }
+    }
+    UNLOCK_CACHE();
+
+    return found;
+}
+
+/*
+ * Record a verified device by its TLS peer certificate, replacing the entry
+ * closest to expiry.  The device certificate only bounds the expiry.
+ */
+static void updateCache(uint8_t *peerFingerprint, X509 *deviceCert) {
+    time_t now = time(NULL), expiry;
+    int idx, slot = 0, days, secs;
+
+    /* Never beyond the validity of the device certificate */
+    expiry = now + CPTL_CFG(authCacheTtl);
+    if (ASN1_TIME_diff(&days, &secs, NULL,
+                       X509_get0_notAfter(deviceCert)) == 1) {
+        if (now + ((time_t) days) * 86400 + secs < expiry) {
+            expiry = now + ((time_t) days) * 86400 + secs;
+        }
+    }
+    if (expiry <= now) return;
+
+    LOCK_CACHE();
+    for (idx = 0; idx < CPTL_AUTH_CACHE_SIZE; idx++) {
+        if (memcmp(authCache[idx].peerFingerprint, peerFingerprint,
+                   AUTH_FINGERPRINT_LEN) == 0) {
+            slot = idx;
+            break;
+        }
+        if (authCache[idx].expiry < authCache[slot].expiry) slot = idx;
+    }
+
+    (void) memcpy(authCache[slot].peerFingerprint, peerFingerprint,
+                  AUTH_FINGERPRINT_LEN);
+    authCache[slot].expiry = expiry;
+    UNLOCK_CACHE();
+}
+
+/* Copy test content into the (replaced) context element */
+static int setTestElement(void **elmnt, long *elmntLen, const void *data,
+                          size_t dataLen) {
+    if (*elmnt != NULL) WXFree(*elmnt);
+    *elmnt = NULL;
+    *elmntLen = 0;
+    if (data == NULL) return 0;
+
+    if ((*elmnt = WXMalloc(dataLen + 1)) == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to allocate device authentication test data");
+        return -1;
+    }
+    (void) memcpy(*elmnt, data, dataLen);
+    *elmntLen = (long) dataLen;
+    return 0;
+}
+
+/**
+ * Set the simulated elements of the device authentication for test mode, the
+ * TLS certificate of the device and its response (DeviceAuthMessage) to the
+ * challenge, which uses a fixed nonce (bytes 0 to 15) in test mode.  Content
+ * is copied, released by the next call or at the end of the request.
+ *
+ * @param peerCert The (DER) TLS certificate of the simulated device, NULL to
+ *                 release the test elements.
+ * @param peerCertLen The length of the peer certificate.
+ * @param response The encoded DeviceAuthMessage response of the device.
+ * @param responseLen The length of the response.
+ * @return 0 on success, -1 on allocation failure (logged).
+ */
+int castAuthSetTestData(const void *peerCert, size_t peerCertLen,
+                        const void *response, size_t responseLen) {
+    if (peerCert == NULL) response = NULL;
+    if ((setTestElement(&(CPTL_CTX(testAuthPeer)), &(CPTL_CTX(testAuthPeerLen)),
+                        peerCert, peerCertLen) < 0) ||
+            (setTestElement(&(CPTL_CTX(testAuthResp)),
+                            &(CPTL_CTX(testAuthRespLen)), response,
+                            responseLen) < 0)) {
+        (void) castAuthSetTestData(NULL, 0, NULL, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* Log the pending OpenSSL error, with the failing operation */
+static void logSslError(const char *operation) {
+    char errBuff[256];
+
+    ERR_error_string_n(ERR_get_error(), errBuff, sizeof(errBuff));
+    castLog(CPTL_LOG_WARNING,
+            "Device authentication failure in %s [%s]",
+            operation, errBuff);
+}
+
+/* Verify the device certificate chain against the configured root store */
+static int verifyChain(X509 *deviceCert, AuthResponse *resp) {
+    STACK_OF(X509) *intermediates = NULL;
+    X509_STORE_CTX *storeCtx = NULL;
+    X509_STORE *store = NULL;
+    const uint8_t *ptr;
+    X509 *cert;
+    int idx, rc = -1;
+
+    if (((store = X509_STORE_new()) == NULL) ||
+            (X509_STORE_load_locations(store, CPTL_CFG(authRootStore),
+                                       NULL) != 1)) {
+        logSslError("root store load");
+        goto chain_done;
+    }
+    if ((intermediates = sk_X509_new_null()) == NULL) goto chain_done;
+    for (idx = 0; idx < resp->intermediateCount; idx++) {
+        ptr = resp->intermediates[idx];
+        cert = d2i_X509(NULL, &ptr, resp->intermediateLens[idx]);
+        if ((cert == NULL) || (sk_X509_push(intermediates, cert) == 0)) {
+            if (cert != NULL) X509_free(cert);
+            logSslError("intermediate certificate decode");
+            goto chain_done;
+        }
+    }
+
+    if (((storeCtx = X509_STORE_CTX_new()) == NULL) ||
+            (X509_STORE_CTX_init(storeCtx, store, deviceCert,
+                                 intermediates) != 1)) {
+        logSslError("chain verification setup");
+        goto chain_done;
+    }
+    if (X509_verify_cert(storeCtx) != 1) {
+        castLog(CPTL_LOG_WARNING,
+                "Device certificate chain verification failed: %s",
+                X509_verify_cert_error_string(
+                         X509_STORE_CTX_get_error(storeCtx)));
+        goto chain_done;
+    }
+    rc = 0;
+
+chain_done:
+    if (storeCtx != NULL) X509_STORE_CTX_free(storeCtx);
+    if (intermediates != NULL) sk_X509_pop_free(intermediates, X509_free);
+    if (store != NULL) X509_STORE_free(store);
+    return rc;
+}
+
+/* Verify the signature of the (nonce and) TLS peer certificate */
+static int verifySignature(X509 *deviceCert, X509 *peerCert,
+                           AuthResponse *resp) {
+    EVP_MD_CTX *mdCtx = NULL;
+    EVP_PKEY_CTX *pkeyCtx;
+    uint8_t *peerDer = NULL;
+    EVP_PKEY *pkey = NULL;
+    int peerDerLen, rc = -1;
+    const EVP_MD *md;
+
+    md = (resp->hashAlgorithm == 1) ? EVP_sha256() : EVP_sha1();
+    if (((peerDerLen = i2d_X509(peerCert, &peerDer)) <= 0) ||
+            ((pkey = X509_get_pubkey(deviceCert)) == NULL) ||
+            ((mdCtx = EVP_MD_CTX_new()) == NULL) ||
+            (EVP_DigestVerifyInit(mdCtx, &pkeyCtx, md, NULL, pkey) != 1)) {
+        logSslError("signature verification setup");
+        goto sig_done;
+    }
+    if ((resp->signatureAlgorithm == 2) &&
+            (EVP_PKEY_CTX_set_rsa_padding(pkeyCtx,
+                                          RSA_PKCS1_PSS_PADDING) != 1)) {
+        logSslError("signature verification setup");
+        goto sig_done;
+    }
+
+    /* Signed content is the TLS certificate, prefixed by any nonce */
+    if (((resp->senderNonce != NULL) &&
+             (EVP_DigestVerifyUpdate(mdCtx, resp->senderNonce,
+                                     resp->senderNonceLen) != 1)) ||
+            (EVP_DigestVerifyUpdate(mdCtx, peerDer, peerDerLen) != 1)) {
+        logSslError("signature verification");
+        goto sig_done;
+    }
+    if (EVP_DigestVerifyFinal(mdCtx, resp->signature,
+                              resp->signatureLen) != 1) {
+        castLog(CPTL_LOG_WARNING, "Invalid device authentication signature");
+        goto sig_done;
+    }
+    rc = 0;
+
+sig_done:
+    if (mdCtx != NULL) EVP_MD_CTX_free(mdCtx);
+    if (pkey != NULL) EVP_PKEY_free(pkey);
+    if (peerDer != NULL) OPENSSL_free(peerDer);
+    return rc;
+}
+
 /**
  * Optional method to check the validity of the cast device instance, based
- * on a private signed key exchange with the Google certificate.
+ * on a private signed key exchange with the Google certificate.  The device
+ * certificate chain is verified against the configured root store and the
+ * device signature against the TLS certificate of the connection.  The device
+ * must echo the challenge nonce (firmware that does not is rejected, as the
+ * response could otherwise be a replay).  Verified devices are cached by the
+ * fingerprint of their TLS peer certificate (the device certificate is not
+ * known until the exchange is done), so the exchange is not repeated on
+ * subsequent connections presenting the same TLS certificate.
  *
  * @param conn The persistent connection to the cast device instance.
  * @return 0 if the device is authentic, -1 on authentication or related
@@ -20,5 +429,142 @@
  */
 int castDeviceAuth(CastDeviceConnection *conn)
 {
-    return -1;
+    uint8_t peerFingerprint[AUTH_FINGERPRINT_LEN];
+    uint8_t challenge[AUTH_NONCE_LEN + 10];
+    uint8_t nonce[AUTH_NONCE_LEN];
+    X509 *peerCert, *deviceCert = NULL;
+    WXBuffer *authMsg = NULL, testFrame;
+    int idx, simulated, rc = -1;
+    AuthResponse resp;
+    const uint8_t *ptr;
+
+    /* Just in case a malformed resource gets destroyed */
+    if (conn == NULL) return -1;
+    simulated = ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL) &&
+                 (CPTL_CTX(testAuthPeer) != NULL)) ? TRUE : FALSE;
+
+    /* Nothing can be verified without the anchors */
+    if ((CPTL_CFG(authRootStore) == NULL) ||
+            (*CPTL_CFG(authRootStore) == '\0')) {
+        castLog(CPTL_LOG_WARNING,
+                "No device authentication root store configured");
+        return -1;
+    }
+    if ((conn->ssl == NULL) && (!simulated)) {
+        castLog(CPTL_LOG_WARNING,
+                "Device authentication requires a TLS connection");
+        return -1;
+    }
+
+    /* Already verified this device (certificate) recently? */
+    if (simulated) {
+        ptr = (const uint8_t *) CPTL_CTX(testAuthPeer);
+        peerCert = d2i_X509(NULL, &ptr, CPTL_CTX(testAuthPeerLen));
+    } else {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        peerCert = SSL_get1_peer_certificate(conn->ssl);
+#else
+        peerCert = SSL_get_peer_certificate(conn->ssl);
+#endif
+    }
+    if ((peerCert == NULL) || (fingerprint(peerCert, peerFingerprint) < 0)) {
+        castLog(CPTL_LOG_WARNING, "Unable to obtain device TLS certificate");
+        if (peerCert != NULL) X509_free(peerCert);
+        return -1;
+    }
+    if (checkCache(peerFingerprint)) {
+        X509_free(peerCert);
+        return 0;
+    }
+
+    /* DeviceAuthMessage with challenge (PKCS1v15, nonce, SHA256) */
+    if (simulated) {
+        /* Canned responses are signed against a known nonce */
+        for (idx = 0; idx < AUTH_NONCE_LEN; idx++) nonce[idx] = idx;
+    } else if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+        logSslError("nonce generation");
+        goto auth_done;
+    }
+    challenge[0] = 0x0A;
+    challenge[1] = AUTH_NONCE_LEN + 6;
+    challenge[2] = 0x08;
+    challenge[3] = 0x01;
+    challenge[4] = 0x12;
+    challenge[5] = AUTH_NONCE_LEN;
+    (void) memcpy(challenge + 6, nonce, AUTH_NONCE_LEN);
+    challenge[AUTH_NONCE_LEN + 6] = 0x18;
+    challenge[AUTH_NONCE_LEN + 7] = 0x01;
+    if (castSendMessage(conn, FALSE, FALSE, NS_DEVICE_AUTH, challenge,
+                        AUTH_NONCE_LEN + 8) < 0) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to issue device authentication challenge");
+        goto auth_done;
+    }
+
+    /* Setup the simulated response for test mode */
+    if (simulated) {
+        if (WXBuffer_Init(&testFrame,
+                          CPTL_CTX(testAuthRespLen) + 128) == NULL) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to allocate simulated authentication response");
+            goto auth_done;
+        }
+        if (castEncodeFrame(&testFrame, CPTL_RECEIVER_ID, CPTL_SENDER_ID,
+                            castNamespaceName(NS_DEVICE_AUTH),
+                            CPTL_CTX(testAuthResp),
+                            CPTL_CTX(testAuthRespLen)) < 0) {
+            WXBuffer_Destroy(&testFrame);
+            goto auth_done;
+        }
+        CPTL_CTX(testResp) = testFrame.buffer;
+        CPTL_CTX(testRespLen) = testFrame.length;
+    }
+
+    authMsg = (WXBuffer *) castReceiveMessage(conn, FALSE, FALSE,
+                                              NS_DEVICE_AUTH,
+                                              captureAuthResponse, FALSE, 0);
+    if (simulated) {
+        CPTL_CTX(testResp) = NULL;
+        CPTL_CTX(testRespLen) = 0;
+        WXBuffer_Destroy(&testFrame);
+    }
+    if (authMsg == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Unable to obtain device authentication response");
+        goto auth_done;
+    }
+    if (parseAuthMessage(authMsg->buffer, authMsg->length, &resp) < 0) {
+        goto auth_done;
+    }
+    /* Without the (echoed) nonce, the response could be a replay */
+    if ((resp.senderNonce == NULL) ||
+            (resp.senderNonceLen != AUTH_NONCE_LEN) ||
+            (memcmp(resp.senderNonce, nonce, AUTH_NONCE_LEN) != 0)) {
+        castLog(CPTL_LOG_WARNING,
+                (resp.senderNonce == NULL) ?
+                    "Device authentication response has no nonce" :
+                    "Device authentication nonce mismatch");
+        goto auth_done;
+    }
+
+    ptr = resp.deviceCert;
+    if ((deviceCert = d2i_X509(NULL, &ptr, resp.deviceCertLen)) == NULL) {
+        logSslError("device certificate decode");
+        goto auth_done;
+    }
+    if (verifyChain(deviceCert, &resp) < 0) goto auth_done;
+    if (verifySignature(deviceCert, peerCert, &resp) < 0) goto auth_done;
+
+    /* Good to go, remember it */
+    updateCache(peerFingerprint, deviceCert);
+    rc = 0;
+
+auth_done:
+    if (deviceCert != NULL) X509_free(deviceCert);
+    if (authMsg != NULL) {
+        WXBuffer_Destroy(authMsg);
+        WXFree(authMsg);
+    }
+    X509_free(peerCert);
+    return rc;
 }
@@ -0,0 +1,151 @@
+/*
+ * Runtime capture of recent raw frames on a device connection, for the
+ * after-the-fact diagnosis of misbehaving devices.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include "mem.h"
+#include <sys/time.h>
+
+/**
+ * Enable (or resize) the capture ring of recent raw frames for a connection,
+ * or disable it.  Any previously captured frames are discarded.
+ *
+ * @param conn The connection to capture the frames of.
+ * @param frames The number of frames to retain, zero (or less) to disable.
+ * @param snapLen The maximum number of bytes retained for each frame.
+ * @return 0 on success, -1 on allocation failure (logged, capture disabled).
+ */
+int castCaptureEnable(CastDeviceConnection *conn, int frames, int snapLen) {
+    CastCaptureRing *ring;
+
+    if (conn->capture != NULL) {
+        WXFree(conn->capture);
+        conn->capture = NULL;
+    }
+    if (frames <= 0) return 0;
+    if (snapLen <= 0) snapLen = 4;
+
+    /* Single allocation, nothing further is allocated while capturing */
+    ring = (CastCaptureRing *) WXMalloc(sizeof(CastCaptureRing) +
+                                   frames * sizeof(CastCaptureEntry) +
+                                   ((size_t) frames) * snapLen);
+    if (ring == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate frame capture ring");
+        return -1;
+    }
+    ring->size = frames;
+    ring->snapLen = snapLen;
+    ring->total = 0;
+    ring->entries = (CastCaptureEntry *) (ring + 1);
+    ring->snapshots = (uint8_t *) (ring->entries + frames);
+    conn->capture = ring;
+
+    return 0;
+}
+
+/* Record a single frame, overwriting the oldest when the ring is full */
+static void captureFrame(CastCaptureRing *ring, int64_t timestamp,
+                         int direction, uint8_t *data, uint32_t len) {
+    uint32_t slot = (uint32_t) (ring->total % ring->size);
+    CastCaptureEntry *entry = &(ring->entries[slot]);
+
+    entry->timestamp = timestamp;
+    entry->length = len;
+    entry->captured = (len < ring->snapLen) ? len : ring->snapLen;
+    entry->direction = direction;
+    (void) memcpy(ring->snapshots + ((size_t) slot) * ring->snapLen, data,
+                  entry->captured);
+    ring->total++;
+}
+
+/**
+ * Record frames into the capture ring of the connection.  Use the macro
+ * below, which is just a pointer test when capture is not enabled.
+ *
+ * @param conn The connection the frames were sent/received on.
+ * @param direction The direction of the frames (CPTL_CAPTURE_IN/OUT).
+ * @param data The raw (length prefixed) frame content, outbound writes may
+ *             contain multiple frames.
+ * @param dataLen The number of bytes of frame content.
+ */
+void castCaptureFrames(CastDeviceConnection *conn, int direction,
+                       uint8_t *data, size_t dataLen) {
+    CastCaptureRing *ring = conn->capture;
+    struct timeval tv;
+    int64_t timestamp;
+    uint32_t len;
+
+    /* Wall clock, as this is for correlation with external events */
+    (void) gettimeofday(&tv, NULL);
+    timestamp = ((int64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+
+    /* Coalesced writes are split into the component frames */
+    while (dataLen >= 4) {
+        len = (((uint32_t) data[0]) << 24) | (((uint32_t) data[1]) << 16) |
+              (((uint32_t) data[2]) << 8) | ((uint32_t) data[3]);
+        if ((size_t) len + 4 > dataLen) len = dataLen - 4;
+        captureFrame(ring, timestamp, direction, data, len + 4);
+        data += len + 4;
+        dataLen -= len + 4;
+    }
+}
+
+/**
+ * Export the captured frames of a connection, oldest first, as JSON lines
+ * (one object per frame).  The capture ring is not altered.
+ *
+ * @param conn The connection to export the captured frames of.
+ * @param output Buffer to append the exported content to.
+ * @return The number of frames exported or -1 on allocation failure (logged).
+ */
+int castCaptureExport(CastDeviceConnection *conn, WXBuffer *output) {
+    static const char hexChars[] = "0123456789abcdef";
+    CastCaptureRing *ring = conn->capture;
+    uint64_t seq, first;
+    CastCaptureEntry *entry;
+    char line[160];
+    uint8_t *snap, *hex;
+    uint32_t slot, idx;
+    int len, count = 0;
+
+    if ((ring == NULL) || (ring->total == 0)) return 0;
+    first = (ring->total > ring->size) ? ring->total - ring->size : 0;
+
+    for (seq = first; seq < ring->total; seq++) {
+        slot = (uint32_t) (seq % ring->size);
+        entry = &(ring->entries[slot]);
+        snap = ring->snapshots + ((size_t) slot) * ring->snapLen;
+
+        len = snprintf(line, sizeof(line),
+                       "{\"seq\":%llu,\"ts\":%lld.%06lld,\"dir\":\"%s\","
+                       "\"len\":%u,\"captured\":%u,\"data\":\"",
+                       (unsigned long long) seq,
+                       (long long) (entry->timestamp / 1000000),
+                       (long long) (entry->timestamp % 1000000),
+                       (entry->direction == CPTL_CAPTURE_OUT) ? "out" : "in",
+                       entry->length, entry->captured);
+        if (WXBuffer_Append(output, line, len, TRUE) == NULL) goto alloc_err;
+
+        /* Expand the hex in place rather than a byte at a time */
+        if (WXBuffer_EnsureCapacity(output, 2 * entry->captured + 4,
+                                    TRUE) == NULL) goto alloc_err;
+        hex = output->buffer + output->length;
+        for (idx = 0; idx < entry->captured; idx++) {
+            *(hex++) = hexChars[snap[idx] >> 4];
+            *(hex++) = hexChars[snap[idx] & 0x0F];
+        }
+        (void) memcpy(hex, "\"}\n", 3);
+        output->length += 2 * entry->captured + 3;
+        count++;
+    }
+
+    return count;
+
+alloc_err:
+    castLog(CPTL_LOG_WARNING, "Failed to allocate frame capture export");
+    return -1;
+}
@@ -1,27 +1,353 @@
 /*
- * Compatibility methods to interface the toolkit library to the Zend core.
+ * Compatibility methods to interface the toolkit library to the allocator of
+ * the host (the Zend engine for the extension).
  *
  * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
 #include "mem.h"
+#include <string.h>
+#include <time.h>
 
-/* The standard memory wrappers need to utilize the PHP functions instead */
+/* Shorthand for the allocator of the host (request-scoped allocations) */
+#define HOST_ALLOC(s) castCoreAllocator.alloc(s)
+#define HOST_CALLOC(n, s) castCoreAllocator.calloc(n, s)
+#define HOST_REALLOC(p, s) castCoreAllocator.realloc(p, s)
+#define HOST_FREE(p) castCoreAllocator.free(p)
+
+/*
+ * Allocation profiler, which attributes every toolkit allocation to the call
+ * site (file/line) that the wrappers below are given.  Each allocation is
+ * prefixed with a header recording the size and site, so the release can be
+ * attributed without a lookup.  As the header changes the layout of every
+ * allocation, this is a startup-only (system) decision.
+ */
+typedef struct {
+    uint32_t site;
+    uint32_t magic;
+    uint64_t size;
+} CastAllocHeader;
+
+#define ALLOC_MAGIC 0xCA57A110
+#define ALLOC_NO_SITE 0xFFFFFFFF
+
+static int allocProfiling = FALSE;
+
+/**
+ * Enable the allocation profiler for the lifetime of the process, once (at
+ * module startup), as every allocation carries the profile header.
+ *
+ * @param enable TRUE to enable the profiler (castportal.alloc_profile).
+ */
+void castAllocProfileInit(int enable) {
+    allocProfiling = (enable) ? TRUE : FALSE;
+}
+
+/**
+ * Reset the allocation profile at the start of a request (the request
+ * allocations of the prior request have all been released).
+ */
+void castAllocProfileReset() {
+    if (!allocProfiling) return;
+
+    /* Table is persistent (not host), it outlives the request allocations */
+    if (CPTL_CTX(allocSites) == NULL) {
+        CPTL_CTX(allocSites) = calloc(CPTL_ALLOC_MAX_SITES,
+                                    sizeof(CastAllocSite));
+    } else {
+        (void) memset(CPTL_CTX(allocSites), 0,
+                      CPTL_ALLOC_MAX_SITES * sizeof(CastAllocSite));
+    }
+    CPTL_CTX(allocLiveBytes) = CPTL_CTX(allocPeakBytes) = 0;
+}
+
+/**
+ * Release the site table of the profiler (thread/process shutdown).
+ */
+void castAllocProfileCleanup() {
+    if (CPTL_CTX(allocSites) != NULL) free(CPTL_CTX(allocSites));
+    CPTL_CTX(allocSites) = NULL;
+}
+
+/**
+ * Access the allocation profile of the current request.
+ *
+ * @param count Returns the number of entries in the site table (including
+ *              unused entries, which have a NULL file).
+ * @return The site table or NULL if the profiler is not enabled.
+ */
+CastAllocSite *castAllocProfileSites(int *count) {
+    *count = CPTL_ALLOC_MAX_SITES;
+    return (allocProfiling) ? (CastAllocSite *) CPTL_CTX(allocSites) : NULL;
+}
+
+/* Locate (or claim) the table entry for a call site, open addressing */
+static uint32_t allocSite(int line, char *file) {
+    CastAllocSite *sites = (CastAllocSite *) CPTL_CTX(allocSites);
+    uint32_t idx, probe;
+
+    if (sites == NULL) return ALLOC_NO_SITE;
+
+    /* The file is always a literal, the pointer identifies it */
+    idx = (uint32_t) ((((uintptr_t) file) >> 3) * 31 + line);
+    for (probe = 0; probe < CPTL_ALLOC_MAX_SITES; probe++) {
+        idx &= CPTL_ALLOC_MAX_SITES - 1;
+        if (sites[idx].file == NULL) {
+            sites[idx].file = file;
+            sites[idx].line = line;
+            return idx;
+        }
+        if ((sites[idx].file == file) && (sites[idx].line == line)) return idx;
+        idx++;
+    }
+
+    return ALLOC_NO_SITE;
+}
+
+/* Account for the arrival of an allocation at a site */
+static void *allocTrack(CastAllocHeader *hdr, size_t size, int line,
+                        char *file) {
+    CastAllocSite *site;
+
+    if (hdr == NULL) return NULL;
+    hdr->magic = ALLOC_MAGIC;
+    hdr->size = size;
+    hdr->site = allocSite(line, file);
+    if (hdr->site != ALLOC_NO_SITE) {
+        site = ((CastAllocSite *) CPTL_CTX(allocSites)) + hdr->site;
+        site->calls++;
+        site->totalBytes += size;
+        site->liveBytes += size;
+        if (site->liveBytes > site->peakBytes) {
+            site->peakBytes = site->liveBytes;
+        }
+    }
+    CPTL_CTX(allocLiveBytes) += size;
+    if (CPTL_CTX(allocLiveBytes) > CPTL_CTX(allocPeakBytes)) {
+        CPTL_CTX(allocPeakBytes) = CPTL_CTX(allocLiveBytes);
+    }
+
+    return hdr + 1;
+}
+
+/* And the departure (release or resize away from) of an allocation */
+static CastAllocHeader *allocUntrack(void *ptr, int isFree, int line,
+                                     char *file) {
+    CastAllocHeader *hdr = ((CastAllocHeader *) ptr) - 1;
+    CastAllocSite *site;
+
+    /* Cheap catch of repeated releases while we're here */
+    if (hdr->magic != ALLOC_MAGIC) {
+        castLog(CPTL_LOG_WARNING,
+                "Invalid/repeated release of allocation at %s:%d",
+                file, line);
+        return NULL;
+    }
+    if (isFree) hdr->magic = 0;
+
+    if ((hdr->site != ALLOC_NO_SITE) && (CPTL_CTX(allocSites) != NULL)) {
+        site = ((CastAllocSite *) CPTL_CTX(allocSites)) + hdr->site;
+        if (isFree) site->frees++;
+        site->liveBytes -= hdr->size;
+    }
+    CPTL_CTX(allocLiveBytes) -= hdr->size;
+
+    return hdr;
+}
+
+/*
+ * Per-message arena, a bump allocator that the wrappers divert to while it
+ * is engaged (the JSON decode of an inbound message).  Releases of arena
+ * blocks are ignored and the whole arena is reset in one shot once the
+ * message has been processed.  Each block carries its size, for resizing
+ * (which copies, into the arena if still engaged and the heap otherwise).
+ */
+typedef struct CastArenaChunk {
+    struct CastArenaChunk *next;
+    size_t size, used;
+} CastArenaChunk;
+
+#define ARENA_ALIGN(s) (((s) + 7) & ~((size_t) 7))
+#define ARENA_HDR_SIZE ARENA_ALIGN(sizeof(size_t))
+#define ARENA_DATA(c) (((uint8_t *) (c)) + ARENA_ALIGN(sizeof(CastArenaChunk)))
+
+/* Bump allocate from the current chunk, chaining another if required */
+static void *arenaAlloc(size_t size) {
+    CastArenaChunk *chunk = (CastArenaChunk *) CPTL_CTX(arenaChunks);
+    size_t need = ARENA_HDR_SIZE + ARENA_ALIGN(size), chunkSize;
+    uint8_t *ptr;
+
+    if ((chunk == NULL) || (chunk->used + need > chunk->size)) {
+        chunkSize = (need > CPTL_ARENA_CHUNK_SIZE) ? need :
+                                                     CPTL_ARENA_CHUNK_SIZE;
+        chunk = (CastArenaChunk *)
+                    HOST_ALLOC(ARENA_ALIGN(sizeof(CastArenaChunk)) + chunkSize);
+        if (chunk == NULL) return NULL;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        chunk->next = (CastArenaChunk *) CPTL_CTX(arenaChunks);
+        CPTL_CTX(arenaChunks) = chunk;
+    }
+
+    ptr = ARENA_DATA(chunk) + chunk->used;
+    chunk->used += need;
+    *((size_t *) ptr) = size;
+    return ptr + ARENA_HDR_SIZE;
+}
+
+/* Determine if the pointer is an arena block (of the current message) */
+static int inArena(void *ptr) {
+    CastArenaChunk *chunk = (CastArenaChunk *) CPTL_CTX(arenaChunks);
+
+    for (; chunk != NULL; chunk = chunk->next) {
+        if (((uint8_t *) ptr >= ARENA_DATA(chunk)) &&
+                ((uint8_t *) ptr < ARENA_DATA(chunk) + chunk->used)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Engage the message arena, all toolkit allocations are diverted to it until
+ * suspended.  The arena is not engaged if disabled (castportal.json_arena) or
+ * if it is still holding the content of another message (nested use).
+ *
+ * @return TRUE if the arena was engaged, FALSE if allocations remain on the
+ *         heap (and must be released normally).
+ */
+int castArenaBegin() {
+    if ((!CPTL_CFG(jsonArena)) || (CPTL_CTX(arenaBusy))) return FALSE;
+    CPTL_CTX(arenaBusy) = CPTL_CTX(arenaActive) = TRUE;
+    return TRUE;
+}
+
+/**
+ * Stop diverting allocations to the message arena, the content allocated so
+ * far remains valid until the arena is reset.
+ */
+void castArenaSuspend() {
+    CPTL_CTX(arenaActive) = FALSE;
+}
+
+/**
+ * Discard everything allocated in the message arena in one shot.  The
+ * standard chunk is retained for the next message, overflow is released.
+ */
+void castArenaReset() {
+    CastArenaChunk *chunk = (CastArenaChunk *) CPTL_CTX(arenaChunks), *next;
+
+    CPTL_CTX(arenaBusy) = CPTL_CTX(arenaActive) = FALSE;
+    if (chunk == NULL) return;
+    while (chunk->next != NULL) {
+        next = chunk->next;
+        HOST_FREE(chunk);
+        chunk = next;
+    }
+    chunk->used = 0;
+    CPTL_CTX(arenaChunks) = chunk;
+}
+
+/**
+ * Release a response returned from the message receive methods.  A response
+ * kept from the message arena holds the arena until released here (parsing
+ * falls back to the heap in the meantime), heap responses are destroyed.
+ *
+ * @param response The (JSON) response to release, NULL is ignored.
+ */
+void castResponseRelease(WXJSONValue *response) {
+    if (response == NULL) return;
+    if ((CPTL_CTX(arenaChunks) != NULL) && (inArena(response))) {
+        castArenaReset();
+    } else {
+        WXJSON_Destroy(response);
+    }
+}
+
+/**
+ * Release the message arena entirely (request shutdown).
+ */
+void castArenaRelease() {
+    castArenaReset();
+    if (CPTL_CTX(arenaChunks) != NULL) HOST_FREE(CPTL_CTX(arenaChunks));
+    CPTL_CTX(arenaChunks) = NULL;
+}
+
+/* The standard memory wrappers need to utilize the host allocator instead */
 
 void *_WXMalloc(size_t size, int line, char *file) {
-    return emalloc(size);
+    if (CPTL_CTX(arenaActive)) return arenaAlloc(size);
+    if (!allocProfiling) return HOST_ALLOC(size);
+    return allocTrack((CastAllocHeader *)
+                          HOST_ALLOC(sizeof(CastAllocHeader) + size),
+                      size, line, file);
 }
 
 void *_WXCalloc(size_t size, int line, char *file) {
-    return ecalloc(1, size);
+    void *ptr;
+
+    if (CPTL_CTX(arenaActive)) {
+        if ((ptr = arenaAlloc(size)) != NULL) (void) memset(ptr, 0, size);
+        return ptr;
+    }
+    if (!allocProfiling) return HOST_CALLOC(1, size);
+    return allocTrack((CastAllocHeader *)
+                          HOST_CALLOC(1, sizeof(CastAllocHeader) + size),
+                      size, line, file);
 }
 
 void *_WXRealloc(void *original, size_t size, int line, char *file) {
-    return erealloc(original, size);
+    CastAllocHeader *hdr = NULL;
+    size_t origSize;
+    void *ptr;
+
+    /* Arena blocks can't grow in place, copy to the arena or the heap */
+    if ((original != NULL) && (CPTL_CTX(arenaChunks) != NULL) &&
+            (inArena(original))) {
+        origSize = *((size_t *) (((uint8_t *) original) - ARENA_HDR_SIZE));
+        ptr = (CPTL_CTX(arenaActive)) ? arenaAlloc(size) :
+                                      _WXMalloc(size, line, file);
+        if (ptr != NULL) {
+            (void) memcpy(ptr, original, (origSize < size) ? origSize : size);
+        }
+        return ptr;
+    }
+
+    /* Fresh (NULL) resizes follow the arena, heap blocks stay on the heap */
+    if ((original == NULL) && (CPTL_CTX(arenaActive))) return arenaAlloc(size);
+    if (!allocProfiling) return HOST_REALLOC(original, size);
+
+    /* Resizing moves the (entire) allocation to the resizing site */
+    if (original != NULL) {
+        hdr = allocUntrack(original, FALSE, line, file);
+        if (hdr == NULL) return NULL;
+    }
+    return allocTrack((CastAllocHeader *)
+                          HOST_REALLOC(hdr, sizeof(CastAllocHeader) + size),
+                      size, line, file);
 }
 
 void _WXFree(void *original, int line, char *file) {
-    efree(original);
+    CastAllocHeader *hdr;
+
+    /* Arena blocks are released en masse by the reset */
+    if ((CPTL_CTX(arenaChunks) != NULL) && (inArena(original))) return;
+    if (!allocProfiling) {
+        HOST_FREE(original);
+        return;
+    }
+    hdr = allocUntrack(original, TRUE, line, file);
+    if (hdr != NULL) HOST_FREE(hdr);
+}
+
+/* Likewise, a common source of time for elapsed measurements */
+
+int64_t castTimeUsec() {
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
@@ -0,0 +1,136 @@
+/*
+ * Host interface of the core library, the hooks (allocator and logging) and
+ * the lifecycle (process, context and request) that the host drives.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include <stdarg.h>
+
+/* Context of the current (calling) thread */
+#ifdef CPTL_THREADED
+__thread CastCoreContext *castCoreCtx = NULL;
+#else
+CastCoreContext *castCoreCtx = NULL;
+#endif
+
+/* Allocator for the request allocations, standard library unless replaced */
+CastCoreAllocator castCoreAllocator = { malloc, calloc, realloc, free };
+
+/* Default logger, just standard error */
+static void stderrLogger(int level, const char *msg) {
+    (void) fprintf(stderr, "castportal%s: %s\n",
+                   (level == CPTL_LOG_WARNING) ? " warning" : "", msg);
+}
+
+static CastCoreLogger coreLogger = stderrLogger;
+
+/**
+ * Populate the configuration settings with the standard defaults (those of
+ * the php.ini entries of the extension), for hosts without other sources.
+ *
+ * @param config The configuration settings to populate.
+ */
+void castCoreConfigDefaults(CastCoreConfig *config) {
+    (void) memset(config, 0, sizeof(CastCoreConfig));
+
+    /* Note: this default is the Cast application id for 'portal' */
+    config->applicationId = "02834648";
+    config->discoveryTimeout = 5000;
+    config->messageTimeout = 500;
+    config->statusCacheTtl = 10000;
+    config->launchTimeout = 10000;
+    config->mediaPreloadTime = 10;
+    config->authRootStore = "";
+    config->authCacheTtl = 3600;
+    config->metricsFile = "";
+    config->metricsSlots = 128;
+    config->captureSnapLen = 512;
+    config->traceFile = "";
+    config->jsonArena = TRUE;
+}
+
+/**
+ * Process-wide startup of the core, installing the host hooks and setting up
+ * the shared (SSL, authentication cache, metrics) elements.  Called once,
+ * before any threads, with the context bound for the startup configuration.
+ *
+ * @param allocator Allocator for the request allocations, NULL for the
+ *                  standard library (malloc/free).
+ * @param logger Logging callback, NULL to write to standard error.
+ * @return 0 on success, -1 on failure (logged).
+ */
+int castCoreStartup(const CastCoreAllocator *allocator, CastCoreLogger logger) {
+    if (allocator != NULL) castCoreAllocator = *allocator;
+    coreLogger = (logger != NULL) ? logger : stderrLogger;
+
+    castAllocProfileInit(CPTL_CFG(allocProfile));
+    if (castSslInit() < 0) {
+        castLog(CPTL_LOG_WARNING, "Unable to initialize the SSL elements");
+        return -1;
+    }
+    castAuthInit();
+    castStatsInit();
+
+    return 0;
+}
+
+/**
+ * Release the process-wide elements of the core, at host shutdown.
+ */
+void castCoreShutdown() {
+    castStatsCleanup();
+    castAuthCleanup();
+    castSslCleanup();
+}
+
+/**
+ * Bind a context to the calling thread, for all subsequent core operations.
+ * The context must remain valid while bound (the config strings also).
+ *
+ * @param ctx The context to bind, zero filled for a new context except for
+ *            the config settings.
+ */
+void castCoreBind(CastCoreContext *ctx) {
+    castCoreCtx = ctx;
+}
+
+/**
+ * Start a unit of work (request) on the bound context, resetting the
+ * per-request tracking (connections, allocation profile, timeline).
+ */
+void castCoreRequestBegin() {
+    castAllocProfileReset();
+    CPTL_CTX(connections) = NULL;
+    castStatsAttach();
+    castTraceStart();
+}
+
+/**
+ * Complete a unit of work (request), flushing the timeline and releasing the
+ * message arena.  Connections are not closed, that is up to the host.
+ */
+void castCoreRequestEnd() {
+    (void) castAuthSetTestData(NULL, 0, NULL, 0);
+    castTraceFlush();
+    castArenaRelease();
+}
+
+/**
+ * Issue a log message through the logging callback of the host.
+ *
+ * @param level The severity level of the message (CPTL_LOG_*).
+ * @param fmt The printf-style format of the message.
+ * @param ... Arguments for the format.
+ */
+void castLog(int level, const char *fmt, ...) {
+    char msg[1024];
+    va_list args;
+
+    va_start(args, fmt);
+    (void) vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    (*coreLogger)(level, msg);
+}
@@ -0,0 +1,1345 @@
+/*
+ * Core definitions for the cast portal library, the discovery, device and
+ * protocol elements independent of the Zend engine (the PHP extension being
+ * a binding over these, as could be a native service or benchmark).
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#ifndef _CASTPTL_CORE_H
+#define _CASTPTL_CORE_H 1
+
+/* Standard inclusions for autoconf and toolkit elements */
+#ifdef HAVE_CONFIG_H
+    #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <openssl/ssl.h>
+#include "socket.h"
+#include "buffer.h"
+#include "json.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+/* Process-wide elements are shared across threads for threaded (ZTS) hosts */
+#if defined(ZTS) && !defined(CPTL_THREADED)
+    #define CPTL_THREADED 1
+#endif
+
+/* Size of the standard chunk of the per-message arena */
+#define CPTL_ARENA_CHUNK_SIZE 16384
+
+/* Capacity of the allocation site table (power of two) */
+#define CPTL_ALLOC_MAX_SITES 1024
+
+/* Limits of the slow operation record (device and distinct phases) */
+#define CPTL_SLOWOP_DEVICE_LEN 64
+#define CPTL_SLOWOP_MAX_PHASES 16
+
+/* Configuration settings, managed through php.ini for the extension */
+typedef struct {
+    char *applicationId;
+    long discoveryTimeout;
+    long messageTimeout;
+    long statusCacheTtl;
+    long launchTimeout;
+    long mediaPreloadTime;
+    char *authRootStore;
+    long authCacheTtl;
+    char *metricsFile;
+    long metricsSlots;
+    long captureFrames;
+    long captureSnapLen;
+    char *traceFile;
+    long slowOpMs;
+    unsigned char allocProfile;
+    unsigned char jsonArena;
+    long idleSlimMs;
+} CastCoreConfig;
+
+/* Working context for the core, per request (thread) of the host */
+typedef struct {
+    CastCoreConfig config;
+
+    /* Request timeline (trace) tracking elements */
+    int traceActive;
+    int64_t traceStart;
+    void *traceEvents;
+    long traceCount;
+    long traceAlloc;
+
+    /* Slow operation tracking elements */
+    const char *slowOpName;
+    char slowOpDevice[CPTL_SLOWOP_DEVICE_LEN];
+    int64_t slowOpStart;
+    const char *slowOpPhaseNames[CPTL_SLOWOP_MAX_PHASES];
+    int64_t slowOpPhaseUsec[CPTL_SLOWOP_MAX_PHASES];
+    int slowOpPhaseCalls[CPTL_SLOWOP_MAX_PHASES];
+    int slowOpPhaseCount;
+
+    /* Allocation profile of the current request */
+    void *allocSites;
+    int64_t allocLiveBytes;
+    int64_t allocPeakBytes;
+
+    /* Open connections of the request, for the idle sweep */
+    void *connections;
+    int64_t lastSlimSweep;
+
+    /* Per-message (JSON decode) arena */
+    void *arenaChunks;
+    int arenaActive;
+    int arenaBusy;
+
+    /* Internal tracking elements for test operation */
+    long testMode;
+    void *testResp;
+    long testRespLen;
+    void *testAuthPeer;
+    long testAuthPeerLen;
+    void *testAuthResp;
+    long testAuthRespLen;
+} CastCoreContext;
+
+/* The context bound to the calling thread (castCoreBind), and accessors */
+#ifdef CPTL_THREADED
+extern __thread CastCoreContext *castCoreCtx;
+#else
+extern CastCoreContext *castCoreCtx;
+#endif
+#define CPTL_CFG(v) (castCoreCtx->config.v)
+#define CPTL_CTX(v) (castCoreCtx->v)
+
+/* Severity levels for the logging callback */
+#define CPTL_LOG_INFO 1
+#define CPTL_LOG_WARNING 2
+
+/**
+ * Callback to issue the (formatted) log messages of the core, warnings are
+ * the errors reported for the current operation, info are operational logs.
+ *
+ * @param level The severity level of the message (CPTL_LOG_*).
+ * @param msg The formatted message text (no trailing newline).
+ */
+typedef void (*CastCoreLogger)(int level, const char *msg);
+
+/* Allocator of the host, for the request-scoped (toolkit) allocations */
+typedef struct {
+    void *(*alloc)(size_t size);
+    void *(*calloc)(size_t count, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+} CastCoreAllocator;
+
+/* The allocator in use, not for direct access (use the toolkit wrappers) */
+extern CastCoreAllocator castCoreAllocator;
+
+/**
+ * Populate the configuration settings with the standard defaults (those of
+ * the php.ini entries of the extension), for hosts without other sources.
+ *
+ * @param config The configuration settings to populate.
+ */
+void castCoreConfigDefaults(CastCoreConfig *config);
+
+/**
+ * Process-wide startup of the core, installing the host hooks and setting up
+ * the shared (SSL, authentication cache, metrics) elements.  Called once,
+ * before any threads, with the context bound for the startup configuration.
+ *
+ * @param allocator Allocator for the request allocations, NULL for the
+ *                  standard library (malloc/free).
+ * @param logger Logging callback, NULL to write to standard error.
+ * @return 0 on success, -1 on failure (logged).
+ */
+int castCoreStartup(const CastCoreAllocator *allocator, CastCoreLogger logger);
+
+/**
+ * Release the process-wide elements of the core, at host shutdown.
+ */
+void castCoreShutdown();
+
+/**
+ * Bind a context to the calling thread, for all subsequent core operations.
+ * The context must remain valid while bound (the config strings also).
+ *
+ * @param ctx The context to bind, zero filled for a new context except for
+ *            the config settings.
+ */
+void castCoreBind(CastCoreContext *ctx);
+
+/**
+ * Start a unit of work (request) on the bound context, resetting the
+ * per-request tracking (connections, allocation profile, timeline).
+ */
+void castCoreRequestBegin();
+
+/**
+ * Complete a unit of work (request), flushing the timeline and releasing the
+ * message arena.  Connections are not closed, that is up to the host.
+ */
+void castCoreRequestEnd();
+
+/**
+ * Issue a log message through the logging callback of the host.
+ *
+ * @param level The severity level of the message (CPTL_LOG_*).
+ * @param fmt The printf-style format of the message.
+ * @param ... Arguments for the format.
+ */
+void castLog(int level, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+/* Linked list data object for returning discovery results */
+typedef struct _castDeviceInfo {
+    char id[256];
+    char name[256];
+    char model[256];
+    char ipAddr[32];
+    uint16_t port;
+    struct _castDeviceInfo *next;
+} CastDeviceInfo;
+
+/**
+ * Execute a cast discovery process, using multicast DNS queries.
+ *
+ * @param ipMode Flagset to determine which IP networks to discover against,
+ *               mix of CPTL_INET4 (1) and CPTL_INET6 (2), as defined in the
+ *               global PHP constants.
+ * @param waitTm Time period (in milliseconds) to wait for responses to
+ *               the UDP query.  If zero, use the system configuration value.
+ * @return Linked list of discovered cast devices or NULL on error/empty.
+ */
+CastDeviceInfo *castDiscover(int ipMode, int waitTm);
+
+/**
+ * Parse a response to the cast discovery query, extracting the details of
+ * the device from the answer and the additional records.
+ *
+ * @param resp The content of the response packet.
+ * @param respLen The length of the response packet.
+ * @param info Device record to populate, initialized by the caller with the
+ *             defaults and the origin address of the response.
+ * @return 0 if the response described a cast device, 1 if the response is
+ *         not of interest (or a bad message) and -1 if the answer could not
+ *         be read and the remaining responses should be abandoned (logged).
+ */
+int castDiscoverParse(const uint8_t *resp, size_t respLen,
+                      CastDeviceInfo *info);
+
+/**
+ * Obtain one of the captured responses used for the discovery test mode (and
+ * the micro-benchmarks).
+ *
+ * @param idx Index of the response, 0 for the IPv4 device and 1 for IPv6.
+ * @param respLen Returns the length of the response packet.
+ * @return The response packet content or NULL for an invalid index.
+ */
+const uint8_t *castDiscoverTestResponse(int idx, size_t *respLen);
+
+/* Definitions for connection tracking object (PHP resource) */
+#define PHP_CASTPTL_DEVCONN_RESNAME "CastConnection"
+
+/* Fixed endpoint identifiers for the default (non-channel) sessions */
+#define CPTL_SENDER_ID "sender-0"
+#define CPTL_SENDER_SESSION_ID "castptl-nnn"
+#define CPTL_RECEIVER_ID "receiver-0"
+#define CPTL_PORTAL_RECEIVER_ID "castptl-000"
+#define CPTL_BROADCAST_ID "*"
+
+/* Maximum length of a virtual channel endpoint identifier */
+#define CPTL_MAX_ENDPOINT_ID 64
+
+/* Limit on the inbound messages held for a channel that is not being read */
+#define CPTL_MAX_CHANNEL_PENDING 65536
+
+/* Virtual channel (source/destination pair) sharing the device connection */
+typedef struct _castChannel {
+    char sourceId[CPTL_MAX_ENDPOINT_ID];
+    char destinationId[CPTL_MAX_ENDPOINT_ID];
+    WXBuffer pendingBuffer;
+    struct _castChannel *next;
+} CastChannel;
+
+/* Encoded message content, shared (reference counted) across connections */
+typedef struct {
+    int refCount;
+    size_t length;
+    uint8_t data[1];
+} CastSharedFrame;
+
+/* Entry in the outbound (non-blocking) message queue of a connection */
+typedef struct _castQueuedFrame {
+    CastSharedFrame *frame;
+    struct _castQueuedFrame *next;
+} CastQueuedFrame;
+
+/* Maximum length of the identifiers/text captured from the receiver status */
+#define CPTL_MAX_STATUS_VALUE 128
+
+/*
+ * Snapshot of the most recent receiver status reported by the device, only
+ * allocated once a status is received (and released when the connection is
+ * slimmed), idle connections do not carry it.
+ */
+typedef struct {
+    int64_t updateTime;
+    int isAppRunning;
+    char appId[CPTL_MAX_STATUS_VALUE];
+    char displayName[CPTL_MAX_STATUS_VALUE];
+    char sessionId[CPTL_MAX_STATUS_VALUE];
+    char transportId[CPTL_MAX_STATUS_VALUE];
+    char statusText[CPTL_MAX_STATUS_VALUE];
+    double volumeLevel;
+    int isMuted;
+} CastReceiverStatus;
+
+/* Direction of a captured frame */
+#define CPTL_CAPTURE_IN 0
+#define CPTL_CAPTURE_OUT 1
+
+/* Entry in the frame capture ring (content is in the snapshot area) */
+typedef struct {
+    int64_t timestamp;
+    uint32_t length;
+    uint32_t captured;
+    int direction;
+} CastCaptureEntry;
+
+/* Fixed-size ring of the most recent raw frames of a connection */
+typedef struct {
+    uint32_t size;
+    uint32_t snapLen;
+    uint64_t total;
+    CastCaptureEntry *entries;
+    uint8_t *snapshots;
+} CastCaptureRing;
+
+/* Initial size of the connection read buffer (allocated on demand) */
+#define CPTL_READ_BUFFER_SIZE 1024
+
+typedef struct _castDeviceConnection {
+    WXSocket scktHandle;
+    SSL *ssl;
+    int isConnected;
+    int isWriteNonBlocking;
+    int isWriteWantRead;
+    WXBuffer readBuffer;
+    int isSlim;
+    int64_t lastActivity;
+    int32_t requestId;
+    CastChannel *channels;
+    CastQueuedFrame *writeQueue;
+    CastReceiverStatus *receiverStatus;
+    CastCaptureRing *capture;
+    char devAddr[CPTL_SLOWOP_DEVICE_LEN];
+    int isRegistered;
+    struct _castDeviceConnection *poolPrev, *poolNext;
+} CastDeviceConnection;
+
+/* Maximum length of an application availability status value */
+#define CPTL_MAX_APP_STATUS 32
+
+/* Result record for the availability query of a specific application */
+typedef struct {
+    const char *appId;
+    char status[CPTL_MAX_APP_STATUS];
+} CastAppAvailability;
+
+/* Number of devices tracked by the client TLS session (resumption) cache */
+#define CPTL_SSL_SESSION_CACHE_SIZE 64
+
+/**
+ * Process-wide initialization of the OpenSSL elements for the device
+ * connections (socket BIO method, session cache and, for older OpenSSL when
+ * threaded, the library locking).  Called once from module startup, before
+ * any threads.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int castSslInit();
+
+/**
+ * Release the process-wide OpenSSL elements, at module shutdown.
+ */
+void castSslCleanup();
+
+/**
+ * Execute a cast connection to a device instance, to create a persistent
+ * message channel (NOT PHP-persistent).
+ *
+ * @param devAddr Network address (typically from discovery) of the cast
+ *                device to connect to.
+ * @param port Connection port as discovered, 8009 would be typical.
+ * @return TLS-enabled connection instance (allocated) or NULL if connection
+ *         failed.
+ */
+CastDeviceConnection *castDeviceConnect(char *devAddr, int port);
+
+/**
+ * Execute a cast connection to a device instance along with the initial
+ * application exchanges.  The CONNECT, application availability and (optional)
+ * receiver status requests are issued in a single write and the responses
+ * collected together.
+ *
+ * @param devAddr Network address (typically from discovery) of the cast
+ *                device to connect to.
+ * @param port Connection port as discovered, 8009 would be typical.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @param withStatus If true, also request the receiver status (tracked in the
+ *                   status snapshot of the connection).
+ * @param timeout Time period to wait for all of the responses (milliseconds).
+ * @return TLS-enabled connection instance (allocated) or NULL if connection
+ *         or the initial exchanges failed (logged).
+ */
+CastDeviceConnection *castDeviceOpen(char *devAddr, int port,
+                                     CastAppAvailability *results,
+                                     int appCount, int withStatus,
+                                     int32_t timeout);
+
+/* Number of verified devices tracked by the authentication cache */
+#define CPTL_AUTH_CACHE_SIZE 64
+
+/**
+ * Process-wide initialization of the (shared) authentication cache, called
+ * once from module startup.
+ */
+void castAuthInit();
+
+/**
+ * Release the authentication cache resources, at module shutdown.
+ */
+void castAuthCleanup();
+
+/**
+ * Optional method to check the validity of the cast device instance, based
+ * on a private signed key exchange with the Google certificate.  The device
+ * certificate chain is verified against the configured root store and the
+ * device signature against the TLS certificate of the connection.  The device
+ * must echo the challenge nonce (firmware that does not is rejected, as the
+ * response could otherwise be a replay).  Verified devices are cached (by TLS
+ * certificate) so the exchange is not repeated on subsequent connections.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @return 0 if the device is authentic, -1 on authentication or related
+ *         device messaging error.
+ */
+int castDeviceAuth(CastDeviceConnection *conn);
+
+/**
+ * Set the simulated elements of the device authentication for test mode, the
+ * TLS certificate of the device and its response (DeviceAuthMessage) to the
+ * challenge, which uses a fixed nonce (bytes 0 to 15) in test mode.  Content
+ * is copied, released by the next call or at the end of the request.
+ *
+ * @param peerCert The (DER) TLS certificate of the simulated device, NULL to
+ *                 release the test elements.
+ * @param peerCertLen The length of the peer certificate.
+ * @param response The encoded DeviceAuthMessage response of the device.
+ * @param responseLen The length of the response.
+ * @return 0 on success, -1 on allocation failure (logged).
+ */
+int castAuthSetTestData(const void *peerCert, size_t peerCertLen,
+                        const void *response, size_t responseLen);
+
+/**
+ * Exchange a ping/heartbeat keepalive message with the cast device.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castDevicePing(CastDeviceConnection *conn);
+
+/**
+ * Exchange ping/heartbeat keepalive messages with a set of cast devices
+ * concurrently.  All of the pings are issued first, then the responses are
+ * collected through a single wait with an overall deadline.
+ *
+ * @param conns Array of device connections to ping, NULL entries are skipped.
+ * @param count The number of connections in the conns array.
+ * @param rtts Array (count entries) for the round trip time (in microseconds)
+ *             of each ping, -1 if no valid response was received.
+ * @param timeout Overall time period to wait for responses (milliseconds).
+ * @return The number of devices that responded successfully.
+ */
+int castDevicePingMany(CastDeviceConnection **conns, int count,
+                       int64_t *rtts, int32_t timeout);
+
+/**
+ * Close the persistent connection instance that was opened by the auth method.
+ *
+ * @param conn The connection instance returned from the authentication method.
+ *             Note that the instance will be freed by this method and should
+ *             no longer be referenced (NULLify the resource).
+ */
+void castDeviceClose(CastDeviceConnection *conn);
+
+/**
+ * Mark activity on a connection, allocating the read buffer if required (for
+ * reads) and sweeping the idle connections (at most twice per idle period).
+ *
+ * @param conn The connection being read from or written to.
+ * @param forRead TRUE if the read buffer is about to be used.
+ * @return 0 on success, -1 on allocation failure (logged).
+ */
+int castDeviceTouch(CastDeviceConnection *conn, int forRead);
+
+/**
+ * Release the read buffers of connections that have been idle (no reads or
+ * writes) for longer than castportal.idle_slim_ms.  Connections with partial
+ * content or queued writes are left alone.
+ *
+ * @param now The current (monotonic) timestamp.
+ */
+void castDeviceSlimIdle(int64_t now);
+
+/**
+ * Determine the memory held by a connection, for the pool accounting.  Note
+ * that this does not include the internal state of the SSL session.
+ *
+ * @param conn The connection to account for.
+ * @return The number of bytes held by the connection.
+ */
+size_t castDeviceMemory(CastDeviceConnection *conn);
+
+/* Set of enumerations for namespace definition */
+typedef enum {
+    NS_ANY = -1,
+    NS_CONNECTION = 0,
+    NS_DEVICE_AUTH = 1,
+    NS_HEARTBEAT = 2,
+    NS_RECEIVER = 3,
+    NS_MEDIA = 4,
+    NS_UNKNOWN = 9999
+} CastNamespace;
+
+/* Number of (defined) namespaces in the above */
+#define NS_COUNT 5
+
+/**
+ * Issue a message to the given cast device connection.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param fromSenderSession If true (non-zero), message is originating from the
+ *                          controller session, if false, originating from the
+ *                          global application (sender-0).
+ * @param toPortalReceiver If true (non-zero), message is being delivered to
+ *                         to the portal application, if false, message is
+ *                         intended for the global device receiver (receiver-0).
+ * @param namespace Enumerated namespace for multiplexing messages across the
+ *                  connection/channel.
+ * @param data Payload of the message to be delivered, either binary or string
+ *             content based on provided length.
+ * @param dataLen Length of the prior data, -1 for a string, >= 0 for a binary
+ *                buffer.
+ * @return 0 if message successfully issued, -1 on error (already logged).
+ */
+int castSendMessage(CastDeviceConnection *conn, int fromSessionSender,
+                    int toPortalReceiver, CastNamespace namespace,
+                    void *data, ssize_t dataLen);
+
+/**
+ * Issue a message between explicit endpoints on the given cast device
+ * connection.  This is the underlying method for all outbound messages.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param sourceId Identifier of the originating (sender) endpoint.
+ * @param destinationId Identifier of the target (receiver) endpoint.
+ * @param namespace Full namespace string for the message.
+ * @param data Payload of the message to be delivered, either binary or string
+ *             content based on provided length.
+ * @param dataLen Length of the prior data, -1 for a string, >= 0 for a binary
+ *                buffer.
+ * @return 0 if message successfully issued, -1 on error (already logged).
+ */
+int castSendFrame(CastDeviceConnection *conn, const char *sourceId,
+                  const char *destinationId, const char *namespace,
+                  void *data, ssize_t dataLen);
+
+/**
+ * Encode a message between explicit endpoints into the wire format (length
+ * prefixed protobuf), appending it to the provided buffer.  Multiple messages
+ * can be encoded into the same buffer for a single (coalesced) write.
+ *
+ * @param buffer The buffer to append the encoded message to.
+ * @param sourceId Identifier of the originating (sender) endpoint.
+ * @param destinationId Identifier of the target (receiver) endpoint.
+ * @param namespace Full namespace string for the message.
+ * @param data Payload of the message to be delivered, either binary or string
+ *             content based on provided length.
+ * @param dataLen Length of the prior data, -1 for a string, >= 0 for a binary
+ *                buffer.
+ * @return 0 if message successfully encoded, -1 on error (already logged,
+ *         buffer is restored to its original length).
+ */
+int castEncodeFrame(WXBuffer *buffer, const char *sourceId,
+                    const char *destinationId, const char *namespace,
+                    void *data, ssize_t dataLen);
+
+/**
+ * Write a set of encoded messages to the device connection.  Any messages
+ * queued to the connection are written first, to preserve ordering.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param data The encoded message content (from castEncodeFrame).
+ * @param dataLen The number of bytes of encoded content.
+ * @return 0 if content was successfully written, -1 on error (logged).
+ */
+int castWriteFrames(CastDeviceConnection *conn, uint8_t *data,
+                    size_t dataLen);
+
+/**
+ * Allocate a shared (reference counted) copy of encoded message content, for
+ * queueing to multiple connections without re-encoding.
+ *
+ * @param data The encoded message content (from castEncodeFrame).
+ * @param dataLen The number of bytes of encoded content.
+ * @return The shared frame with a single reference (the caller) or NULL on
+ *         allocation failure (logged).
+ */
+CastSharedFrame *castSharedFrameCreate(uint8_t *data, size_t dataLen);
+
+/**
+ * Release a reference to a shared message frame, freeing the frame when the
+ * last reference is released.
+ *
+ * @param frame The shared frame to release.
+ */
+void castSharedFrameRelease(CastSharedFrame *frame);
+
+/**
+ * Queue a shared message frame for writing to the device connection.  The
+ * queue retains a reference to the frame until it has been written.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param frame The shared frame to queue.
+ * @return 0 if the frame was queued, -1 on allocation error (logged).
+ */
+int castQueueFrame(CastDeviceConnection *conn, CastSharedFrame *frame);
+
+/**
+ * Write the queued frames to the device connection.  If the connection is
+ * marked for non-blocking writes, this will return once the socket cannot
+ * accept further content, otherwise it will block until the queue is empty.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @return 0 if the queue was completely written, 1 if content remains in the
+ *         queue (non-blocking) and -1 on error (logged, queue is discarded).
+ */
+int castFlushQueue(CastDeviceConnection *conn);
+
+/**
+ * Discard any frames queued to the device connection, without writing.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ */
+void castDiscardQueue(CastDeviceConnection *conn);
+
+/**
+ * Broadcast a (string) message to the portal application session across a
+ * set of device connections.  The message is encoded once and the shared
+ * frame is written to all of the connections concurrently (non-blocking).
+ *
+ * @param conns Array of device connections to write to, NULL entries are
+ *              skipped.
+ * @param count The number of connections in the conns array.
+ * @param namespace Full namespace string for the message.
+ * @param data The string payload of the message.
+ * @param results Array (count entries) for the outcome of each connection,
+ *                TRUE if the message was completely written, FALSE otherwise.
+ * @param timeout Overall time period to wait for writes (milliseconds).
+ * @return The number of connections that the message was written to.
+ */
+int castBroadcastMessage(CastDeviceConnection **conns, int count,
+                         const char *namespace, char *data, int *results,
+                         int32_t timeout);
+
+/**
+ * Obtain the namespace string associated to the given enumeration.
+ *
+ * @param namespace The enumerated namespace to translate.
+ * @return The full namespace string or NULL for any/unknown values.
+ */
+const char *castNamespaceName(CastNamespace namespace);
+
+#define CPTL_RESP_ERROR ((void *) (intptr_t) -1)
+
+/**
+ * Definition for processing matched (according to specified criteria) response
+ * messages from the cast device.
+ *
+ * Note: by design, the message processor will automatically clean up the
+ *       parsed JSON content, *unless* the return value of the callback is the
+ *       JSON value reference, in which case the caller must clean up.  If
+ *       extracting data from the JSON content for return, it needs to be
+ *       copied (or swapped out).
+ *
+ * @param conn The connection from which the response was received.
+ * @param content The response content, either binary (contentLen >= 0) or
+ *                a parsed JSON value (contentLen < 0).
+ * @param contentLen For binary responses, the number of bytes in the dataset,
+ *                   -1 if the content is parsed JSON data.
+ * @return A non-NULL response if successfully processed, NULL to ignore this
+ *         response and continue processing or CTPL_RESP_ERROR if a data error
+ *         condition occured (and processing should stop).
+ */
+typedef void *ProcessResponseCB(CastDeviceConnection *conn, void *content,
+                                size_t contentLen);
+
+/**
+ * Read responses from the cast device, looking for a matched response
+ * according to the filtering criteria.  Timeout is managed by the global
+ * module parameter setting.
+ *
+ * @param conn The connection to read responses from.
+ * @param forSenderSession True (greater than zero) if expecting a message for
+ *                         the controller session, false (zero) if for the
+ *                         global application.  Negative indicates any.
+ * @param fromPortalReceiver True (greater than zero) if expecting a message
+ *                           from the portal application, false (zero) if from
+ *                           the device receiver.  Negative indicates any.
+ * @param namespace The namespace to match the response again, use NS_ANY (-1)
+ *                  for any namespace.
+ * @param responseCallback Reference to the method to handle callbacks for
+ *                         matched response instances.
+ * @param expJsonResponse True (greater than zero) if the callback is expecting
+ *                        only JSON content, false (zero) for binary-only
+ *                        content and negative for any response type.
+ * @param requestId If greater than zero, match against the provided request
+ *                  identifier.  This is ignored if the response is not JSON.
+ * @return Non-null if a valid response was determined by the response callback
+ *         function (value returned from callback is passed through) or NULL
+ *         for any processing error (logged internally).  CPTL_RESP_ERROR is
+ *         not returned by this method.  A returned JSON content value must be
+ *         released with castResponseRelease.
+ */
+void *castReceiveMessage(CastDeviceConnection *conn, int forSenderSession,
+                         int fromPortalReceiver, CastNamespace namespace,
+                         ProcessResponseCB responseCallback,
+                         int expJsonResponse, int32_t requestId);
+
+/* Matching criteria for the filtered message receive method (below) */
+typedef struct {
+    /* If non-NULL, match messages routed to this virtual channel only */
+    CastChannel *channel;
+
+    /* Default session filters, per castReceiveMessage (ignored for channel) */
+    int forSenderSession;
+    int fromPortalReceiver;
+
+    /* Enumerated namespace or NS_ANY, overridden by name if non-NULL */
+    CastNamespace namespace;
+    const char *namespaceName;
+
+    /* Content type and request id filtering, as per castReceiveMessage */
+    int expJsonResponse;
+    int32_t requestId;
+
+    /* If true, string content is passed to the callback without parsing */
+    int rawContent;
+
+    /* Wait period (milliseconds) for castReceiveFiltered, zero for default */
+    int32_t timeout;
+
+    ProcessResponseCB *responseCallback;
+} CastMessageFilter;
+
+/**
+ * Read responses from the cast device, looking for a matched response
+ * according to the provided filter.  Underlying method for all of the
+ * message receive functions.
+ *
+ * @param conn The connection to read responses from.
+ * @param filter Matching criteria and callback for the target response.
+ * @return Non-null if a valid response was determined by the response callback
+ *         function or NULL for any processing error (logged internally).
+ *         A returned JSON content value is released with castResponseRelease.
+ */
+void *castReceiveFiltered(CastDeviceConnection *conn,
+                          CastMessageFilter *filter);
+
+/**
+ * Read all of the content currently available from the device connection,
+ * without blocking, into the read buffer of the connection (no parsing).
+ *
+ * @param conn The connection to read content from.
+ * @return The number of bytes read, zero if there was no content available
+ *         and -1 on error (logged, read buffer is flushed).
+ */
+int castReadAvailable(CastDeviceConnection *conn);
+
+/**
+ * Process the messages already received on the device connection (no read),
+ * looking for a matched response according to the provided filter.
+ *
+ * @param conn The connection to process messages for.
+ * @param filter Matching criteria and callback for the target response.
+ * @return Non-null if a valid response was determined by the response callback
+ *         function, CPTL_RESP_ERROR if a processing error occurred (logged)
+ *         or NULL if no matching response has been received.
+ */
+void *castProcessFiltered(CastDeviceConnection *conn,
+                          CastMessageFilter *filter);
+
+/* Tracking states for the concurrent response processing (below) */
+#define CPTL_PENDING_WAIT 0
+#define CPTL_PENDING_DONE 1
+#define CPTL_PENDING_FAILED -1
+
+/* Outstanding response expected from a connection, for concurrent receipt */
+typedef struct {
+    CastDeviceConnection *conn;
+    CastMessageFilter filter;
+
+    /* Time at which the request was issued (caller), used for elapsed time */
+    int64_t startTime;
+
+    /* Results of the processing, response from filter callback if done */
+    int state;
+    void *response;
+    int64_t elapsed;
+} CastPendingResponse;
+
+/**
+ * Wait for the responses on a set of connections concurrently, through a
+ * single multiplexed wait with one overall deadline.  Requests must already
+ * have been issued by the caller.
+ *
+ * @param pending The set of responses to wait for.  Entries with a NULL
+ *                connection or a state other than CPTL_PENDING_WAIT are
+ *                ignored.  On return, the state of each entry indicates the
+ *                outcome (entries still waiting have timed out).
+ * @param count The number of entries in the pending array.
+ * @param timeout The overall time (in milliseconds) to wait for responses.
+ * @return The number of entries that were successfully completed.
+ */
+int castReceiveMultiple(CastPendingResponse *pending, int count,
+                        int32_t timeout);
+
+/**
+ * Obtain a monotonic timestamp, for elapsed time measurement.
+ *
+ * @return Monotonic clock value, in microseconds.
+ */
+int64_t castTimeUsec();
+
+/* Aggregated allocation details for a single call site */
+typedef struct {
+    const char *file;
+    int line;
+    int64_t calls;
+    int64_t frees;
+    int64_t liveBytes;
+    int64_t peakBytes;
+    int64_t totalBytes;
+} CastAllocSite;
+
+/**
+ * Enable the allocation profiler for the lifetime of the process, once (at
+ * module startup), as every allocation carries the profile header.
+ *
+ * @param enable TRUE to enable the profiler (castportal.alloc_profile).
+ */
+void castAllocProfileInit(int enable);
+
+/**
+ * Reset the allocation profile at the start of a request (the request
+ * allocations of the prior request have all been released).
+ */
+void castAllocProfileReset();
+
+/**
+ * Release the site table of the profiler (thread/process shutdown).
+ */
+void castAllocProfileCleanup();
+
+/**
+ * Access the allocation profile of the current request.
+ *
+ * @param count Returns the number of entries in the site table (including
+ *              unused entries, which have a NULL file).
+ * @return The site table or NULL if the profiler is not enabled.
+ */
+CastAllocSite *castAllocProfileSites(int *count);
+
+/**
+ * Engage the message arena, all toolkit allocations are diverted to it until
+ * suspended.  The arena is not engaged if disabled (castportal.json_arena) or
+ * if it is still holding the content of another message (nested use).
+ *
+ * @return TRUE if the arena was engaged, FALSE if allocations remain on the
+ *         heap (and must be released normally).
+ */
+int castArenaBegin();
+
+/**
+ * Stop diverting allocations to the message arena, the content allocated so
+ * far remains valid until the arena is reset.
+ */
+void castArenaSuspend();
+
+/**
+ * Discard everything allocated in the message arena in one shot.  The
+ * standard chunk is retained for the next message, overflow is released.
+ */
+void castArenaReset();
+
+/**
+ * Release a response returned from the message receive methods.  A response
+ * kept from the message arena holds the arena until released here (parsing
+ * falls back to the heap in the meantime), heap responses are destroyed.
+ *
+ * @param response The (JSON) response to release, NULL is ignored.
+ */
+void castResponseRelease(WXJSONValue *response);
+
+/**
+ * Release the message arena entirely (request shutdown).
+ */
+void castArenaRelease();
+
+/**
+ * Open a virtual channel across the device connection, issuing the CONNECT
+ * request between the two endpoints.  Messages inbound to the source id of
+ * the channel are routed to the channel for processing.
+ *
+ * @param conn The connection to multiplex the virtual channel over.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel,
+ *                 must be unique across the channels of the connection.
+ * @param destinationId Identifier of the remote (receiver) endpoint.
+ * @return The channel instance (owned by the connection) or NULL on error
+ *         (logged).
+ */
+CastChannel *castChannelOpen(CastDeviceConnection *conn, const char *sourceId,
+                             const char *destinationId);
+
+/**
+ * Open a virtual channel across the device connection along with an initial
+ * message, where the CONNECT request and the message are issued in a single
+ * write (no waiting in between).  If the channel is already open to the
+ * destination, just the message is sent.
+ *
+ * @param conn The connection to multiplex the virtual channel over.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel,
+ *                 must be unique across the channels of the connection.
+ * @param destinationId Identifier of the remote (receiver) endpoint.
+ * @param namespace Full namespace string for the initial message, NULL for
+ *                  no initial message.
+ * @param payload String content of the initial message (ignored if namespace
+ *                is NULL).
+ * @return The channel instance (owned by the connection) or NULL on error
+ *         (logged).
+ */
+CastChannel *castChannelOpenSend(CastDeviceConnection *conn,
+                                 const char *sourceId,
+                                 const char *destinationId,
+                                 const char *namespace, const char *payload);
+
+/**
+ * Locate a previously opened virtual channel for the connection.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param sourceId The local (sender) endpoint identifier for the channel.
+ * @return The matching channel instance or NULL if not found.
+ */
+CastChannel *castChannelFind(CastDeviceConnection *conn, const char *sourceId);
+
+/**
+ * Close a virtual channel, issuing the CLOSE request between the endpoints and
+ * releasing any unread inbound messages.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to close, no longer valid after this call.
+ */
+void castChannelClose(CastDeviceConnection *conn, CastChannel *channel);
+
+/**
+ * Generate simulated inbound traffic for the open channels of a test mode
+ * connection (interleaved across the channels) as the simulated response.
+ *
+ * @param conn The (test mode) connection with the open channels.
+ * @param frames Buffer for the encoded frames, destroyed by the caller after
+ *               the receive if this method succeeds.
+ * @return 0 if the traffic was set up, -1 on error (logged).
+ */
+int castChannelSimulate(CastDeviceConnection *conn, WXBuffer *frames);
+
+/**
+ * Verify the availability of the configured application instance on the
+ * associated device (connection).
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @return Zero on success (communicated and configuration application is
+ *         available), -1 on error or unavailable application (logged).
+ */
+int castAppCheckAvailability(CastDeviceConnection *conn);
+
+/**
+ * Query the availability of a set of application instances on the associated
+ * device (connection), using a single request.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @return Zero on success (communicated, results populated), -1 on error
+ *         (logged).
+ */
+int castAppQueryAvailability(CastDeviceConnection *conn,
+                             CastAppAvailability *results, int appCount);
+
+/**
+ * Encode the availability request for a set of application instances into
+ * the provided buffer (wire format), for issue alone or coalesced with other
+ * messages.
+ *
+ * @param conn The connection that the request will be issued on.
+ * @param frameBuffer The buffer to append the encoded request message to.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry (status is cleared).
+ * @param appCount The number of records in the results array.
+ * @param requestIdRef Returns the request identifier of the encoded request.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castAppEncodeAvailability(CastDeviceConnection *conn,
+                              WXBuffer *frameBuffer,
+                              CastAppAvailability *results, int appCount,
+                              int32_t *requestIdRef);
+
+/**
+ * Extract the application status values from an availability response.
+ *
+ * @param response The parsed JSON content of the GET_APP_AVAILABILITY
+ *                 response.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @return Zero on success, -1 if the response is invalid (logged).
+ */
+int castAppExtractAvailability(WXJSONValue *response,
+                               CastAppAvailability *results, int appCount);
+
+/**
+ * Query the availability of a set of application instances across multiple
+ * devices concurrently.  Requests are issued to all devices and the responses
+ * collected through a single wait with an overall deadline.
+ *
+ * @param conns Array of device connections to query, NULL entries are skipped.
+ * @param connCount The number of connections in the conns array.
+ * @param results Array of availability records, connCount rows of appCount
+ *                records, with the appId of each populated on entry.
+ * @param appCount The number of applications queried per device.
+ * @param latencies Array (connCount entries) for the elapsed time (in
+ *                  microseconds) of each response, -1 if no valid response.
+ * @param timeout Overall time period to wait for responses (milliseconds).
+ * @return The number of devices that responded successfully.
+ */
+int castAppSweepAvailability(CastDeviceConnection **conns, int connCount,
+                             CastAppAvailability *results, int appCount,
+                             int64_t *latencies, int32_t timeout);
+
+/**
+ * Update the receiver status snapshot of the connection from a RECEIVER_STATUS
+ * message (response or unsolicited broadcast).  Other messages are ignored.
+ *
+ * @param conn The connection the message was received on.
+ * @param message The parsed JSON content of the receiver namespace message.
+ */
+void castAppUpdateStatus(CastDeviceConnection *conn, WXJSONValue *message);
+
+/**
+ * Obtain the receiver status of the device, from the snapshot maintained by
+ * the status broadcasts if it is recent enough, otherwise through a status
+ * request to the device.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param maxAge Maximum age (milliseconds) of a cached status to be returned,
+ *               zero to always request the current status.
+ * @return The (updated) status snapshot of the connection or NULL on error
+ *         (logged).
+ */
+CastReceiverStatus *castAppReceiverStatus(CastDeviceConnection *conn,
+                                          int32_t maxAge);
+
+/**
+ * Launch the configured application on the device (unless it is already
+ * running) and open a virtual channel to the application transport.  The
+ * channel CONNECT and the initial application message are issued as soon as
+ * the transport is reported, without waiting for any other response.
+ *
+ * @param conn The connection instance returned from the device connect method.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel.
+ * @param namespace Full namespace string for the initial application message,
+ *                  NULL for no initial message.
+ * @param payload String content of the initial application message.
+ * @param timeout Time period to wait for the launch to complete (milliseconds).
+ * @param reused Returns true if the already running application session was
+ *               used, false if the application was launched.
+ * @return The status snapshot of the connection (with the session and
+ *         transport details of the application) or NULL on error (logged).
+ */
+CastReceiverStatus *castAppLaunch(CastDeviceConnection *conn,
+                                  const char *sourceId, const char *namespace,
+                                  const char *payload, int32_t timeout,
+                                  int *reused);
+
+/* Definition of a media item for the queueing operations */
+typedef struct {
+    const char *contentId;
+    const char *contentType;
+
+    /* Seconds before the end of the prior item to start loading, -1 none */
+    int32_t preloadTime;
+
+    /* Seconds of playback (e.g. for images), zero or less for natural end */
+    double playbackDuration;
+} CastMediaItem;
+
+/**
+ * Load a queue of media items on the application media session across the
+ * given channel.  Each item carries its preload hint, so the receiver buffers
+ * the next item before the current one completes (gapless playback).
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to the application transport (media receiver).
+ * @param items The set of media items to queue.
+ * @param count The number of media items.
+ * @param startIndex Index of the item to start playback with.
+ * @param repeatAll If true, the queue repeats once all items are played.
+ * @param mediaSessionId Returns the media session identifier for the queue.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castMediaQueueLoad(CastDeviceConnection *conn, CastChannel *channel,
+                       CastMediaItem *items, int count, int startIndex,
+                       int repeatAll, int32_t *mediaSessionId);
+
+/**
+ * Append media items to the queue of an active media session.  This does not
+ * wait for any response, the status updates for the session (and any other
+ * unread messages for the channel) are discarded as the next insert is issued.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to the application transport (media receiver).
+ * @param mediaSessionId The media session identifier from the queue load.
+ * @param items The set of media items to append.
+ * @param count The number of media items.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castMediaQueueInsert(CastDeviceConnection *conn, CastChannel *channel,
+                         int32_t mediaSessionId, CastMediaItem *items,
+                         int count);
+
+/**
+ * Enable (or resize) the capture ring of recent raw frames for a connection,
+ * or disable it.  Any previously captured frames are discarded.
+ *
+ * @param conn The connection to capture the frames of.
+ * @param frames The number of frames to retain, zero (or less) to disable.
+ * @param snapLen The maximum number of bytes retained for each frame.
+ * @return 0 on success, -1 on allocation failure (logged, capture disabled).
+ */
+int castCaptureEnable(CastDeviceConnection *conn, int frames, int snapLen);
+
+/**
+ * Record frames into the capture ring of the connection.  Use the macro
+ * below, which is just a pointer test when capture is not enabled.
+ *
+ * @param conn The connection the frames were sent/received on.
+ * @param direction The direction of the frames (CPTL_CAPTURE_IN/OUT).
+ * @param data The raw (length prefixed) frame content, outbound writes may
+ *             contain multiple frames.
+ * @param dataLen The number of bytes of frame content.
+ */
+void castCaptureFrames(CastDeviceConnection *conn, int direction,
+                       uint8_t *data, size_t dataLen);
+#define CPTL_CAPTURE(conn, dir, data, len) \
+    do { \
+        if ((conn)->capture != NULL) castCaptureFrames(conn, dir, data, len); \
+    } while (0)
+
+/**
+ * Export the captured frames of a connection, oldest first, as JSON lines
+ * (one object per frame).  The capture ring is not altered.
+ *
+ * @param conn The connection to export the captured frames of.
+ * @param output Buffer to append the exported content to.
+ * @return The number of frames exported or -1 on allocation failure (logged).
+ */
+int castCaptureExport(CastDeviceConnection *conn, WXBuffer *output);
+
+/* Timing consumers, bitmask for the traceActive global */
+#define CPTL_TRACE_TIMELINE 0x01
+#define CPTL_TRACE_SLOWOP 0x02
+
+/* Upper limit on the trace events recorded for a single request */
+#define CPTL_TRACE_MAX_EVENTS 65536
+
+/* Maximum length of the detail (argument) retained for a trace event */
+#define CPTL_TRACE_DETAIL_LEN 64
+
+/* Completed span of the request timeline */
+typedef struct {
+    const char *name;
+    char detail[CPTL_TRACE_DETAIL_LEN];
+    int64_t begin;
+    int64_t duration;
+} CastTraceEvent;
+
+/**
+ * Start the timeline for the current request, if tracing is configured
+ * (castportal.trace_file).  Called from request startup.
+ */
+void castTraceStart();
+
+/**
+ * Record a completed span in the timeline of the current request and/or the
+ * phase breakdown of the current slow operation candidate.  Use the macros
+ * below, where the begin timestamp is only taken if either is active.
+ *
+ * @param name Name of the span (phase), must be a static string.
+ * @param detail Optional detail (e.g. device address) for the span, copied
+ *               (truncated), NULL if not applicable.
+ * @param begin Monotonic timestamp of the start of the span (castTimeUsec).
+ */
+void castTraceEnd(const char *name, const char *detail, int64_t begin);
+#define CPTL_TRACE_BEGIN() ((CPTL_CTX(traceActive)) ? castTimeUsec() : 0)
+#define CPTL_TRACE_END(name, detail, begin) \
+    do { \
+        if ((begin) != 0) castTraceEnd(name, detail, begin); \
+    } while (0)
+
+/**
+ * Write the timeline of the current request to the configured trace file, as
+ * Chrome trace-event JSON (for chrome://tracing or Perfetto), and release the
+ * recorded events.  Called from request shutdown.
+ */
+void castTraceFlush();
+
+/**
+ * Mark the start of a public operation, for the slow operation log.  No-op
+ * unless castportal.slow_op_ms is set.
+ *
+ * @param opName Name of the operation (PHP function), must be a static string.
+ * @param device Address of the associated device, NULL if not applicable.
+ * @param port Port of the associated device, ignored if device is NULL or
+ *             zero if already included in the address.
+ */
+void castSlowOpBegin(const char *opName, const char *device, int port);
+
+/**
+ * Complete the current public operation, logging the operation with the
+ * breakdown of the timed phases if it exceeded castportal.slow_op_ms.
+ *
+ * @param success TRUE if the operation was successful, FALSE otherwise.
+ */
+void castSlowOpEnd(int success);
+
+/* Process-wide statistics counters, indices for the counter array */
+typedef enum {
+    STAT_CONNECTS = 0,
+    STAT_CONNECT_FAILURES,
+    STAT_HANDSHAKES,
+    STAT_HANDSHAKE_USEC,
+    STAT_SESSIONS_RESUMED,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_JSON_PARSES,
+    STAT_JSON_PARSE_USEC,
+    STAT_TIMEOUTS,
+    STAT_PARSE_ERRORS,
+    STAT_DISCOVERY_QUERIES,
+    STAT_DISCOVERY_RESPONSES,
+    STAT_IDLE_SLIMS,
+    STAT_IDLE_SLIM_BYTES,
+
+    /* Frame counts by namespace, with the last (NS_COUNT) for unknown */
+    STAT_FRAMES_IN,
+    STAT_FRAMES_OUT = STAT_FRAMES_IN + NS_COUNT + 1,
+    STAT_COUNT = STAT_FRAMES_OUT + NS_COUNT + 1
+} CastStatCounter;
+
+/* The counters themselves, not for direct access (use the macros below) */
+extern int64_t castStats[STAT_COUNT];
+
+/* Slot of the shared metrics segment for this process (NULL if disabled) */
+extern int64_t *castStatsSlot;
+
+/* Counter updates are relaxed atomics when threaded, plain adds otherwise */
+#ifdef CPTL_THREADED
+    #define CPTL_STAT_ATOMIC_ADD(p, v) \
+        ((void) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+#else
+    #define CPTL_STAT_ATOMIC_ADD(p, v) ((void) (*(p) += (v)))
+#endif
+static inline void castStatAdd(int counter, int64_t value) {
+    CPTL_STAT_ATOMIC_ADD(&(castStats[counter]), value);
+    if (castStatsSlot != NULL) {
+        CPTL_STAT_ATOMIC_ADD(&(castStatsSlot[counter]), value);
+    }
+}
+#define CPTL_STAT_ADD(c, v) castStatAdd((c), (int64_t) (v))
+#define CPTL_STAT_INC(c) CPTL_STAT_ADD(c, 1)
+
+/* Frame counter offset for a namespace, unknown (or any) is the last */
+#define CPTL_STAT_NS(ns) \
+    ((((ns) >= 0) && ((ns) < NS_COUNT)) ? (int) (ns) : NS_COUNT)
+
+/**
+ * Read the current value of a statistics counter.
+ *
+ * @param counter The index of the counter to read.
+ * @return The current counter value.
+ */
+int64_t castStatValue(int counter);
+
+/**
+ * Obtain the (external) name of a statistics counter, for reporting.
+ *
+ * @param counter The index of the counter.
+ * @return The counter name or NULL for the per-namespace frame counters,
+ *         which are named by namespace.
+ */
+const char *castStatName(int counter);
+
+/**
+ * Map the shared (cross-process) metrics segment, if configured.  Called from
+ * module startup, failures are logged and the segment is just not used.
+ */
+void castStatsInit();
+
+/**
+ * Attach the current process to a slot of the shared metrics segment, if
+ * not already attached (workers are forked after the segment is mapped).
+ */
+void castStatsAttach();
+
+/**
+ * Release the slot and mapping of the shared metrics segment.
+ */
+void castStatsCleanup();
+
+/**
+ * Render the counters aggregated across all of the processes attached to the
+ * shared metrics segment, in the Prometheus text exposition format.
+ *
+ * @param buffer Buffer to append the rendered text to.
+ * @return 0 on success, -1 if there is no segment or on allocation failure.
+ */
+int castStatsFormatGlobal(WXBuffer *buffer);
+#endif
@@ -5,10 +5,15 @@
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
+#include "castptl_probes.h"
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <errno.h>
 #include "json.h"
+#ifdef CPTL_THREADED
+#include <pthread.h>
+#endif
 
 /* If you have to uncomment this, you probably won't link properly */
 /*
@@ -27,11 +32,19 @@ static int castSslWrite(BIO *bio, const char *data, int len) {
 #else
     CastDeviceConnection *conn = (CastDeviceConnection *) BIO_get_data(bio);
 #endif
-    int ret = 0;
+    int ret = 0, flags;
 
-    /* Outbound is always blocking */
+    /* Outbound is blocking, unless the connection is flagged otherwise */
     if (data != NULL) {
-        ret = (int) WXSocket_Send(conn->scktHandle, data, len, 0);
+        flags = (conn->isWriteNonBlocking) ? MSG_DONTWAIT : 0;
+        ret = (int) WXSocket_Send(conn->scktHandle, data, len, flags);
+        BIO_clear_retry_flags(bio);
+        if (ret > 0) CPTL_STAT_ADD(STAT_BYTES_OUT, ret);
+        if ((ret == 0) ||
+                ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))) {
+            BIO_set_retry_write(bio);
+            ret = -1;
+        }
     }
 
     return ret;
@@ -49,6 +62,7 @@ static int castSslRead(BIO *bio, char *data, int len) {
         ret = (int) WXSocket_Recv(conn->scktHandle, data, len,
                                   (conn->isConnected) ? MSG_DONTWAIT : 0);
         BIO_clear_retry_flags(bio);
+        if (ret > 0) CPTL_STAT_ADD(STAT_BYTES_IN, ret);
         if (ret == 0) {
             BIO_set_retry_read(bio);
             /* Need to force an error condition for SSL to read this state */
@@ -115,7 +129,7 @@ static int castSslFree(BIO *bio) {
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 
-static const BIO_METHOD castSslMethods = {
+static BIO_METHOD castSslMethodsDef = {
     BIO_TYPE_WXSOCKET,
     "wxsocket",
     castSslWrite,
@@ -128,38 +142,209 @@ static const BIO_METHOD castSslMethods = {
     NULL
 };
 
+#endif
+
+/* Shared across all connections (and threads), created at module startup */
+static BIO_METHOD *castSslMethods = NULL;
+static SSL_CTX *castSslCtx = NULL;
+
 const BIO_METHOD *castSslBio() {
-    return (&castSslMethods);
+    return castSslMethods;
 }
 
+/* Client TLS sessions for resumption, keyed by the device address:port */
+typedef struct {
+    char devAddr[CPTL_SLOWOP_DEVICE_LEN];
+    SSL_SESSION *session;
+    int64_t lastUsed;
+} SslSessionEntry;
+
+/* Like the authentication cache, process-wide and shared across threads */
+static SslSessionEntry sslSessions[CPTL_SSL_SESSION_CACHE_SIZE];
+#ifdef CPTL_THREADED
+static pthread_mutex_t sslSessionLock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SESSIONS() (void) pthread_mutex_lock(&sslSessionLock)
+#define UNLOCK_SESSIONS() (void) pthread_mutex_unlock(&sslSessionLock)
 #else
+#define LOCK_SESSIONS()
+#define UNLOCK_SESSIONS()
+#endif
 
-const BIO_METHOD *castSslBio() {
-    static BIO_METHOD *biom = NULL;
+/* New session callback (TLS 1.3 tickets arrive after the handshake) */
+static int storeSession(SSL *ssl, SSL_SESSION *session) {
+    CastDeviceConnection *conn = (CastDeviceConnection *) SSL_get_app_data(ssl);
+    int idx, slot = 0;
+
+    if (conn == NULL) return 0;
+
+    /* Replace the entry for the device, otherwise the least recently used */
+    LOCK_SESSIONS();
+    for (idx = 0; idx < CPTL_SSL_SESSION_CACHE_SIZE; idx++) {
+        if ((sslSessions[idx].session != NULL) &&
+                (strcmp(sslSessions[idx].devAddr, conn->devAddr) == 0)) {
+            slot = idx;
+            break;
+        }
+        if (sslSessions[idx].lastUsed < sslSessions[slot].lastUsed) slot = idx;
+    }
+    if (sslSessions[slot].session != NULL) {
+        SSL_SESSION_free(sslSessions[slot].session);
+    }
+    (void) strcpy(sslSessions[slot].devAddr, conn->devAddr);
+    sslSessions[slot].session = session;
+    sslSessions[slot].lastUsed = castTimeUsec();
+    UNLOCK_SESSIONS();
+
+    /* Reference is retained by the cache */
+    return 1;
+}
 
-    if (biom == NULL) {
-        biom = BIO_meth_new(BIO_TYPE_WXSOCKET, "wxsocket");
-        BIO_meth_set_write(biom, castSslWrite);
-        BIO_meth_set_read(biom, castSslRead);
-        BIO_meth_set_puts(biom, castSslPuts);
-        BIO_meth_set_ctrl(biom, castSslCtrl);
-        BIO_meth_set_create(biom, castSslNew);
-        BIO_meth_set_destroy(biom, castSslFree);
+/* Offer the cached session (if any) for the device to the handshake */
+static void resumeSession(CastDeviceConnection *conn) {
+    int idx;
+
+    LOCK_SESSIONS();
+    for (idx = 0; idx < CPTL_SSL_SESSION_CACHE_SIZE; idx++) {
+        if ((sslSessions[idx].session != NULL) &&
+                (strcmp(sslSessions[idx].devAddr, conn->devAddr) == 0)) {
+            (void) SSL_set_session(conn->ssl, sslSessions[idx].session);
+            sslSessions[idx].lastUsed = castTimeUsec();
+            break;
+        }
     }
+    UNLOCK_SESSIONS();
+}
 
-    return biom;
+/* Discard the cached session for a device (failed handshake or shutdown) */
+static void dropSession(const char *devAddr) {
+    int idx;
+
+    LOCK_SESSIONS();
+    for (idx = 0; idx < CPTL_SSL_SESSION_CACHE_SIZE; idx++) {
+        if ((sslSessions[idx].session == NULL) ||
+                ((devAddr != NULL) &&
+                     (strcmp(sslSessions[idx].devAddr, devAddr) != 0))) {
+            continue;
+        }
+        SSL_SESSION_free(sslSessions[idx].session);
+        (void) memset(&(sslSessions[idx]), 0, sizeof(SslSessionEntry));
+    }
+    UNLOCK_SESSIONS();
+}
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) && defined(CPTL_THREADED)
+
+/* Older OpenSSL relies on the application for the library locking */
+static pthread_mutex_t *sslLocks = NULL;
+
+static void sslLockingCallback(int mode, int type, const char *file,
+                               int line) {
+    if (mode & CRYPTO_LOCK) {
+        (void) pthread_mutex_lock(&(sslLocks[type]));
+    } else {
+        (void) pthread_mutex_unlock(&(sslLocks[type]));
+    }
+}
+
+static unsigned long sslThreadId(void) {
+    return (unsigned long) pthread_self();
 }
 
 #endif
 
+/**
+ * Process-wide initialization of the OpenSSL elements for the device
+ * connections (socket BIO method, session cache and, for older OpenSSL when
+ * threaded, the library locking).  Called once from module startup, before
+ * any threads.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int castSslInit() {
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) && defined(CPTL_THREADED)
+    int idx;
+#endif
+
+    /* Harmless if the host (or another extension) has already done so */
+    SSL_load_error_strings();
+    SSL_library_init();
+    OpenSSL_add_all_algorithms();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    castSslMethods = &castSslMethodsDef;
+#ifdef CPTL_THREADED
+    /* Don't trample on anyone else (e.g. curl) that has already done this */
+    if (CRYPTO_get_locking_callback() == NULL) {
+        sslLocks = (pthread_mutex_t *) malloc(CRYPTO_num_locks() *
+                                              sizeof(pthread_mutex_t));
+        if (sslLocks == NULL) return -1;
+        for (idx = 0; idx < CRYPTO_num_locks(); idx++) {
+            (void) pthread_mutex_init(&(sslLocks[idx]), NULL);
+        }
+        CRYPTO_set_id_callback(sslThreadId);
+        CRYPTO_set_locking_callback(sslLockingCallback);
+    }
+#endif
+#else
+    castSslMethods = BIO_meth_new(BIO_TYPE_WXSOCKET, "wxsocket");
+    if (castSslMethods == NULL) return -1;
+    BIO_meth_set_write(castSslMethods, castSslWrite);
+    BIO_meth_set_read(castSslMethods, castSslRead);
+    BIO_meth_set_puts(castSslMethods, castSslPuts);
+    BIO_meth_set_ctrl(castSslMethods, castSslCtrl);
+    BIO_meth_set_create(castSslMethods, castSslNew);
+    BIO_meth_set_destroy(castSslMethods, castSslFree);
+#endif
+
+    /* One client context for all connections, buffers released when idle */
+    castSslCtx = SSL_CTX_new(TLS_client_method());
+    if (castSslCtx == NULL) return -1;
+    (void) SSL_CTX_set_mode(castSslCtx, SSL_MODE_RELEASE_BUFFERS);
+
+    /* Sessions are cached here (by device), for resumption on reconnect */
+    (void) memset(sslSessions, 0, sizeof(sslSessions));
+    (void) SSL_CTX_set_session_cache_mode(castSslCtx,
+                                          SSL_SESS_CACHE_CLIENT |
+                                              SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(castSslCtx, storeSession);
+
+    return 0;
+}
+
+/**
+ * Release the process-wide OpenSSL elements, at module shutdown.
+ */
+void castSslCleanup() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#ifdef CPTL_THREADED
+    int idx;
+
+    if (sslLocks != NULL) {
+        CRYPTO_set_locking_callback(NULL);
+        CRYPTO_set_id_callback(NULL);
+        for (idx = 0; idx < CRYPTO_num_locks(); idx++) {
+            (void) pthread_mutex_destroy(&(sslLocks[idx]));
+        }
+        free(sslLocks);
+        sslLocks = NULL;
+    }
+#endif
+#else
+    if (castSslMethods != NULL) BIO_meth_free(castSslMethods);
+#endif
+    castSslMethods = NULL;
+    dropSession(NULL);
+    if (castSslCtx != NULL) SSL_CTX_free(castSslCtx);
+    castSslCtx = NULL;
+}
+
 /* Wrap all of the above into a tidy bow */
 static int bindSslBio(CastDeviceConnection *conn) {
     BIO *bio;
 
     bio = BIO_new(castSslBio());
     if (bio == NULL) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to allocate BIO instance");
+        castLog(CPTL_LOG_WARNING, "Failed to allocate BIO instance");
         return -1;
     }
     BIO_set_data(bio, conn);
@@ -169,71 +354,188 @@ static int bindSslBio(CastDeviceConnection *conn) {
     return 0;
 }
 
+/* Track the open connections of the request, for the idle sweep */
+static void registerConnection(CastDeviceConnection *conn) {
+    CastDeviceConnection *head = (CastDeviceConnection *) CPTL_CTX(connections);
+
+    conn->poolPrev = NULL;
+    conn->poolNext = head;
+    if (head != NULL) head->poolPrev = conn;
+    CPTL_CTX(connections) = conn;
+    conn->isRegistered = TRUE;
+}
+
+static void unregisterConnection(CastDeviceConnection *conn) {
+    if (!conn->isRegistered) return;
+    if (conn->poolPrev != NULL) {
+        conn->poolPrev->poolNext = conn->poolNext;
+    } else {
+        CPTL_CTX(connections) = conn->poolNext;
+    }
+    if (conn->poolNext != NULL) conn->poolNext->poolPrev = conn->poolPrev;
+    conn->isRegistered = FALSE;
+}
+
+/*
+ * Release the read buffer and status snapshot (a stale cache by now) of an
+ * idle connection, returns bytes released.
+ */
+static size_t slimConnection(CastDeviceConnection *conn) {
+    size_t released = conn->readBuffer.allocLength;
+
+    WXBuffer_Destroy(&(conn->readBuffer));
+    (void) memset(&(conn->readBuffer), 0, sizeof(WXBuffer));
+    conn->isSlim = TRUE;
+    if (conn->receiverStatus != NULL) {
+        WXFree(conn->receiverStatus);
+        conn->receiverStatus = NULL;
+        released += sizeof(CastReceiverStatus);
+    }
+
+    return released;
+}
+
 /**
- * Execute a cast connection to a device instance, to create a persistent
- * message channel (NOT PHP-persistent).
+ * Release the read buffers of connections that have been idle (no reads or
+ * writes) for longer than castportal.idle_slim_ms.  Connections with partial
+ * content or queued writes are left alone.
  *
- * @param devAddr Network address (typically from discovery) of the cast
- *                device to connect to.
- * @param port Connection port as discovered, 8009 would be typical.
- * @return TLS-enabled connection instance (allocated) or NULL if connection
- *         failed.
+ * @param now The current (monotonic) timestamp.
  */
-CastDeviceConnection *castDeviceConnect(char *devAddr, int port) {
+void castDeviceSlimIdle(int64_t now) {
+    CastDeviceConnection *conn = (CastDeviceConnection *) CPTL_CTX(connections);
+    int64_t idleUsec = ((int64_t) CPTL_CFG(idleSlimMs)) * 1000;
+
+    CPTL_CTX(lastSlimSweep) = now;
+    if (idleUsec <= 0) return;
+
+    for (; conn != NULL; conn = conn->poolNext) {
+        if ((conn->isSlim) || (conn->readBuffer.length != 0) ||
+                (conn->writeQueue != NULL) ||
+                (now - conn->lastActivity < idleUsec)) continue;
+        CPTL_STAT_INC(STAT_IDLE_SLIMS);
+        CPTL_STAT_ADD(STAT_IDLE_SLIM_BYTES, slimConnection(conn));
+    }
+}
+
+/**
+ * Mark activity on a connection, allocating the read buffer if required (for
+ * reads) and sweeping the idle connections (at most twice per idle period).
+ *
+ * @param conn The connection being read from or written to.
+ * @param forRead TRUE if the read buffer is about to be used.
+ * @return 0 on success, -1 on allocation failure (logged).
+ */
+int castDeviceTouch(CastDeviceConnection *conn, int forRead) {
+    int64_t now = castTimeUsec();
+
+    conn->lastActivity = now;
+    if ((forRead) && (conn->isSlim)) {
+        if (WXBuffer_Init(&(conn->readBuffer),
+                          CPTL_READ_BUFFER_SIZE) == NULL) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to allocate connection read buffer");
+            (void) memset(&(conn->readBuffer), 0, sizeof(WXBuffer));
+            return -1;
+        }
+        conn->isSlim = FALSE;
+    }
+    if ((CPTL_CFG(idleSlimMs) > 0) &&
+            (now - CPTL_CTX(lastSlimSweep) >= CPTL_CFG(idleSlimMs) * 500)) {
+        castDeviceSlimIdle(now);
+    }
+
+    return 0;
+}
+
+/**
+ * Determine the memory held by a connection, for the pool accounting.  Note
+ * that this does not include the internal state of the SSL session.
+ *
+ * @param conn The connection to account for.
+ * @return The number of bytes held by the connection.
+ */
+size_t castDeviceMemory(CastDeviceConnection *conn) {
+    size_t total = sizeof(CastDeviceConnection);
+    CastChannel *channel;
+
+    if (!conn->isSlim) total += conn->readBuffer.allocLength;
+    if (conn->receiverStatus != NULL) total += sizeof(CastReceiverStatus);
+    if (conn->capture != NULL) {
+        total += sizeof(CastCaptureRing) +
+                 conn->capture->size * (sizeof(CastCaptureEntry) +
+                                        (size_t) conn->capture->snapLen);
+    }
+    for (channel = conn->channels; channel != NULL; channel = channel->next) {
+        total += sizeof(CastChannel) + channel->pendingBuffer.allocLength;
+    }
+
+    return total;
+}
+
+/* Common method to establish the TLS connection, no messages exchanged */
+static CastDeviceConnection *establishConnection(char *devAddr, int port) {
     char txtBuff[256], errBuff[256];
-    const SSL_METHOD *connMethod;
     CastDeviceConnection *retVal;
     unsigned long sslErrNo;
     WXSocket scktHandle;
+    int64_t connectTime, startTime, endTime;
+    int resumed;
 
     /* Allocate connection/resource object for complex return */
     retVal = (CastDeviceConnection *) WXMalloc(sizeof(CastDeviceConnection));
     if (retVal == NULL) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to allocate connection resource");
+        castLog(CPTL_LOG_WARNING, "Failed to allocate connection resource");
         return NULL;
     }
     (void) memset(retVal, 0, sizeof(CastDeviceConnection));
-    WXBuffer_InitLocal(&(retVal->readBuffer), retVal->readBufferData,
-                       sizeof(retVal->readBufferData));
+
+    /* Read buffer is only allocated on first read (see castDeviceTouch) */
+    retVal->isSlim = TRUE;
+    retVal->lastActivity = castTimeUsec();
+    (void) snprintf(retVal->devAddr, sizeof(retVal->devAddr), "%s:%d",
+                    devAddr, port);
+    if (CPTL_CFG(captureFrames) > 0) {
+        (void) castCaptureEnable(retVal, (int) CPTL_CFG(captureFrames),
+                                 (int) CPTL_CFG(captureSnapLen));
+    }
 
     /* Handle test simulation */
-    if (_cptl_tstmode != 0) {
+    if (CPTL_CTX(testMode) != 0) {
         retVal->scktHandle = INVALID_SOCKET_FD;
         retVal->isConnected = FALSE;
+        CPTL_STAT_INC(STAT_CONNECTS);
+        registerConnection(retVal);
         return retVal;
     }
 
     /* Create the base connection instance */
+    CPTL_PROBE2(connect__start, devAddr, port);
+    connectTime = castTimeUsec();
     (void) sprintf(txtBuff, "%d", port);
     if (WXSocket_OpenTCPClient(devAddr, txtBuff, &scktHandle,
                                NULL) != WXNRC_OK) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Connection failure for %s: %s", devAddr,
-                         WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
+        castLog(CPTL_LOG_WARNING,
+                "Connection failure for %s: %s", devAddr,
+                WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
+        CPTL_STAT_INC(STAT_CONNECT_FAILURES);
+        CPTL_PROBE2(connect__fail, devAddr, port);
+        if (retVal->capture != NULL) WXFree(retVal->capture);
+        WXFree(retVal);
         return NULL;
     }
+    CPTL_TRACE_END("connect.socket", devAddr, connectTime);
     retVal->scktHandle = scktHandle;
     retVal->isConnected = FALSE;
     retVal->requestId = 0;
 
-    /* Setup SSL context (negotiated maximum) and associate to socket */
-    if (((connMethod = TLS_client_method()) == NULL) ||
-        ((retVal->sslCtx = SSL_CTX_new(connMethod)) == NULL)) {
-        sslErrNo = ERR_get_error();
-        ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to initialize client SSL context [%s]",
-                         errBuff);
-        castDeviceClose(retVal);
-        return NULL;
-    }
-    if (((retVal->ssl = SSL_new(retVal->sslCtx)) == NULL) ||
+    /* Associate to the shared SSL context (negotiated maximum) and socket */
+    if (((retVal->ssl = SSL_new(castSslCtx)) == NULL) ||
                                        (bindSslBio(retVal) < 0)) {
         sslErrNo = ERR_get_error();
         ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to associate SSL processing [%s]", errBuff);
+        castLog(CPTL_LOG_WARNING,
+                "Failed to associate SSL processing [%s]", errBuff);
         castDeviceClose(retVal);
         return NULL;
     }
@@ -244,30 +546,333 @@ CastDeviceConnection *castDeviceConnect(char *devAddr, int port) {
     SSL_set_msg_callback_arg(retVal->ssl, BIO_new_fp(stderr, 0));
      */
 
-    /* And negotiate the connection (synchronous) */
+    /* And negotiate the connection (synchronous), resuming if possible */
+    SSL_set_app_data(retVal->ssl, retVal);
+    resumeSession(retVal);
     SSL_set_connect_state(retVal->ssl);
+    startTime = castTimeUsec();
     if (SSL_connect(retVal->ssl) <= 0) {
         sslErrNo = ERR_get_error();
         ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to establish SSL connection [%s]", errBuff);
+        castLog(CPTL_LOG_WARNING,
+                "Failed to establish SSL connection [%s]", errBuff);
+        dropSession(retVal->devAddr);
+        CPTL_STAT_INC(STAT_CONNECT_FAILURES);
+        CPTL_PROBE2(connect__fail, devAddr, port);
         castDeviceClose(retVal);
         return NULL;
     }
+    endTime = castTimeUsec();
+    CPTL_TRACE_END("connect.tls", devAddr, startTime);
+    resumed = (SSL_session_reused(retVal->ssl)) ? TRUE : FALSE;
+    CPTL_STAT_INC(STAT_HANDSHAKES);
+    CPTL_STAT_ADD(STAT_HANDSHAKE_USEC, endTime - startTime);
+    if (resumed) CPTL_STAT_INC(STAT_SESSIONS_RESUMED);
+    CPTL_PROBE5(connect__done, devAddr, port, endTime - connectTime,
+                endTime - startTime, resumed);
 
     /* We are connected! */
     retVal->isConnected = TRUE;
+    CPTL_STAT_INC(STAT_CONNECTS);
+    registerConnection(retVal);
+
+    return retVal;
+}
+
+/**
+ * Execute a cast connection to a device instance, to create a persistent
+ * message channel (NOT PHP-persistent).
+ *
+ * @param devAddr Network address (typically from discovery) of the cast
+ *                device to connect to.
+ * @param port Connection port as discovered, 8009 would be typical.
+ * @return TLS-enabled connection instance (allocated) or NULL if connection
+ *         failed.
+ */
+CastDeviceConnection *castDeviceConnect(char *devAddr, int port) {
+    int64_t traceBegin = CPTL_TRACE_BEGIN();
+    CastDeviceConnection *retVal;
+
+    if ((retVal = establishConnection(devAddr, port)) == NULL) return NULL;
 
     /* Initial connection always starts with a baseline connect message */
     if (castSendMessage(retVal, FALSE, FALSE, NS_CONNECTION,
                         "{\"type\": \"CONNECT\"}", -1) < 0) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to issue CONNECT request");
+        castLog(CPTL_LOG_WARNING, "Failed to issue CONNECT request");
         castDeviceClose(retVal);
         return NULL;
     }
 
     /* No response is currently returned from the connect message */
+    CPTL_TRACE_END("device.connect", devAddr, traceBegin);
+
+    return retVal;
+}
+
+/* Test responses for the open exchanges (availability and status) */
+static uint8_t _tstOpenAvailResp[] = {
+    0x00, 0x00, 0x00, 0xA2, 0x08, 0x00, 0x12, 0x0A,   // ........
+    0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72,   // receiver
+    0x2D, 0x30, 0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64,   // -0..send
+    0x65, 0x72, 0x2D, 0x30, 0x22, 0x23, 0x75, 0x72,   // er-0"#ur
+    0x6E, 0x3A, 0x78, 0x2D, 0x63, 0x61, 0x73, 0x74,   // n:x-cast
+    0x3A, 0x63, 0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F,   // :com.goo
+    0x67, 0x6C, 0x65, 0x2E, 0x63, 0x61, 0x73, 0x74,   // gle.cast
+    0x2E, 0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65,   // .receive
+    0x72, 0x28, 0x00, 0x32, 0x61, 0x7B, 0x22, 0x61,   // r(.2a{"a
+    0x76, 0x61, 0x69, 0x6C, 0x61, 0x62, 0x69, 0x6C,   // vailabil
+    0x69, 0x74, 0x79, 0x22, 0x3A, 0x7B, 0x22, 0x30,   // ity":{"0
+    0x32, 0x38, 0x33, 0x34, 0x36, 0x34, 0x38, 0x22,   // 2834648"
+    0x3A, 0x22, 0x41, 0x50, 0x50, 0x5F, 0x41, 0x56,   // :"APP_AV
+    0x41, 0x49, 0x4C, 0x41, 0x42, 0x4C, 0x45, 0x22,   // AILABLE"
+    0x7D, 0x2C, 0x22, 0x72, 0x65, 0x71, 0x75, 0x65,   // },"reque
+    0x73, 0x74, 0x49, 0x64, 0x22, 0x3A, 0x31, 0x2C,   // stId":1,
+    0x22, 0x72, 0x65, 0x73, 0x70, 0x6F, 0x6E, 0x73,   // "respons
+    0x65, 0x54, 0x79, 0x70, 0x65, 0x22, 0x3A, 0x22,   // eType":"
+    0x47, 0x45, 0x54, 0x5F, 0x41, 0x50, 0x50, 0x5F,   // GET_APP_
+    0x41, 0x56, 0x41, 0x49, 0x4C, 0x41, 0x42, 0x49,   // AVAILABI
+    0x4C, 0x49, 0x54, 0x59, 0x22, 0x7D, 0x00, 0x00,   // LITY"}..
+    0x01, 0x1A, 0x08, 0x00, 0x12, 0x0A, 0x72, 0x65,   // ......re
+    0x63, 0x65, 0x69, 0x76, 0x65, 0x72, 0x2D, 0x30,   // ceiver-0
+    0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64, 0x65, 0x72,   // ..sender
+    0x2D, 0x30, 0x22, 0x23, 0x75, 0x72, 0x6E, 0x3A,   // -0"#urn:
+    0x78, 0x2D, 0x63, 0x61, 0x73, 0x74, 0x3A, 0x63,   // x-cast:c
+    0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F, 0x67, 0x6C,   // om.googl
+    0x65, 0x2E, 0x63, 0x61, 0x73, 0x74, 0x2E, 0x72,   // e.cast.r
+    0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72, 0x28,   // eceiver(
+    0x00, 0x32, 0xD8, 0x01, 0x7B, 0x22, 0x72, 0x65,   // .2..{"re
+    0x71, 0x75, 0x65, 0x73, 0x74, 0x49, 0x64, 0x22,   // questId"
+    0x3A, 0x32, 0x2C, 0x22, 0x73, 0x74, 0x61, 0x74,   // :2,"stat
+    0x75, 0x73, 0x22, 0x3A, 0x7B, 0x22, 0x61, 0x70,   // us":{"ap
+    0x70, 0x6C, 0x69, 0x63, 0x61, 0x74, 0x69, 0x6F,   // plicatio
+    0x6E, 0x73, 0x22, 0x3A, 0x5B, 0x7B, 0x22, 0x61,   // ns":[{"a
+    0x70, 0x70, 0x49, 0x64, 0x22, 0x3A, 0x22, 0x30,   // ppId":"0
+    0x32, 0x38, 0x33, 0x34, 0x36, 0x34, 0x38, 0x22,   // 2834648"
+    0x2C, 0x22, 0x64, 0x69, 0x73, 0x70, 0x6C, 0x61,   // ,"displa
+    0x79, 0x4E, 0x61, 0x6D, 0x65, 0x22, 0x3A, 0x22,   // yName":"
+    0x50, 0x6F, 0x72, 0x74, 0x61, 0x6C, 0x22, 0x2C,   // Portal",
+    0x22, 0x73, 0x65, 0x73, 0x73, 0x69, 0x6F, 0x6E,   // "session
+    0x49, 0x64, 0x22, 0x3A, 0x22, 0x41, 0x31, 0x42,   // Id":"A1B
+    0x32, 0x2D, 0x43, 0x33, 0x44, 0x34, 0x22, 0x2C,   // 2-C3D4",
+    0x22, 0x73, 0x74, 0x61, 0x74, 0x75, 0x73, 0x54,   // "statusT
+    0x65, 0x78, 0x74, 0x22, 0x3A, 0x22, 0x52, 0x65,   // ext":"Re
+    0x61, 0x64, 0x79, 0x22, 0x2C, 0x22, 0x74, 0x72,   // ady","tr
+    0x61, 0x6E, 0x73, 0x70, 0x6F, 0x72, 0x74, 0x49,   // ansportI
+    0x64, 0x22, 0x3A, 0x22, 0x77, 0x65, 0x62, 0x2D,   // d":"web-
+    0x35, 0x22, 0x7D, 0x5D, 0x2C, 0x22, 0x76, 0x6F,   // 5"}],"vo
+    0x6C, 0x75, 0x6D, 0x65, 0x22, 0x3A, 0x7B, 0x22,   // lume":{"
+    0x6C, 0x65, 0x76, 0x65, 0x6C, 0x22, 0x3A, 0x30,   // level":0
+    0x2E, 0x35, 0x2C, 0x22, 0x6D, 0x75, 0x74, 0x65,   // .5,"mute
+    0x64, 0x22, 0x3A, 0x66, 0x61, 0x6C, 0x73, 0x65,   // d":false
+    0x7D, 0x7D, 0x2C, 0x22, 0x74, 0x79, 0x70, 0x65,   // }},"type
+    0x22, 0x3A, 0x22, 0x52, 0x45, 0x43, 0x45, 0x49,   // ":"RECEI
+    0x56, 0x45, 0x52, 0x5F, 0x53, 0x54, 0x41, 0x54,   // VER_STAT
+    0x55, 0x53, 0x22, 0x7D                            // US"}
+};
+
+static uint8_t _tstOpenUnavailResp[] = {
+    0x00, 0x00, 0x00, 0xA4, 0x08, 0x00, 0x12, 0x0A,   // ........
+    0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72,   // receiver
+    0x2D, 0x30, 0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64,   // -0..send
+    0x65, 0x72, 0x2D, 0x30, 0x22, 0x23, 0x75, 0x72,   // er-0"#ur
+    0x6E, 0x3A, 0x78, 0x2D, 0x63, 0x61, 0x73, 0x74,   // n:x-cast
+    0x3A, 0x63, 0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F,   // :com.goo
+    0x67, 0x6C, 0x65, 0x2E, 0x63, 0x61, 0x73, 0x74,   // gle.cast
+    0x2E, 0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65,   // .receive
+    0x72, 0x28, 0x00, 0x32, 0x63, 0x7B, 0x22, 0x61,   // r(.2c{"a
+    0x76, 0x61, 0x69, 0x6C, 0x61, 0x62, 0x69, 0x6C,   // vailabil
+    0x69, 0x74, 0x79, 0x22, 0x3A, 0x7B, 0x22, 0x30,   // ity":{"0
+    0x32, 0x38, 0x33, 0x34, 0x36, 0x34, 0x38, 0x22,   // 2834648"
+    0x3A, 0x22, 0x41, 0x50, 0x50, 0x5F, 0x55, 0x4E,   // :"APP_UN
+    0x41, 0x56, 0x41, 0x49, 0x4C, 0x41, 0x42, 0x4C,   // AVAILABL
+    0x45, 0x22, 0x7D, 0x2C, 0x22, 0x72, 0x65, 0x71,   // E"},"req
+    0x75, 0x65, 0x73, 0x74, 0x49, 0x64, 0x22, 0x3A,   // uestId":
+    0x31, 0x2C, 0x22, 0x72, 0x65, 0x73, 0x70, 0x6F,   // 1,"respo
+    0x6E, 0x73, 0x65, 0x54, 0x79, 0x70, 0x65, 0x22,   // nseType"
+    0x3A, 0x22, 0x47, 0x45, 0x54, 0x5F, 0x41, 0x50,   // :"GET_AP
+    0x50, 0x5F, 0x41, 0x56, 0x41, 0x49, 0x4C, 0x41,   // P_AVAILA
+    0x42, 0x49, 0x4C, 0x49, 0x54, 0x59, 0x22, 0x7D,   // BILITY"}
+    0x00, 0x00, 0x00, 0xAB, 0x08, 0x00, 0x12, 0x0A,   // ........
+    0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65, 0x72,   // receiver
+    0x2D, 0x30, 0x1A, 0x08, 0x73, 0x65, 0x6E, 0x64,   // -0..send
+    0x65, 0x72, 0x2D, 0x30, 0x22, 0x23, 0x75, 0x72,   // er-0"#ur
+    0x6E, 0x3A, 0x78, 0x2D, 0x63, 0x61, 0x73, 0x74,   // n:x-cast
+    0x3A, 0x63, 0x6F, 0x6D, 0x2E, 0x67, 0x6F, 0x6F,   // :com.goo
+    0x67, 0x6C, 0x65, 0x2E, 0x63, 0x61, 0x73, 0x74,   // gle.cast
+    0x2E, 0x72, 0x65, 0x63, 0x65, 0x69, 0x76, 0x65,   // .receive
+    0x72, 0x28, 0x00, 0x32, 0x6A, 0x7B, 0x22, 0x72,   // r(.2j{"r
+    0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x49, 0x64,   // equestId
+    0x22, 0x3A, 0x32, 0x2C, 0x22, 0x73, 0x74, 0x61,   // ":2,"sta
+    0x74, 0x75, 0x73, 0x22, 0x3A, 0x7B, 0x22, 0x61,   // tus":{"a
+    0x70, 0x70, 0x6C, 0x69, 0x63, 0x61, 0x74, 0x69,   // pplicati
+    0x6F, 0x6E, 0x73, 0x22, 0x3A, 0x5B, 0x5D, 0x2C,   // ons":[],
+    0x22, 0x76, 0x6F, 0x6C, 0x75, 0x6D, 0x65, 0x22,   // "volume"
+    0x3A, 0x7B, 0x22, 0x6C, 0x65, 0x76, 0x65, 0x6C,   // :{"level
+    0x22, 0x3A, 0x30, 0x2E, 0x35, 0x2C, 0x22, 0x6D,   // ":0.5,"m
+    0x75, 0x74, 0x65, 0x64, 0x22, 0x3A, 0x66, 0x61,   // uted":fa
+    0x6C, 0x73, 0x65, 0x7D, 0x7D, 0x2C, 0x22, 0x74,   // lse}},"t
+    0x79, 0x70, 0x65, 0x22, 0x3A, 0x22, 0x52, 0x45,   // ype":"RE
+    0x43, 0x45, 0x49, 0x56, 0x45, 0x52, 0x5F, 0x53,   // CEIVER_S
+    0x54, 0x41, 0x54, 0x55, 0x53, 0x22, 0x7D          // TATUS"}
+};
+
+/* Request identifier of a (parsed) response, zero if there is none */
+static int32_t responseRequestId(WXJSONValue *val) {
+    WXJSONValue *requestId;
+
+    requestId = WXHash_GetEntry(&(val->value.oval), "requestId",
+                                WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((requestId == NULL) || (requestId->type != WXJSONVALUE_INT)) return 0;
+    return (int32_t) requestId->value.ival;
+}
+
+/**
+ * Callback to classify the responses to the open exchanges, filtered against
+ * the global sender and device receiver.  Returns the parsed availability or
+ * receiver status response (the caller aligns them to the request ids),
+ * everything else is skipped.
+ */
+static void *parseOpenResponse(CastDeviceConnection *conn, void *content,
+                               size_t contentLen) {
+    WXJSONValue *val = (WXJSONValue *) content;
+    WXJSONValue *respType;
+
+    if (responseRequestId(val) <= 0) return NULL;
+    respType = WXHash_GetEntry(&(val->value.oval), "responseType",
+                               WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((respType != NULL) && (respType->type == WXJSONVALUE_STRING) &&
+            (strcmp(respType->value.sval, "GET_APP_AVAILABILITY") == 0)) {
+        return val;
+    }
+    respType = WXHash_GetEntry(&(val->value.oval), "type",
+                               WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((respType != NULL) && (respType->type == WXJSONVALUE_STRING) &&
+            (strcmp(respType->value.sval, "RECEIVER_STATUS") == 0)) {
+        return val;
+    }
+    return NULL;
+}
+
+/**
+ * Execute a cast connection to a device instance along with the initial
+ * application exchanges.  The CONNECT, application availability and (optional)
+ * receiver status requests are issued in a single write and the responses
+ * collected together, each matched to its request id (the same ids are used
+ * in test mode, the simulated responses carry them).
+ *
+ * @param devAddr Network address (typically from discovery) of the cast
+ *                device to connect to.
+ * @param port Connection port as discovered, 8009 would be typical.
+ * @param results Array of availability records, the appId of each must be
+ *                populated on entry, the status is returned (empty string if
+ *                the device did not report the application).
+ * @param appCount The number of records in the results array.
+ * @param withStatus If true, also request the receiver status (tracked in the
+ *                   status snapshot of the connection).
+ * @param timeout Time period to wait for all of the responses (milliseconds).
+ * @return TLS-enabled connection instance (allocated) or NULL if connection
+ *         or the initial exchanges failed (logged).
+ */
+CastDeviceConnection *castDeviceOpen(char *devAddr, int port,
+                                     CastAppAvailability *results,
+                                     int appCount, int withStatus,
+                                     int32_t timeout) {
+    int64_t traceBegin = CPTL_TRACE_BEGIN();
+    WXJSONValue *availResp = NULL;
+    uint8_t frameBufferData[2048];
+    CastDeviceConnection *retVal;
+    int64_t deadline, remaining;
+    int32_t availId, statusId = 0;
+    CastMessageFilter filter;
+    char msgBuffer[64];
+    WXBuffer frameBuffer;
+    int rc, statusSeen;
+    WXJSONValue *resp;
+
+    if ((retVal = establishConnection(devAddr, port)) == NULL) return NULL;
+
+    /* Everything goes out in a single flight */
+    WXBuffer_InitLocal(&frameBuffer, frameBufferData, sizeof(frameBufferData));
+    rc = castEncodeFrame(&frameBuffer, CPTL_SENDER_ID, CPTL_RECEIVER_ID,
+                         castNamespaceName(NS_CONNECTION),
+                         "{\"type\": \"CONNECT\"}", -1);
+    if (rc == 0) {
+        rc = castAppEncodeAvailability(retVal, &frameBuffer, results,
+                                       appCount, &availId);
+    }
+    if ((rc == 0) && (withStatus)) {
+        statusId = ++(retVal->requestId);
+        (void) snprintf(msgBuffer, sizeof(msgBuffer),
+                        "{\"type\": \"GET_STATUS\", \"requestId\": %d}",
+                        statusId);
+        rc = castEncodeFrame(&frameBuffer, CPTL_SENDER_ID, CPTL_RECEIVER_ID,
+                             castNamespaceName(NS_RECEIVER), msgBuffer, -1);
+    }
+    if (rc == 0) {
+        rc = castWriteFrames(retVal, frameBuffer.buffer, frameBuffer.length);
+    }
+    WXBuffer_Destroy(&frameBuffer);
+    if (rc < 0) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to issue initial connection requests");
+        castDeviceClose(retVal);
+        return NULL;
+    }
+
+    /* Setup the simulated responses for test mode */
+    if (CPTL_CTX(testMode) == 1) {
+        CPTL_CTX(testResp) = _tstOpenAvailResp;
+        CPTL_CTX(testRespLen) = sizeof(_tstOpenAvailResp);
+    } else {
+        CPTL_CTX(testResp) = _tstOpenUnavailResp;
+        CPTL_CTX(testRespLen) = sizeof(_tstOpenUnavailResp);
+    }
+
+    /* Collect the responses in whatever order they arrive, common deadline */
+    (void) memset(&filter, 0, sizeof(filter));
+    filter.forSenderSession = FALSE;
+    filter.fromPortalReceiver = FALSE;
+    filter.namespace = NS_RECEIVER;
+    filter.expJsonResponse = TRUE;
+    filter.responseCallback = parseOpenResponse;
+    statusSeen = (withStatus) ? FALSE : TRUE;
+    deadline = castTimeUsec() + ((int64_t) timeout) * 1000;
+    while ((availResp == NULL) || (!statusSeen)) {
+        remaining = (deadline - castTimeUsec()) / 1000;
+        if (remaining <= 0) {
+            castLog(CPTL_LOG_WARNING,
+                    "Timeout on wait for initial connection "
+                    "responses");
+            CPTL_STAT_INC(STAT_TIMEOUTS);
+            break;
+        }
+        filter.timeout = (int32_t) remaining;
+        resp = (WXJSONValue *) castReceiveFiltered(retVal, &filter);
+        if (resp == NULL) break;
+        if ((availResp == NULL) && (responseRequestId(resp) == availId) &&
+                (WXHash_GetEntry(&(resp->value.oval), "responseType",
+                                 WXHash_StrHashFn,
+                                 WXHash_StrEqualsFn) != NULL)) {
+            availResp = resp;
+            continue;
+        }
+        if ((withStatus) && (responseRequestId(resp) == statusId)) {
+            statusSeen = TRUE;
+        }
+        castResponseRelease(resp);
+    }
+
+    if (availResp != NULL) {
+        rc = castAppExtractAvailability(availResp, results, appCount);
+        castResponseRelease(availResp);
+    }
+    if ((availResp == NULL) || (rc < 0) || (!statusSeen)) {
+        castLog(CPTL_LOG_WARNING,
+                "Unable to obtain initial connection responses");
+        castDeviceClose(retVal);
+        return NULL;
+    }
+    CPTL_TRACE_END("device.open", devAddr, traceBegin);
 
     return retVal;
 }
@@ -322,25 +927,83 @@ int castDevicePing(CastDeviceConnection *conn) {
     /* Pretty basic message structure, I actually had this sequence years ago */
     if (castSendMessage(conn, FALSE, FALSE, NS_HEARTBEAT,
                         "{\"type\": \"PING\"}", -1) < 0) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to issue PING request");
+        castLog(CPTL_LOG_WARNING, "Failed to issue PING request");
         return -1;
     }
 
     /* And the response */
-    _cptl_tstresp = _tstPongResp;
-    _cptl_tstresplen = sizeof(_tstPongResp);
+    CPTL_CTX(testResp) = _tstPongResp;
+    CPTL_CTX(testRespLen) = sizeof(_tstPongResp);
     retval = castReceiveMessage(conn, FALSE, FALSE, NS_HEARTBEAT,
                                 validatePongResponse, TRUE, -1);
     if (retval != _pongOk) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to obtain PONG response to PING request");
+        castLog(CPTL_LOG_WARNING,
+                "Failed to obtain PONG response to PING request");
         return -1;
     }
 
     return 0;
 }
 
+/**
+ * Exchange ping/heartbeat keepalive messages with a set of cast devices
+ * concurrently.  All of the pings are issued first, then the responses are
+ * collected through a single wait with an overall deadline.
+ *
+ * @param conns Array of device connections to ping, NULL entries are skipped.
+ * @param count The number of connections in the conns array.
+ * @param rtts Array (count entries) for the round trip time (in microseconds)
+ *             of each ping, -1 if no valid response was received.
+ * @param timeout Overall time period to wait for responses (milliseconds).
+ * @return The number of devices that responded successfully.
+ */
+int castDevicePingMany(CastDeviceConnection **conns, int count,
+                       int64_t *rtts, int32_t timeout) {
+    CastPendingResponse *pending;
+    int idx, completed;
+
+    pending = (CastPendingResponse *) WXCalloc(count *
+                                               sizeof(CastPendingResponse));
+    if (pending == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate ping tracking");
+        return 0;
+    }
+
+    /* Same structure as the individual ping, just everyone at once */
+    CPTL_CTX(testResp) = _tstPongResp;
+    CPTL_CTX(testRespLen) = sizeof(_tstPongResp);
+    for (idx = 0; idx < count; idx++) {
+        rtts[idx] = -1;
+        if (conns[idx] == NULL) continue;
+        pending[idx].startTime = castTimeUsec();
+        if (castSendMessage(conns[idx], FALSE, FALSE, NS_HEARTBEAT,
+                            "{\"type\": \"PING\"}", -1) < 0) {
+            castLog(CPTL_LOG_WARNING, "Failed to issue PING request");
+            continue;
+        }
+        pending[idx].conn = conns[idx];
+        pending[idx].state = CPTL_PENDING_WAIT;
+        pending[idx].filter.forSenderSession = FALSE;
+        pending[idx].filter.fromPortalReceiver = FALSE;
+        pending[idx].filter.namespace = NS_HEARTBEAT;
+        pending[idx].filter.expJsonResponse = TRUE;
+        pending[idx].filter.requestId = -1;
+        pending[idx].filter.responseCallback = validatePongResponse;
+    }
+
+    completed = castReceiveMultiple(pending, count, timeout);
+
+    for (idx = 0; idx < count; idx++) {
+        if ((pending[idx].state == CPTL_PENDING_DONE) &&
+                (pending[idx].response == _pongOk)) {
+            rtts[idx] = pending[idx].elapsed;
+        }
+    }
+    WXFree(pending);
+
+    return completed;
+}
+
 /**
  * Close the persistent connection instance that was opened by the auth method.
  *
@@ -352,12 +1015,22 @@ void castDeviceClose(CastDeviceConnection *conn) {
     /* Just in case a malformed resource gets destroyed */
     if (conn == NULL) return;
 
+    /* Anything unsent is abandoned, virtual channels go next */
+    castDiscardQueue(conn);
+    while (conn->channels != NULL) castChannelClose(conn, conn->channels);
+
     /* Quietly be polite about it, no response because we're going to close */
-    (void) castSendMessage(conn, FALSE, FALSE, NS_CONNECTION,
-                           "{\"type\": \"CLOSE\"}", -1);
+    if ((conn->isConnected) || (conn->scktHandle == INVALID_SOCKET_FD)) {
+        (void) castSendMessage(conn, FALSE, FALSE, NS_CONNECTION,
+                               "{\"type\": \"CLOSE\"}", -1);
+    }
 
-    /* And then just unwind the connection elements */
+    /* And then just unwind the connection elements (SSL frees the BIO) */
+    unregisterConnection(conn);
+    if (conn->ssl != NULL) SSL_free(conn->ssl);
     if (conn->scktHandle != INVALID_SOCKET_FD) WXSocket_Close(conn->scktHandle);
-    WXBuffer_Destroy(&(conn->readBuffer));
+    if (!conn->isSlim) WXBuffer_Destroy(&(conn->readBuffer));
+    if (conn->receiverStatus != NULL) WXFree(conn->receiverStatus);
+    if (conn->capture != NULL) WXFree(conn->capture);
     WXFree(conn);
 }
@@ -5,7 +5,8 @@
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
+#include "castptl_probes.h"
 #include "socket.h"
 #include "buffer.h"
 
@@ -111,8 +112,7 @@ static QNameSegment *parseQName(WXBuffer *msgBuffer, ssize_t maxLen) {
         seg = (QNameSegment *) WXMalloc(sizeof(QNameSegment));
         if (seg == NULL) {
             /* Shouldn't happen but clean up anyways */
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Allocation error in name retrieval");
+            castLog(CPTL_LOG_WARNING, "Allocation error in name retrieval");
             _freeQName(retVal);
             return NULL;
         }
@@ -129,8 +129,7 @@ static QNameSegment *parseQName(WXBuffer *msgBuffer, ssize_t maxLen) {
 
     /* Error if overflowed or unterminated */
     if ((offset > limit) || (slen != 0)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Invalid/unterminated name segments/set");
+        castLog(CPTL_LOG_WARNING, "Invalid/unterminated name segments/set");
         _freeQName(retVal);
         return NULL;
     }
@@ -163,8 +162,7 @@ static int skipQName(WXBuffer *msgBuffer) {
 
     /* Error if overflowed or unterminated */
     if ((offset > msgBuffer->length) || (slen != 0)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Invalid/unterminated name segments/set");
+        castLog(CPTL_LOG_WARNING, "Invalid/unterminated name segments/set");
         return -1;
     }
 
@@ -301,6 +299,164 @@ static void cvtIPv6(char *addrBuff, uint8_t *data) {
     *addrBuff = '\0';
 }
 
+/**
+ * Obtain one of the captured responses used for the discovery test mode (and
+ * the micro-benchmarks).
+ *
+ * @param idx Index of the response, 0 for the IPv4 device and 1 for IPv6.
+ * @param respLen Returns the length of the response packet.
+ * @return The response packet content or NULL for an invalid index.
+ */
+const uint8_t *castDiscoverTestResponse(int idx, size_t *respLen) {
+    if (idx == 0) {
+        *respLen = sizeof(tstRespOne);
+        return tstRespOne;
+    } else if (idx == 1) {
+        *respLen = sizeof(tstRespTwo);
+        return tstRespTwo;
+    }
+
+    return NULL;
+}
+
+/**
+ * Parse a response to the cast discovery query, extracting the details of
+ * the device from the answer and the additional records.
+ *
+ * @param resp The content of the response packet.
+ * @param respLen The length of the response packet.
+ * @param info Device record to populate, initialized by the caller with the
+ *             defaults and the origin address of the response.
+ * @return 0 if the response described a cast device, 1 if the response is
+ *         not of interest (or a bad message) and -1 if the answer could not
+ *         be read and the remaining responses should be abandoned (logged).
+ */
+int castDiscoverParse(const uint8_t *resp, size_t respLen,
+                      CastDeviceInfo *info) {
+    uint16_t rTxnId, rFlags, rQueries, rAnswers, rAuthority, rAdditional;
+    uint16_t *sptr, rType, rClass, rLen;
+    uint8_t *ptr, msgBufferData[MDNS_MSG_LIMIT];
+    QNameSegment *names = NULL;
+    WXBuffer msgBuffer;
+    char txtBuff[256];
+    unsigned int slen;
+    uint32_t rTTL;
+    int idx;
+
+    /* Push to buffer for unpack and extract header (see above) */
+    if (respLen > sizeof(msgBufferData)) return 1;
+    WXBuffer_InitLocal(&msgBuffer, msgBufferData, sizeof(msgBufferData));
+    (void) WXBuffer_Append(&msgBuffer, (uint8_t *) resp, respLen, TRUE);
+    if (WXBuffer_Unpack(&msgBuffer, "nnnnnn",
+                        &rTxnId, &rFlags, &rQueries, &rAnswers,
+                        &rAuthority, &rAdditional) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Error on mDNS response header unpack");
+        return 1;
+    }
+
+    /* Must be an appropriate response to the direct request */
+    if ((rTxnId != 0xFEED) || (rFlags != 0x8400) ||
+            (rQueries != 0) || (rAnswers != 1)) {
+        return 1;
+    }
+
+    /* Validate the answer (source name, PTR response) */
+    if (((names = parseQName(&msgBuffer, -1)) == NULL) ||
+        (WXBuffer_Unpack(&msgBuffer, "nnNn",
+                         &rType, &rClass, &rTTL, &rLen) == NULL)) {
+        castLog(CPTL_LOG_WARNING, "Error on answer record data unpack");
+        freeQName(names);
+        return -1;
+    }
+    if ((rType != 0x0c) || ((rClass & 0x7FFF) != 0x01)) {
+        freeQName(names);
+        return 1;
+    }
+    if ((names == NULL) ||
+        (strcmp(names->fragment, _googlecast) != 0) ||
+            (names->next == NULL) ||
+            (strcmp(names->next->fragment, _tcp) != 0) ||
+                (names->next->next == NULL) ||
+                (strcmp(names->next->next->fragment, local) != 0) ||
+                    (names->next->next->next != NULL)) {
+        freeQName(names);
+        return 1;
+    }
+    freeQName(names);
+
+    /* The PTR response contains the fqname, grab base as dflt name */
+    if ((names = parseQName(&msgBuffer, rLen)) != NULL) {
+        (void) strncpy(info->name, names->fragment, 256);
+        info->name[255] = '\0';
+        freeQName(names);
+    }
+    msgBuffer.offset += rLen;
+
+    /* Should be no authorities, but just in case... */
+    for (idx = 0; idx < rAuthority; idx++) {
+        if ((skipQName(&msgBuffer) < 0) ||
+            (WXBuffer_Unpack(&msgBuffer, "nnNn",
+                             &rType, &rClass, &rTTL, &rLen) == NULL)) {
+            castLog(CPTL_LOG_WARNING, "Error on authority record data unpack");
+            break;
+        }
+        msgBuffer.offset += rLen;
+    }
+    if (idx < rAuthority) return 1;
+
+    /* Additional records is where the action is */
+    for (idx = 0; idx < rAdditional; idx++) {
+        if ((skipQName(&msgBuffer) < 0) ||
+            (WXBuffer_Unpack(&msgBuffer, "nnNn",
+                             &rType, &rClass, &rTTL, &rLen) == NULL)) {
+            castLog(CPTL_LOG_WARNING,
+                    "Error on additional record data unpack");
+            break;
+        }
+
+        /* Content of interest is based on record type */
+        if (rType == 1 /* A */) {
+            if (rLen == 4) {
+                cvtIPv4(txtBuff, msgBuffer.buffer + msgBuffer.offset);
+            }
+        } else if (rType == 16 /* TXT */) {
+            ptr = msgBuffer.buffer + msgBuffer.offset;
+            while (rLen > 0) {
+                slen = *(ptr++);
+                if (slen >= rLen) break;
+                (void) strncpy(txtBuff, ptr, slen);
+                txtBuff[slen] = '\0';
+
+                /* Keyset lookup for relevant data values */
+                if (strncmp(txtBuff, "id=", 3) == 0) {
+                    (void) strcpy(info->id, txtBuff + 3);
+                } else if (strncmp(txtBuff, "fn=", 3) == 0) {
+                    (void) strcpy(info->name, txtBuff + 3);
+                } else if (strncmp(txtBuff, "md=", 3) == 0) {
+                    (void) strcpy(info->model, txtBuff + 3);
+                }
+                ptr += (slen++);
+                rLen -= slen;
+                msgBuffer.offset += slen;
+            }
+        } else if (rType == 28 /* AAA */) {
+            if (rLen == 16) {
+                cvtIPv6(txtBuff, msgBuffer.buffer + msgBuffer.offset);
+            }
+        } else if (rType == 33 /* SRV */) {
+            if (rLen >= 6) {
+                sptr = (uint16_t *) (msgBuffer.buffer + msgBuffer.offset + 4);
+                info->port = ntohs(*sptr);
+            }
+        }
+
+        msgBuffer.offset += rLen;
+    }
+    if (idx < rAdditional) return 1;
+
+    return 0;
+}
+
 /**
  * Execute a cast discovery process, using multicast DNS queries.
  *
@@ -312,25 +468,23 @@ static void cvtIPv6(char *addrBuff, uint8_t *data) {
  * @return Linked list of discovered cast devices or NULL on error/empty.
  */
 CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
-    uint8_t *ptr, msgBufferData[MDNS_MSG_LIMIT], respBuffer[MDNS_MSG_LIMIT];
-    uint16_t rTxnId, rFlags, rQueries, rAnswers, rAuthority, rAdditional;
+    uint8_t msgBufferData[MDNS_MSG_LIMIT], respBuffer[MDNS_MSG_LIMIT];
     CastDeviceInfo *device, wrk, *retVal = NULL, *last = NULL;
-    uint16_t *sptr, rType, rClass, rLen;
     struct addrinfo *addrInfo = NULL;
     struct sockaddr_storage respAddr;
     char *targetAddr, txtBuff[256];
-    QNameSegment *names = NULL;
+    const uint8_t *tstResp;
     socklen_t respAddrLen;
     WXSocket scktHandle;
-    int rc, modeIdx, idx;
+    int rc, modeIdx;
     WXBuffer msgBuffer;
-    unsigned int slen;
+    size_t tstRespLen;
     ssize_t respLen;
+    int64_t queryTime, traceBegin;
     int32_t timeout;
-    uint32_t rTTL;
 
     /* Use the global configuration fallback */
-    if (waitTm <= 0) waitTm = CPTL_G(discoveryTimeout);
+    if (waitTm <= 0) waitTm = CPTL_CFG(discoveryTimeout);
 
     /* Two passes, one per network type */
     for (modeIdx = 1; modeIdx <= 2; modeIdx++) {
@@ -341,18 +495,18 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
         targetAddr = (modeIdx == 1) ? "224.0.0.251" : "ff02::fb";
         if (WXSocket_OpenUDPClient(targetAddr, "mdns", &scktHandle,
                                    (void **) &addrInfo) != WXNRC_OK) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Error opening discovery socket for %s: %s",
-                             targetAddr, WXSocket_GetErrorStr(
-                                                WXSocket_GetLastErrNo()));
+            castLog(CPTL_LOG_WARNING,
+                    "Error opening discovery socket for %s: %s",
+                    targetAddr, WXSocket_GetErrorStr(
+                                       WXSocket_GetLastErrNo()));
             continue;
         }
 
         /* Force non-blocking to properly handle timeout */
         if (WXSocket_SetNonBlockingState(scktHandle, TRUE) != WXNRC_OK) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Error marking socket for non-blocking: %s",
-                             WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
+            castLog(CPTL_LOG_WARNING,
+                    "Error marking socket for non-blocking: %s",
+                    WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
             WXSocket_Close(scktHandle);
             freeaddrinfo(addrInfo);
             continue;
@@ -362,9 +516,9 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
         rc = (addrInfo->ai_family == AF_INET) ?
                        multicastIPv4(scktHandle) : multicastIPv6(scktHandle);
         if (rc < 0) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Error marking multicast options: %s",
-                             WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
+            castLog(CPTL_LOG_WARNING,
+                    "Error marking multicast options: %s",
+                    WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
             WXSocket_Close(scktHandle);
             freeaddrinfo(addrInfo);
             continue;
@@ -397,23 +551,27 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
         /* There she blows! */
         if (WXSocket_SendTo(scktHandle, msgBuffer.buffer, msgBuffer.length, 0,
                             addrInfo->ai_addr, addrInfo->ai_addrlen) < 0) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Error broadcasting mDNS query: %s",
-                             WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
+            castLog(CPTL_LOG_WARNING,
+                    "Error broadcasting mDNS query: %s",
+                    WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
             WXSocket_Close(scktHandle);
             freeaddrinfo(addrInfo);
             continue;
         }
+        CPTL_STAT_INC(STAT_DISCOVERY_QUERIES);
+        queryTime = castTimeUsec();
 
         /* Grab some answers */
         timeout = waitTm;
         while (timeout > 0) {
             /* Wait for something to read, until timeout has been reached */
+            traceBegin = CPTL_TRACE_BEGIN();
             rc = WXSocket_Wait(scktHandle, WXNRC_READ_REQUIRED, &timeout);
+            CPTL_TRACE_END("discovery.wait", NULL, traceBegin);
             if (rc == WXNRC_TIMEOUT) {
-                if (_cptl_tstmode == 0) break;
+                if (CPTL_CTX(testMode) == 0) break;
             } else if (rc < 0) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                castLog(CPTL_LOG_WARNING,
                               "Unexpected error on wait response: %s",
                               WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
                 break;
@@ -425,18 +583,18 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
             respLen = WXSocket_RecvFrom(scktHandle, respBuffer,
                                         sizeof(respBuffer), 0,
                                         &respAddr, &respAddrLen);
-            if (_cptl_tstmode != 0) {
+            if (CPTL_CTX(testMode) != 0) {
                 if ((respLen == 0) && (timeout <= 0)) {
                     /* Timeout in test mode, simulate fixed responses */
+                    tstResp = castDiscoverTestResponse(modeIdx - 1,
+                                                       &tstRespLen);
+                    respLen = tstRespLen;
+                    (void) memcpy(respBuffer, tstResp, respLen);
                     if (modeIdx == 1) {
-                        respLen = sizeof(tstRespOne);
-                        (void) memcpy(respBuffer, tstRespOne, respLen);
                         respAddr.ss_family = AF_INET;
                         (void) inet_pton(AF_INET, "10.11.12.13",
                                &(((struct sockaddr_in *) &respAddr)->sin_addr));
                     } else {
-                        respLen = sizeof(tstRespTwo);
-                        (void) memcpy(respBuffer, tstRespTwo, respLen);
                         respAddr.ss_family = AF_INET6;
                         (void) inet_pton(AF_INET6, "2016:cd8:4567:2cd0::12",
                              &(((struct sockaddr_in6 *) &respAddr)->sin6_addr));
@@ -447,11 +605,12 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
                 }
             }
             if (respLen <= 0) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                castLog(CPTL_LOG_WARNING,
                               "Error on response read: %s",
                               WXSocket_GetErrorStr(WXSocket_GetLastErrNo()));
                 break;
             }
+            CPTL_STAT_INC(STAT_DISCOVERY_RESPONSES);
 
             /* Prepare to add a device information record */
             (void) memset(&wrk, 0, sizeof(wrk));
@@ -467,123 +626,13 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
                                                    &respAddr)->sin6_addr),
                       txtBuff, sizeof(txtBuff));
             (void) strcpy(wrk.ipAddr, txtBuff);
+            CPTL_PROBE3(discovery__receive, wrk.ipAddr, (int) respLen,
+                        castTimeUsec() - queryTime);
 
             /* Note: from this point it's just a bad message, so continue */
-
-            /* Push to buffer for unpack and extract header (see above) */
-            WXBuffer_Empty(&msgBuffer);
-            (void) WXBuffer_Append(&msgBuffer, respBuffer, respLen, TRUE);
-            if (WXBuffer_Unpack(&msgBuffer, "nnnnnn",
-                                &rTxnId, &rFlags, &rQueries, &rAnswers,
-                                &rAuthority, &rAdditional) == NULL) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                 "Error on mDNS response header unpack");
-                continue;
-            }
-
-            /* Must be an appropriate response to the direct request */
-            if ((rTxnId != 0xFEED) || (rFlags != 0x8400) ||
-                    (rQueries != 0) || (rAnswers != 1)) {
-                continue;
-            }
-
-            /* Validate the answer (source name, PTR response) */
-            if (((names = parseQName(&msgBuffer, -1)) == NULL) ||
-                (WXBuffer_Unpack(&msgBuffer, "nnNn",
-                                 &rType, &rClass, &rTTL, &rLen) == NULL)) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                 "Error on answer record data unpack");
-                freeQName(names);
-                break;
-            }
-            if ((rType != 0x0c) || ((rClass & 0x7FFF) != 0x01)) {
-                freeQName(names);
-                continue;
-            }
-            if ((names == NULL) ||
-                (strcmp(names->fragment, _googlecast) != 0) ||
-                    (names->next == NULL) ||
-                    (strcmp(names->next->fragment, _tcp) != 0) ||
-                        (names->next->next == NULL) ||
-                        (strcmp(names->next->next->fragment, local) != 0) ||
-                            (names->next->next->next != NULL)) {
-                freeQName(names);
-                continue;
-            }
-            freeQName(names);
-
-            /* The PTR response contains the fqname, grab base as dflt name */
-            if ((names = parseQName(&msgBuffer, rLen)) != NULL) {
-                (void) strncpy(wrk.name, names->fragment, 256);
-                wrk.name[255] = '\0';
-                freeQName(names);
-            }
-            msgBuffer.offset += rLen;
-
-            /* Should be no authorities, but just in case... */
-            for (idx = 0; idx < rAuthority; idx++) {
-                if ((skipQName(&msgBuffer) < 0) ||
-                    (WXBuffer_Unpack(&msgBuffer, "nnNn",
-                                     &rType, &rClass, &rTTL, &rLen) == NULL)) {
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                     "Error on authority record data unpack");
-                    break;
-                }
-                msgBuffer.offset += rLen;
-            }
-            if (idx < rAuthority) continue;
-
-            /* Additional records is where the action is */
-            for (idx = 0; idx < rAdditional; idx++) {
-                if ((skipQName(&msgBuffer) < 0) ||
-                    (WXBuffer_Unpack(&msgBuffer, "nnNn",
-                                     &rType, &rClass, &rTTL, &rLen) == NULL)) {
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                     "Error on additional record data unpack");
-                    break;
-                }
-
-                /* Content of interest is based on record type */
-                if (rType == 1 /* A */) {
-                    if (rLen == 4) {
-                        cvtIPv4(txtBuff, msgBuffer.buffer + msgBuffer.offset);
-                    }
-                } else if (rType == 16 /* TXT */) {
-                    ptr = msgBuffer.buffer + msgBuffer.offset;
-                    while (rLen > 0) {
-                        slen = *(ptr++);
-                        if (slen >= rLen) break;
-                        (void) strncpy(txtBuff, ptr, slen);
-                        txtBuff[slen] = '\0';
-
-                        /* Keyset lookup for relevant data values */
-                        if (strncmp(txtBuff, "id=", 3) == 0) {
-                            (void) strcpy(wrk.id, txtBuff + 3);
-                        } else if (strncmp(txtBuff, "fn=", 3) == 0) {
-                            (void) strcpy(wrk.name, txtBuff + 3);
-                        } else if (strncmp(txtBuff, "md=", 3) == 0) {
-                            (void) strcpy(wrk.model, txtBuff + 3);
-                        }
-                        ptr += (slen++);
-                        rLen -= slen;
-                        msgBuffer.offset += slen;
-                    }
-                } else if (rType == 28 /* AAA */) {
-                    if (rLen == 16) {
-                        cvtIPv6(txtBuff, msgBuffer.buffer + msgBuffer.offset);
-                    }
-                } else if (rType == 33 /* SRV */) {
-                    if (rLen >= 6) {
-                        sptr = (uint16_t *) (msgBuffer.buffer +
-                                                         msgBuffer.offset + 4);
-                        wrk.port = ntohs(*sptr);
-                    }
-                }
-
-                msgBuffer.offset += rLen;
-            }
-            freeQName(names);
-            if (idx < rAdditional) continue;
+            rc = castDiscoverParse(respBuffer, respLen, &wrk);
+            if (rc < 0) break;
+            if (rc > 0) continue;
 
             /* If we got to here, it's official! */
             device = (CastDeviceInfo *) WXMalloc(sizeof(CastDeviceInfo));
@@ -593,6 +642,9 @@ CastDeviceInfo *castDiscover(int ipMode, int waitTm) {
             if (last != NULL) last->next = device;
             last = device;
         }
+
+        WXSocket_Close(scktHandle);
+        freeaddrinfo(addrInfo);
     }
 
     return retVal;
@@ -0,0 +1,228 @@
+/*
+ * Functions for concurrent operations across multiple device connections.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include <errno.h>
+#include <poll.h>
+
+/* Drain the connection and check for the pending response */
+static void checkPending(CastPendingResponse *pending) {
+    void *retval;
+
+    if (castReadAvailable(pending->conn) < 0) {
+        pending->state = CPTL_PENDING_FAILED;
+        return;
+    }
+
+    retval = castProcessFiltered(pending->conn, &(pending->filter));
+    if (retval == NULL) return;
+    pending->elapsed = castTimeUsec() - pending->startTime;
+    if (retval == CPTL_RESP_ERROR) {
+        pending->state = CPTL_PENDING_FAILED;
+    } else {
+        pending->state = CPTL_PENDING_DONE;
+        pending->response = retval;
+    }
+}
+
+/**
+ * Wait for the responses on a set of connections concurrently, through a
+ * single multiplexed wait with one overall deadline.  Requests must already
+ * have been issued by the caller.
+ *
+ * @param pending The set of responses to wait for.  Entries with a NULL
+ *                connection or a state other than CPTL_PENDING_WAIT are
+ *                ignored.  On return, the state of each entry indicates the
+ *                outcome (entries still waiting have timed out).
+ * @param count The number of entries in the pending array.
+ * @param timeout The overall time (in milliseconds) to wait for responses.
+ * @return The number of entries that were successfully completed.
+ */
+int castReceiveMultiple(CastPendingResponse *pending, int count,
+                        int32_t timeout) {
+    int64_t now, deadline = castTimeUsec() + ((int64_t) timeout) * 1000;
+    int idx, pollCount, rc, completed = 0;
+    struct pollfd *pollFds;
+    int *pollIdx;
+
+    /* Parallel arrays for the poll set and associated pending entry */
+    pollFds = (struct pollfd *) WXMalloc(count * sizeof(struct pollfd));
+    pollIdx = (int *) WXMalloc(count * sizeof(int));
+    if ((pollFds == NULL) || (pollIdx == NULL)) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to allocate multiple response poll set");
+        if (pollFds != NULL) WXFree(pollFds);
+        if (pollIdx != NULL) WXFree(pollIdx);
+        return 0;
+    }
+
+    /* Responses may have already arrived (or be simulated) */
+    for (idx = 0; idx < count; idx++) {
+        if ((pending[idx].conn == NULL) ||
+                (pending[idx].state != CPTL_PENDING_WAIT)) continue;
+        checkPending(&(pending[idx]));
+    }
+
+    /* Then it's one wait for all, until everyone answers or time runs out */
+    while (TRUE) {
+        pollCount = 0;
+        for (idx = 0; idx < count; idx++) {
+            if ((pending[idx].conn == NULL) ||
+                    (pending[idx].state != CPTL_PENDING_WAIT) ||
+                    (pending[idx].conn->scktHandle == INVALID_SOCKET_FD)) {
+                continue;
+            }
+            pollFds[pollCount].fd = pending[idx].conn->scktHandle;
+            pollFds[pollCount].events = POLLIN;
+            pollFds[pollCount].revents = 0;
+            pollIdx[pollCount++] = idx;
+        }
+        if (pollCount == 0) break;
+
+        now = castTimeUsec();
+        if (now >= deadline) break;
+        rc = poll(pollFds, pollCount, (int) ((deadline - now + 999) / 1000));
+        if (CPTL_CTX(traceActive)) {
+            castTraceEnd("message.wait", "multiple", now);
+        }
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            castLog(CPTL_LOG_WARNING,
+                    "Error in multiple response poll: %s",
+                    strerror(errno));
+            break;
+        }
+
+        for (idx = 0; (idx < pollCount) && (rc > 0); idx++) {
+            if (pollFds[idx].revents == 0) continue;
+            checkPending(&(pending[pollIdx[idx]]));
+            rc--;
+        }
+    }
+
+    for (idx = 0; idx < count; idx++) {
+        if (pending[idx].conn == NULL) continue;
+        if (pending[idx].state == CPTL_PENDING_DONE) completed++;
+        if (pending[idx].state == CPTL_PENDING_WAIT) {
+            CPTL_STAT_INC(STAT_TIMEOUTS);
+        }
+    }
+    WXFree(pollFds);
+    WXFree(pollIdx);
+
+    return completed;
+}
+
+/**
+ * Broadcast a (string) message to the portal application session across a
+ * set of device connections.  The message is encoded once and the shared
+ * frame is written to all of the connections concurrently (non-blocking).
+ *
+ * @param conns Array of device connections to write to, NULL entries are
+ *              skipped.
+ * @param count The number of connections in the conns array.
+ * @param namespace Full namespace string for the message.
+ * @param data The string payload of the message.
+ * @param results Array (count entries) for the outcome of each connection,
+ *                TRUE if the message was completely written, FALSE otherwise.
+ * @param timeout Overall time period to wait for writes (milliseconds).
+ * @return The number of connections that the message was written to.
+ */
+int castBroadcastMessage(CastDeviceConnection **conns, int count,
+                         const char *namespace, char *data, int *results,
+                         int32_t timeout) {
+    int64_t now, deadline = castTimeUsec() + ((int64_t) timeout) * 1000;
+    int idx, pollCount, rc, completed = 0;
+    struct pollfd *pollFds;
+    CastSharedFrame *frame;
+    uint8_t bufferData[2048];
+    WXBuffer buffer;
+    int *pollIdx;
+
+    for (idx = 0; idx < count; idx++) results[idx] = FALSE;
+
+    /* Encode once, everyone shares the same frame */
+    WXBuffer_InitLocal(&buffer, bufferData, sizeof(bufferData));
+    if (castEncodeFrame(&buffer, CPTL_SENDER_SESSION_ID,
+                        CPTL_PORTAL_RECEIVER_ID, namespace, data, -1) < 0) {
+        WXBuffer_Destroy(&buffer);
+        return 0;
+    }
+    frame = castSharedFrameCreate(buffer.buffer, buffer.length);
+    WXBuffer_Destroy(&buffer);
+    if (frame == NULL) return 0;
+
+    pollFds = (struct pollfd *) WXMalloc(count * sizeof(struct pollfd));
+    pollIdx = (int *) WXMalloc(count * sizeof(int));
+    if ((pollFds == NULL) || (pollIdx == NULL)) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate broadcast poll set");
+        if (pollFds != NULL) WXFree(pollFds);
+        if (pollIdx != NULL) WXFree(pollIdx);
+        castSharedFrameRelease(frame);
+        return 0;
+    }
+
+    /* Queue to all and write as much as the sockets will take immediately */
+    for (idx = 0; idx < count; idx++) {
+        if (conns[idx] == NULL) continue;
+        if (castQueueFrame(conns[idx], frame) < 0) continue;
+        conns[idx]->isWriteNonBlocking = TRUE;
+        rc = castFlushQueue(conns[idx]);
+        if (rc <= 0) {
+            results[idx] = (rc == 0);
+            conns[idx]->isWriteNonBlocking = FALSE;
+        }
+    }
+
+    /* Then poll for writability on the remainder until done or deadline */
+    while (TRUE) {
+        pollCount = 0;
+        for (idx = 0; idx < count; idx++) {
+            if ((conns[idx] == NULL) || (!conns[idx]->isWriteNonBlocking)) {
+                continue;
+            }
+            pollFds[pollCount].fd = conns[idx]->scktHandle;
+            /* Unread inbound frames would otherwise keep POLLIN set */
+            pollFds[pollCount].events =
+                      (conns[idx]->isWriteWantRead) ? POLLIN : POLLOUT;
+            pollFds[pollCount].revents = 0;
+            pollIdx[pollCount++] = idx;
+        }
+        if (pollCount == 0) break;
+
+        now = castTimeUsec();
+        if (now >= deadline) break;
+        rc = poll(pollFds, pollCount, (int) ((deadline - now + 999) / 1000));
+        if (CPTL_CTX(traceActive)) castTraceEnd("broadcast.wait", NULL, now);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            castLog(CPTL_LOG_WARNING,
+                    "Error in broadcast poll: %s", strerror(errno));
+            break;
+        }
+
+        for (idx = 0; (idx < pollCount) && (rc > 0); idx++) {
+            if (pollFds[idx].revents == 0) continue;
+            rc--;
+            if (castFlushQueue(conns[pollIdx[idx]]) > 0) continue;
+            results[pollIdx[idx]] = (conns[pollIdx[idx]]->writeQueue == NULL);
+            conns[pollIdx[idx]]->isWriteNonBlocking = FALSE;
+        }
+    }
+
+    /* Incomplete writes stay queued, to be flushed before the next message */
+    for (idx = 0; idx < count; idx++) {
+        if (conns[idx] == NULL) continue;
+        conns[idx]->isWriteNonBlocking = FALSE;
+        if (results[idx]) completed++;
+    }
+    castSharedFrameRelease(frame);
+    WXFree(pollFds);
+    WXFree(pollIdx);
+
+    return completed;
+}
@@ -0,0 +1,314 @@
+/*
+ * Functions for the media namespace, queueing of media items for playback.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include "json.h"
+
+/* Test response for the media queue load (destined for test channel) */
+static uint8_t _mediaStatusResp[] = {
+    0x00, 0x00, 0x00, 0xAC, 0x08, 0x00, 0x12, 0x05,   // ........
+    0x77, 0x65, 0x62, 0x2D, 0x35, 0x1A, 0x0A, 0x70,   // web-5..p
+    0x6F, 0x72, 0x74, 0x61, 0x6C, 0x2D, 0x63, 0x74,   // ortal-ct
+    0x6C, 0x22, 0x20, 0x75, 0x72, 0x6E, 0x3A, 0x78,   // l" urn:x
+    0x2D, 0x63, 0x61, 0x73, 0x74, 0x3A, 0x63, 0x6F,   // -cast:co
+    0x6D, 0x2E, 0x67, 0x6F, 0x6F, 0x67, 0x6C, 0x65,   // m.google
+    0x2E, 0x63, 0x61, 0x73, 0x74, 0x2E, 0x6D, 0x65,   // .cast.me
+    0x64, 0x69, 0x61, 0x28, 0x00, 0x32, 0x71, 0x7B,   // dia(.2q{
+    0x22, 0x72, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74,   // "request
+    0x49, 0x64, 0x22, 0x3A, 0x31, 0x2C, 0x22, 0x73,   // Id":1,"s
+    0x74, 0x61, 0x74, 0x75, 0x73, 0x22, 0x3A, 0x5B,   // tatus":[
+    0x7B, 0x22, 0x63, 0x75, 0x72, 0x72, 0x65, 0x6E,   // {"curren
+    0x74, 0x49, 0x74, 0x65, 0x6D, 0x49, 0x64, 0x22,   // tItemId"
+    0x3A, 0x31, 0x2C, 0x22, 0x6D, 0x65, 0x64, 0x69,   // :1,"medi
+    0x61, 0x53, 0x65, 0x73, 0x73, 0x69, 0x6F, 0x6E,   // aSession
+    0x49, 0x64, 0x22, 0x3A, 0x37, 0x2C, 0x22, 0x70,   // Id":7,"p
+    0x6C, 0x61, 0x79, 0x65, 0x72, 0x53, 0x74, 0x61,   // layerSta
+    0x74, 0x65, 0x22, 0x3A, 0x22, 0x42, 0x55, 0x46,   // te":"BUF
+    0x46, 0x45, 0x52, 0x49, 0x4E, 0x47, 0x22, 0x7D,   // FERING"}
+    0x5D, 0x2C, 0x22, 0x74, 0x79, 0x70, 0x65, 0x22,   // ],"type"
+    0x3A, 0x22, 0x4D, 0x45, 0x44, 0x49, 0x41, 0x5F,   // :"MEDIA_
+    0x53, 0x54, 0x41, 0x54, 0x55, 0x53, 0x22, 0x7D    // STATUS"}
+};
+
+/* Shorthand for building request messages (errors caught on completion) */
+static void appendStr(WXBuffer *buffer, const char *str) {
+    (void) WXBuffer_Append(buffer, str, strlen(str), TRUE);
+}
+
+/* Append a string value as a JSON string (quoted and escaped) */
+static void appendJsonStr(WXBuffer *buffer, const char *str) {
+    char escBuff[8];
+
+    appendStr(buffer, "\"");
+    while (*str != '\0') {
+        if ((*str == '"') || (*str == '\\')) {
+            escBuff[0] = '\\';
+            escBuff[1] = *str;
+            escBuff[2] = '\0';
+            appendStr(buffer, escBuff);
+        } else if ((unsigned char) *str < 0x20) {
+            (void) snprintf(escBuff, sizeof(escBuff), "\\u%04x",
+                            (unsigned char) *str);
+            appendStr(buffer, escBuff);
+        } else {
+            (void) WXBuffer_Append(buffer, str, 1, TRUE);
+        }
+        str++;
+    }
+    appendStr(buffer, "\"");
+}
+
+/* Append the JSON array of queue items, with the preload/playback hints */
+static void appendQueueItems(WXBuffer *buffer, CastMediaItem *items,
+                             int count) {
+    char numBuff[64];
+    int idx;
+
+    appendStr(buffer, "[");
+    for (idx = 0; idx < count; idx++) {
+        appendStr(buffer, (idx != 0) ? ", " : " ");
+        appendStr(buffer, "{\"media\": {\"contentId\": ");
+        appendJsonStr(buffer, items[idx].contentId);
+        appendStr(buffer, ", \"contentType\": ");
+        appendJsonStr(buffer, items[idx].contentType);
+        appendStr(buffer, ", \"streamType\": \"BUFFERED\"}, "
+                          "\"autoplay\": true");
+        if (items[idx].preloadTime >= 0) {
+            (void) snprintf(numBuff, sizeof(numBuff),
+                            ", \"preloadTime\": %d", items[idx].preloadTime);
+            appendStr(buffer, numBuff);
+        }
+        if (items[idx].playbackDuration > 0) {
+            (void) snprintf(numBuff, sizeof(numBuff),
+                            ", \"playbackDuration\": %.3f",
+                            items[idx].playbackDuration);
+            appendStr(buffer, numBuff);
+        }
+        appendStr(buffer, "}");
+    }
+    appendStr(buffer, " ]");
+}
+
+/* Common validation of the items prior to building the request */
+static int validItems(CastMediaItem *items, int count) {
+    int idx;
+
+    if (count <= 0) {
+        castLog(CPTL_LOG_WARNING, "No media items specified for queue request");
+        return FALSE;
+    }
+    for (idx = 0; idx < count; idx++) {
+        if ((items[idx].contentId == NULL) ||
+                (*(items[idx].contentId) == '\0') ||
+                (items[idx].contentType == NULL) ||
+                (*(items[idx].contentType) == '\0')) {
+            castLog(CPTL_LOG_WARNING,
+                    "Media item %d requires content id and type",
+                    idx);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Terminate (as a string) and issue the assembled request on the channel */
+static int sendMediaRequest(CastDeviceConnection *conn, CastChannel *channel,
+                            WXBuffer *msgBuffer, const char *reqType) {
+    /* Note that this includes the terminator, message is sent as a string */
+    if (WXBuffer_Append(msgBuffer, "}", 2, TRUE) == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Failed to allocate media %s request", reqType);
+        return -1;
+    }
+    if (castSendFrame(conn, channel->sourceId, channel->destinationId,
+                      castNamespaceName(NS_MEDIA), msgBuffer->buffer,
+                      -1) < 0) {
+        castLog(CPTL_LOG_WARNING, "Failed to issue media %s request", reqType);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Callback to validate the media status response to the queue load, aligned
+ * to the original request id.  Returns the parsed response for extraction of
+ * the media session identifier.
+ */
+static void *parseQueueLoadResponse(CastDeviceConnection *conn,
+                                    void *content, size_t contentLen) {
+    WXJSONValue *val = (WXJSONValue *) content;
+    WXJSONValue *respType, *reason;
+
+    respType = WXHash_GetEntry(&(val->value.oval), "type",
+                               WXHash_StrHashFn, WXHash_StrEqualsFn);
+    if ((respType == NULL) || (respType->type != WXJSONVALUE_STRING)) {
+        castLog(CPTL_LOG_WARNING,
+                "Invalid response to matched media queue request");
+        return CPTL_RESP_ERROR;
+    }
+    if (strcmp(respType->value.sval, "MEDIA_STATUS") != 0) {
+        reason = WXHash_GetEntry(&(val->value.oval), "reason",
+                                 WXHash_StrHashFn, WXHash_StrEqualsFn);
+        castLog(CPTL_LOG_WARNING,
+                "Media queue load failed: %s",
+                ((reason != NULL) &&
+                     (reason->type == WXJSONVALUE_STRING)) ?
+                         reason->value.sval : respType->value.sval);
+        return CPTL_RESP_ERROR;
+    }
+
+    return val;
+}
+
+/**
+ * Load a queue of media items on the application media session across the
+ * given channel.  Each item carries its preload hint, so the receiver buffers
+ * the next item before the current one completes (gapless playback).
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to the application transport (media receiver).
+ * @param items The set of media items to queue.
+ * @param count The number of media items.
+ * @param startIndex Index of the item to start playback with.
+ * @param repeatAll If true, the queue repeats once all items are played.
+ * @param mediaSessionId Returns the media session identifier for the queue.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castMediaQueueLoad(CastDeviceConnection *conn, CastChannel *channel,
+                       CastMediaItem *items, int count, int startIndex,
+                       int repeatAll, int32_t *mediaSessionId) {
+    WXJSONValue *response, *status, *sessionId;
+    CastMessageFilter filter;
+    WXBuffer msgBuffer;
+    char numBuff[64];
+    int32_t requestId;
+
+    if (!validItems(items, count)) return -1;
+    if ((startIndex < 0) || (startIndex >= count)) {
+        castLog(CPTL_LOG_WARNING,
+                "Invalid media queue start index %d", startIndex);
+        return -1;
+    }
+
+    /* Queue can be sizable, so the request buffer is dynamic */
+    requestId = ++(conn->requestId);
+    if (CPTL_CTX(testMode) != 0) requestId = 1;
+    if (WXBuffer_Init(&msgBuffer, 1024) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate media queue request");
+        return -1;
+    }
+    appendStr(&msgBuffer, "{\"type\": \"QUEUE_LOAD\", \"items\": ");
+    appendQueueItems(&msgBuffer, items, count);
+    (void) snprintf(numBuff, sizeof(numBuff),
+                    ", \"startIndex\": %d, \"requestId\": %d",
+                    startIndex, requestId);
+    appendStr(&msgBuffer, numBuff);
+    appendStr(&msgBuffer, (repeatAll) ? ", \"repeatMode\": \"REPEAT_ALL\"" :
+                                        ", \"repeatMode\": \"REPEAT_OFF\"");
+    if (sendMediaRequest(conn, channel, &msgBuffer, "QUEUE_LOAD") < 0) {
+        WXBuffer_Destroy(&msgBuffer);
+        return -1;
+    }
+    WXBuffer_Destroy(&msgBuffer);
+
+    /* Setup the simulated response for test mode */
+    CPTL_CTX(testResp) = _mediaStatusResp;
+    CPTL_CTX(testRespLen) = sizeof(_mediaStatusResp);
+
+    /* Single response for the entire queue, provides the media session */
+    (void) memset(&filter, 0, sizeof(filter));
+    filter.channel = channel;
+    filter.namespace = NS_MEDIA;
+    filter.expJsonResponse = TRUE;
+    filter.requestId = requestId;
+    filter.responseCallback = parseQueueLoadResponse;
+    response = (WXJSONValue *) castReceiveFiltered(conn, &filter);
+    if (response == NULL) {
+        castLog(CPTL_LOG_WARNING, "Unable to obtain media queue load response");
+        return -1;
+    }
+
+    /* Status is an array of media sessions, there should be only the one */
+    status = WXHash_GetEntry(&(response->value.oval), "status",
+                             WXHash_StrHashFn, WXHash_StrEqualsFn);
+    sessionId = NULL;
+    if ((status != NULL) && (status->type == WXJSONVALUE_ARRAY) &&
+            (status->value.aval.length > 0)) {
+        status = (WXJSONValue *) status->value.aval.array;
+        if (status->type == WXJSONVALUE_OBJECT) {
+            sessionId = WXHash_GetEntry(&(status->value.oval),
+                                        "mediaSessionId", WXHash_StrHashFn,
+                                        WXHash_StrEqualsFn);
+        }
+    }
+    if ((sessionId == NULL) || (sessionId->type != WXJSONVALUE_INT)) {
+        castLog(CPTL_LOG_WARNING,
+                "Missing/invalid media session in queue response");
+        castResponseRelease(response);
+        return -1;
+    }
+    *mediaSessionId = (int32_t) sessionId->value.ival;
+    castResponseRelease(response);
+
+    return 0;
+}
+
+/* Drain callback, consumes the interim media status updates */
+static void *ignoreMediaStatus(CastDeviceConnection *conn,
+                               void *content, size_t contentLen) {
+    return NULL;
+}
+
+/**
+ * Append media items to the queue of an active media session.  This does not
+ * wait for any response, the status updates for the session (and any other
+ * unread messages for the channel) are discarded as the next insert is issued.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to the application transport (media receiver).
+ * @param mediaSessionId The media session identifier from the queue load.
+ * @param items The set of media items to append.
+ * @param count The number of media items.
+ * @return Zero on success, -1 on error (logged).
+ */
+int castMediaQueueInsert(CastDeviceConnection *conn, CastChannel *channel,
+                         int32_t mediaSessionId, CastMediaItem *items,
+                         int count) {
+    CastMessageFilter filter;
+    WXBuffer msgBuffer;
+    char numBuff[96];
+    int rc;
+
+    if (!validItems(items, count)) return -1;
+
+    /* Don't let the unsolicited status updates pile up against the channel */
+    if (conn->ssl != NULL) {
+        if (castReadAvailable(conn) < 0) return -1;
+        (void) memset(&filter, 0, sizeof(filter));
+        filter.channel = channel;
+        filter.namespace = NS_MEDIA;
+        filter.expJsonResponse = TRUE;
+        filter.rawContent = TRUE;
+        filter.responseCallback = ignoreMediaStatus;
+        (void) castProcessFiltered(conn, &filter);
+    }
+
+    if (WXBuffer_Init(&msgBuffer, 1024) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate media queue request");
+        return -1;
+    }
+    appendStr(&msgBuffer, "{\"type\": \"QUEUE_INSERT\", \"items\": ");
+    appendQueueItems(&msgBuffer, items, count);
+    (void) snprintf(numBuff, sizeof(numBuff),
+                    ", \"mediaSessionId\": %d, \"requestId\": %d",
+                    mediaSessionId, ++(conn->requestId));
+    appendStr(&msgBuffer, numBuff);
+    rc = sendMediaRequest(conn, channel, &msgBuffer, "QUEUE_INSERT");
+    WXBuffer_Destroy(&msgBuffer);
+
+    return rc;
+}
@@ -5,7 +5,8 @@
  * See the LICENSE file accompanying the distribution your rights to use
  * this software.
  */
-#include "php_castptl.h"
+#include "castptl_core.h"
+#include "castptl_probes.h"
 #include <openssl/err.h>
 #include "buffer.h"
 #include "json.h"
@@ -59,6 +60,12 @@
  * message AuthResponse {
  *     required bytes signature = 1;
  *     required bytes client_auth_certificate = 2;
+ *     repeated bytes intermediate_certificate = 3;
+ *     optional SignatureAlgorithm signature_algorithm = 4
+ *         [default = RSASSA_PKCS1v15];
+ *     optional bytes sender_nonce = 5;
+ *     optional HashAlgorithm hash_algorithm = 6
+ *         [default = SHA1];
  * }
  *
  * message AuthError {
@@ -83,10 +90,64 @@ static char* namespaces[] = {
     "urn:x-cast:com.google.cast.tp.connection",
     "urn:x-cast:com.google.cast.tp.deviceauth",
     "urn:x-cast:com.google.cast.tp.heartbeat",
-    "urn:x-cast:com.google.cast.receiver"
+    "urn:x-cast:com.google.cast.receiver",
+    "urn:x-cast:com.google.cast.media"
 };
 
-#define NS_COUNT 4
+/* Utility to compare a (non-terminated) message identifier to a string */
+static int idEquals(uint8_t *id, uint32_t idLen, const char *str) {
+    return ((id != NULL) && (idLen == strlen(str)) &&
+                (memcmp(id, str, idLen) == 0));
+}
+
+/* Read a (protobuf) varint, returns the bytes consumed or 0 if truncated */
+static size_t readVarInt(uint8_t *ptr, uint8_t *end, uint32_t *value) {
+    size_t len = 0;
+    int shift = 0;
+
+    *value = 0;
+    while ((ptr + len < end) && (shift < 32)) {
+        *value |= ((uint32_t) (ptr[len] & 0x7F)) << shift;
+        if ((ptr[len++] & 0x80) == 0) return len;
+        shift += 7;
+    }
+    return 0;
+}
+
+/* Tally written frames (castEncodeFrame content) against their namespace */
+static void tallyFramesOut(uint8_t *data, size_t dataLen) {
+    uint8_t *ptr = data, *end = data + dataLen, *frameEnd;
+    uint32_t frameLen, tag, value;
+    size_t len;
+    int idx;
+
+    for (; ptr + 4 <= end; ptr = frameEnd) {
+        frameLen = (((uint32_t) ptr[0]) << 24) | (((uint32_t) ptr[1]) << 16) |
+                   (((uint32_t) ptr[2]) << 8) | ((uint32_t) ptr[3]);
+        ptr += 4;
+        if (frameLen > (size_t) (end - ptr)) break;
+        frameEnd = ptr + frameLen;
+
+        /* Namespace is the fourth field, ahead of the payload */
+        idx = NS_COUNT;
+        while (ptr < frameEnd) {
+            if ((len = readVarInt(ptr, frameEnd, &tag)) == 0) break;
+            ptr += len;
+            if ((len = readVarInt(ptr, frameEnd, &value)) == 0) break;
+            ptr += len;
+            if ((tag & 0x07) != 2) continue;
+            if (value > (size_t) (frameEnd - ptr)) break;
+            if ((tag >> 3) == 4) {
+                for (idx = 0; idx < NS_COUNT; idx++) {
+                    if (idEquals(ptr, value, namespaces[idx])) break;
+                }
+                break;
+            }
+            ptr += value;
+        }
+        CPTL_STAT_INC(STAT_FRAMES_OUT + idx);
+    }
+}
 
 /* Handy utility to generate the test datasets below... */
 static void dump(char *dir, WXBuffer *buffer) {
@@ -94,21 +155,32 @@ static void dump(char *dir, WXBuffer *buffer) {
     int ch, idx;
  
     chrs[8] = '\0';
-    php_printf("%s: [%d bytes]\n", dir, (int) buffer->length);
+    printf("%s: [%d bytes]\n", dir, (int) buffer->length);
     for (idx = 0; idx < buffer->length; idx++) {
         if (idx != 0) {
-            php_printf((((idx % 8) == 0) ? ",   %s\n" : ", "), chrs);
+            printf((((idx % 8) == 0) ? ",   %s\n" : ", "), chrs);
         }
         ch = *(buffer->buffer + idx);
-        php_printf("0x%02X", ch);
+        printf("0x%02X", ch);
         chrs[idx % 8] = (isprint(ch)) ? ((char) ch) : '.';
     }
     while ((idx % 8) != 0) {
-        php_printf("      ");
+        printf("      ");
         chrs[idx % 8] = ' ';
         idx++;
     }
-    php_printf("    %s\n", chrs);
+    printf("    %s\n", chrs);
+}
+
+/**
+ * Obtain the namespace string associated to the given enumeration.
+ *
+ * @param namespace The enumerated namespace to translate.
+ * @return The full namespace string or NULL for any/unknown values.
+ */
+const char *castNamespaceName(CastNamespace namespace) {
+    if ((namespace < 0) || (namespace >= NS_COUNT)) return NULL;
+    return namespaces[namespace];
 }
 
 /**
@@ -132,77 +204,299 @@ static void dump(char *dir, WXBuffer *buffer) {
 int castSendMessage(CastDeviceConnection *conn, int fromSenderSession,
                     int toPortalReceiver, CastNamespace namespace,
                     void *data, ssize_t dataLen) {
-    char *nsStr = namespaces[namespace], *senderId, *receiverId;
-    uint8_t msgBufferData[2048];
-    unsigned long sslErrNo;
-    WXBuffer msgBuffer;
-    char errBuff[512];
-    size_t len;
+    char *senderId, *receiverId;
 
     /* Translate messsage endpoints */
-    senderId = (fromSenderSession) ? "castptl-nnn" : "sender-0";
-    receiverId = (toPortalReceiver) ? "castptl-000" : "receiver-0";
+    senderId = (fromSenderSession) ? CPTL_SENDER_SESSION_ID : CPTL_SENDER_ID;
+    receiverId = (toPortalReceiver) ? CPTL_PORTAL_RECEIVER_ID :
+                                      CPTL_RECEIVER_ID;
+
+    return castSendFrame(conn, senderId, receiverId, namespaces[namespace],
+                         data, dataLen);
+}
+
+/**
+ * Encode a message between explicit endpoints into the wire format (length
+ * prefixed protobuf), appending it to the provided buffer.  Multiple messages
+ * can be encoded into the same buffer for a single (coalesced) write.
+ *
+ * @param buffer The buffer to append the encoded message to.
+ * @param sourceId Identifier of the originating (sender) endpoint.
+ * @param destinationId Identifier of the target (receiver) endpoint.
+ * @param namespace Full namespace string for the message.
+ * @param data Payload of the message to be delivered, either binary or string
+ *             content based on provided length.
+ * @param dataLen Length of the prior data, -1 for a string, >= 0 for a binary
+ *                buffer.
+ * @return 0 if message successfully encoded, -1 on error (already logged,
+ *         buffer is restored to its original length).
+ */
+int castEncodeFrame(WXBuffer *buffer, const char *sourceId,
+                    const char *destinationId, const char *namespace,
+                    void *data, ssize_t dataLen) {
+    size_t start = buffer->length, len;
+    uint8_t *ptr;
+
+    /* Message is prefixed with length in big-endian order, filled in below */
+    if (WXBuffer_Pack(buffer, "N", 0) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Message header prefix allocation failure");
+        buffer->length = start;
+        return -1;
+    }
 
     /* Encoding is pretty straightforward with the buffer pack capability */
-    WXBuffer_InitLocal(&msgBuffer, msgBufferData, sizeof(msgBufferData));
-    if (WXBuffer_Pack(&msgBuffer, "yy yya* yya* yya*",
+    if (WXBuffer_Pack(buffer, "yy yya* yya* yya*",
                       (1 << 3) | 0, 0 /* CASTV2_1_0 */,
-                      (2 << 3) | 2, strlen(senderId), senderId,
-                      (3 << 3) | 2, strlen(receiverId), receiverId,
-                      (4 << 3) | 2, strlen(nsStr), nsStr) == NULL) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Message header packaging failure");
+                      (2 << 3) | 2, strlen(sourceId), sourceId,
+                      (3 << 3) | 2, strlen(destinationId), destinationId,
+                      (4 << 3) | 2, strlen(namespace), namespace) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Message header packaging failure");
+        buffer->length = start;
         return -1;
     }
     if (dataLen < 0) {
-        if (WXBuffer_Pack(&msgBuffer, "yy yya*",
+        if (WXBuffer_Pack(buffer, "yy yya*",
                           (5 << 3) | 0, 0 /* STRING */,
                           (6 << 3) | 2, strlen((char *) data),
                                         (char *) data) == NULL) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Message payload (string) packaging failure");
+            castLog(CPTL_LOG_WARNING,
+                    "Message payload (string) packaging failure");
+            buffer->length = start;
             return -1;
        }
     } else {
-        if (WXBuffer_Pack(&msgBuffer, "yy yyb%",
+        if (WXBuffer_Pack(buffer, "yy yyb%",
                           (5 << 3) | 0, 1 /* BINARY */,
                           (7 << 3) | 2, dataLen, (int) dataLen, data) == NULL) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Message payload (binary) packaging failure");
+            castLog(CPTL_LOG_WARNING,
+                    "Message payload (binary) packaging failure");
+            buffer->length = start;
             return -1;
        }
     }
 
-    /* Message is prefixed with length in big-endian order */
-    if (WXBuffer_EnsureCapacity(&msgBuffer, 4, TRUE) == NULL) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Message header prefix allocation failure");
-        return -1;
-    }
-    len = msgBuffer.length;
-    (void) memmove(msgBuffer.buffer + 4, msgBuffer.buffer, len);
-    msgBuffer.length = 0;
-    (void) WXBuffer_Pack(&msgBuffer, "N", len);
-    msgBuffer.length += len;
+    /* Backfill the length prefix */
+    len = buffer->length - start - 4;
+    ptr = buffer->buffer + start;
+    ptr[0] = (uint8_t) (len >> 24);
+    ptr[1] = (uint8_t) (len >> 16);
+    ptr[2] = (uint8_t) (len >> 8);
+    ptr[3] = (uint8_t) len;
+
+    return 0;
+}
+
+/**
+ * Write a set of encoded messages to the device connection.  Any messages
+ * queued to the connection are written first, to preserve ordering.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param data The encoded message content (from castEncodeFrame).
+ * @param dataLen The number of bytes of encoded content.
+ * @return 0 if content was successfully written, -1 on error (logged).
+ */
+int castWriteFrames(CastDeviceConnection *conn, uint8_t *data,
+                    size_t dataLen) {
+    unsigned long sslErrNo;
+    int64_t traceBegin;
+    char errBuff[512];
+
+    /* Captured as issued, even if queued behind stragglers (below) */
+    CPTL_CAPTURE(conn, CPTL_CAPTURE_OUT, data, dataLen);
+    (void) castDeviceTouch(conn, FALSE);
 
     /* Bypass the actual write for test conditions */
-    if ((_cptl_tstmode != 0) && (conn->ssl == NULL)) return 0;
+    if ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) {
+        tallyFramesOut(data, dataLen);
+        return 0;
+    }
+
+    /* Stragglers from a prior broadcast go first */
+    if ((conn->writeQueue != NULL) && (castFlushQueue(conn) < 0)) return -1;
 
     /* Issue the message */
+    traceBegin = CPTL_TRACE_BEGIN();
+    if (SSL_write(conn->ssl, data, dataLen) <= 0) {
+        sslErrNo = ERR_get_error();
+        ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
+        castLog(CPTL_LOG_WARNING,
+                "Failed to write outbound message [%s]", errBuff);
+        return -1;
+    }
+    CPTL_TRACE_END("message.send", NULL, traceBegin);
+    tallyFramesOut(data, dataLen);
+
+    return 0;
+}
+
+/**
+ * Issue a message between explicit endpoints on the given cast device
+ * connection.  This is the underlying method for all outbound messages.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param sourceId Identifier of the originating (sender) endpoint.
+ * @param destinationId Identifier of the target (receiver) endpoint.
+ * @param namespace Full namespace string for the message.
+ * @param data Payload of the message to be delivered, either binary or string
+ *             content based on provided length.
+ * @param dataLen Length of the prior data, -1 for a string, >= 0 for a binary
+ *                buffer.
+ * @return 0 if message successfully issued, -1 on error (already logged).
+ */
+int castSendFrame(CastDeviceConnection *conn, const char *sourceId,
+                  const char *destinationId, const char *namespace,
+                  void *data, ssize_t dataLen) {
+    uint8_t msgBufferData[2048];
+    WXBuffer msgBuffer;
+    int rc;
+
+    WXBuffer_InitLocal(&msgBuffer, msgBufferData, sizeof(msgBufferData));
+    if (castEncodeFrame(&msgBuffer, sourceId, destinationId, namespace,
+                        data, dataLen) < 0) {
+        WXBuffer_Destroy(&msgBuffer);
+        return -1;
+    }
+
 #ifdef _PHP_TRACE_MSG
     dump("WRITE", &msgBuffer);
 #endif
-    if (SSL_write(conn->ssl, msgBuffer.buffer, msgBuffer.length) < 0) {
-        sslErrNo = ERR_get_error();
-        ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
-        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                         "Failed to write outbound message [%s]", errBuff);
+    CPTL_PROBE3(message__send, (char *) destinationId, (char *) namespace,
+                (int64_t) msgBuffer.length);
+    rc = castWriteFrames(conn, msgBuffer.buffer, msgBuffer.length);
+    WXBuffer_Destroy(&msgBuffer);
+
+    return rc;
+}
+
+/**
+ * Allocate a shared (reference counted) copy of encoded message content, for
+ * queueing to multiple connections without re-encoding.
+ *
+ * @param data The encoded message content (from castEncodeFrame).
+ * @param dataLen The number of bytes of encoded content.
+ * @return The shared frame with a single reference (the caller) or NULL on
+ *         allocation failure (logged).
+ */
+CastSharedFrame *castSharedFrameCreate(uint8_t *data, size_t dataLen) {
+    CastSharedFrame *frame;
+
+    frame = (CastSharedFrame *) WXMalloc(sizeof(CastSharedFrame) + dataLen);
+    if (frame == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate shared message frame");
+        return NULL;
+    }
+    frame->refCount = 1;
+    frame->length = dataLen;
+    (void) memcpy(frame->data, data, dataLen);
+
+    return frame;
+}
+
+/**
+ * Release a reference to a shared message frame, freeing the frame when the
+ * last reference is released.
+ *
+ * @param frame The shared frame to release.
+ */
+void castSharedFrameRelease(CastSharedFrame *frame) {
+    if (--(frame->refCount) <= 0) WXFree(frame);
+}
+
+/**
+ * Queue a shared message frame for writing to the device connection.  The
+ * queue retains a reference to the frame until it has been written.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @param frame The shared frame to queue.
+ * @return 0 if the frame was queued, -1 on allocation error (logged).
+ */
+int castQueueFrame(CastDeviceConnection *conn, CastSharedFrame *frame) {
+    CastQueuedFrame *entry, **tail;
+
+    entry = (CastQueuedFrame *) WXMalloc(sizeof(CastQueuedFrame));
+    if (entry == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate message queue entry");
         return -1;
     }
+    entry->frame = frame;
+    entry->next = NULL;
+    frame->refCount++;
+
+    for (tail = &(conn->writeQueue); *tail != NULL; tail = &((*tail)->next));
+    *tail = entry;
+
+    return 0;
+}
+
+/* Pop the head of the write queue (after write or for discard) */
+static void dequeueFrame(CastDeviceConnection *conn) {
+    CastQueuedFrame *entry = conn->writeQueue;
+
+    conn->writeQueue = entry->next;
+    castSharedFrameRelease(entry->frame);
+    WXFree(entry);
+}
+
+/**
+ * Write the queued frames to the device connection.  If the connection is
+ * marked for non-blocking writes, this will return once the socket cannot
+ * accept further content, otherwise it will block until the queue is empty.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ * @return 0 if the queue was completely written, 1 if content remains in the
+ *         queue (non-blocking, isWriteWantRead indicates if the TLS layer is
+ *         waiting to read rather than write) and -1 on error (logged, queue
+ *         is discarded).
+ */
+int castFlushQueue(CastDeviceConnection *conn) {
+    unsigned long sslErrNo;
+    CastSharedFrame *frame;
+    char errBuff[512];
+    int rc;
+
+    while (conn->writeQueue != NULL) {
+        /* Simulated connections just swallow the content */
+        frame = conn->writeQueue->frame;
+        if ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) {
+            CPTL_CAPTURE(conn, CPTL_CAPTURE_OUT, frame->data, frame->length);
+            tallyFramesOut(frame->data, frame->length);
+            dequeueFrame(conn);
+            continue;
+        }
+
+        /* Note that retries must be with the same arguments, which holds */
+        rc = SSL_write(conn->ssl, frame->data, frame->length);
+        if (rc <= 0) {
+            sslErrNo = SSL_get_error(conn->ssl, rc);
+            if ((sslErrNo == SSL_ERROR_WANT_WRITE) ||
+                    (sslErrNo == SSL_ERROR_WANT_READ)) {
+                conn->isWriteWantRead = (sslErrNo == SSL_ERROR_WANT_READ);
+                return 1;
+            }
+
+            ERR_error_string_n(ERR_get_error(), errBuff, sizeof(errBuff));
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to write queued message [%s]", errBuff);
+            castDiscardQueue(conn);
+            return -1;
+        }
+        CPTL_CAPTURE(conn, CPTL_CAPTURE_OUT, frame->data, frame->length);
+        tallyFramesOut(frame->data, frame->length);
+        dequeueFrame(conn);
+    }
 
     return 0;
 }
 
+/**
+ * Discard any frames queued to the device connection, without writing.
+ *
+ * @param conn The persistent connection to the cast device instance.
+ */
+void castDiscardQueue(CastDeviceConnection *conn) {
+    while (conn->writeQueue != NULL) dequeueFrame(conn);
+}
+
 /* Might want to look at putting this into the buffer.c code someday */
 static void consumeBuffer(WXBuffer *buffer, uint32_t len) {
     buffer->length -= len;
@@ -210,39 +504,66 @@ static void consumeBuffer(WXBuffer *buffer, uint32_t len) {
     buffer->offset = 0;
 }
 
+/* Locate the virtual channel (if any) that a destination id is routed to */
+static CastChannel *routeChannel(CastDeviceConnection *conn, uint8_t *destId,
+                                 uint32_t destIdLen) {
+    CastChannel *channel;
+
+    for (channel = conn->channels; channel != NULL; channel = channel->next) {
+        if (idEquals(destId, destIdLen, channel->sourceId)) return channel;
+    }
+    return NULL;
+}
+
 /**
  * Looping processor for handling inbound message content from the main
  * message receive method.  Refer to that method (below) for more details on
- * the arguments.  Note that this method will return CPTL_RESP_ERROR for
- * any error occurrences (including callback errors).
+ * the filtering criteria.  Messages destined for a virtual channel other than
+ * the one being filtered for are transferred to the pending buffer of that
+ * channel.  Note that this method will return CPTL_RESP_ERROR for any error
+ * occurrences (including callback errors).
  */
 static void *parseInboundMessages(CastDeviceConnection *conn,
-                                  int forSenderSession, int fromPortalReceiver,
-                                  CastNamespace targNamespace,
-                                  ProcessResponseCB responseCallback,
-                                  int expJsonResponse, int32_t requestId) {
+                                  WXBuffer *rdBuffer,
+                                  CastMessageFilter *filter) {
     uint32_t msgLen = 0, msgLimit, fragIdx, fragType, fragLen, fragVarInt;
-    int idx, isSenderSession, isPortalReceiver, matched;
+    uint32_t sourceIdLen, destIdLen, nsLen;
+    int idx, isSenderSession, isPortalReceiver, isStatusSource, matched;
+    int arena = FALSE;
     int32_t msgProtoVersion, contentType, contentLen;
-    WXBuffer *rdBuffer = &(conn->readBuffer);
+    uint8_t *content, *sourceId, *destId, *nsId;
     WXJSONValue *jsonVal, *requestIdVal;
+    CastChannel *channel;
     CastNamespace namespace;
     void *retval = NULL;
-    uint8_t *content;
+    int64_t parseStart, parseEnd, traceBegin;
 
     /* Note that the cast device can send multiple messages in a single bound */
     while ((rdBuffer->length >= 4) && (retval == NULL)) {
+        /* One shot release of the (JSON) content of the prior message */
+        if (arena) {
+            castArenaReset();
+            arena = FALSE;
+        }
+
         /* Encoded as defined 4-byte length parcel */
         rdBuffer->offset = 0;
         (void) WXBuffer_Unpack(rdBuffer, "N", &msgLen);
         if (rdBuffer->length < msgLen + 4) break;
         msgLimit = msgLen + 4;
 
+        /* Capture on first sight, not as re-parsed from a channel */
+        if (rdBuffer == &(conn->readBuffer)) {
+            CPTL_CAPTURE(conn, CPTL_CAPTURE_IN, rdBuffer->buffer, msgLimit);
+        }
+
         /* Prepare for general content extraction */
         msgProtoVersion = -1;
         namespace = NS_UNKNOWN;
         contentType = -1;
-        isSenderSession = isPortalReceiver = -1;
+        content = sourceId = destId = nsId = NULL;
+        contentLen = sourceIdLen = destIdLen = nsLen = 0;
+        jsonVal = NULL;
 
         /* Read the fragments to extract the message elements */
         while (rdBuffer->offset < msgLimit) {
@@ -290,36 +611,23 @@ static void *parseInboundMessages(CastDeviceConnection *conn,
                     break;
 
                 case 2: /* Sender ID */
-                    if ((fragLen == 10) &&
-                            (strncmp(rdBuffer->buffer + rdBuffer->offset,
-                                     "receiver-0", 10) == 0)) {
-                        isPortalReceiver = 0;
-                    } else if (fragLen = 999) /* TODO */ {
-                        isPortalReceiver = 1;
-                    } else {
-                        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                   "Unrecognized sender id '%.*s'", fragLen,
-                                   rdBuffer->buffer + rdBuffer->offset);
-                    }
+                    if (fragType != 2) goto msg_error;
+                    sourceId = rdBuffer->buffer + rdBuffer->offset;
+                    sourceIdLen = fragLen;
                     break;
+
                 case 3: /* Receiver ID */
-                    if ((fragLen == 8) &&
-                            (strncmp(rdBuffer->buffer + rdBuffer->offset,
-                                     "sender-0", 8) == 0)) {
-                        isSenderSession = 0;
-                    } else if (fragLen = 999) /* TODO */ {
-                        isSenderSession = 1;
-                    } else {
-                        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                   "Unrecognized receiver id '%.*s'", fragLen,
-                                   rdBuffer->buffer + rdBuffer->offset);
-                    }
+                    if (fragType != 2) goto msg_error;
+                    destId = rdBuffer->buffer + rdBuffer->offset;
+                    destIdLen = fragLen;
                     break;
+
                 case 4: /* Namespace */
+                    if (fragType != 2) goto msg_error;
+                    nsId = rdBuffer->buffer + rdBuffer->offset;
+                    nsLen = fragLen;
                     for (idx = 0; idx < NS_COUNT; idx++) {
-                        if ((fragLen == strlen(namespaces[idx])) &&
-                                (memcmp(rdBuffer->buffer + rdBuffer->offset,
-                                         namespaces[idx], fragLen) == 0)) {
+                        if (idEquals(nsId, nsLen, namespaces[idx])) {
                             namespace = (CastNamespace) idx;
                             break;
                         }
@@ -341,9 +649,9 @@ static void *parseInboundMessages(CastDeviceConnection *conn,
                     break;
 
                 default:
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                     "Invalid protocol fragment index %d",
-                                     fragIdx);
+                    castLog(CPTL_LOG_WARNING,
+                            "Invalid protocol fragment index %d",
+                            fragIdx);
                     goto msg_error;
             }
             
@@ -355,107 +663,223 @@ static void *parseInboundMessages(CastDeviceConnection *conn,
         if (rdBuffer->offset != msgLimit) goto msg_error;
 
         /* And pretty much everything is required */
-        if ((msgProtoVersion != 0) || (namespace == NS_UNKNOWN) ||
-                (isSenderSession < 0) || (isPortalReceiver < 0) ||
+        if ((msgProtoVersion != 0) || (nsId == NULL) ||
+                (sourceId == NULL) || (destId == NULL) ||
                 (contentType == -1) || (content == NULL)) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                             "Missing/invalid elements in the msg response");
+            castLog(CPTL_LOG_WARNING,
+                    "Missing/invalid elements in the msg response");
             goto msg_error;
         }
 
+        CPTL_STAT_INC(STAT_FRAMES_IN + CPTL_STAT_NS(namespace));
+        CPTL_PROBE5(frame__decode, nsId, (int) nsLen, (int) namespace,
+                    (int) contentLen, (int) contentType);
+
+        /* Anything not from the device receiver is from an application */
+        isPortalReceiver = (idEquals(sourceId, sourceIdLen,
+                                     CPTL_RECEIVER_ID)) ? FALSE : TRUE;
+        isSenderSession = (idEquals(destId, destIdLen,
+                                    CPTL_SENDER_SESSION_ID)) ? TRUE : FALSE;
+
+        /* Route messages for other virtual channels to their pending queue */
+        channel = routeChannel(conn, destId, destIdLen);
+        if ((channel != NULL) && (channel != filter->channel)) {
+            if (channel->pendingBuffer.length + msgLimit >
+                                          CPTL_MAX_CHANNEL_PENDING) {
+                castLog(CPTL_LOG_WARNING,
+                        "Pending limit exceeded for channel '%s', "
+                        "discarding message", channel->sourceId);
+            } else if (WXBuffer_Append(&(channel->pendingBuffer),
+                                       rdBuffer->buffer, msgLimit,
+                                       TRUE) == NULL) {
+                castLog(CPTL_LOG_WARNING,
+                        "Failed to queue message for channel '%s'",
+                        channel->sourceId);
+            }
+            consumeBuffer(rdBuffer, msgLimit);
+            continue;
+        }
+
         /* Filter according to indicated details for callback (with any's) */
         retval = NULL;
         matched = TRUE;
-        if (forSenderSession >= 0) {
-            if ((forSenderSession) && (isSenderSession)) matched = FALSE;
-            if ((!forSenderSession) && (isSenderSession)) matched = FALSE;
-        }
-        if (fromPortalReceiver >= 0) {
-            if ((fromPortalReceiver) && (!isPortalReceiver)) matched = FALSE;
-            if ((!fromPortalReceiver) && (isPortalReceiver)) matched = FALSE;
+        if (filter->channel != NULL) {
+            if (channel != filter->channel) matched = FALSE;
+        } else {
+            if (filter->forSenderSession >= 0) {
+                if ((filter->forSenderSession) && (!isSenderSession)) {
+                    matched = FALSE;
+                }
+                if ((!filter->forSenderSession) && (isSenderSession)) {
+                    matched = FALSE;
+                }
+            }
+            if (filter->fromPortalReceiver >= 0) {
+                if ((filter->fromPortalReceiver) && (!isPortalReceiver)) {
+                    matched = FALSE;
+                }
+                if ((!filter->fromPortalReceiver) && (isPortalReceiver)) {
+                    matched = FALSE;
+                }
+            }
         }
-        if (targNamespace != NS_ANY) {
-            if (namespace != targNamespace) matched = FALSE;
+        if (filter->namespaceName != NULL) {
+            if (!idEquals(nsId, nsLen, filter->namespaceName)) matched = FALSE;
+        } else if (filter->namespace != NS_ANY) {
+            if (namespace != filter->namespace) matched = FALSE;
         }
-        if (expJsonResponse >= 0) {
+        if (filter->expJsonResponse >= 0) {
             /* Note that the contentType is backwards to the expect flag */
-            if ((contentType == 0) && (!expJsonResponse)) matched = FALSE;
-            if ((contentType != 0) && (expJsonResponse)) matched = FALSE;
+            if ((contentType == 0) && (!filter->expJsonResponse)) {
+                matched = FALSE;
+            }
+            if ((contentType != 0) && (filter->expJsonResponse)) {
+                matched = FALSE;
+            }
         }
 
-        if (contentType == 0) {
+        /* Receiver messages are also parsed to track the receiver status */
+        isStatusSource = ((namespace == NS_RECEIVER) && (!isPortalReceiver) &&
+                          (channel == NULL)) ? TRUE : FALSE;
+        if ((contentType == 0) &&
+                (((matched) && (!filter->rawContent)) || (isStatusSource))) {
             /* Strings are always JSON, so just parse it */
             /* Not a pretty thing but we can muck the buffer backwards */
             (void) memmove(content - 1, content, contentLen); content--;
             content[contentLen] = '\0';
+            parseStart = castTimeUsec();
+            arena = castArenaBegin();
             jsonVal = WXJSON_Decode(content);
+            if (arena) castArenaSuspend();
+            parseEnd = castTimeUsec();
+            CPTL_STAT_INC(STAT_JSON_PARSES);
+            CPTL_STAT_ADD(STAT_JSON_PARSE_USEC, parseEnd - parseStart);
+            CPTL_PROBE3(json__parse, (int) namespace, (int) contentLen,
+                        parseEnd - parseStart);
+            if (CPTL_CTX(traceActive)) {
+                castTraceEnd("message.parse", castNamespaceName(namespace),
+                             parseStart);
+            }
             if (jsonVal == NULL) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                 "Allocation failure in JSON parsing");
+                castLog(CPTL_LOG_WARNING, "Allocation failure in JSON parsing");
                 goto msg_error;
             } else if (jsonVal->type == WXJSONVALUE_ERROR) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                 "Invalid JSON response: %s",
-                                 WXJSON_GetErrorStr(
-                                           jsonVal->value.error.errorCode));
-                WXJSON_Destroy(jsonVal);
+                castLog(CPTL_LOG_WARNING,
+                        "Invalid JSON response: %s",
+                        WXJSON_GetErrorStr(
+                                  jsonVal->value.error.errorCode));
+                if (!arena) WXJSON_Destroy(jsonVal);
                 jsonVal = NULL;
+                CPTL_STAT_INC(STAT_PARSE_ERRORS);
 
                 /* Not fatal from a message stream perspective */
-                consumeBuffer(rdBuffer, msgLen + 4);
+                consumeBuffer(rdBuffer, msgLimit);
                 continue;
             }
 
+            /* Keep the status snapshot current (broadcasts and responses) */
+            if (isStatusSource) castAppUpdateStatus(conn, jsonVal);
+
             /* Check for request id, if required */
-            if (requestId > 0) {
+            if ((matched) && (filter->requestId > 0)) {
                 requestIdVal = WXHash_GetEntry(&(jsonVal->value.oval),
                                                "requestId",
                                                WXHash_StrHashFn,
                                                WXHash_StrEqualsFn);
                 if ((requestIdVal == NULL) ||
                         (requestIdVal->type != WXJSONVALUE_INT) ||
-                        (requestIdVal->value.ival != requestId)) {
+                        (requestIdVal->value.ival != filter->requestId)) {
                     matched = FALSE;
                 }
             }
         }
 
         if (matched) {
-            if (jsonVal != NULL) {
-                retval = (*responseCallback)(conn, jsonVal, -1);
-                if (retval != (void *) jsonVal) {
+            traceBegin = CPTL_TRACE_BEGIN();
+            if ((jsonVal != NULL) && (!filter->rawContent)) {
+                retval = (*(filter->responseCallback))(conn, jsonVal, -1);
+                if ((retval == (void *) jsonVal) && (arena)) {
+                    /* Kept responses hold the arena, castResponseRelease */
+                    arena = FALSE;
+                } else if ((retval != (void *) jsonVal) && (!arena)) {
                     /* Discard source JSON unless it's the return value */
                     WXJSON_Destroy(jsonVal);
                 }
                 jsonVal = NULL;
             } else {
-                retval = (*responseCallback)(conn, content, contentLen);
+                retval = (*(filter->responseCallback))(conn, content,
+                                                       contentLen);
             }
+            CPTL_TRACE_END("message.callback", castNamespaceName(namespace),
+                           traceBegin);
         } else {
             /* TODO - do we debug the general status messages? */
-            /* TODO - capture unmatched responses with source id? */
         }
 
         /* Clean up parsed value if it wasn't consumed for return */
+        /* (arena trees are discarded by the reset, no need to walk them) */
         if (jsonVal != NULL) {
-            WXJSON_Destroy(jsonVal);
+            if (!arena) WXJSON_Destroy(jsonVal);
             jsonVal = NULL;
         }
 
         /* Consume message content */
-        consumeBuffer(rdBuffer, msgLen + 4);
+        consumeBuffer(rdBuffer, msgLimit);
     }
+    if (arena) castArenaReset();
 
     return retval;
 
     /* I hate goto's but this is the one case I agree with them */
 msg_error:
-    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                     "Invalid/unparsable content in response message buffer");
+    if (arena) castArenaReset();
+    castLog(CPTL_LOG_WARNING,
+            "Invalid/unparsable content in response message buffer");
+    CPTL_STAT_INC(STAT_PARSE_ERRORS);
     if (msgLen != 0) consumeBuffer(rdBuffer, msgLen + 4);
     return CPTL_RESP_ERROR;
 }
 
+/**
+ * Generate simulated inbound traffic for the open channels of a test mode
+ * connection, two messages per channel interleaved across the channels, and
+ * set it as the simulated response for the next read.  Only for receivers
+ * that have no simulated response of their own (cptl_channel_receive).
+ *
+ * @param conn The (test mode) connection with the open channels.
+ * @param frames Buffer for the encoded frames, to be destroyed by the caller
+ *               (after the receive) if this method succeeds.
+ * @return 0 if the traffic was set up, -1 on error (logged).
+ */
+int castChannelSimulate(CastDeviceConnection *conn, WXBuffer *frames) {
+    CastChannel *channel;
+    char payload[128];
+    int round, seq = 0;
+
+    if (WXBuffer_Init(frames, 512) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate simulated channel data");
+        return -1;
+    }
+    for (round = 0; round < 2; round++) {
+        for (channel = conn->channels; channel != NULL;
+                                           channel = channel->next) {
+            (void) snprintf(payload, sizeof(payload),
+                            "{\"type\":\"SIM\",\"channel\":\"%s\","
+                            "\"seq\":%d}", channel->sourceId, ++seq);
+            if (castEncodeFrame(frames, channel->destinationId,
+                                channel->sourceId, "urn:x-cast:ca.heisz.portal",
+                                payload, -1) < 0) {
+                WXBuffer_Destroy(frames);
+                return -1;
+            }
+        }
+    }
+
+    CPTL_CTX(testResp) = frames->buffer;
+    CPTL_CTX(testRespLen) = frames->length;
+    return 0;
+}
+
 /**
  * Read responses from the cast device, looking for a matched response
  * according to the filtering criteria.  Timeout is managed by the global
@@ -486,82 +910,320 @@ void *castReceiveMessage(CastDeviceConnection *conn, int forSenderSession,
                          int fromPortalReceiver, CastNamespace namespace,
                          ProcessResponseCB responseCallback,
                          int expJsonResponse, int32_t requestId) { 
-    int32_t reqTimeout = CPTL_G(messageTimeout);
-    uint8_t rdBuffer[1024];
-    unsigned long sslErrNo;
+    CastMessageFilter filter;
+
+    (void) memset(&filter, 0, sizeof(filter));
+    filter.forSenderSession = forSenderSession;
+    filter.fromPortalReceiver = fromPortalReceiver;
+    filter.namespace = namespace;
+    filter.expJsonResponse = expJsonResponse;
+    filter.requestId = requestId;
+    filter.responseCallback = responseCallback;
+
+    return castReceiveFiltered(conn, &filter);
+}
+
+/**
+ * Read responses from the cast device, looking for a matched response
+ * according to the provided filter.  Underlying method for all of the
+ * message receive functions.
+ *
+ * @param conn The connection to read responses from.
+ * @param filter Matching criteria and callback for the target response.
+ * @return Non-null if a valid response was determined by the response callback
+ *         function or NULL for any processing error (logged internally).
+ */
+void *castReceiveFiltered(CastDeviceConnection *conn,
+                          CastMessageFilter *filter) {
+    int32_t reqTimeout = (filter->timeout > 0) ? filter->timeout :
+                                                 CPTL_CFG(messageTimeout);
     void *retval = NULL;
-    char errBuff[512];
-    int rc = 0, wrc;
+    int64_t traceBegin;
+    int rc, wrc;
 
     /* Munch until we munch no more... */
-    while ((rc >= 0) && (reqTimeout > 0)) {
-        if ((_cptl_tstmode != 0) && (conn->ssl == NULL)) {
-            rc = _cptl_tstresplen;
-            (void) memcpy(rdBuffer, _cptl_tstresp, rc);
+    while (TRUE) {
+        /* Anything already received (or routed) might be the response */
+        retval = castProcessFiltered(conn, filter);
+        if (retval != NULL) {
+            /* There was some matching response, good or bad */
+            return (retval == CPTL_RESP_ERROR) ? NULL: retval;
+        }
+        if (reqTimeout <= 0) break;
+
+        /* Pull in whatever is pending, wait for more if nothing there */
+        rc = castReadAvailable(conn);
+        if (rc < 0) break;
+        if (rc > 0) {
+            /* Simulated responses are a one-shot deal */
+            if ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) {
+                retval = castProcessFiltered(conn, filter);
+                return ((retval == CPTL_RESP_ERROR) ? NULL : retval);
+            }
+            continue;
+        }
+
+        traceBegin = CPTL_TRACE_BEGIN();
+        wrc = WXSocket_Wait(conn->scktHandle, WXNRC_READ_REQUIRED, &reqTimeout);
+        CPTL_TRACE_END("message.wait", NULL, traceBegin);
+        if (wrc == WXNRC_READ_REQUIRED) {
+            /* Ready to read */
+            continue;
+        } else if (wrc == WXNRC_TIMEOUT) {
+            castLog(CPTL_LOG_WARNING, "Timeout on wait for socket response");
+            CPTL_STAT_INC(STAT_TIMEOUTS);
+        } else {
+            /* Any other response is an explicit error */
+            castLog(CPTL_LOG_WARNING,
+                    "Error in socket READ_WAIT %s",
+                    WXSocket_GetErrorStr(wrc));
+        }
+        break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Read all of the content currently available from the device connection,
+ * without blocking, into the read buffer of the connection (no parsing).
+ *
+ * @param conn The connection to read content from.
+ * @return The number of bytes read, zero if there was no content available
+ *         and -1 on error (logged, read buffer is flushed).
+ */
+int castReadAvailable(CastDeviceConnection *conn) {
+    uint8_t rdBuffer[1024], *data;
+    unsigned long sslErrNo;
+    char errBuff[512];
+    int rc, total = 0;
+
+    /* Slimmed (idle) connections need their read buffer back */
+    if (castDeviceTouch(conn, TRUE) < 0) return -1;
+
+    while (TRUE) {
+        if ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) {
+            /* Simulated response is taken whole (can exceed a read) */
+            rc = CPTL_CTX(testRespLen);
+            data = (uint8_t *) CPTL_CTX(testResp);
         } else {
             rc = SSL_read(conn->ssl, rdBuffer, sizeof(rdBuffer));
+            data = rdBuffer;
+            CPTL_PROBE3(read__return, (int) conn->scktHandle, rc,
+                        (int64_t) conn->readBuffer.length);
         }
         if (rc <= 0) {
             sslErrNo = SSL_get_error(conn->ssl, rc);
-            switch (sslErrNo) {
-                case SSL_ERROR_WANT_READ:
-                    /* TODO TIMEOUT HERE */
-                    wrc = WXSocket_Wait(conn->scktHandle,
-                                        WXNRC_READ_REQUIRED, &reqTimeout);
-                    if (wrc == WXNRC_READ_REQUIRED) {
-                        /* Ready to read */
-                        rc = 0;
-                    } else if (wrc == WXNRC_TIMEOUT) {
-                        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                         "Timeout on wait for socket response");
-                        rc = -1;
-                    } else {
-                        /* Any other response is an explicit error */
-                        php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                         "Error in socket READ_WAIT %s",
-                                         WXSocket_GetErrorStr(wrc));
-                        rc = -1;
-                    }
-                    break;
+            if (sslErrNo == SSL_ERROR_WANT_READ) return total;
 
-                 default:
-                    /* Everything else is an SSL protocol error */
-                    ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                     "Failed to read inbound content [%s]",
-                                     errBuff);
-                    rc = -1;
-                    break;
-            }
-            if (rc < 0) {
-                /* On general error, flush existing buffer */
-                WXBuffer_Empty(&(conn->readBuffer));
-            }
-        } else {
-            /* Append content to rolling buffer */
-            if (WXBuffer_Append(&(conn->readBuffer), rdBuffer, rc,
-                                FALSE) == NULL) {
-                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                 "Error assembling read response");
-                WXBuffer_Empty(&(conn->readBuffer));
-                rc = WXNRC_MEM_ERROR;
-                break;
-            }
+            /* Everything else is an SSL protocol error */
+            ERR_error_string_n(sslErrNo, errBuff, sizeof(errBuff));
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to read inbound content [%s]", errBuff);
 
-            /* And attempt to parse inbound message elements */
+            /* On general error, flush existing buffer */
+            WXBuffer_Empty(&(conn->readBuffer));
+            return -1;
+        }
+
+        /* Append content to rolling buffer */
+        if (WXBuffer_Append(&(conn->readBuffer), data, rc,
+                            FALSE) == NULL) {
+            castLog(CPTL_LOG_WARNING, "Error assembling read response");
+            WXBuffer_Empty(&(conn->readBuffer));
+            return -1;
+        }
 #ifdef _PHP_TRACE_MSG
-            dump("READ", &(conn->readBuffer));
+        dump("READ", &(conn->readBuffer));
 #endif
-            retval = parseInboundMessages(conn, forSenderSession,
-                                          fromPortalReceiver, namespace,
-                                          responseCallback, expJsonResponse,
-                                          requestId);
-            if (retval != NULL) {
-                /* There was some matching response, good or bad */
-                return (retval == CPTL_RESP_ERROR) ? NULL: retval;
-            }
+        total += rc;
+
+        /* Test mode has a single simulated response */
+        if ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) break;
+    }
+
+    return total;
+}
+
+/**
+ * Process the messages already received on the device connection (no read),
+ * looking for a matched response according to the provided filter.
+ *
+ * @param conn The connection to process messages for.
+ * @param filter Matching criteria and callback for the target response.
+ * @return Non-null if a valid response was determined by the response callback
+ *         function, CPTL_RESP_ERROR if a processing error occurred (logged)
+ *         or NULL if no matching response has been received.
+ */
+void *castProcessFiltered(CastDeviceConnection *conn,
+                          CastMessageFilter *filter) {
+    void *retval;
+
+    /* Messages previously routed to the channel take precedence */
+    if (filter->channel != NULL) {
+        retval = parseInboundMessages(conn, &(filter->channel->pendingBuffer),
+                                      filter);
+        if (retval != NULL) return retval;
+    }
+
+    return parseInboundMessages(conn, &(conn->readBuffer), filter);
+}
+
+/**
+ * Open a virtual channel across the device connection, issuing the CONNECT
+ * request between the two endpoints.  Messages inbound to the source id of
+ * the channel are routed to the channel for processing.
+ *
+ * @param conn The connection to multiplex the virtual channel over.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel,
+ *                 must be unique across the channels of the connection.
+ * @param destinationId Identifier of the remote (receiver) endpoint.
+ * @return The channel instance (owned by the connection) or NULL on error
+ *         (logged).
+ */
+CastChannel *castChannelOpen(CastDeviceConnection *conn, const char *sourceId,
+                             const char *destinationId) {
+    return castChannelOpenSend(conn, sourceId, destinationId, NULL, NULL);
+}
+
+/**
+ * Open a virtual channel across the device connection along with an initial
+ * message, where the CONNECT request and the message are issued in a single
+ * write (no waiting in between).  If the channel is already open to the
+ * destination, just the message is sent.
+ *
+ * @param conn The connection to multiplex the virtual channel over.
+ * @param sourceId Identifier of the local (sender) endpoint for the channel,
+ *                 must be unique across the channels of the connection.
+ * @param destinationId Identifier of the remote (receiver) endpoint.
+ * @param namespace Full namespace string for the initial message, NULL for
+ *                  no initial message.
+ * @param payload String content of the initial message (ignored if namespace
+ *                is NULL).
+ * @return The channel instance (owned by the connection) or NULL on error
+ *         (logged).
+ */
+CastChannel *castChannelOpenSend(CastDeviceConnection *conn,
+                                 const char *sourceId,
+                                 const char *destinationId,
+                                 const char *namespace, const char *payload) {
+    uint8_t msgBufferData[2048];
+    CastChannel *channel;
+    WXBuffer msgBuffer;
+    int rc;
+
+    /* Validate the endpoints, reserved ids belong to the default sessions */
+    if ((strlen(sourceId) == 0) ||
+            (strlen(sourceId) >= CPTL_MAX_ENDPOINT_ID) ||
+            (strlen(destinationId) == 0) ||
+            (strlen(destinationId) >= CPTL_MAX_ENDPOINT_ID)) {
+        castLog(CPTL_LOG_WARNING, "Invalid channel endpoint identifier length");
+        return NULL;
+    }
+    if ((strcmp(sourceId, CPTL_SENDER_ID) == 0) ||
+            (strcmp(sourceId, CPTL_SENDER_SESSION_ID) == 0) ||
+            (strcmp(sourceId, CPTL_BROADCAST_ID) == 0)) {
+        castLog(CPTL_LOG_WARNING,
+                "Reserved channel source identifier '%s'", sourceId);
+        return NULL;
+    }
+    channel = castChannelFind(conn, sourceId);
+    if (channel != NULL) {
+        if (strcmp(channel->destinationId, destinationId) == 0) {
+            if (namespace == NULL) return channel;
+            if (castSendFrame(conn, sourceId, destinationId, namespace,
+                              (void *) payload, -1) < 0) return NULL;
+            return channel;
         }
+        castLog(CPTL_LOG_WARNING,
+                "Channel '%s' is already open to '%s'", sourceId,
+                channel->destinationId);
+        return NULL;
+    }
+
+    /* Allocate and connect the channel, only link in if that succeeds */
+    channel = (CastChannel *) WXMalloc(sizeof(CastChannel));
+    if (channel == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate channel instance");
+        return NULL;
     }
+    (void) memset(channel, 0, sizeof(CastChannel));
+    (void) strcpy(channel->sourceId, sourceId);
+    (void) strcpy(channel->destinationId, destinationId);
+    if (WXBuffer_Init(&(channel->pendingBuffer), 256) == NULL) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate channel buffer");
+        WXFree(channel);
+        return NULL;
+    }
+
+    /* Encode the connect and initial message together, single write */
+    WXBuffer_InitLocal(&msgBuffer, msgBufferData, sizeof(msgBufferData));
+    rc = castEncodeFrame(&msgBuffer, sourceId, destinationId,
+                         namespaces[NS_CONNECTION],
+                         "{\"type\": \"CONNECT\"}", -1);
+    if ((rc == 0) && (namespace != NULL)) {
+        rc = castEncodeFrame(&msgBuffer, sourceId, destinationId, namespace,
+                             (void *) payload, -1);
+    }
+    if (rc == 0) {
+#ifdef _PHP_TRACE_MSG
+        dump("WRITE", &msgBuffer);
+#endif
+        rc = castWriteFrames(conn, msgBuffer.buffer, msgBuffer.length);
+    }
+    WXBuffer_Destroy(&msgBuffer);
+    if (rc < 0) {
+        castLog(CPTL_LOG_WARNING, "Failed to issue channel CONNECT request");
+        WXBuffer_Destroy(&(channel->pendingBuffer));
+        WXFree(channel);
+        return NULL;
+    }
+
+    channel->next = conn->channels;
+    conn->channels = channel;
 
+    return channel;
+}
+
+/**
+ * Locate a previously opened virtual channel for the connection.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param sourceId The local (sender) endpoint identifier for the channel.
+ * @return The matching channel instance or NULL if not found.
+ */
+CastChannel *castChannelFind(CastDeviceConnection *conn, const char *sourceId) {
+    CastChannel *channel;
+
+    for (channel = conn->channels; channel != NULL; channel = channel->next) {
+        if (strcmp(channel->sourceId, sourceId) == 0) return channel;
+    }
     return NULL;
 }
+
+/**
+ * Close a virtual channel, issuing the CLOSE request between the endpoints and
+ * releasing any unread inbound messages.
+ *
+ * @param conn The connection that the channel was opened against.
+ * @param channel The channel to close, no longer valid after this call.
+ */
+void castChannelClose(CastDeviceConnection *conn, CastChannel *channel) {
+    CastChannel **ptr;
+
+    /* Unlink first, so nothing more is routed to the channel */
+    for (ptr = &(conn->channels); *ptr != NULL; ptr = &((*ptr)->next)) {
+        if (*ptr == channel) {
+            *ptr = channel->next;
+            break;
+        }
+    }
+
+    /* Like the connection, be polite but don't wait for any response */
+    (void) castSendFrame(conn, channel->sourceId, channel->destinationId,
+                         namespaces[NS_CONNECTION], "{\"type\": \"CLOSE\"}",
+                         -1);
+
+    WXBuffer_Destroy(&(channel->pendingBuffer));
+    WXFree(channel);
+}
@@ -0,0 +1,367 @@
+/*
+ * Cross-process metrics segment, shared (mmap) across the worker processes.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Slots are sized to whole cache lines, so workers never share a line */
+static uint32_t slotSize(uint32_t counterCount) {
+    size_t size = offsetof(CastMetricsSlot, counters) +
+                                       counterCount * sizeof(int64_t);
+
+    return (uint32_t) ((size + CPTL_METRICS_LINE_SIZE - 1) &
+                                       ~((size_t) CPTL_METRICS_LINE_SIZE - 1));
+}
+
+/* Total size of the segment for the given layout */
+static size_t segmentSize(uint32_t slotCount, uint32_t counterCount,
+                          uint32_t *slotOffset) {
+    *slotOffset = (uint32_t) ((sizeof(CastMetricsHeader) +
+                                   CPTL_METRICS_LINE_SIZE - 1) &
+                                   ~((size_t) CPTL_METRICS_LINE_SIZE - 1));
+    return *slotOffset + ((size_t) slotCount) * slotSize(counterCount);
+}
+
+/* Determine if an existing segment matches the requested layout */
+static int layoutMatches(CastMetricsHeader *hdr, uint32_t slotCount,
+                         CastMetricsCounterDef *defs, uint32_t counterCount) {
+    if ((memcmp(hdr->magic, CPTL_METRICS_MAGIC, 8) != 0) ||
+            (hdr->version != CPTL_METRICS_VERSION) ||
+            (hdr->slotCount != slotCount) ||
+            (hdr->counterCount != counterCount)) return 0;
+    return (memcmp(hdr->counters, defs,
+                   counterCount * sizeof(CastMetricsCounterDef)) == 0);
+}
+
+/* Size and map a new (empty) segment file, publishing the layout header */
+static CastMetricsHeader *initSegment(int fd, size_t size, uint32_t slotCount,
+                                      CastMetricsCounterDef *defs,
+                                      uint32_t counterCount,
+                                      uint32_t slotOffset,
+                                      const char **errMsg) {
+    CastMetricsHeader *hdr;
+
+    if (ftruncate(fd, (off_t) size) < 0) {
+        *errMsg = strerror(errno);
+        return NULL;
+    }
+    hdr = (CastMetricsHeader *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        *errMsg = strerror(errno);
+        return NULL;
+    }
+
+    /* Extension zeroed everything, just need the descriptive header */
+    hdr->version = CPTL_METRICS_VERSION;
+    hdr->counterCount = counterCount;
+    hdr->slotCount = slotCount;
+    hdr->slotSize = slotSize(counterCount);
+    hdr->slotOffset = slotOffset;
+    (void) memcpy(hdr->counters, defs,
+                  counterCount * sizeof(CastMetricsCounterDef));
+
+    /* Magic goes last, readers ignore the segment until it's complete */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    (void) memcpy(hdr->magic, CPTL_METRICS_MAGIC, 8);
+
+    return hdr;
+}
+
+/* Replace an incompatible segment, mapped instances keep the old content */
+static CastMetricsHeader *replaceSegment(const char *fileName, size_t size,
+                                         uint32_t slotCount,
+                                         CastMetricsCounterDef *defs,
+                                         uint32_t counterCount,
+                                         uint32_t slotOffset,
+                                         const char **errMsg) {
+    CastMetricsHeader *hdr;
+    char tmpName[1024];
+    int fd;
+
+    /* Built aside and renamed over, never truncated under another mapping */
+    if (snprintf(tmpName, sizeof(tmpName), "%s.XXXXXX",
+                 fileName) >= (int) sizeof(tmpName)) {
+        *errMsg = "segment file name is too long";
+        return NULL;
+    }
+    if ((fd = mkstemp(tmpName)) < 0) {
+        *errMsg = strerror(errno);
+        return NULL;
+    }
+    hdr = initSegment(fd, size, slotCount, defs, counterCount, slotOffset,
+                      errMsg);
+    (void) close(fd);
+    if ((hdr != NULL) && (rename(tmpName, fileName) < 0)) {
+        *errMsg = strerror(errno);
+        (void) munmap(hdr, size);
+        hdr = NULL;
+    }
+    if (hdr == NULL) (void) unlink(tmpName);
+
+    return hdr;
+}
+
+/**
+ * Create (or reattach to a compatible) metrics segment file and map it into
+ * memory as a shared mapping, for the extension process and its workers.  An
+ * existing segment with the same layout is retained, so counters accumulate
+ * across restarts.  Creators are serialized by an exclusive lock on the file
+ * and an incompatible segment is replaced (renamed over) rather than resized,
+ * as other processes may still have it mapped.
+ *
+ * @param fileName The file to create/map, typically on a tmpfs (/dev/shm).
+ * @param slotCount The number of worker slots to allocate.
+ * @param defs The definitions of the counters for each slot.
+ * @param counterCount The number of counter definitions.
+ * @param mapLen Returns the size of the mapping (for unmap).
+ * @param errMsg Returns a description of the failure (if NULL returned).
+ * @return The mapped segment or NULL on error.
+ */
+CastMetricsHeader *castMetricsCreate(const char *fileName, uint32_t slotCount,
+                                     CastMetricsCounterDef *defs,
+                                     uint32_t counterCount, size_t *mapLen,
+                                     const char **errMsg) {
+    CastMetricsHeader *hdr = NULL;
+    struct stat st, pathSt;
+    uint32_t slotOffset;
+    size_t size;
+    int fd;
+
+    if ((slotCount == 0) || (counterCount == 0) ||
+            (counterCount > CPTL_METRICS_MAX_COUNTERS)) {
+        *errMsg = "invalid segment layout";
+        return NULL;
+    }
+    size = segmentSize(slotCount, counterCount, &slotOffset);
+
+    for (;;) {
+        fd = open(fileName, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            *errMsg = strerror(errno);
+            return NULL;
+        }
+        if ((flock(fd, LOCK_EX) < 0) || (fstat(fd, &st) < 0)) {
+            *errMsg = strerror(errno);
+            (void) close(fd);
+            return NULL;
+        }
+
+        /* Lost a race with a replacement, lock the current segment instead */
+        if ((stat(fileName, &pathSt) == 0) && (pathSt.st_dev == st.st_dev) &&
+                (pathSt.st_ino == st.st_ino)) break;
+        (void) close(fd);
+    }
+
+    if (st.st_size == 0) {
+        /* New file, nobody else can have it mapped (see castMetricsOpen) */
+        hdr = initSegment(fd, size, slotCount, defs, counterCount,
+                          slotOffset, errMsg);
+    } else {
+        /* Reattach if the existing content is compatible */
+        if ((size_t) st.st_size == size) {
+            hdr = (CastMetricsHeader *) mmap(NULL, size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, fd, 0);
+            if (hdr == MAP_FAILED) {
+                hdr = NULL;
+            } else if (!layoutMatches(hdr, slotCount, defs, counterCount)) {
+                (void) munmap(hdr, size);
+                hdr = NULL;
+            }
+        }
+
+        /* Otherwise start over, while still holding the lock on the old */
+        if (hdr == NULL) {
+            hdr = replaceSegment(fileName, size, slotCount, defs,
+                                 counterCount, slotOffset, errMsg);
+        }
+    }
+
+    /* Note: explicit unlock, the mapping keeps the file description open */
+    (void) flock(fd, LOCK_UN);
+    (void) close(fd);
+    if (hdr == NULL) return NULL;
+
+    *mapLen = size;
+    return hdr;
+}
+
+/**
+ * Map an existing metrics segment (read-only), for external readers.
+ *
+ * @param fileName The segment file to map.
+ * @param mapLen Returns the size of the mapping (for unmap).
+ * @param errMsg Returns a description of the failure (if NULL returned).
+ * @return The mapped segment or NULL on error.
+ */
+CastMetricsHeader *castMetricsOpen(const char *fileName, size_t *mapLen,
+                                   const char **errMsg) {
+    CastMetricsHeader *hdr;
+    uint32_t slotOffset;
+    struct stat st;
+    int fd;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        *errMsg = strerror(errno);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        *errMsg = strerror(errno);
+        (void) close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(CastMetricsHeader)) {
+        *errMsg = "segment is truncated or not initialized";
+        (void) close(fd);
+        return NULL;
+    }
+    hdr = (CastMetricsHeader *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                                     fd, 0);
+    (void) close(fd);
+    if (hdr == MAP_FAILED) {
+        *errMsg = strerror(errno);
+        return NULL;
+    }
+
+    /* Validate before anyone trusts the layout details */
+    if ((memcmp(hdr->magic, CPTL_METRICS_MAGIC, 8) != 0) ||
+            (hdr->version != CPTL_METRICS_VERSION) ||
+            (hdr->counterCount == 0) ||
+            (hdr->counterCount > CPTL_METRICS_MAX_COUNTERS) ||
+            (hdr->slotSize != slotSize(hdr->counterCount)) ||
+            (segmentSize(hdr->slotCount, hdr->counterCount,
+                         &slotOffset) != (size_t) st.st_size) ||
+            (hdr->slotOffset != slotOffset)) {
+        *errMsg = "not a (compatible) metrics segment";
+        (void) munmap(hdr, st.st_size);
+        return NULL;
+    }
+
+    *mapLen = st.st_size;
+    return hdr;
+}
+
+/* Attempt to take over a slot, only one claimant can win the swap */
+static int takeSlot(CastMetricsSlot *slot, int32_t expected, pid_t pid) {
+    return __atomic_compare_exchange_n(&(slot->pid), &expected, (int32_t) pid,
+                                       0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * Claim a slot in the segment for the given process.  A slot already held by
+ * the process is returned, otherwise a free slot or one held by a process
+ * that no longer exists (whose counts are retained, totals never go back).
+ *
+ * @param hdr The mapped (writable) metrics segment.
+ * @param pid The identifier of the claiming process.
+ * @return The counters of the claimed slot or NULL if all slots are in use.
+ */
+int64_t *castMetricsClaim(CastMetricsHeader *hdr, pid_t pid) {
+    CastMetricsSlot *slot;
+    int32_t owner;
+    uint32_t idx;
+
+    /* Ours already? */
+    for (idx = 0; idx < hdr->slotCount; idx++) {
+        slot = CPTL_METRICS_SLOT(hdr, idx);
+        if (__atomic_load_n(&(slot->pid), __ATOMIC_ACQUIRE) == pid) {
+            return slot->counters;
+        }
+    }
+
+    /* Unused slots first, then those of departed workers */
+    for (idx = 0; idx < hdr->slotCount; idx++) {
+        slot = CPTL_METRICS_SLOT(hdr, idx);
+        if (takeSlot(slot, 0, pid)) return slot->counters;
+    }
+    for (idx = 0; idx < hdr->slotCount; idx++) {
+        slot = CPTL_METRICS_SLOT(hdr, idx);
+        owner = __atomic_load_n(&(slot->pid), __ATOMIC_ACQUIRE);
+        if ((owner > 0) && (kill(owner, 0) < 0) && (errno == ESRCH) &&
+                (takeSlot(slot, owner, pid))) return slot->counters;
+    }
+
+    return NULL;
+}
+
+/**
+ * Release the slot held by the given process (counts are retained).
+ *
+ * @param hdr The mapped (writable) metrics segment.
+ * @param pid The identifier of the releasing process.
+ */
+void castMetricsRelease(CastMetricsHeader *hdr, pid_t pid) {
+    uint32_t idx;
+
+    for (idx = 0; idx < hdr->slotCount; idx++) {
+        if (takeSlot(CPTL_METRICS_SLOT(hdr, idx), (int32_t) pid, 0)) return;
+    }
+}
+
+/**
+ * Aggregate the counters across all slots of the segment and render them in
+ * the Prometheus text exposition format.
+ *
+ * @param hdr The mapped metrics segment.
+ * @param writer Output callback for the rendered text.
+ * @param ctx Context for the writer callback.
+ */
+void castMetricsFormat(CastMetricsHeader *hdr, CastMetricsWriter writer,
+                       void *ctx) {
+    int64_t total;
+    uint32_t cnt, idx, claimed = 0;
+    CastMetricsCounterDef *def;
+    CastMetricsSlot *slot;
+    char line[256];
+    int len;
+
+    /* Claimed, not necessarily live (departed workers are reclaimed lazily) */
+    for (idx = 0; idx < hdr->slotCount; idx++) {
+        slot = CPTL_METRICS_SLOT(hdr, idx);
+        if (__atomic_load_n(&(slot->pid), __ATOMIC_RELAXED) > 0) claimed++;
+    }
+    len = snprintf(line, sizeof(line),
+                   "# TYPE castportal_slots_claimed gauge\n"
+                   "castportal_slots_claimed %u\n", claimed);
+    (*writer)(ctx, line, len);
+
+    for (cnt = 0; cnt < hdr->counterCount; cnt++) {
+        def = &(hdr->counters[cnt]);
+        total = 0;
+        for (idx = 0; idx < hdr->slotCount; idx++) {
+            slot = CPTL_METRICS_SLOT(hdr, idx);
+            total += __atomic_load_n(&(slot->counters[cnt]),
+                                     __ATOMIC_RELAXED);
+        }
+
+        /* Labelled variants share a name (and type line) and are adjacent */
+        if ((cnt == 0) || (strcmp(def->name, hdr->counters[cnt - 1].name))) {
+            len = snprintf(line, sizeof(line),
+                           "# TYPE castportal_%s_total counter\n", def->name);
+            (*writer)(ctx, line, len);
+        }
+        if (def->label[0] != '\0') {
+            len = snprintf(line, sizeof(line), "castportal_%s_total{%s} %lld\n",
+                           def->name, def->label, (long long) total);
+        } else {
+            len = snprintf(line, sizeof(line), "castportal_%s_total %lld\n",
+                           def->name, (long long) total);
+        }
+        (*writer)(ctx, line, len);
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * Definitions for the cross-process (shared memory) metrics segment.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#ifndef CPTL_METRICS_H
+#define CPTL_METRICS_H 1
+
+/* Note: no PHP dependencies, this is also built into the external reader */
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Fixed elements of the segment format */
+#define CPTL_METRICS_MAGIC "CPTLMET1"
+#define CPTL_METRICS_VERSION 1
+#define CPTL_METRICS_LINE_SIZE 64
+#define CPTL_METRICS_MAX_COUNTERS 64
+#define CPTL_METRICS_NAME_LEN 32
+#define CPTL_METRICS_LABEL_LEN 96
+
+/* Self-describing counter definition, reader needs no knowledge of the enum */
+typedef struct {
+    char name[CPTL_METRICS_NAME_LEN];
+    char label[CPTL_METRICS_LABEL_LEN];
+} CastMetricsCounterDef;
+
+/* Leading header of the segment, followed by the (line-aligned) slots */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t counterCount;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    uint32_t slotOffset;
+    uint32_t reserved;
+    CastMetricsCounterDef counters[CPTL_METRICS_MAX_COUNTERS];
+} CastMetricsHeader;
+
+/*
+ * Each worker process owns a slot, which is padded out to a multiple of the
+ * cache line size so that no two workers ever write to the same line.  Only
+ * the owning process writes the counters, readers may see an update late but
+ * never a torn value (aligned 64-bit).
+ */
+typedef struct {
+    int32_t pid;
+    uint32_t reserved;
+    int64_t counters[1];
+} CastMetricsSlot;
+
+/* Access the indexed slot of the segment */
+#define CPTL_METRICS_SLOT(hdr, idx) \
+    ((CastMetricsSlot *) (((uint8_t *) (hdr)) + (hdr)->slotOffset + \
+                          ((size_t) (idx)) * (hdr)->slotSize))
+
+/* Output callback for the text formatter */
+typedef void (*CastMetricsWriter)(void *ctx, const char *text, size_t len);
+
+/**
+ * Create (or reattach to a compatible) metrics segment file and map it into
+ * memory as a shared mapping, for the extension process and its workers.  An
+ * existing segment with the same layout is retained, so counters accumulate
+ * across restarts.
+ *
+ * @param fileName The file to create/map, typically on a tmpfs (/dev/shm).
+ * @param slotCount The number of worker slots to allocate.
+ * @param defs The definitions of the counters for each slot.
+ * @param counterCount The number of counter definitions.
+ * @param mapLen Returns the size of the mapping (for unmap).
+ * @param errMsg Returns a description of the failure (if NULL returned).
+ * @return The mapped segment or NULL on error.
+ */
+CastMetricsHeader *castMetricsCreate(const char *fileName, uint32_t slotCount,
+                                     CastMetricsCounterDef *defs,
+                                     uint32_t counterCount, size_t *mapLen,
+                                     const char **errMsg);
+
+/**
+ * Map an existing metrics segment (read-only), for external readers.
+ *
+ * @param fileName The segment file to map.
+ * @param mapLen Returns the size of the mapping (for unmap).
+ * @param errMsg Returns a description of the failure (if NULL returned).
+ * @return The mapped segment or NULL on error.
+ */
+CastMetricsHeader *castMetricsOpen(const char *fileName, size_t *mapLen,
+                                   const char **errMsg);
+
+/**
+ * Claim a slot in the segment for the given process.  A slot already held by
+ * the process is returned, otherwise a free slot or one held by a process
+ * that no longer exists (whose counts are retained, totals never go back).
+ *
+ * @param hdr The mapped (writable) metrics segment.
+ * @param pid The identifier of the claiming process.
+ * @return The counters of the claimed slot or NULL if all slots are in use.
+ */
+int64_t *castMetricsClaim(CastMetricsHeader *hdr, pid_t pid);
+
+/**
+ * Release the slot held by the given process (counts are retained).
+ *
+ * @param hdr The mapped (writable) metrics segment.
+ * @param pid The identifier of the releasing process.
+ */
+void castMetricsRelease(CastMetricsHeader *hdr, pid_t pid);
+
+/**
+ * Aggregate the counters across all slots of the segment and render them in
+ * the Prometheus text exposition format.
+ *
+ * @param hdr The mapped metrics segment.
+ * @param writer Output callback for the rendered text.
+ * @param ctx Context for the writer callback.
+ */
+void castMetricsFormat(CastMetricsHeader *hdr, CastMetricsWriter writer,
+                       void *ctx);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Static (USDT) probe points for the cast portal extension.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#ifndef CPTL_PROBES_H
+#define CPTL_PROBES_H 1
+
+/*
+ * Probes are compiled to a single nop (plus an ELF note) when sys/sdt.h is
+ * available, and to nothing at all otherwise (or with CPTL_DISABLE_PROBES),
+ * where the arguments are only referenced in an unevaluated sizeof.
+ * Arguments on the message paths are only values already at hand, no probe
+ * there adds a clock read or a copy.  Identifier arguments from the wire are
+ * not terminated, so they come as a pointer/length pair (for bpftrace, use
+ * str(arg0, arg1)).
+ *
+ * Provider 'castportal', probes and arguments:
+ *
+ *   connect__start(char *addr, int port)
+ *   connect__done(char *addr, int port, int64 connectUsec,
+ *                 int64 handshakeUsec, int resumed)
+ *   connect__fail(char *addr, int port)
+ *   message__send(char *destId, char *namespace, int64 bytes)
+ *   read__return(int fd, int rc, int64 buffered)
+ *   frame__decode(char *nsId, int nsLen, int namespace, int contentLen,
+ *                 int contentType)
+ *   json__parse(int namespace, int contentLen, int64 parseUsec)
+ *   discovery__receive(char *addr, int bytes, int64 sinceQueryUsec)
+ *
+ * For example:
+ *
+ *   bpftrace -e 'usdt:/path/castportal.so:castportal:connect__done
+ *                    { @hs[str(arg0)] = hist(arg3); }'
+ */
+#if defined(HAVE_SYS_SDT_H) && !defined(CPTL_DISABLE_PROBES)
+    #include <sys/sdt.h>
+
+    #define CPTL_PROBE2(name, a1, a2) \
+        DTRACE_PROBE2(castportal, name, a1, a2)
+    #define CPTL_PROBE3(name, a1, a2, a3) \
+        DTRACE_PROBE3(castportal, name, a1, a2, a3)
+    #define CPTL_PROBE5(name, a1, a2, a3, a4, a5) \
+        DTRACE_PROBE5(castportal, name, a1, a2, a3, a4, a5)
+#else
+    #define CPTL_PROBE2(name, a1, a2) \
+        ((void) sizeof(a1), (void) sizeof(a2))
+    #define CPTL_PROBE3(name, a1, a2, a3) \
+        ((void) sizeof(a1), (void) sizeof(a2), (void) sizeof(a3))
+    #define CPTL_PROBE5(name, a1, a2, a3, a4, a5) \
+        ((void) sizeof(a1), (void) sizeof(a2), (void) sizeof(a3), \
+         (void) sizeof(a4), (void) sizeof(a5))
+#endif
+
+#endif
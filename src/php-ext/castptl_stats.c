@@ -0,0 +1,183 @@
+/*
+ * Process-wide runtime statistics for the cast portal extension.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include "castptl_metrics.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Note that the counters are per-process and survive across requests.  When
+ * threaded they are shared by all of the request threads and updated with
+ * relaxed atomics (no ordering, just no lost updates), which is all that the
+ * counts and accumulated times require.
+ */
+int64_t castStats[STAT_COUNT];
+
+/* Shared metrics segment (across processes) and the slot of this process */
+static CastMetricsHeader *metricsSegment = NULL;
+static size_t metricsSegmentLen = 0;
+static pid_t metricsSlotPid = 0;
+int64_t *castStatsSlot = NULL;
+
+/* The following names must align to the CastStatCounter enumeration */
+static const char *statNames[] = {
+    "connects",
+    "connect_failures",
+    "handshakes",
+    "handshake_usec",
+    "sessions_resumed",
+    "bytes_in",
+    "bytes_out",
+    "json_parses",
+    "json_parse_usec",
+    "timeouts",
+    "parse_errors",
+    "discovery_queries",
+    "discovery_responses",
+    "idle_slims",
+    "idle_slim_bytes"
+};
+
+/**
+ * Read the current value of a statistics counter.
+ *
+ * @param counter The index of the counter to read.
+ * @return The current counter value.
+ */
+int64_t castStatValue(int counter) {
+    if ((counter < 0) || (counter >= STAT_COUNT)) return 0;
+#ifdef CPTL_THREADED
+    return __atomic_load_n(&(castStats[counter]), __ATOMIC_RELAXED);
+#else
+    return castStats[counter];
+#endif
+}
+
+/**
+ * Obtain the (external) name of a statistics counter, for reporting.
+ *
+ * @param counter The index of the counter.
+ * @return The counter name or NULL for the per-namespace frame counters,
+ *         which are named by namespace.
+ */
+const char *castStatName(int counter) {
+    if ((counter < 0) || (counter >= STAT_FRAMES_IN)) return NULL;
+    return statNames[counter];
+}
+
+/**
+ * Map the shared (cross-process) metrics segment, if configured.  Called from
+ * module startup, failures are logged and the segment is just not used.
+ */
+void castStatsInit() {
+    CastMetricsCounterDef defs[STAT_COUNT];
+    const char *name, *errMsg = NULL;
+    int idx, frameIdx;
+
+    if ((CPTL_CFG(metricsFile) == NULL) || (*CPTL_CFG(metricsFile) == '\0')) {
+        return;
+    }
+
+    /* The segment is self-describing, so the reader needs no enum */
+    (void) memset(defs, 0, sizeof(defs));
+    for (idx = 0; idx < STAT_COUNT; idx++) {
+        if (idx < STAT_FRAMES_IN) {
+            (void) strcpy(defs[idx].name, statNames[idx]);
+            continue;
+        }
+        frameIdx = (idx - STAT_FRAMES_IN) % (NS_COUNT + 1);
+        name = castNamespaceName((CastNamespace) frameIdx);
+        (void) strcpy(defs[idx].name,
+                      (idx < STAT_FRAMES_OUT) ? "frames_in" : "frames_out");
+        (void) snprintf(defs[idx].label, sizeof(defs[idx].label),
+                        "namespace=\"%s\"", (name != NULL) ? name : "unknown");
+    }
+
+    if (CPTL_CFG(metricsSlots) <= 0) {
+        castLog(CPTL_LOG_WARNING,
+                "Invalid metrics slot count %ld, segment disabled",
+                CPTL_CFG(metricsSlots));
+        return;
+    }
+    metricsSegment = castMetricsCreate(CPTL_CFG(metricsFile),
+                                       (uint32_t) CPTL_CFG(metricsSlots), defs,
+                                       STAT_COUNT, &metricsSegmentLen,
+                                       &errMsg);
+    if (metricsSegment == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Unable to map metrics segment '%s': %s",
+                CPTL_CFG(metricsFile), errMsg);
+    }
+}
+
+/**
+ * Attach the current process to a slot of the shared metrics segment, if
+ * not already attached (workers are forked after the segment is mapped).
+ */
+void castStatsAttach() {
+    pid_t pid;
+
+    if (metricsSegment == NULL) return;
+    if ((pid = getpid()) == metricsSlotPid) return;
+
+    /* Note that a forked child inherits (but doesn't own) the parent slot */
+    castStatsSlot = castMetricsClaim(metricsSegment, pid);
+    metricsSlotPid = pid;
+    if (castStatsSlot == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "No free metrics slot for process %d (of %u), "
+                "increase castportal.metrics_slots", (int) pid,
+                metricsSegment->slotCount);
+    }
+}
+
+/**
+ * Release the slot and mapping of the shared metrics segment.
+ */
+void castStatsCleanup() {
+    if (metricsSegment == NULL) return;
+
+    castStatsSlot = NULL;
+    if (metricsSlotPid == getpid()) {
+        castMetricsRelease(metricsSegment, metricsSlotPid);
+    }
+    (void) munmap(metricsSegment, metricsSegmentLen);
+    metricsSegment = NULL;
+    metricsSlotPid = 0;
+}
+
+/* Writer callback for the metrics formatter, into a WXBuffer */
+static void appendMetrics(void *ctx, const char *text, size_t len) {
+    (void) WXBuffer_Append((WXBuffer *) ctx, (uint8_t *) text, len, TRUE);
+}
+
+/**
+ * Render the counters aggregated across all of the processes attached to the
+ * shared metrics segment, in the Prometheus text exposition format.
+ *
+ * @param buffer Buffer to append the rendered text to.
+ * @return 0 on success, -1 if there is no segment or on allocation failure.
+ */
+int castStatsFormatGlobal(WXBuffer *buffer) {
+    size_t start = buffer->length;
+
+    if (metricsSegment == NULL) {
+        castLog(CPTL_LOG_WARNING,
+                "Shared metrics segment is not enabled "
+                "(castportal.metrics_file)");
+        return -1;
+    }
+
+    castMetricsFormat(metricsSegment, appendMetrics, buffer);
+    if (buffer->length == start) {
+        castLog(CPTL_LOG_WARNING, "Failed to allocate metrics content");
+        return -1;
+    }
+
+    return 0;
+}
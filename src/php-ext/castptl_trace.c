@@ -0,0 +1,255 @@
+/*
+ * Request timeline tracing, recorded as spans for the phases of the composite
+ * operations and written as Chrome trace-event JSON, along with the slow
+ * operation log (which breaks down the same spans).
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include "mem.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef CPTL_THREADED
+#include <pthread.h>
+#endif
+
+/**
+ * Start the timeline for the current request, if tracing is configured
+ * (castportal.trace_file).  Called from request startup.
+ */
+void castTraceStart() {
+    CPTL_CTX(traceActive) = FALSE;
+    CPTL_CTX(traceEvents) = NULL;
+    CPTL_CTX(traceCount) = CPTL_CTX(traceAlloc) = 0;
+    if ((CPTL_CFG(traceFile) == NULL) || (*CPTL_CFG(traceFile) == '\0')) return;
+
+    CPTL_CTX(traceStart) = castTimeUsec();
+    CPTL_CTX(traceActive) = CPTL_TRACE_TIMELINE;
+}
+
+/* Accumulate the span into the phase breakdown of the slow op candidate */
+static void slowOpPhase(const char *name, int64_t duration) {
+    int idx;
+
+    for (idx = 0; idx < CPTL_CTX(slowOpPhaseCount); idx++) {
+        if (strcmp(CPTL_CTX(slowOpPhaseNames)[idx], name) == 0) break;
+    }
+    if (idx == CPTL_CTX(slowOpPhaseCount)) {
+        if (idx >= CPTL_SLOWOP_MAX_PHASES) return;
+        CPTL_CTX(slowOpPhaseNames)[idx] = name;
+        CPTL_CTX(slowOpPhaseUsec)[idx] = 0;
+        CPTL_CTX(slowOpPhaseCalls)[idx] = 0;
+        CPTL_CTX(slowOpPhaseCount)++;
+    }
+    CPTL_CTX(slowOpPhaseUsec)[idx] += duration;
+    CPTL_CTX(slowOpPhaseCalls)[idx]++;
+}
+
+/**
+ * Record a completed span in the timeline of the current request and/or the
+ * phase breakdown of the current slow operation candidate.  Use the macros
+ * below, where the begin timestamp is only taken if either is active.
+ *
+ * @param name Name of the span (phase), must be a static string.
+ * @param detail Optional detail (e.g. device address) for the span, copied
+ *               (truncated), NULL if not applicable.
+ * @param begin Monotonic timestamp of the start of the span (castTimeUsec).
+ */
+void castTraceEnd(const char *name, const char *detail, int64_t begin) {
+    CastTraceEvent *event, *events = (CastTraceEvent *) CPTL_CTX(traceEvents);
+    int64_t duration = castTimeUsec() - begin;
+    long alloc;
+
+    if (CPTL_CTX(traceActive) & CPTL_TRACE_SLOWOP) slowOpPhase(name, duration);
+    if ((CPTL_CTX(traceActive) & CPTL_TRACE_TIMELINE) == 0) return;
+
+    /* Grow as needed, quietly stop recording at the limit */
+    if (CPTL_CTX(traceCount) >= CPTL_CTX(traceAlloc)) {
+        if (CPTL_CTX(traceAlloc) >= CPTL_TRACE_MAX_EVENTS) return;
+        alloc = (CPTL_CTX(traceAlloc) == 0) ? 256 : 2 * CPTL_CTX(traceAlloc);
+        events = (CastTraceEvent *) WXRealloc(events,
+                                              alloc * sizeof(CastTraceEvent));
+        if (events == NULL) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to allocate trace events, tracing "
+                    "disabled for request");
+            if (CPTL_CTX(traceEvents) != NULL) WXFree(CPTL_CTX(traceEvents));
+            CPTL_CTX(traceEvents) = NULL;
+            CPTL_CTX(traceCount) = CPTL_CTX(traceAlloc) = 0;
+            CPTL_CTX(traceActive) &= ~CPTL_TRACE_TIMELINE;
+            return;
+        }
+        CPTL_CTX(traceEvents) = events;
+        CPTL_CTX(traceAlloc) = alloc;
+    }
+
+    event = events + CPTL_CTX(traceCount)++;
+    event->name = name;
+    event->begin = begin;
+    event->duration = duration;
+    event->detail[0] = '\0';
+    if (detail != NULL) {
+        (void) strncpy(event->detail, detail, CPTL_TRACE_DETAIL_LEN - 1);
+        event->detail[CPTL_TRACE_DETAIL_LEN - 1] = '\0';
+    }
+}
+
+/* Expand the trace file name, %p for process id and %t for request time */
+static void traceFileName(char *dest, size_t destLen) {
+    char *src = CPTL_CFG(traceFile), *end = dest + destLen - 1;
+    struct timeval tv;
+    int len;
+
+    (void) gettimeofday(&tv, NULL);
+    while ((*src != '\0') && (dest < end)) {
+        len = 0;
+        if ((*src == '%') && (*(src + 1) == 'p')) {
+            len = snprintf(dest, end - dest + 1, "%d", (int) getpid());
+            src += 2;
+        } else if ((*src == '%') && (*(src + 1) == 't')) {
+            len = snprintf(dest, end - dest + 1, "%ld%06ld",
+                           (long) tv.tv_sec, (long) tv.tv_usec);
+            src += 2;
+        } else {
+            *(dest++) = *(src++);
+            continue;
+        }
+        if (len < 0) break;
+        dest += ((dest + len) > end) ? (end - dest) : len;
+    }
+    *dest = '\0';
+}
+
+/* Detail content is arbitrary (device strings), escape for JSON */
+static void writeJsonString(FILE *fp, const char *str) {
+    (void) fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        if ((*str == '"') || (*str == '\\')) {
+            (void) fputc('\\', fp);
+            (void) fputc(*str, fp);
+        } else if ((unsigned char) *str < 0x20) {
+            (void) fprintf(fp, "\\u%04x", (unsigned char) *str);
+        } else {
+            (void) fputc(*str, fp);
+        }
+    }
+    (void) fputc('"', fp);
+}
+
+/**
+ * Write the timeline of the current request to the configured trace file, as
+ * Chrome trace-event JSON (for chrome://tracing or Perfetto), and release the
+ * recorded events.  Called from request shutdown.
+ */
+void castTraceFlush() {
+    CastTraceEvent *event, *events = (CastTraceEvent *) CPTL_CTX(traceEvents);
+    char fileName[1024];
+    long idx, tid;
+    FILE *fp;
+
+    if ((CPTL_CTX(traceActive) & CPTL_TRACE_TIMELINE) == 0) return;
+    CPTL_CTX(traceActive) &= ~CPTL_TRACE_TIMELINE;
+    if (CPTL_CTX(traceCount) == 0) return;
+
+    /* Note: a direct open (no open_basedir), so the file is system-only */
+    traceFileName(fileName, sizeof(fileName));
+    fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        castLog(CPTL_LOG_WARNING, "Unable to open trace file '%s'", fileName);
+    } else {
+#ifdef CPTL_THREADED
+        tid = (long) pthread_self();
+#else
+        tid = (long) getpid();
+#endif
+        (void) fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (idx = 0; idx < CPTL_CTX(traceCount); idx++) {
+            event = events + idx;
+            (void) fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"castportal\","
+                               "\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                               "\"pid\":%d,\"tid\":%ld",
+                           (idx == 0) ? "" : ",\n", event->name,
+                           (long long) (event->begin - CPTL_CTX(traceStart)),
+                           (long long) event->duration, (int) getpid(), tid);
+            if (event->detail[0] != '\0') {
+                (void) fprintf(fp, ",\"args\":{\"detail\":");
+                writeJsonString(fp, event->detail);
+                (void) fputc('}', fp);
+            }
+            (void) fputc('}', fp);
+        }
+        (void) fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0) {
+            castLog(CPTL_LOG_WARNING,
+                    "Failed to write trace file '%s'", fileName);
+        }
+    }
+
+    WXFree(events);
+    CPTL_CTX(traceEvents) = NULL;
+    CPTL_CTX(traceCount) = CPTL_CTX(traceAlloc) = 0;
+}
+
+/**
+ * Mark the start of a public operation, for the slow operation log.  No-op
+ * unless castportal.slow_op_ms is set.
+ *
+ * @param opName Name of the operation (PHP function), must be a static string.
+ * @param device Address of the associated device, NULL if not applicable.
+ * @param port Port of the associated device, ignored if device is NULL or
+ *             zero if already included in the address.
+ */
+void castSlowOpBegin(const char *opName, const char *device, int port) {
+    CPTL_CTX(traceActive) &= ~CPTL_TRACE_SLOWOP;
+    if (CPTL_CFG(slowOpMs) <= 0) return;
+
+    CPTL_CTX(slowOpName) = opName;
+    if (device == NULL) {
+        (void) strcpy(CPTL_CTX(slowOpDevice), "-");
+    } else if (port <= 0) {
+        (void) snprintf(CPTL_CTX(slowOpDevice), CPTL_SLOWOP_DEVICE_LEN, "%s",
+                        device);
+    } else {
+        (void) snprintf(CPTL_CTX(slowOpDevice), CPTL_SLOWOP_DEVICE_LEN, "%s:%d",
+                        device, port);
+    }
+    CPTL_CTX(slowOpPhaseCount) = 0;
+    CPTL_CTX(slowOpStart) = castTimeUsec();
+    CPTL_CTX(traceActive) |= CPTL_TRACE_SLOWOP;
+}
+
+/**
+ * Complete the current public operation, logging the operation with the
+ * breakdown of the timed phases if it exceeded castportal.slow_op_ms.
+ *
+ * @param success TRUE if the operation was successful, FALSE otherwise.
+ */
+void castSlowOpEnd(int success) {
+    char line[1024];
+    int64_t elapsed;
+    int idx, len;
+
+    if ((CPTL_CTX(traceActive) & CPTL_TRACE_SLOWOP) == 0) return;
+    CPTL_CTX(traceActive) &= ~CPTL_TRACE_SLOWOP;
+    elapsed = castTimeUsec() - CPTL_CTX(slowOpStart);
+    if (elapsed < ((int64_t) CPTL_CFG(slowOpMs)) * 1000) return;
+
+    /* Single logfmt line, phases are total time and count (spans overlap) */
+    len = snprintf(line, sizeof(line),
+                   "castportal slow_op op=%s device=%s result=%s "
+                   "total_ms=%.3f", CPTL_CTX(slowOpName),
+                   CPTL_CTX(slowOpDevice), (success) ? "ok" : "fail",
+                   elapsed / 1000.0);
+    for (idx = 0; idx < CPTL_CTX(slowOpPhaseCount); idx++) {
+        if ((len < 0) || (len >= (int) sizeof(line))) break;
+        len += snprintf(line + len, sizeof(line) - len, " %s_ms=%.3f %s_n=%d",
+                        CPTL_CTX(slowOpPhaseNames)[idx],
+                        CPTL_CTX(slowOpPhaseUsec)[idx] / 1000.0,
+                        CPTL_CTX(slowOpPhaseNames)[idx],
+                        CPTL_CTX(slowOpPhaseCalls)[idx]);
+    }
+    castLog(CPTL_LOG_INFO, "%s", line);
+}
@@ -24,6 +24,18 @@ if test $PHP_CASTPORTAL != "no"; then
     AC_CHECK_HEADERS([sys/endian.h])
     AC_CHECK_HEADERS([byteswap.h])
 
+    dnl
+    dnl Static (USDT) probes are compiled in if SystemTap headers are present
+    dnl
+    AC_CHECK_HEADERS([sys/sdt.h])
+
+    dnl
+    dnl The core library is Zend-independent, carry over the thread safety
+    dnl
+    if test "$PHP_THREAD_SAFETY" = "yes"; then
+        AC_DEFINE(CPTL_THREADED,1,[Shared core elements are thread safe])
+    fi
+
     dnl
     dnl Requires OpenSSL for the TLS communication with cast devices
     dnl
@@ -38,9 +50,12 @@ if test $PHP_CASTPORTAL != "no"; then
     PHP_ADD_INCLUDE(toolkit/src/network)
     PHP_ADD_INCLUDE(toolkit/src/utility)
     PHP_NEW_EXTENSION(castportal,
-                      php_castptl.c castptl_discover.c castptl_device.c \
+                      php_castptl.c castptl_core.c \
+                      castptl_discover.c castptl_device.c \
                       castptl_auth.c castptl_app.c castptl_message.c \
-                      castptl_compat.c \
+                      castptl_compat.c castptl_fleet.c castptl_media.c \
+                      castptl_stats.c castptl_metrics.c castptl_capture.c \
+                      castptl_trace.c \
                       toolkit/src/lang/json.c toolkit/src/network/socket.c \
                       toolkit/src/utility/hash.c toolkit/src/utility/array.c \
                       toolkit/src/utility/buffer.c, 
@@ -7,12 +7,16 @@
  */
 #include "php_castptl.h"
 #include "zend_exceptions.h"
+#include "ext/standard/info.h"
 #include "mem.h"
 
-/* Elements for test mode: mode 0 - normal, 1 - simulate, 2 - invalid */
-long _cptl_tstmode = 0;
-void *_cptl_tstresp = NULL;
-long _cptl_tstresplen = 0;
+/* Module globals (per-thread under ZTS), including the test mode elements */
+ZEND_DECLARE_MODULE_GLOBALS(castportal)
+#if (PHP_MAJOR_VERSION >= 7) && defined(ZTS) && defined(COMPILE_DL_CASTPORTAL)
+    ZEND_TSRMLS_CACHE_DEFINE()
+#endif
+static PHP_GINIT_FUNCTION(castportal);
+static PHP_GSHUTDOWN_FUNCTION(castportal);
 
 /* Obtain the module context for the extension instance */
 #if COMPILE_DL_CASTPORTAL
@@ -28,6 +32,24 @@ static const zend_function_entry cptl_functions[] = {
     PHP_FE(cptl_device_ping, NULL)
     PHP_FE(cptl_device_close, NULL)
     PHP_FE(cptl_app_available, NULL)
+    PHP_FE(cptl_channel_open, NULL)
+    PHP_FE(cptl_channel_send, NULL)
+    PHP_FE(cptl_channel_receive, NULL)
+    PHP_FE(cptl_channel_close, NULL)
+    PHP_FE(cptl_app_availability, NULL)
+    PHP_FE(cptl_app_available_many, NULL)
+    PHP_FE(cptl_ping_many, NULL)
+    PHP_FE(cptl_broadcast, NULL)
+    PHP_FE(cptl_receiver_status, NULL)
+    PHP_FE(cptl_app_launch, NULL)
+    PHP_FE(cptl_device_open, NULL)
+    PHP_FE(cptl_media_queue_load, NULL)
+    PHP_FE(cptl_media_queue_insert, NULL)
+    PHP_FE(cptl_stats, NULL)
+    PHP_FE(cptl_stats_global, NULL)
+    PHP_FE(cptl_capture, NULL)
+    PHP_FE(cptl_capture_export, NULL)
+    PHP_FE(cptl_alloc_profile, NULL)
     PHP_FE_END
 };
 
@@ -46,21 +68,67 @@ zend_module_entry castportal_module_entry = {
 #if ZEND_MODULE_API_NO >= 20010901
     CPTL_EXTENSION_VERSION,
 #endif
-    STANDARD_MODULE_PROPERTIES
+    PHP_MODULE_GLOBALS(castportal),
+    PHP_GINIT(castportal),
+    PHP_GSHUTDOWN(castportal),
+    NULL,
+    STANDARD_MODULE_PROPERTIES_EX
 };
 
 /* Declarations for global ini variables for the extension */
 PHP_INI_BEGIN()
     /* Note: this default is the Cast application id for 'portal' */
     STD_PHP_INI_ENTRY("castportal.application_id", "02834648", PHP_INI_SYSTEM,
-                      OnUpdateString, applicationId, zend_castportal_globals,
-                      castportal_globals)
+                      OnUpdateString, core.config.applicationId,
+                      zend_castportal_globals, castportal_globals)
     STD_PHP_INI_ENTRY("castportal.discovery_timeout", "5000", PHP_INI_SYSTEM,
-                      OnUpdateLong, discoveryTimeout, zend_castportal_globals,
-                      castportal_globals)
+                      OnUpdateLong, core.config.discoveryTimeout,
+                      zend_castportal_globals, castportal_globals)
     STD_PHP_INI_ENTRY("castportal.message_timeout", "500", PHP_INI_SYSTEM,
-                      OnUpdateLong, messageTimeout, zend_castportal_globals,
-                      castportal_globals)
+                      OnUpdateLong, core.config.messageTimeout,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.status_cache_ttl", "10000", PHP_INI_SYSTEM,
+                      OnUpdateLong, core.config.statusCacheTtl,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.launch_timeout", "10000", PHP_INI_SYSTEM,
+                      OnUpdateLong, core.config.launchTimeout,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.media_preload_time", "10", PHP_INI_SYSTEM,
+                      OnUpdateLong, core.config.mediaPreloadTime,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.auth_root_store", "", PHP_INI_SYSTEM,
+                      OnUpdateString, core.config.authRootStore,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.auth_cache_ttl", "3600", PHP_INI_SYSTEM,
+                      OnUpdateLong, core.config.authCacheTtl,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.metrics_file", "", PHP_INI_SYSTEM,
+                      OnUpdateString, core.config.metricsFile,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.metrics_slots", "128", PHP_INI_SYSTEM,
+                      OnUpdateLong, core.config.metricsSlots,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.capture_frames", "0", PHP_INI_ALL,
+                      OnUpdateLong, core.config.captureFrames,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.capture_snaplen", "512", PHP_INI_ALL,
+                      OnUpdateLong, core.config.captureSnapLen,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.trace_file", "", PHP_INI_SYSTEM,
+                      OnUpdateString, core.config.traceFile,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.slow_op_ms", "0", PHP_INI_ALL,
+                      OnUpdateLong, core.config.slowOpMs,
+                      zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_BOOLEAN("castportal.alloc_profile", "0", PHP_INI_SYSTEM,
+                        OnUpdateBool, core.config.allocProfile,
+                        zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_BOOLEAN("castportal.json_arena", "1", PHP_INI_ALL,
+                        OnUpdateBool, core.config.jsonArena,
+                        zend_castportal_globals, castportal_globals)
+    STD_PHP_INI_ENTRY("castportal.idle_slim_ms", "0", PHP_INI_ALL,
+                      OnUpdateLong, core.config.idleSlimMs,
+                      zend_castportal_globals, castportal_globals)
 PHP_INI_END()
 
 /* Tracking and destructor for the Cast connection resource object */
@@ -76,6 +144,52 @@ static ZEND_RSRC_DTOR_FUNC(castptl_devconn_dtor) {
     if (conn != NULL) castDeviceClose(conn);
 }
 
+/* Core hooks, request allocations and messages are handled by the engine */
+static void *phpAlloc(size_t size) {
+    return emalloc(size);
+}
+
+static void *phpCalloc(size_t count, size_t size) {
+    return ecalloc(count, size);
+}
+
+static void *phpRealloc(void *ptr, size_t size) {
+    return erealloc(ptr, size);
+}
+
+static void phpFree(void *ptr) {
+    efree(ptr);
+}
+
+static const CastCoreAllocator phpAllocator = {
+    phpAlloc, phpCalloc, phpRealloc, phpFree
+};
+
+/* Warnings are for the current function, info is for the error log */
+static void phpLogger(int level, const char *msg) {
+    TSRMLS_FETCH();
+
+    if (level == CPTL_LOG_WARNING) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s", msg);
+    } else {
+        php_log_err((char *) msg TSRMLS_CC);
+    }
+}
+
+/* Test mode: 0 - normal, 1 - simulate, 2 - invalid (zeroed like the rest) */
+static PHP_GINIT_FUNCTION(castportal) {
+#if (PHP_MAJOR_VERSION >= 7) && defined(ZTS) && defined(COMPILE_DL_CASTPORTAL)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+    (void) memset(castportal_globals, 0, sizeof(zend_castportal_globals));
+}
+
+static PHP_GSHUTDOWN_FUNCTION(castportal) {
+    castCoreBind(&(castportal_globals->core));
+    castAllocProfileCleanup();
+    castCoreBind(NULL);
+}
+
 PHP_MINIT_FUNCTION(castportal) {
     REGISTER_INI_ENTRIES();
 
@@ -84,10 +198,9 @@ PHP_MINIT_FUNCTION(castportal) {
     REGISTER_LONG_CONSTANT("CPTL_INET6", 2, CONST_CS | CONST_PERSISTENT);
     REGISTER_LONG_CONSTANT("CPTL_INET_ALL", 3, CONST_CS | CONST_PERSISTENT);
 
-    /* Initialize OpenSSL resources */
-    SSL_load_error_strings();
-    SSL_library_init();
-    OpenSSL_add_all_algorithms();
+    /* Shared (process-wide) elements are set up before any request threads */
+    castCoreBind(&CPTL_G(core));
+    if (castCoreStartup(&phpAllocator, phpLogger) < 0) return FAILURE;
 
     /* Track the connection resources */
     castptl_devconn_resid =
@@ -100,26 +213,333 @@ PHP_MINIT_FUNCTION(castportal) {
 PHP_MSHUTDOWN_FUNCTION(castportal) {
     UNREGISTER_INI_ENTRIES();
 
+    castCoreShutdown();
+
     return SUCCESS;
 }
 
 PHP_RINIT_FUNCTION(castportal) {
+#if (PHP_MAJOR_VERSION >= 7) && defined(ZTS) && defined(COMPILE_DL_CASTPORTAL)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+    castCoreBind(&CPTL_G(core));
+    castCoreRequestBegin();
     return SUCCESS;
 }
 PHP_RSHUTDOWN_FUNCTION(castportal) {
+    castCoreRequestEnd();
     return SUCCESS;
 }
 
-PHP_MINFO_FUNCTION(castportal) {}
+PHP_MINFO_FUNCTION(castportal) {
+    char label[128], value[32];
+    const char *name;
+    int idx;
+
+    php_info_print_table_start();
+    php_info_print_table_header(2, "Cast Portal support", "enabled");
+    php_info_print_table_row(2, "Version", CPTL_EXTENSION_VERSION);
+    php_info_print_table_end();
+
+    /* Process statistics, frame counters are labelled by namespace */
+    php_info_print_table_start();
+    php_info_print_table_header(2, "Statistic", "Value");
+    for (idx = 0; idx < STAT_COUNT; idx++) {
+        if ((name = castStatName(idx)) != NULL) {
+            (void) snprintf(label, sizeof(label), "%s", name);
+        } else {
+            name = castNamespaceName((CastNamespace)
+                                   ((idx - STAT_FRAMES_IN) % (NS_COUNT + 1)));
+            (void) snprintf(label, sizeof(label), "%s %s",
+                            (idx < STAT_FRAMES_OUT) ? "frames_in" :
+                                                      "frames_out",
+                            (name != NULL) ? name : "unknown");
+        }
+        (void) snprintf(value, sizeof(value), "%lld",
+                        (long long) castStatValue(idx));
+        php_info_print_table_row(2, label, value);
+    }
+    php_info_print_table_end();
+}
+
+/* Device connection collected from an array argument, retaining the key */
+typedef struct {
+    CastDeviceConnection *conn;
+    int primary;
+#if PHP_MAJOR_VERSION < 7
+    char *strKey;
+    uint strKeyLen;
+    ulong numKey;
+#else
+    zend_string *strKey;
+    zend_ulong numKey;
+#endif
+} ConnArrayEntry;
+
+/*
+ * Extract the connection set from an array, entries are NULL if invalid.  A
+ * connection repeated in the array is only collected for the first entry
+ * (primary), the repeats share its result (concurrent requests on the same
+ * connection would consume each other's responses).
+ */
+static ConnArrayEntry *collectConnections(zval *zvConns, int *count TSRMLS_DC) {
+    HashTable *table = Z_ARRVAL_P(zvConns);
+    ConnArrayEntry *entries;
+    zval *zvConn;
+#if PHP_MAJOR_VERSION < 7
+    HashPosition pos;
+    zval **zvEntry;
+#endif
+    int idx = 0, dupIdx;
+
+    *count = zend_hash_num_elements(table);
+    entries = (ConnArrayEntry *) ecalloc(*count + 1, sizeof(ConnArrayEntry));
+#if PHP_MAJOR_VERSION < 7
+    for (zend_hash_internal_pointer_reset_ex(table, &pos);
+         zend_hash_get_current_data_ex(table, (void **) &zvEntry,
+                                       &pos) == SUCCESS;
+         zend_hash_move_forward_ex(table, &pos)) {
+        zvConn = *zvEntry;
+        if (zend_hash_get_current_key_ex(table, &(entries[idx].strKey),
+                                         &(entries[idx].strKeyLen),
+                                         &(entries[idx].numKey), 0,
+                                         &pos) != HASH_KEY_IS_STRING) {
+            entries[idx].strKey = NULL;
+        }
+        if (Z_TYPE_P(zvConn) == IS_RESOURCE) {
+            entries[idx].conn = (CastDeviceConnection *)
+                        zend_fetch_resource(&zvConn TSRMLS_CC, -1,
+                                            PHP_CASTPTL_DEVCONN_RESNAME, NULL,
+                                            1, castptl_devconn_resid);
+        }
+        idx++;
+    }
+#else
+    ZEND_HASH_FOREACH_KEY_VAL(table, entries[idx].numKey,
+                              entries[idx].strKey, zvConn) {
+        if (Z_TYPE_P(zvConn) == IS_RESOURCE) {
+            entries[idx].conn = (CastDeviceConnection *)
+                        zend_fetch_resource(Z_RES_P(zvConn),
+                                            PHP_CASTPTL_DEVCONN_RESNAME,
+                                            castptl_devconn_resid);
+        }
+        idx++;
+    } ZEND_HASH_FOREACH_END();
+#endif
+
+    for (idx = 0; idx < *count; idx++) {
+        entries[idx].primary = idx;
+        if (entries[idx].conn == NULL) continue;
+        for (dupIdx = 0; dupIdx < idx; dupIdx++) {
+            if (entries[dupIdx].conn == entries[idx].conn) {
+                entries[idx].primary = dupIdx;
+                entries[idx].conn = NULL;
+                break;
+            }
+        }
+    }
+
+    return entries;
+}
+
+/* Store a per-connection result, using the key from the original array */
+static void addConnectionResult(zval *zvResults, ConnArrayEntry *entry,
+                                zval *zvResult) {
+#if PHP_MAJOR_VERSION < 7
+    if (entry->strKey != NULL) {
+        add_assoc_zval_ex(zvResults, entry->strKey, entry->strKeyLen,
+                          zvResult);
+    } else {
+        add_index_zval(zvResults, entry->numKey, zvResult);
+    }
+#else
+    if (entry->strKey != NULL) {
+        add_assoc_zval_ex(zvResults, ZSTR_VAL(entry->strKey),
+                          ZSTR_LEN(entry->strKey), zvResult);
+    } else {
+        add_index_zval(zvResults, entry->numKey, zvResult);
+    }
+#endif
+}
+
+/* Extract a set of strings from an array (NULL and warning if invalid) */
+static char **collectStrings(zval *zvStrings, int *count TSRMLS_DC) {
+    HashTable *table = Z_ARRVAL_P(zvStrings);
+    zval *zvString;
+#if PHP_MAJOR_VERSION < 7
+    HashPosition pos;
+    zval **zvEntry;
+#endif
+    char **retval;
+    int idx = 0;
+
+    *count = zend_hash_num_elements(table);
+    retval = (char **) emalloc((*count + 1) * sizeof(char *));
+#if PHP_MAJOR_VERSION < 7
+    for (zend_hash_internal_pointer_reset_ex(table, &pos);
+         zend_hash_get_current_data_ex(table, (void **) &zvEntry,
+                                       &pos) == SUCCESS;
+         zend_hash_move_forward_ex(table, &pos)) {
+        zvString = *zvEntry;
+#else
+    ZEND_HASH_FOREACH_VAL(table, zvString) {
+#endif
+        if (Z_TYPE_P(zvString) != IS_STRING) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                             "Array elements must be strings");
+            efree(retval);
+            return NULL;
+        }
+        retval[idx++] = Z_STRVAL_P(zvString);
+#if PHP_MAJOR_VERSION < 7
+    }
+#else
+    } ZEND_HASH_FOREACH_END();
+#endif
+
+    return retval;
+}
+
+/* Populate an (initialized) array with an application availability map */
+static void addAvailability(zval *target, CastAppAvailability *results,
+                            int count) {
+    int idx;
+
+    for (idx = 0; idx < count; idx++) {
+        if (results[idx].status[0] == '\0') {
+            add_assoc_null(target, results[idx].appId);
+        } else {
+#if PHP_MAJOR_VERSION < 7
+            add_assoc_string(target, results[idx].appId,
+                             results[idx].status, 1);
+#else
+            add_assoc_string(target, results[idx].appId,
+                             results[idx].status);
+#endif
+        }
+    }
+}
+
+/* Populate an (initialized) array with the receiver status details */
+static void addReceiverStatus(zval *target, CastReceiverStatus *rcvrStatus) {
+    add_assoc_bool(target, "running", rcvrStatus->isAppRunning);
+#if PHP_MAJOR_VERSION < 7
+    add_assoc_string(target, "appId", rcvrStatus->appId, 1);
+    add_assoc_string(target, "displayName", rcvrStatus->displayName, 1);
+    add_assoc_string(target, "sessionId", rcvrStatus->sessionId, 1);
+    add_assoc_string(target, "transportId", rcvrStatus->transportId, 1);
+    add_assoc_string(target, "statusText", rcvrStatus->statusText, 1);
+#else
+    add_assoc_string(target, "appId", rcvrStatus->appId);
+    add_assoc_string(target, "displayName", rcvrStatus->displayName);
+    add_assoc_string(target, "sessionId", rcvrStatus->sessionId);
+    add_assoc_string(target, "transportId", rcvrStatus->transportId);
+    add_assoc_string(target, "statusText", rcvrStatus->statusText);
+#endif
+    add_assoc_double(target, "volume", rcvrStatus->volumeLevel);
+    add_assoc_bool(target, "muted", rcvrStatus->isMuted);
+    add_assoc_double(target, "age",
+                     (castTimeUsec() - rcvrStatus->updateTime) / 1000.0);
+}
+
+/* Locate an entry in an options array (NULL if not present) */
+static zval *optionEntry(zval *zvOpts, char *key) {
+#if PHP_MAJOR_VERSION < 7
+    zval **zvEntry;
+
+    if (zend_hash_find(Z_ARRVAL_P(zvOpts), key, strlen(key) + 1,
+                       (void **) &zvEntry) != SUCCESS) return NULL;
+    return *zvEntry;
+#else
+    return zend_hash_str_find(Z_ARRVAL_P(zvOpts), key, strlen(key));
+#endif
+}
+
+/* Extract the media item definitions from an array (NULL if invalid) */
+static CastMediaItem *collectMediaItems(zval *zvItems, int *count TSRMLS_DC) {
+    HashTable *table = Z_ARRVAL_P(zvItems);
+    zval *zvItem, *zvOpt;
+#if PHP_MAJOR_VERSION < 7
+    HashPosition pos;
+    zval **zvEntry;
+#endif
+    CastMediaItem *retval, *item;
+
+    *count = zend_hash_num_elements(table);
+    retval = (CastMediaItem *) emalloc((*count + 1) * sizeof(CastMediaItem));
+    item = retval;
+#if PHP_MAJOR_VERSION < 7
+    for (zend_hash_internal_pointer_reset_ex(table, &pos);
+         zend_hash_get_current_data_ex(table, (void **) &zvEntry,
+                                       &pos) == SUCCESS;
+         zend_hash_move_forward_ex(table, &pos)) {
+        zvItem = *zvEntry;
+#else
+    ZEND_HASH_FOREACH_VAL(table, zvItem) {
+#endif
+        if (Z_TYPE_P(zvItem) != IS_ARRAY) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                             "Media items must be arrays");
+            efree(retval);
+            return NULL;
+        }
+        (void) memset(item, 0, sizeof(CastMediaItem));
+        item->preloadTime = CPTL_CFG(mediaPreloadTime);
+        if (((zvOpt = optionEntry(zvItem, "contentId")) != NULL) &&
+                (Z_TYPE_P(zvOpt) == IS_STRING)) {
+            item->contentId = Z_STRVAL_P(zvOpt);
+        }
+        if (((zvOpt = optionEntry(zvItem, "contentType")) != NULL) &&
+                (Z_TYPE_P(zvOpt) == IS_STRING)) {
+            item->contentType = Z_STRVAL_P(zvOpt);
+        }
+        if (((zvOpt = optionEntry(zvItem, "preloadTime")) != NULL) &&
+                (Z_TYPE_P(zvOpt) == IS_LONG)) {
+            item->preloadTime = Z_LVAL_P(zvOpt);
+        }
+        if ((zvOpt = optionEntry(zvItem, "playbackDuration")) != NULL) {
+            if (Z_TYPE_P(zvOpt) == IS_LONG) {
+                item->playbackDuration = Z_LVAL_P(zvOpt);
+            } else if (Z_TYPE_P(zvOpt) == IS_DOUBLE) {
+                item->playbackDuration = Z_DVAL_P(zvOpt);
+            }
+        }
+        item++;
+#if PHP_MAJOR_VERSION < 7
+    }
+#else
+    } ZEND_HASH_FOREACH_END();
+#endif
+
+    return retval;
+}
 
 /**
  * Control method to enable various test processing models.
  *
  * @param mode Mode argument for test control.
+ * @param authPeerCert Optional (DER) TLS certificate of the simulated device
+ *                     for cptl_device_auth(), null to clear.
+ * @param authResponse The DeviceAuthMessage response of the simulated device
+ *                     to the (fixed nonce) challenge.
  */
 PHP_FUNCTION(cptl_testctl) {
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l",
-                              &_cptl_tstmode) != SUCCESS) return;
+    char *authPeerCert = NULL, *authResponse = NULL;
+#if PHP_MAJOR_VERSION < 7
+    int authPeerCertLen = 0, authResponseLen = 0;
+#else
+    size_t authPeerCertLen = 0, authResponseLen = 0;
+#endif
+    long mode;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|s!s!", &mode,
+                              &authPeerCert, &authPeerCertLen,
+                              &authResponse, &authResponseLen) != SUCCESS) {
+        return;
+    }
+    CPTL_CTX(testMode) = mode;
+    if (castAuthSetTestData(authPeerCert, authPeerCertLen, authResponse,
+                            authResponseLen) < 0) RETURN_FALSE;
     RETURN_TRUE;
 }
 
@@ -147,7 +567,9 @@ PHP_FUNCTION(cptl_discover) {
                               &ipMode, &timeout) != SUCCESS) return;
 
     /* Execute the discovery process */
+    castSlowOpBegin("cptl_discover", NULL, 0);
     info = castDiscover(ipMode, timeout);
+    castSlowOpEnd(TRUE);
 
     /* And convert it to a hash array for data return */
     array_init(return_value);
@@ -197,7 +619,9 @@ PHP_FUNCTION(cptl_device_connect) {
 
     /* Hand off to the device authentication method */
     /* Note that this assumes no monkey business with the string content */
+    castSlowOpBegin("cptl_device_connect", ipAddr, port);
     conn = castDeviceConnect(ipAddr, port);
+    castSlowOpEnd((conn != NULL) ? TRUE : FALSE);
     if (conn == NULL) {
         zend_throw_exception(zend_exception_get_default(TSRMLS_C),
                              "Unable to obtain/authenticate cast connection",
@@ -213,6 +637,134 @@ PHP_FUNCTION(cptl_device_connect) {
 #endif
 }
 
+/**
+ * Execute a cast connection along with the initial application exchanges
+ * (CONNECT, application availability and optionally the receiver status), all
+ * issued in a single write with the responses collected together.
+ *
+ * @param devAddr Network address (typically from discovery) of the cast
+ *                device to connect to.
+ * @param port Connection port as discovered - optional, defaults to 8009.
+ * @param opts Optional array of settings - 'appIds' (array of application
+ *             identifiers to query, defaults to the configured portal
+ *             application), 'status' (true to also obtain the receiver status)
+ *             and 'timeout' (milliseconds to wait for the responses, defaults
+ *             to the system message timeout).
+ * @return Array of the device 'connection' resource, the 'availability' map
+ *         (as per cptl_app_availability) and the receiver 'status' (as per
+ *         cptl_receiver_status, if requested).
+ */
+PHP_FUNCTION(cptl_device_open) {
+    zval *zvOpts = NULL, *zvOpt, *zvAppIds = NULL;
+    CastAppAvailability *results;
+    CastDeviceConnection *conn;
+    int idx, appCount, withStatus = FALSE;
+#if PHP_MAJOR_VERSION < 7
+    int ipAddrLen;
+#else
+    size_t ipAddrLen;
+#endif
+    long port = 8009, timeout = 0;
+    char **appIds;
+    char* ipAddr;
+#if PHP_MAJOR_VERSION < 7
+    zval *zvConn, *zvAvail, *zvStatus;
+#else
+    zval zvConnData, zvAvailData, zvStatusData;
+    zval *zvConn = &zvConnData, *zvAvail = &zvAvailData;
+    zval *zvStatus = &zvStatusData;
+#endif
+
+    /* Read the argument set for the function */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|la!", &ipAddr,
+                              &ipAddrLen, &port, &zvOpts) != SUCCESS) return;
+
+    /* Unpack the options */
+    if (zvOpts != NULL) {
+        if ((zvOpt = optionEntry(zvOpts, "appIds")) != NULL) {
+            if (Z_TYPE_P(zvOpt) != IS_ARRAY) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                                 "Option 'appIds' must be an array");
+                RETURN_FALSE;
+            }
+            zvAppIds = zvOpt;
+        }
+        if ((zvOpt = optionEntry(zvOpts, "status")) != NULL) {
+            withStatus = zend_is_true(zvOpt);
+        }
+        if ((zvOpt = optionEntry(zvOpts, "timeout")) != NULL) {
+            if (Z_TYPE_P(zvOpt) != IS_LONG) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                                 "Option 'timeout' must be an integer");
+                RETURN_FALSE;
+            }
+            timeout = Z_LVAL_P(zvOpt);
+        }
+    }
+    if (timeout <= 0) timeout = CPTL_CFG(messageTimeout);
+
+    /* Applications default to the configured portal */
+    if (zvAppIds != NULL) {
+        if ((appIds = collectStrings(zvAppIds, &appCount TSRMLS_CC)) == NULL) {
+            RETURN_FALSE;
+        }
+        if (appCount == 0) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                             "No application identifiers provided");
+            efree(appIds);
+            RETURN_FALSE;
+        }
+    } else {
+        appIds = (char **) emalloc(sizeof(char *));
+        appIds[0] = CPTL_CFG(applicationId);
+        appCount = 1;
+    }
+    results = (CastAppAvailability *) emalloc(appCount *
+                                              sizeof(CastAppAvailability));
+    for (idx = 0; idx < appCount; idx++) results[idx].appId = appIds[idx];
+    efree(appIds);
+
+    /* Note that this assumes no monkey business with the string content */
+    castSlowOpBegin("cptl_device_open", ipAddr, port);
+    conn = castDeviceOpen(ipAddr, port, results, appCount, withStatus,
+                          (int32_t) timeout);
+    castSlowOpEnd((conn != NULL) ? TRUE : FALSE);
+    if (conn == NULL) {
+        efree(results);
+        zend_throw_exception(zend_exception_get_default(TSRMLS_C),
+                             "Unable to open cast device connection",
+                             0 TSRMLS_CC);
+        RETURN_FALSE;
+    }
+
+    /* Connection is tracked as a resource, alongside the exchange results */
+    array_init(return_value);
+#if PHP_MAJOR_VERSION < 7
+    ALLOC_INIT_ZVAL(zvConn);
+    ZEND_REGISTER_RESOURCE(zvConn, conn, castptl_devconn_resid);
+    ALLOC_INIT_ZVAL(zvAvail);
+#else
+    ZVAL_RES(zvConn, zend_register_resource(conn, castptl_devconn_resid));
+    ZVAL_NULL(zvAvail);
+#endif
+    add_assoc_zval(return_value, "connection", zvConn);
+    array_init(zvAvail);
+    addAvailability(zvAvail, results, appCount);
+    add_assoc_zval(return_value, "availability", zvAvail);
+    efree(results);
+
+    if ((withStatus) && (conn->receiverStatus != NULL)) {
+#if PHP_MAJOR_VERSION < 7
+        ALLOC_INIT_ZVAL(zvStatus);
+#else
+        ZVAL_NULL(zvStatus);
+#endif
+        array_init(zvStatus);
+        addReceiverStatus(zvStatus, conn->receiverStatus);
+        add_assoc_zval(return_value, "status", zvStatus);
+    }
+}
+
 /**
  * Authenticate that the device on the other side of the connection is a valid
  * Google chromecast device (through private signatures).
@@ -264,6 +816,7 @@ PHP_FUNCTION(cptl_device_auth) {
 PHP_FUNCTION(cptl_device_ping) {
     CastDeviceConnection *conn;
     zval *zvRes = NULL;
+    int rc;
 
     /* Access the resource for the associated connection */
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "r",
@@ -282,7 +835,10 @@ PHP_FUNCTION(cptl_device_ping) {
     }
 
     /* And perform the ping operation */
-    if (castDevicePing(conn) < 0) {
+    castSlowOpBegin("cptl_device_ping", conn->devAddr, 0);
+    rc = castDevicePing(conn);
+    castSlowOpEnd((rc < 0) ? FALSE : TRUE);
+    if (rc < 0) {
         php_error_docref(NULL TSRMLS_CC, E_WARNING,
                          "Failed to ping remote cast device");
 #if PHP_MAJOR_VERSION < 7
@@ -343,6 +899,7 @@ PHP_FUNCTION(cptl_device_close) {
 PHP_FUNCTION(cptl_app_available) {
     CastDeviceConnection *conn;
     zval *zvRes = NULL;
+    int rc;
 
     /* Access the resource for the associated connection */
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "r",
@@ -361,9 +918,1091 @@ PHP_FUNCTION(cptl_app_available) {
     }
 
     /* And check for the availability of the application */
-    if (castAppCheckAvailability(conn) < 0) {
+    castSlowOpBegin("cptl_app_available", conn->devAddr, 0);
+    rc = castAppCheckAvailability(conn);
+    castSlowOpEnd((rc < 0) ? FALSE : TRUE);
+    if (rc < 0) {
+        RETURN_FALSE;
+    } else {
+        RETURN_TRUE;
+    }
+}
+
+/**
+ * Open a virtual channel between the indicated endpoints, multiplexed across
+ * the device connection.  Multiple channels (with distinct source ids) can
+ * share the single device connection.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id for the channel.
+ * @param destinationId The remote (receiver) endpoint id for the channel,
+ *                      e.g. receiver-0 or an application transport id.
+ * @return True if the channel was opened (or already open to the destination),
+ *         false on failure (logged).
+ */
+PHP_FUNCTION(cptl_channel_open) {
+    char *sourceId, *destinationId;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen, destinationIdLen;
+#else
+    size_t sourceIdLen, destinationIdLen;
+#endif
+    CastDeviceConnection *conn;
+    zval *zvRes = NULL;
+
+    /* Access the resource for the associated connection and endpoints */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rss", &zvRes,
+                              &sourceId, &sourceIdLen, &destinationId,
+                              &destinationIdLen) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if (castChannelOpen(conn, sourceId, destinationId) == NULL) {
+        RETURN_FALSE;
+    } else {
+        RETURN_TRUE;
+    }
+}
+
+/**
+ * Issue a (string) message across a previously opened virtual channel.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id of the channel.
+ * @param namespace The full namespace string for the message.
+ * @param payload The string (typically JSON) content of the message.
+ * @return True if the message was sent, false on failure (logged).
+ */
+PHP_FUNCTION(cptl_channel_send) {
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen, namespaceLen, payloadLen;
+#else
+    size_t sourceIdLen, namespaceLen, payloadLen;
+#endif
+    char *sourceId, *namespace, *payload;
+    CastDeviceConnection *conn;
+    CastChannel *channel;
+    zval *zvRes = NULL;
+
+    /* Access the resource for the associated connection and message details */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rsss", &zvRes,
+                              &sourceId, &sourceIdLen, &namespace,
+                              &namespaceLen, &payload,
+                              &payloadLen) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((channel = castChannelFind(conn, sourceId)) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "No open channel for source id '%s'", sourceId);
+        RETURN_FALSE;
+    }
+    if (castSendFrame(conn, channel->sourceId, channel->destinationId,
+                      namespace, payload, -1) < 0) {
         RETURN_FALSE;
     } else {
         RETURN_TRUE;
     }
 }
+
+/* Callback to extract the raw content of a channel message (copied) */
+static void *extractChannelContent(CastDeviceConnection *conn, void *content,
+                                   size_t contentLen) {
+    WXBuffer *retval;
+
+    retval = (WXBuffer *) WXMalloc(sizeof(WXBuffer));
+    if (retval == NULL) return CPTL_RESP_ERROR;
+    if (WXBuffer_Init(retval, contentLen + 1) == NULL) {
+        WXFree(retval);
+        return CPTL_RESP_ERROR;
+    }
+    (void) WXBuffer_Append(retval, content, contentLen, TRUE);
+
+    return retval;
+}
+
+/**
+ * Receive the next message routed to a previously opened virtual channel,
+ * waiting up to the configured message timeout.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id of the channel.
+ * @param namespace Optional full namespace string to filter messages against.
+ * @return The (raw) content of the message or false on timeout/failure
+ *         (logged).
+ */
+PHP_FUNCTION(cptl_channel_receive) {
+    char *sourceId, *namespace = NULL;
+    int simulated;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen, namespaceLen = 0;
+#else
+    size_t sourceIdLen, namespaceLen = 0;
+#endif
+    WXBuffer *content, simFrames;
+    CastDeviceConnection *conn;
+    CastMessageFilter filter;
+    CastChannel *channel;
+    zval *zvRes = NULL;
+
+    /* Access the resource for the associated connection and filter details */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rs|s", &zvRes,
+                              &sourceId, &sourceIdLen, &namespace,
+                              &namespaceLen) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((channel = castChannelFind(conn, sourceId)) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "No open channel for source id '%s'", sourceId);
+        RETURN_FALSE;
+    }
+
+    /* Any content type, passed through as-is */
+    (void) memset(&filter, 0, sizeof(filter));
+    filter.channel = channel;
+    filter.namespace = NS_ANY;
+    filter.namespaceName = namespace;
+    filter.expJsonResponse = -1;
+    filter.rawContent = TRUE;
+    filter.responseCallback = extractChannelContent;
+
+    /* Test mode connections get (interleaved) traffic for all channels */
+    simulated = ((CPTL_CTX(testMode) != 0) && (conn->ssl == NULL)) ?
+                                                        TRUE : FALSE;
+    if ((simulated) && (castChannelSimulate(conn, &simFrames) < 0)) {
+        RETURN_FALSE;
+    }
+    content = (WXBuffer *) castReceiveFiltered(conn, &filter);
+    if (simulated) {
+        CPTL_CTX(testResp) = NULL;
+        CPTL_CTX(testRespLen) = 0;
+        WXBuffer_Destroy(&simFrames);
+    }
+    if (content == NULL) {
+        RETURN_FALSE;
+    }
+
+#if PHP_MAJOR_VERSION < 7
+    RETVAL_STRINGL((char *) content->buffer, content->length, 1);
+#else
+    RETVAL_STRINGL((char *) content->buffer, content->length);
+#endif
+    WXBuffer_Destroy(content);
+    WXFree(content);
+}
+
+/**
+ * Close a previously opened virtual channel, discarding any unread messages
+ * for the channel.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id of the channel.
+ * @return True if the channel was closed, false if no such channel was open.
+ */
+PHP_FUNCTION(cptl_channel_close) {
+    CastDeviceConnection *conn;
+    CastChannel *channel;
+    zval *zvRes = NULL;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen;
+#else
+    size_t sourceIdLen;
+#endif
+    char *sourceId;
+
+    /* Access the resource for the associated connection and endpoint */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rs", &zvRes,
+                              &sourceId, &sourceIdLen) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((channel = castChannelFind(conn, sourceId)) == NULL) {
+        RETURN_FALSE;
+    }
+
+    castChannelClose(conn, channel);
+    RETURN_TRUE;
+}
+
+/**
+ * Query the availability of multiple application instances on the provided
+ * device, in a single request.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param appIds Array of application identifiers to query.
+ * @return Associative array of application identifier to availability status
+ *         (APP_AVAILABLE, APP_UNAVAILABLE or NULL if not reported by the
+ *         device) or false on any failure in the request (logged).
+ */
+PHP_FUNCTION(cptl_app_availability) {
+    CastAppAvailability *results;
+    zval *zvRes = NULL, *zvAppIds = NULL;
+    CastDeviceConnection *conn;
+    int idx, count;
+    char **appIds;
+
+    /* Access the resource for the associated connection and the app list */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ra",
+                              &zvRes, &zvAppIds) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    /* Collect the application identifiers (strings only) */
+    if ((appIds = collectStrings(zvAppIds, &count TSRMLS_CC)) == NULL) {
+        RETURN_FALSE;
+    }
+    if (count == 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "No application identifiers provided");
+        efree(appIds);
+        RETURN_FALSE;
+    }
+    results = (CastAppAvailability *) emalloc(count *
+                                              sizeof(CastAppAvailability));
+    for (idx = 0; idx < count; idx++) results[idx].appId = appIds[idx];
+    efree(appIds);
+
+    /* One request for the lot */
+    if (castAppQueryAvailability(conn, results, count) < 0) {
+        efree(results);
+        RETURN_FALSE;
+    }
+
+    array_init(return_value);
+    addAvailability(return_value, results, count);
+    efree(results);
+}
+
+/**
+ * Retrieve the current receiver status of the device.  The status is tracked
+ * from the status broadcasts of the device and answered locally if recent
+ * enough, otherwise it is requested from the device.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param maxAge Optional maximum age (in milliseconds) of a tracked status to
+ *               be returned, defaults to the system status cache ttl.  Zero
+ *               always requests the status from the device.
+ * @return Array of the status details ('running' flag for the configured
+ *         application, 'appId', 'displayName', 'sessionId', 'transportId' and
+ *         'statusText' of the running application, 'volume' level, 'muted'
+ *         flag and the 'age' of the status in milliseconds) or false on error
+ *         (logged).
+ */
+PHP_FUNCTION(cptl_receiver_status) {
+    CastReceiverStatus *rcvrStatus;
+    CastDeviceConnection *conn;
+    zval *zvRes = NULL;
+    long maxAge = 0;
+
+    /* Access the resource for the associated connection */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "r|l",
+                              &zvRes, &maxAge) != SUCCESS) return;
+    if (ZEND_NUM_ARGS() < 2) maxAge = CPTL_CFG(statusCacheTtl);
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((rcvrStatus = castAppReceiverStatus(conn, (int32_t) maxAge)) == NULL) {
+        RETURN_FALSE;
+    }
+
+    array_init(return_value);
+    addReceiverStatus(return_value, rcvrStatus);
+}
+
+/**
+ * Launch the configured (portal) application on the device, or join the
+ * already running session, and open a virtual channel to the application.
+ * The channel connect and the optional initial message are pipelined with
+ * the launch, issued as soon as the application transport is known.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id for the application channel.
+ * @param namespace Optional namespace string for the initial message.
+ * @param payload Optional string content of the initial message (required if
+ *                the namespace is provided).
+ * @param timeout Optional time period (in milliseconds) to wait for the launch
+ *                to complete, defaults to the system launch timeout.
+ * @return Array of the application 'sessionId', 'transportId' and 'reused'
+ *         flag (true if the running session was joined) or false on error
+ *         (logged).
+ */
+PHP_FUNCTION(cptl_app_launch) {
+    char *sourceId, *namespace = NULL, *payload = NULL;
+    int reused;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen, namespaceLen = 0, payloadLen = 0;
+#else
+    size_t sourceIdLen, namespaceLen = 0, payloadLen = 0;
+#endif
+    CastReceiverStatus *rcvrStatus;
+    CastDeviceConnection *conn;
+    zval *zvRes = NULL;
+    long timeout = 0;
+
+    /* Access the resource for the associated connection and launch details */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rs|s!s!l", &zvRes,
+                              &sourceId, &sourceIdLen, &namespace,
+                              &namespaceLen, &payload, &payloadLen,
+                              &timeout) != SUCCESS) return;
+    if (timeout <= 0) timeout = CPTL_CFG(launchTimeout);
+    if ((namespace != NULL) && (payload == NULL)) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "Missing payload for initial application message");
+        RETURN_FALSE;
+    }
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    rcvrStatus = castAppLaunch(conn, sourceId, namespace, payload,
+                               (int32_t) timeout, &reused);
+    if (rcvrStatus == NULL) {
+        RETURN_FALSE;
+    }
+
+    array_init(return_value);
+#if PHP_MAJOR_VERSION < 7
+    add_assoc_string(return_value, "sessionId", rcvrStatus->sessionId, 1);
+    add_assoc_string(return_value, "transportId", rcvrStatus->transportId, 1);
+#else
+    add_assoc_string(return_value, "sessionId", rcvrStatus->sessionId);
+    add_assoc_string(return_value, "transportId", rcvrStatus->transportId);
+#endif
+    add_assoc_bool(return_value, "reused", reused);
+}
+
+/**
+ * Load a queue of media items for playback by the application across the
+ * virtual channel (typically opened by cptl_app_launch).  Items are issued in
+ * a single request with preload hints, so the receiver buffers the following
+ * item ahead of time.
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id of the application channel.
+ * @param items Array of media items, each an array of 'contentId' and
+ *              'contentType' along with the optional 'preloadTime' (seconds,
+ *              defaults to the system media preload time, -1 for none) and
+ *              'playbackDuration' (seconds, e.g. for images).
+ * @param opts Optional array of settings - 'startIndex' (item to start with)
+ *             and 'repeat' (true to loop the queue).
+ * @return The media session identifier of the queue or false on failure
+ *         (logged).
+ */
+PHP_FUNCTION(cptl_media_queue_load) {
+    zval *zvRes = NULL, *zvItems = NULL, *zvOpts = NULL, *zvOpt;
+    int count, startIndex = 0, repeatAll = FALSE, rc;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen;
+#else
+    size_t sourceIdLen;
+#endif
+    CastDeviceConnection *conn;
+    int32_t mediaSessionId;
+    CastMediaItem *items;
+    CastChannel *channel;
+    char *sourceId;
+
+    /* Access the resource for the associated connection and queue details */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rsa|a!", &zvRes,
+                              &sourceId, &sourceIdLen, &zvItems,
+                              &zvOpts) != SUCCESS) return;
+    if (zvOpts != NULL) {
+        if (((zvOpt = optionEntry(zvOpts, "startIndex")) != NULL) &&
+                (Z_TYPE_P(zvOpt) == IS_LONG)) {
+            startIndex = Z_LVAL_P(zvOpt);
+        }
+        if ((zvOpt = optionEntry(zvOpts, "repeat")) != NULL) {
+            repeatAll = zend_is_true(zvOpt);
+        }
+    }
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((channel = castChannelFind(conn, sourceId)) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "No open channel for source id '%s'", sourceId);
+        RETURN_FALSE;
+    }
+    if ((items = collectMediaItems(zvItems, &count TSRMLS_CC)) == NULL) {
+        RETURN_FALSE;
+    }
+
+    rc = castMediaQueueLoad(conn, channel, items, count, startIndex,
+                            repeatAll, &mediaSessionId);
+    efree(items);
+    if (rc < 0) {
+        RETURN_FALSE;
+    }
+    RETURN_LONG(mediaSessionId);
+}
+
+/**
+ * Append media items to the queue of an active media session, without waiting
+ * for any response (no round trip per item).
+ *
+ * @param conn The device connection instance returned from cptl_device_connect.
+ * @param sourceId The local (sender) endpoint id of the application channel.
+ * @param mediaSessionId The media session identifier from the queue load.
+ * @param items Array of media items, as per cptl_media_queue_load.
+ * @return True if the insert was issued, false on failure (logged).
+ */
+PHP_FUNCTION(cptl_media_queue_insert) {
+    zval *zvRes = NULL, *zvItems = NULL;
+    CastDeviceConnection *conn;
+    int count, rc;
+#if PHP_MAJOR_VERSION < 7
+    int sourceIdLen;
+#else
+    size_t sourceIdLen;
+#endif
+    long mediaSessionId = 0;
+    CastMediaItem *items;
+    CastChannel *channel;
+    char *sourceId;
+
+    /* Access the resource for the associated connection and queue details */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rsla", &zvRes,
+                              &sourceId, &sourceIdLen, &mediaSessionId,
+                              &zvItems) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if ((channel = castChannelFind(conn, sourceId)) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "No open channel for source id '%s'", sourceId);
+        RETURN_FALSE;
+    }
+    if ((items = collectMediaItems(zvItems, &count TSRMLS_CC)) == NULL) {
+        RETURN_FALSE;
+    }
+
+    rc = castMediaQueueInsert(conn, channel, (int32_t) mediaSessionId, items,
+                              count);
+    efree(items);
+    if (rc < 0) {
+        RETURN_FALSE;
+    } else {
+        RETURN_TRUE;
+    }
+}
+
+/**
+ * Verify the availability of application instances across a set of devices
+ * concurrently, issuing all of the requests and then collecting the responses
+ * with a single overall timeout.
+ *
+ * @param conns Array of device connection instances from cptl_device_connect.
+ * @param appIds Optional array of application identifiers to query, defaults
+ *               to the configured portal application.
+ * @param timeout Optional overall time period (in milliseconds) to wait for
+ *                responses, defaults to the system message timeout.
+ * @return Array (using the keys of the connection array) of the device results,
+ *         either an array of the 'availability' map (as per
+ *         cptl_app_availability) and response 'latency' (milliseconds) or
+ *         false if the device did not respond.
+ */
+PHP_FUNCTION(cptl_app_available_many) {
+    zval *zvConns = NULL, *zvAppIds = NULL;
+    CastDeviceConnection **conns;
+    CastAppAvailability *results;
+    int idx, src, appIdx, connCount, appCount;
+    ConnArrayEntry *entries;
+    char **appIds = NULL;
+    int64_t *latencies;
+    long timeout = 0;
+#if PHP_MAJOR_VERSION < 7
+    zval *zvResult, *zvAvail;
+#else
+    zval zvResultData, zvAvailData;
+    zval *zvResult = &zvResultData, *zvAvail = &zvAvailData;
+#endif
+
+    /* Read the argument set for the function */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|a!l", &zvConns,
+                              &zvAppIds, &timeout) != SUCCESS) return;
+    if (timeout <= 0) timeout = CPTL_CFG(messageTimeout);
+
+    /* Applications default to the configured portal */
+    if (zvAppIds != NULL) {
+        if ((appIds = collectStrings(zvAppIds, &appCount TSRMLS_CC)) == NULL) {
+            RETURN_FALSE;
+        }
+        if (appCount == 0) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                             "No application identifiers provided");
+            efree(appIds);
+            RETURN_FALSE;
+        }
+    } else {
+        appIds = (char **) emalloc(sizeof(char *));
+        appIds[0] = CPTL_CFG(applicationId);
+        appCount = 1;
+    }
+
+    /* Build the request and result sets */
+    entries = collectConnections(zvConns, &connCount TSRMLS_CC);
+    conns = (CastDeviceConnection **) emalloc((connCount + 1) *
+                                              sizeof(CastDeviceConnection *));
+    results = (CastAppAvailability *) emalloc((connCount * appCount + 1) *
+                                              sizeof(CastAppAvailability));
+    latencies = (int64_t *) emalloc((connCount + 1) * sizeof(int64_t));
+    for (idx = 0; idx < connCount; idx++) {
+        conns[idx] = entries[idx].conn;
+        for (appIdx = 0; appIdx < appCount; appIdx++) {
+            results[idx * appCount + appIdx].appId = appIds[appIdx];
+        }
+    }
+
+    /* All in one go */
+    (void) castAppSweepAvailability(conns, connCount, results, appCount,
+                                    latencies, timeout);
+
+    array_init(return_value);
+    for (idx = 0; idx < connCount; idx++) {
+#if PHP_MAJOR_VERSION < 7
+        ALLOC_INIT_ZVAL(zvResult);
+#else
+        ZVAL_NULL(zvResult);
+#endif
+        src = entries[idx].primary;
+        if (latencies[src] < 0) {
+            ZVAL_FALSE(zvResult);
+            addConnectionResult(return_value, &(entries[idx]), zvResult);
+            continue;
+        }
+
+#if PHP_MAJOR_VERSION < 7
+        ALLOC_INIT_ZVAL(zvAvail);
+#else
+        ZVAL_NULL(zvAvail);
+#endif
+        array_init(zvAvail);
+        addAvailability(zvAvail, results + src * appCount, appCount);
+        array_init(zvResult);
+        add_assoc_zval(zvResult, "availability", zvAvail);
+        add_assoc_double(zvResult, "latency", latencies[src] / 1000.0);
+        addConnectionResult(return_value, &(entries[idx]), zvResult);
+    }
+
+    efree(latencies);
+    efree(results);
+    efree(conns);
+    efree(entries);
+    efree(appIds);
+}
+
+/**
+ * Exchange ping/heartbeat messages with a set of devices concurrently, issuing
+ * all of the pings and then collecting the responses with a single overall
+ * timeout.  Unlike cptl_device_ping, failed connections are not closed.
+ *
+ * @param conns Array of device connection instances from cptl_device_connect.
+ * @param timeout Optional overall time period (in milliseconds) to wait for
+ *                responses, defaults to the system message timeout.
+ * @return Array (using the keys of the connection array) of the round trip
+ *         time (in milliseconds) for each device or false if the device did
+ *         not respond.
+ */
+PHP_FUNCTION(cptl_ping_many) {
+    CastDeviceConnection **conns;
+    ConnArrayEntry *entries;
+    zval *zvConns = NULL;
+    int idx, src, connCount;
+    long timeout = 0;
+    int64_t *rtts;
+#if PHP_MAJOR_VERSION < 7
+    zval *zvResult;
+#else
+    zval zvResultData; zval *zvResult = &zvResultData;
+#endif
+
+    /* Read the argument set for the function */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|l", &zvConns,
+                              &timeout) != SUCCESS) return;
+    if (timeout <= 0) timeout = CPTL_CFG(messageTimeout);
+
+    entries = collectConnections(zvConns, &connCount TSRMLS_CC);
+    conns = (CastDeviceConnection **) emalloc((connCount + 1) *
+                                              sizeof(CastDeviceConnection *));
+    rtts = (int64_t *) emalloc((connCount + 1) * sizeof(int64_t));
+    for (idx = 0; idx < connCount; idx++) conns[idx] = entries[idx].conn;
+
+    (void) castDevicePingMany(conns, connCount, rtts, timeout);
+
+    array_init(return_value);
+    for (idx = 0; idx < connCount; idx++) {
+#if PHP_MAJOR_VERSION < 7
+        ALLOC_INIT_ZVAL(zvResult);
+#endif
+        src = entries[idx].primary;
+        if (rtts[src] < 0) {
+            ZVAL_FALSE(zvResult);
+        } else {
+            ZVAL_DOUBLE(zvResult, rtts[src] / 1000.0);
+        }
+        addConnectionResult(return_value, &(entries[idx]), zvResult);
+    }
+
+    efree(rtts);
+    efree(conns);
+    efree(entries);
+}
+
+/**
+ * Broadcast a message to the portal application across a set of devices.  The
+ * message is encoded once and written to all of the connections concurrently.
+ *
+ * @param conns Array of device connection instances from cptl_device_connect.
+ * @param namespace The full namespace string for the message.
+ * @param payload The string (typically JSON) content of the message.
+ * @param timeout Optional overall time period (in milliseconds) to wait for
+ *                the writes, defaults to the system message timeout.
+ * @return Array (using the keys of the connection array) of the outcome for
+ *         each device, true if the message was written, false otherwise.
+ */
+PHP_FUNCTION(cptl_broadcast) {
+    int idx, connCount;
+#if PHP_MAJOR_VERSION < 7
+    int namespaceLen, payloadLen;
+#else
+    size_t namespaceLen, payloadLen;
+#endif
+    CastDeviceConnection **conns;
+    char *namespace, *payload;
+    ConnArrayEntry *entries;
+    zval *zvConns = NULL;
+    long timeout = 0;
+    int *results;
+
+    /* Read the argument set for the function */
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ass|l", &zvConns,
+                              &namespace, &namespaceLen, &payload, &payloadLen,
+                              &timeout) != SUCCESS) return;
+    if (timeout <= 0) timeout = CPTL_CFG(messageTimeout);
+
+    entries = collectConnections(zvConns, &connCount TSRMLS_CC);
+    conns = (CastDeviceConnection **) emalloc((connCount + 1) *
+                                              sizeof(CastDeviceConnection *));
+    results = (int *) emalloc((connCount + 1) * sizeof(int));
+    for (idx = 0; idx < connCount; idx++) conns[idx] = entries[idx].conn;
+
+    (void) castBroadcastMessage(conns, connCount, namespace, payload, results,
+                                timeout);
+
+    array_init(return_value);
+    for (idx = 0; idx < connCount; idx++) {
+#if PHP_MAJOR_VERSION < 7
+        if (entries[idx].strKey != NULL) {
+            add_assoc_bool_ex(return_value, entries[idx].strKey,
+                              entries[idx].strKeyLen,
+                              results[entries[idx].primary]);
+        } else {
+            add_index_bool(return_value, entries[idx].numKey,
+                           results[entries[idx].primary]);
+        }
+#else
+        if (entries[idx].strKey != NULL) {
+            add_assoc_bool_ex(return_value, ZSTR_VAL(entries[idx].strKey),
+                              ZSTR_LEN(entries[idx].strKey),
+                              results[entries[idx].primary]);
+        } else {
+            add_index_bool(return_value, entries[idx].numKey,
+                           results[entries[idx].primary]);
+        }
+#endif
+    }
+
+    efree(results);
+    efree(conns);
+    efree(entries);
+}
+
+/* Populate the per-namespace frame counts, starting at the given counter */
+static void addFrameStats(zval *target, int base) {
+    const char *name;
+    int idx;
+
+    for (idx = 0; idx <= NS_COUNT; idx++) {
+        name = castNamespaceName((CastNamespace) idx);
+        add_assoc_long(target, (name != NULL) ? (char *) name : "unknown",
+                       (long) castStatValue(base + idx));
+    }
+}
+
+/**
+ * Retrieve the runtime statistics for the extension.  Note that these are
+ * process-wide (shared across threads for ZTS) and accumulate across requests
+ * for the lifetime of the process.
+ *
+ * @return Array of the counters by name, accumulated times are in
+ *         microseconds, 'frames_in' and 'frames_out' are arrays of frame
+ *         counts by namespace (with 'unknown' for unrecognized namespaces).
+ *         The 'connections' array is the exception, the 'open' and 'slim'
+ *         (idle, buffers released) counts and the 'bytes' held by the
+ *         connections currently open in the request.
+ */
+PHP_FUNCTION(cptl_stats) {
+#if PHP_MAJOR_VERSION < 7
+    zval *zvFramesIn, *zvFramesOut, *zvConns;
+#else
+    zval zvFramesInData, zvFramesOutData, zvConnsData;
+    zval *zvFramesIn = &zvFramesInData, *zvFramesOut = &zvFramesOutData;
+    zval *zvConns = &zvConnsData;
+#endif
+    long open = 0, slim = 0, bytes = 0;
+    CastDeviceConnection *conn;
+    int idx;
+
+    if (zend_parse_parameters_none() == FAILURE) return;
+
+    array_init(return_value);
+    for (idx = 0; idx < STAT_FRAMES_IN; idx++) {
+        add_assoc_long(return_value, (char *) castStatName(idx),
+                       (long) castStatValue(idx));
+    }
+
+#if PHP_MAJOR_VERSION < 7
+    ALLOC_INIT_ZVAL(zvFramesIn);
+    ALLOC_INIT_ZVAL(zvFramesOut);
+#else
+    ZVAL_NULL(zvFramesIn);
+    ZVAL_NULL(zvFramesOut);
+#endif
+    array_init(zvFramesIn);
+    addFrameStats(zvFramesIn, STAT_FRAMES_IN);
+    add_assoc_zval(return_value, "frames_in", zvFramesIn);
+    array_init(zvFramesOut);
+    addFrameStats(zvFramesOut, STAT_FRAMES_OUT);
+    add_assoc_zval(return_value, "frames_out", zvFramesOut);
+
+    /* Connection pool (of this request) memory accounting */
+    for (conn = (CastDeviceConnection *) CPTL_CTX(connections); conn != NULL;
+                                                  conn = conn->poolNext) {
+        open++;
+        if (conn->isSlim) slim++;
+        bytes += (long) castDeviceMemory(conn);
+    }
+#if PHP_MAJOR_VERSION < 7
+    ALLOC_INIT_ZVAL(zvConns);
+#else
+    ZVAL_NULL(zvConns);
+#endif
+    array_init(zvConns);
+    add_assoc_long(zvConns, "open", open);
+    add_assoc_long(zvConns, "slim", slim);
+    add_assoc_long(zvConns, "bytes", bytes);
+    add_assoc_zval(return_value, "connections", zvConns);
+}
+
+/**
+ * Retrieve the runtime statistics aggregated across all of the worker
+ * processes sharing the metrics segment (castportal.metrics_file).
+ *
+ * @return The aggregated counters in the Prometheus text exposition format or
+ *         false if the metrics segment is not enabled (or on error).
+ */
+PHP_FUNCTION(cptl_stats_global) {
+    WXBuffer buffer;
+
+    if (zend_parse_parameters_none() == FAILURE) return;
+
+    if (WXBuffer_Init(&buffer, 4096) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "Failed to allocate metrics buffer");
+        RETURN_FALSE;
+    }
+    if (castStatsFormatGlobal(&buffer) < 0) {
+        WXBuffer_Destroy(&buffer);
+        RETURN_FALSE;
+    }
+#if PHP_MAJOR_VERSION < 7
+    RETVAL_STRINGL((char *) buffer.buffer, buffer.length, 1);
+#else
+    RETVAL_STRINGL((char *) buffer.buffer, buffer.length);
+#endif
+    WXBuffer_Destroy(&buffer);
+}
+
+/**
+ * Enable (or resize) the capture of recent raw frames for the connection, or
+ * disable it.  Note that any previously captured frames are discarded.
+ *
+ * @param conn The device connection instance from cptl_device_connect.
+ * @param frames The number of (most recent) frames to retain, zero to disable.
+ * @param snapLen Optional maximum number of bytes retained for each frame,
+ *                defaults to the castportal.capture_snaplen setting.
+ * @return True if the capture was updated, false on error.
+ */
+PHP_FUNCTION(cptl_capture) {
+    long frames, snapLen = 0;
+    CastDeviceConnection *conn;
+    zval *zvRes = NULL;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rl|l", &zvRes,
+                              &frames, &snapLen) != SUCCESS) return;
+    if (snapLen <= 0) snapLen = CPTL_CFG(captureSnapLen);
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if (castCaptureEnable(conn, (int) frames, (int) snapLen) < 0) {
+        RETURN_FALSE;
+    }
+    RETURN_TRUE;
+}
+
+/**
+ * Export the captured frames of the connection (oldest first) as JSON lines,
+ * one object per frame with the sequence number, wall clock timestamp (in
+ * seconds), direction, full length and the captured content (in hex).
+ *
+ * @param conn The device connection instance from cptl_device_connect.
+ * @param fileName Optional file (or stream) to append the export to.
+ * @return The exported content if no file was given, otherwise the number of
+ *         frames appended to the file, false on error.
+ */
+PHP_FUNCTION(cptl_capture_export) {
+    char *fileName = NULL;
+    CastDeviceConnection *conn;
+    int count;
+#if PHP_MAJOR_VERSION < 7
+    int fileNameLen = 0;
+#else
+    size_t fileNameLen = 0;
+#endif
+    zval *zvRes = NULL;
+    php_stream *stream;
+    WXBuffer buffer;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "r|s", &zvRes,
+                              &fileName, &fileNameLen) != SUCCESS) return;
+
+#if PHP_MAJOR_VERSION < 7
+    ZEND_FETCH_RESOURCE(conn, CastDeviceConnection *, &zvRes, -1,
+                        PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#else
+    conn = (CastDeviceConnection *) zend_fetch_resource(Z_RES_P(zvRes),
+                           PHP_CASTPTL_DEVCONN_RESNAME, castptl_devconn_resid);
+#endif
+    if (conn == NULL) {
+        RETURN_FALSE;
+        return;
+    }
+
+    if (WXBuffer_Init(&buffer, 4096) == NULL) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "Failed to allocate frame capture export");
+        RETURN_FALSE;
+    }
+    if ((count = castCaptureExport(conn, &buffer)) < 0) {
+        WXBuffer_Destroy(&buffer);
+        RETURN_FALSE;
+    }
+
+    if (fileName == NULL) {
+#if PHP_MAJOR_VERSION < 7
+        RETVAL_STRINGL((char *) buffer.buffer, buffer.length, 1);
+#else
+        RETVAL_STRINGL((char *) buffer.buffer, buffer.length);
+#endif
+        WXBuffer_Destroy(&buffer);
+        return;
+    }
+
+    /* Streams layer applies open_basedir (and allows wrappers) */
+    stream = php_stream_open_wrapper(fileName, "ab", REPORT_ERRORS, NULL);
+    if (stream == NULL) {
+        WXBuffer_Destroy(&buffer);
+        RETURN_FALSE;
+    }
+    if ((buffer.length > 0) &&
+            (php_stream_write(stream, (char *) buffer.buffer,
+                              buffer.length) != buffer.length)) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                         "Failed to write frame capture to '%s'", fileName);
+        count = -1;
+    }
+    php_stream_close(stream);
+    WXBuffer_Destroy(&buffer);
+
+    if (count < 0) RETURN_FALSE;
+    RETURN_LONG(count);
+}
+
+/* Heaviest (peak live bytes) allocation sites first */
+static int compareAllocSites(const void *a, const void *b) {
+    const CastAllocSite *siteA = *((const CastAllocSite **) a);
+    const CastAllocSite *siteB = *((const CastAllocSite **) b);
+
+    if (siteA->peakBytes != siteB->peakBytes) {
+        return (siteA->peakBytes > siteB->peakBytes) ? -1 : 1;
+    }
+    return (siteA->totalBytes > siteB->totalBytes) ? -1 :
+                          ((siteA->totalBytes < siteB->totalBytes) ? 1 : 0);
+}
+
+/**
+ * Retrieve the allocation profile of the current request, the toolkit
+ * allocations aggregated by call site (castportal.alloc_profile).
+ *
+ * @return Array of the overall 'live' and 'peak' bytes and the 'sites' list,
+ *         ordered by peak bytes, of 'site' (file:line), 'calls', 'frees',
+ *         'live', 'peak' and 'total' (bytes), or false if the profiler is not
+ *         enabled.
+ */
+PHP_FUNCTION(cptl_alloc_profile) {
+    CastAllocSite *sites, **used;
+    int idx, count, usedCount = 0;
+    const char *file, *sep;
+    char label[256];
+#if PHP_MAJOR_VERSION < 7
+    zval *zvSites, *zvSite;
+#else
+    zval zvSitesData, zvSiteData;
+    zval *zvSites = &zvSitesData, *zvSite = &zvSiteData;
+#endif
+
+    if (zend_parse_parameters_none() == FAILURE) return;
+
+    sites = castAllocProfileSites(&count);
+    if (sites == NULL) RETURN_FALSE;
+
+    /* Note: plain emalloc, bypasses (and does not disturb) the profile */
+    used = (CastAllocSite **) emalloc((count + 1) * sizeof(CastAllocSite *));
+    for (idx = 0; idx < count; idx++) {
+        if (sites[idx].file != NULL) used[usedCount++] = &(sites[idx]);
+    }
+    qsort(used, usedCount, sizeof(CastAllocSite *), compareAllocSites);
+
+    array_init(return_value);
+    add_assoc_long(return_value, "live", (long) CPTL_CTX(allocLiveBytes));
+    add_assoc_long(return_value, "peak", (long) CPTL_CTX(allocPeakBytes));
+#if PHP_MAJOR_VERSION < 7
+    ALLOC_INIT_ZVAL(zvSites);
+#else
+    ZVAL_NULL(zvSites);
+#endif
+    array_init(zvSites);
+    for (idx = 0; idx < usedCount; idx++) {
+        file = used[idx]->file;
+        if ((sep = strrchr(file, '/')) != NULL) file = sep + 1;
+        (void) snprintf(label, sizeof(label), "%s:%d", file, used[idx]->line);
+
+#if PHP_MAJOR_VERSION < 7
+        ALLOC_INIT_ZVAL(zvSite);
+        array_init(zvSite);
+        add_assoc_string(zvSite, "site", label, 1);
+#else
+        ZVAL_NULL(zvSite);
+        array_init(zvSite);
+        add_assoc_string(zvSite, "site", label);
+#endif
+        add_assoc_long(zvSite, "calls", (long) used[idx]->calls);
+        add_assoc_long(zvSite, "frees", (long) used[idx]->frees);
+        add_assoc_long(zvSite, "live", (long) used[idx]->liveBytes);
+        add_assoc_long(zvSite, "peak", (long) used[idx]->peakBytes);
+        add_assoc_long(zvSite, "total", (long) used[idx]->totalBytes);
+        add_next_index_zval(zvSites, zvSite);
+    }
+    add_assoc_zval(return_value, "sites", zvSites);
+    efree(used);
+}
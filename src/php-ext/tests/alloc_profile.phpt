@@ -0,0 +1,48 @@
+--TEST--
+Verify the allocation site profile of the current request.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.alloc_profile=1
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_ping($hndl));
+var_dump(count(cptl_discover(CPTL_INET_ALL, 1)) > 0);
+
+$profile = cptl_alloc_profile();
+var_dump($profile['live'] > 0, $profile['peak'] >= $profile['live']);
+var_dump(count($profile['sites']) > 0);
+$site = $profile['sites'][0];
+var_dump(preg_match('/^[a-z_]+\.c:[0-9]+$/', $site['site']));
+var_dump($site['peak'] >= $site['live'], $site['total'] >= $site['peak']);
+$last = PHP_INT_MAX;
+foreach ($profile['sites'] as $site) {
+    if ($site['peak'] > $last) echo "Out of order\n";
+    $last = $site['peak'];
+}
+
+/* Live bytes drop back when the connection is released */
+cptl_device_close($hndl);
+$after = cptl_alloc_profile();
+var_dump($after['live'] < $profile['live']);
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(1)
+bool(true)
+bool(true)
+bool(true)
+===END===
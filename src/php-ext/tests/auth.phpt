@@ -0,0 +1,68 @@
+--TEST--
+Verify device authentication against simulated device responses
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.auth_root_store={PWD}/auth/root.pem
+--FILE--
+===START===
+<?php
+$auth = 'urn:x-cast:com.google.cast.tp.deviceauth';
+$fixture = function($name) {
+    return file_get_contents(__DIR__ . '/auth/' . $name);
+};
+$peer = $fixture('peer.der');
+
+/* Failures close the connection and are never cached */
+foreach (array('resp_badsig.bin', 'resp_wrongroot.bin',
+               'resp_nononce.bin') as $resp) {
+    cptl_testctl(1, $peer, $fixture($resp));
+    $hndl = cptl_device_connect('localhost', 8009);
+    var_dump(cptl_device_auth($hndl));
+}
+
+/* Valid response (PKCS1v15/SHA256) */
+cptl_testctl(1, $peer, $fixture('resp_ok.bin'));
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_auth($hndl));
+
+/* Cached, no challenge is issued (the invalid response is never read) */
+$before = cptl_stats();
+cptl_testctl(1, $peer, $fixture('resp_badsig.bin'));
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_auth($hndl));
+$after = cptl_stats();
+var_dump($after['frames_out'][$auth] - $before['frames_out'][$auth]);
+
+/* RSASSA-PSS signature for a different TLS certificate */
+cptl_testctl(1, $fixture('peer_pss.der'), $fixture('resp_pss.bin'));
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_auth($hndl));
+?>
+===END===
+--EXPECTF--
+===START===
+
+Warning: cptl_device_auth(): Invalid device authentication signature %a
+
+Warning: cptl_device_auth(): Failed to authenticate remote cast device %a
+bool(false)
+
+Warning: cptl_device_auth(): Device certificate chain verification failed: %s
+
+Warning: cptl_device_auth(): Failed to authenticate remote cast device %a
+bool(false)
+
+Warning: cptl_device_auth(): Device authentication response has no nonce %a
+
+Warning: cptl_device_auth(): Failed to authenticate remote cast device %a
+bool(false)
+bool(true)
+bool(true)
+int(0)
+bool(true)
+===END===
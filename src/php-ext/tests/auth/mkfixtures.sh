@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Generate the (throwaway) device authentication fixtures for auth.phpt: a
+# root/intermediate/device chain, simulated TLS peer certificates and the
+# canned DeviceAuthMessage responses, signed over the fixed test mode nonce.
+#
+# Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+# See the LICENSE file accompanying the distribution your rights to use
+# this software.
+#
+# Requires openssl and perl, run from this directory.  Nothing is needed at
+# test time other than the output files (the keys are discarded).
+#
+set -e
+WRK=`mktemp -d`
+trap 'rm -rf $WRK' EXIT
+
+# Certificate authority extensions for the root and intermediates
+cat > $WRK/ca.ext <<EXT
+basicConstraints=critical,CA:TRUE
+keyUsage=critical,keyCertSign,cRLSign
+EXT
+cat > $WRK/leaf.ext <<EXT
+basicConstraints=critical,CA:FALSE
+keyUsage=critical,digitalSignature
+EXT
+
+# Self-signed root, intermediate and device certificate under it
+chain() {
+    openssl req -x509 -newkey rsa:2048 -nodes -days 36500 -sha256 \
+        -subj "/CN=Cast Portal Test $1 Root" -keyout $WRK/$1_root.key \
+        -out $WRK/$1_root.pem -extensions v3_ca 2>/dev/null
+    openssl req -new -newkey rsa:2048 -nodes -sha256 \
+        -subj "/CN=Cast Portal Test $1 ICA" -keyout $WRK/$1_ica.key \
+        -out $WRK/$1_ica.csr 2>/dev/null
+    openssl x509 -req -in $WRK/$1_ica.csr -CA $WRK/$1_root.pem \
+        -CAkey $WRK/$1_root.key -CAcreateserial -days 36500 -sha256 \
+        -extfile $WRK/ca.ext -out $WRK/$1_ica.pem 2>/dev/null
+    openssl req -new -newkey rsa:2048 -nodes -sha256 \
+        -subj "/CN=Cast Portal Test $1 Device" -keyout $WRK/$1_device.key \
+        -out $WRK/$1_device.csr 2>/dev/null
+    openssl x509 -req -in $WRK/$1_device.csr -CA $WRK/$1_ica.pem \
+        -CAkey $WRK/$1_ica.key -CAcreateserial -days 36500 -sha256 \
+        -extfile $WRK/leaf.ext -out $WRK/$1_device.pem 2>/dev/null
+    openssl x509 -in $WRK/$1_ica.pem -outform DER -out $WRK/$1_ica.der
+    openssl x509 -in $WRK/$1_device.pem -outform DER -out $WRK/$1_device.der
+}
+chain trusted
+chain other
+cp $WRK/trusted_root.pem root.pem
+
+# The (self-signed) TLS certificates of the simulated devices
+for peer in peer peer_pss; do
+    openssl req -x509 -newkey rsa:2048 -nodes -days 36500 -sha256 \
+        -subj "/CN=$peer" -keyout $WRK/$peer.key -out $WRK/$peer.pem \
+        2>/dev/null
+    openssl x509 -in $WRK/$peer.pem -outform DER -out $peer.der
+done
+
+# Signed content is the test mode nonce (bytes 0 to 15) and the peer cert
+perl -e 'print pack("C*", 0..15)' > $WRK/nonce
+sign() {
+    cat $WRK/nonce $2 > $WRK/signed
+    if [ "$3" = "pss" ]; then
+        openssl dgst -sha256 -sign $WRK/$1_device.key \
+            -sigopt rsa_padding_mode:pss -sigopt rsa_pss_saltlen:32 \
+            -out $WRK/sig $WRK/signed
+    else
+        openssl dgst -sha256 -sign $WRK/$1_device.key -out $WRK/sig \
+            $WRK/signed
+    fi
+}
+
+# DeviceAuthMessage { 2: AuthResponse { 1: signature, 2: device cert,
+#   3: intermediate, 4: signature algorithm, 5: sender nonce, 6: hash } }
+message() {
+    perl -e '
+        sub varint {
+            my ($v, $out) = (shift, "");
+            while ($v > 0x7F) { $out .= chr(($v & 0x7F) | 0x80); $v >>= 7; }
+            return $out . chr($v);
+        }
+        sub field { return chr(($_[0] << 3) | 2) . varint(length($_[1])) .
+                           $_[1]; }
+        sub slurp { local $/; open(my $fh, "<", shift) or die; binmode $fh;
+                    my $c = <$fh>; return $c; }
+        my ($sig, $dev, $ica, $alg, $nonce, $flip) = @ARGV;
+        $sig = slurp($sig);
+        substr($sig, 10, 1) = chr(ord(substr($sig, 10, 1)) ^ 0xFF) if $flip;
+        my $resp = field(1, $sig) . field(2, slurp($dev)) .
+                   field(3, slurp($ica)) . chr(4 << 3) . chr($alg);
+        $resp .= field(5, slurp($nonce)) if $nonce ne "-";
+        $resp .= chr(6 << 3) . chr(1);
+        binmode STDOUT;
+        print field(2, $resp);
+    ' "$@"
+}
+
+sign trusted peer.der
+message $WRK/sig $WRK/trusted_device.der $WRK/trusted_ica.der 1 \
+        $WRK/nonce 0 > resp_ok.bin
+message $WRK/sig $WRK/trusted_device.der $WRK/trusted_ica.der 1 \
+        $WRK/nonce 1 > resp_badsig.bin
+sign trusted peer_pss.der pss
+message $WRK/sig $WRK/trusted_device.der $WRK/trusted_ica.der 2 \
+        $WRK/nonce 0 > resp_pss.bin
+sign other peer.der
+message $WRK/sig $WRK/other_device.der $WRK/other_ica.der 1 \
+        $WRK/nonce 0 > resp_wrongroot.bin
+
+# No nonce echoed (older firmware or a replay), signed over the cert alone
+openssl dgst -sha256 -sign $WRK/trusted_device.key -out $WRK/sig peer.der
+message $WRK/sig $WRK/trusted_device.der $WRK/trusted_ica.der 1 - 0 \
+        > resp_nononce.bin
@@ -0,0 +1,26 @@
+--TEST--
+Verify device authentication without a configured root store
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.auth_root_store=
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_auth($hndl));
+?>
+===END===
+--EXPECTF--
+===START===
+
+Warning: cptl_device_auth(): No device authentication root store configured %a
+
+Warning: cptl_device_auth(): Failed to authenticate remote cast device %a
+bool(false)
+===END===
@@ -0,0 +1,39 @@
+--TEST--
+Verify concurrent application availability messaging across devices
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$den = cptl_device_connect('localhost', 8009);
+$hall = cptl_device_connect('localhost', 8009);
+$res = cptl_app_available_many(array('den' => $den, 'hall' => $hall,
+                                     'bogus' => 'notaconnection'));
+var_dump(array_keys($res));
+var_dump($res['den']['availability']);
+var_dump(is_float($res['hall']['latency']));
+var_dump($res['bogus']);
+?>
+===END===
+--EXPECTF--
+===START===
+array(3) {
+  [0]=>
+  string(3) "den"
+  [1]=>
+  string(4) "hall"
+  [2]=>
+  string(5) "bogus"
+}
+array(1) {
+  ["02834648"]=>
+  string(13) "APP_AVAILABLE"
+}
+bool(true)
+bool(false)
+===END===
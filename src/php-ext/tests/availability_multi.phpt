@@ -0,0 +1,35 @@
+--TEST--
+Verify processing of multiple application availability messaging
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_app_availability($hndl, array('02834648', 'CC1AD845')));
+cptl_testctl(2);
+var_dump(cptl_app_availability($hndl, array('02834648')));
+var_dump(cptl_app_availability($hndl, array('bad"id')));
+?>
+===END===
+--EXPECTF--
+===START===
+array(2) {
+  ["02834648"]=>
+  string(13) "APP_AVAILABLE"
+  ["CC1AD845"]=>
+  NULL
+}
+array(1) {
+  ["02834648"]=>
+  string(15) "APP_UNAVAILABLE"
+}
+
+Warning: cptl_app_availability(): Invalid application identifier 'bad"id' %a
+bool(false)
+===END===
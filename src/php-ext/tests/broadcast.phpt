@@ -0,0 +1,30 @@
+--TEST--
+Verify simulated broadcast of a message across multiple devices.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$conns = array('lobby' => cptl_device_connect('localhost', 8009),
+               'cafe' => cptl_device_connect('localhost', 8009),
+               'gone' => false);
+var_dump(cptl_broadcast($conns, 'urn:x-cast:com.heisz.castportal',
+                        '{"type": "ANNOUNCE", "text": "Fire drill at 3"}'));
+?>
+===END===
+--EXPECTF--
+===START===
+array(3) {
+  ["lobby"]=>
+  bool(true)
+  ["cafe"]=>
+  bool(true)
+  ["gone"]=>
+  bool(false)
+}
+===END===
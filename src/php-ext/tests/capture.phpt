@@ -0,0 +1,50 @@
+--TEST--
+Verify the runtime frame capture ring and its JSON lines export.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_capture_export($hndl));
+var_dump(cptl_capture($hndl, 2, 8));
+var_dump(cptl_device_ping($hndl));
+var_dump(cptl_device_ping($hndl));
+
+$lines = explode("\n", trim(cptl_capture_export($hndl)));
+var_dump(count($lines));
+foreach ($lines as $line) {
+    $frame = json_decode($line, true);
+    echo $frame['seq'] . ' ' . $frame['dir'] . ' ' . $frame['captured'] .
+         ' ' . strlen($frame['data']) . ' ' .
+         (($frame['len'] > $frame['captured']) ? 'snapped' : 'whole') . "\n";
+}
+
+$file = tempnam(sys_get_temp_dir(), 'cptl');
+var_dump(cptl_capture_export($hndl, $file));
+var_dump(count(file($file)));
+unlink($file);
+
+var_dump(cptl_capture($hndl, 0));
+var_dump(cptl_capture_export($hndl));
+?>
+===END===
+--EXPECTF--
+===START===
+string(0) ""
+bool(true)
+bool(true)
+bool(true)
+int(2)
+2 out 8 16 snapped
+3 in 8 16 snapped
+int(2)
+int(2)
+bool(true)
+string(0) ""
+===END===
@@ -0,0 +1,59 @@
+--TEST--
+Verify virtual channel management across a single device connection
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_channel_open($hndl, 'scheduler', 'receiver-0'));
+var_dump(cptl_channel_open($hndl, 'dashboard', 'receiver-0'));
+var_dump(cptl_channel_open($hndl, 'dashboard', 'receiver-0'));
+var_dump(cptl_channel_open($hndl, 'dashboard', 'web-5'));
+var_dump(cptl_channel_open($hndl, 'sender-0', 'receiver-0'));
+var_dump(cptl_channel_send($hndl, 'scheduler',
+                           'urn:x-cast:com.google.cast.receiver',
+                           '{"type": "GET_STATUS", "requestId": 1}'));
+var_dump(cptl_channel_close($hndl, 'scheduler'));
+var_dump(cptl_channel_close($hndl, 'scheduler'));
+var_dump(cptl_channel_send($hndl, 'scheduler',
+                           'urn:x-cast:com.google.cast.receiver', '{}'));
+
+/* Interleaved inbound traffic is delivered to the owning channel only */
+$hndl = cptl_device_connect('localhost', 8009);
+cptl_channel_open($hndl, 'scheduler', 'web-5');
+cptl_channel_open($hndl, 'dashboard', 'web-5');
+echo cptl_channel_receive($hndl, 'dashboard') . "\n";
+echo cptl_channel_receive($hndl, 'dashboard',
+                          'urn:x-cast:ca.heisz.portal') . "\n";
+echo cptl_channel_receive($hndl, 'scheduler') . "\n";
+echo cptl_channel_receive($hndl, 'scheduler') . "\n";
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+bool(true)
+bool(true)
+
+Warning: cptl_channel_open(): Channel 'dashboard' is already open to 'receiver-0' %a
+bool(false)
+
+Warning: cptl_channel_open(): Reserved channel source identifier 'sender-0' %a
+bool(false)
+bool(true)
+bool(true)
+bool(false)
+
+Warning: cptl_channel_send(): No open channel for source id 'scheduler' %a
+bool(false)
+{"type":"SIM","channel":"dashboard","seq":1}
+{"type":"SIM","channel":"dashboard","seq":3}
+{"type":"SIM","channel":"scheduler","seq":2}
+{"type":"SIM","channel":"scheduler","seq":4}
+===END===
@@ -0,0 +1,40 @@
+--TEST--
+Verify composite device open with initial application exchanges
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$dev = cptl_device_open('localhost', 8009, array('status' => true));
+var_dump(is_resource($dev['connection']), $dev['availability']);
+var_dump($dev['status']['running'], $dev['status']['transportId']);
+var_dump(cptl_receiver_status($dev['connection'])['sessionId']);
+cptl_testctl(2);
+$dev = cptl_device_open('localhost', 8009,
+                        array('appIds' => array('02834648', 'CC1AD845')));
+var_dump($dev['availability'], isset($dev['status']));
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+array(1) {
+  ["02834648"]=>
+  string(13) "APP_AVAILABLE"
+}
+bool(true)
+string(5) "web-5"
+string(9) "A1B2-C3D4"
+array(2) {
+  ["02834648"]=>
+  string(15) "APP_UNAVAILABLE"
+  ["CC1AD845"]=>
+  NULL
+}
+bool(false)
+===END===
@@ -0,0 +1,57 @@
+--TEST--
+Verify idle connections release their buffers and the pool accounting.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.idle_slim_ms=1
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$first = cptl_device_connect('localhost', 8009);
+$second = cptl_device_connect('localhost', 8009);
+
+/* Read buffers are only allocated on first use */
+$stats = cptl_stats();
+var_dump($stats['connections']['open'], $stats['connections']['slim']);
+var_dump(cptl_device_ping($first));
+var_dump(is_array(cptl_receiver_status($first)));
+$before = cptl_stats();
+var_dump($before['connections']['slim']);
+
+/* Activity on the second sweeps the (now idle) first */
+usleep(10000);
+var_dump(cptl_device_ping($second));
+$after = cptl_stats();
+var_dump($after['idle_slims'] > $before['idle_slims']);
+var_dump($after['idle_slim_bytes'] - $before['idle_slim_bytes'] >= 1024);
+
+/* Status snapshot (five 128 byte strings) went with the slimmed first */
+var_dump($before['connections']['bytes'] - $after['connections']['bytes'] >=
+                                                                   5 * 128);
+
+/* And the first still works, buffer restored on demand */
+var_dump(cptl_device_ping($first));
+cptl_device_close($second);
+$stats = cptl_stats();
+var_dump($stats['connections']['open']);
+?>
+===END===
+--EXPECTF--
+===START===
+int(2)
+int(2)
+bool(true)
+bool(true)
+int(1)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(1)
+===END===
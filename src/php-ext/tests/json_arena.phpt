@@ -0,0 +1,54 @@
+--TEST--
+Verify responses are equivalent with and without the message arena.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.json_arena=1
+castportal.alloc_profile=1
+--FILE--
+===START===
+<?php
+function exchange() {
+    cptl_testctl(1);
+    $dev = cptl_device_open('localhost', 8009, array('status' => true));
+    $result = array($dev['availability'], $dev['status']['running'],
+                    $dev['status']['transportId'],
+                    cptl_device_ping($dev['connection']),
+                    cptl_app_available($dev['connection']));
+    cptl_device_close($dev['connection']);
+    return $result;
+}
+
+/* Heap allocation calls (arena content is not tracked by the profile) */
+function allocCalls() {
+    $calls = 0;
+    foreach (cptl_alloc_profile()['sites'] as $site) $calls += $site['calls'];
+    return $calls;
+}
+
+/* Kept responses (availability) are used directly from the arena */
+$start = allocCalls();
+$arena = exchange();
+$arenaCalls = allocCalls() - $start;
+ini_set('castportal.json_arena', 0);
+$start = allocCalls();
+$heap = exchange();
+$heapCalls = allocCalls() - $start;
+var_dump($arena === $heap);
+var_dump($arena[0]);
+var_dump($arenaCalls < $heapCalls);
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+array(1) {
+  ["02834648"]=>
+  string(13) "APP_AVAILABLE"
+}
+bool(true)
+===END===
@@ -0,0 +1,54 @@
+--TEST--
+Verify application launch and running session reuse
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+$receiver = 'urn:x-cast:com.google.cast.receiver';
+
+/* No known status, the launch goes out directly (no status request) */
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+$before = cptl_stats();
+var_dump(cptl_app_launch($hndl, 'portal-ctl'));
+$after = cptl_stats();
+var_dump($after['frames_out'][$receiver] - $before['frames_out'][$receiver]);
+
+/* Status from the launch is recent, the session is joined */
+$before = $after;
+var_dump(cptl_app_launch($hndl, 'portal-ctl', 'urn:x-cast:ca.heisz.portal',
+                         '{"type":"SHOW"}'));
+$after = cptl_stats();
+var_dump($after['frames_out'][$receiver] - $before['frames_out'][$receiver]);
+var_dump(cptl_app_launch($hndl, 'portal-ctl', 'urn:x-cast:ca.heisz.portal'));
+?>
+===END===
+--EXPECTF--
+===START===
+array(3) {
+  ["sessionId"]=>
+  string(9) "A1B2-C3D4"
+  ["transportId"]=>
+  string(5) "web-5"
+  ["reused"]=>
+  bool(false)
+}
+int(1)
+array(3) {
+  ["sessionId"]=>
+  string(9) "A1B2-C3D4"
+  ["transportId"]=>
+  string(5) "web-5"
+  ["reused"]=>
+  bool(true)
+}
+int(0)
+
+Warning: cptl_app_launch(): Missing payload for initial application message %a
+bool(false)
+===END===
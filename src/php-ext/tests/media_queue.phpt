@@ -0,0 +1,77 @@
+--TEST--
+Verify media queue load and insert messaging
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.media_preload_time=12
+--FILE--
+===START===
+<?php
+/* Issued requests (JSON payload trails the frame header) from the capture */
+function queueRequests($hndl) {
+    $reqs = array();
+    foreach (explode("\n", trim(cptl_capture_export($hndl))) as $line) {
+        $frame = json_decode($line, true);
+        $data = hex2bin($frame['data']);
+        if (($frame['dir'] != 'out') ||
+                (strpos($data, '"QUEUE_') === false)) continue;
+        $reqs[] = json_decode(rtrim(substr($data, strpos($data, '{')), "\0"),
+                              true);
+    }
+    return $reqs;
+}
+
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+cptl_app_launch($hndl, 'portal-ctl');
+cptl_capture($hndl, 16, 2048);
+$items = array(
+    array('contentId' => 'http://frame/a.jpg', 'contentType' => 'image/jpeg',
+          'playbackDuration' => 15),
+    array('contentId' => 'http://frame/b.mp4', 'contentType' => 'video/mp4',
+          'preloadTime' => 20)
+);
+var_dump(cptl_media_queue_load($hndl, 'portal-ctl', $items,
+                               array('repeat' => true, 'startIndex' => 1)));
+var_dump(cptl_media_queue_insert($hndl, 'portal-ctl', 7, $items));
+var_dump(cptl_media_queue_insert($hndl, 'portal-ctl', 7,
+                                 array(array('contentId' => 'x'))));
+var_dump(cptl_media_queue_load($hndl, 'no-channel', $items));
+
+foreach (queueRequests($hndl) as $req) {
+    echo $req['type'] . ' items=' . count($req['items']) .
+         (isset($req['startIndex']) ? ' start=' . $req['startIndex'] .
+                                      ' ' . $req['repeatMode'] : '') .
+         (isset($req['mediaSessionId']) ?
+                     ' session=' . $req['mediaSessionId'] : '') . "\n";
+    foreach ($req['items'] as $item) {
+        echo '  ' . $item['media']['contentId'] . ' ' .
+             $item['media']['contentType'] . ' preload=' .
+             $item['preloadTime'] . ' duration=' .
+             (isset($item['playbackDuration']) ?
+                         $item['playbackDuration'] : '-') . "\n";
+    }
+}
+?>
+===END===
+--EXPECTF--
+===START===
+int(7)
+bool(true)
+
+Warning: cptl_media_queue_insert(): Media item 0 requires content id and type %a
+bool(false)
+
+Warning: cptl_media_queue_load(): No open channel for source id 'no-channel' %a
+bool(false)
+QUEUE_LOAD items=2 start=1 REPEAT_ALL
+  http://frame/a.jpg image/jpeg preload=12 duration=15
+  http://frame/b.mp4 video/mp4 preload=20 duration=-
+QUEUE_INSERT items=2 session=7
+  http://frame/a.jpg image/jpeg preload=12 duration=15
+  http://frame/b.mp4 video/mp4 preload=20 duration=-
+===END===
@@ -0,0 +1,38 @@
+--TEST--
+Verify simulated concurrent keepalive ping across multiple devices.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$conns = array(cptl_device_connect('localhost', 8009),
+               cptl_device_connect('localhost', 8009), null);
+$rtts = cptl_ping_many($conns, 100);
+var_dump(count($rtts), is_float($rtts[0]), is_float($rtts[1]), $rtts[2]);
+
+/* Repeated connection is pinged once, sharing the result */
+$heartbeat = 'urn:x-cast:com.google.cast.tp.heartbeat';
+$hndl = cptl_device_connect('localhost', 8009);
+$before = cptl_stats();
+$rtts = cptl_ping_many(array('a' => $hndl, 'b' => $hndl), 100);
+$after = cptl_stats();
+var_dump(is_float($rtts['a']), $rtts['a'] === $rtts['b']);
+var_dump($after['frames_out'][$heartbeat] -
+                 $before['frames_out'][$heartbeat]);
+?>
+===END===
+--EXPECTF--
+===START===
+int(3)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
+int(1)
+===END===
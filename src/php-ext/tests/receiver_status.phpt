@@ -0,0 +1,32 @@
+--TEST--
+Verify receiver status request and tracked status reuse
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+$status = cptl_receiver_status($hndl);
+var_dump($status['running'], $status['sessionId'], $status['transportId']);
+var_dump($status['volume'], $status['muted']);
+$cached = cptl_receiver_status($hndl, 60000);
+var_dump($cached['transportId'], $cached['age'] >= $status['age']);
+var_dump(cptl_receiver_status($hndl, 0)['statusText']);
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+string(9) "A1B2-C3D4"
+string(5) "web-5"
+float(0.5)
+bool(false)
+string(5) "web-5"
+bool(true)
+string(5) "Ready"
+===END===
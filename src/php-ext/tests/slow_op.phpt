@@ -0,0 +1,41 @@
+--TEST--
+Verify the slow operation log line and its per-phase breakdown.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.slow_op_ms=1
+error_log=/tmp/castptl_slow_op.phpt.log
+--FILE--
+===START===
+<?php
+/* Test mode discovery always waits out the (1ms per pass) timeout */
+cptl_testctl(1);
+var_dump(count(cptl_discover(CPTL_INET_ALL, 1)) > 0);
+$log = file_get_contents('/tmp/castptl_slow_op.phpt.log');
+var_dump(preg_match('/castportal slow_op op=cptl_discover device=- ' .
+                    'result=ok total_ms=[0-9.]+ .*discovery\.wait_ms=' .
+                    '[0-9.]+ discovery\.wait_n=[1-9][0-9]*/', $log));
+
+/* And nothing at all under the threshold */
+ini_set('castportal.slow_op_ms', 60000);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_ping($hndl));
+var_dump(strlen(file_get_contents('/tmp/castptl_slow_op.phpt.log')) ==
+         strlen($log));
+?>
+===END===
+--CLEAN--
+<?php
+@unlink('/tmp/castptl_slow_op.phpt.log');
+?>
+--EXPECTF--
+===START===
+bool(true)
+int(1)
+bool(true)
+bool(true)
+===END===
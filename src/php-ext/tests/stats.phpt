@@ -0,0 +1,45 @@
+--TEST--
+Verify the runtime statistics counters across simulated operations.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--FILE--
+===START===
+<?php
+$heartbeat = 'urn:x-cast:com.google.cast.tp.heartbeat';
+$receiver = 'urn:x-cast:com.google.cast.receiver';
+
+cptl_testctl(1);
+$before = cptl_stats();
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_ping($hndl));
+var_dump(cptl_app_available($hndl));
+$after = cptl_stats();
+
+var_dump($after['connects'] - $before['connects']);
+var_dump($after['frames_out'][$heartbeat] -
+                 $before['frames_out'][$heartbeat]);
+var_dump($after['frames_in'][$heartbeat] - $before['frames_in'][$heartbeat]);
+var_dump($after['frames_out'][$receiver] - $before['frames_out'][$receiver]);
+var_dump($after['frames_in'][$receiver] > $before['frames_in'][$receiver]);
+var_dump($after['json_parses'] > $before['json_parses']);
+var_dump($after['parse_errors'] - $before['parse_errors']);
+var_dump(array_key_exists('unknown', $after['frames_in']));
+?>
+===END===
+--EXPECTF--
+===START===
+bool(true)
+bool(true)
+int(1)
+int(1)
+int(1)
+int(1)
+bool(true)
+bool(true)
+int(0)
+bool(true)
+===END===
@@ -0,0 +1,39 @@
+--TEST--
+Verify the aggregated (shared metrics segment) statistics output.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+?>
+--INI--
+castportal.metrics_file=/tmp/castptl_metrics.phpt.seg
+castportal.metrics_slots=4
+--FILE--
+===START===
+<?php
+cptl_testctl(1);
+$hndl = cptl_device_connect('localhost', 8009);
+var_dump(cptl_device_ping($hndl));
+$text = cptl_stats_global();
+var_dump(preg_match('/^castportal_slots_claimed [1-4]$/m', $text));
+var_dump(preg_match('/^castportal_connects_total [1-9][0-9]*$/m', $text));
+var_dump(preg_match('/^# TYPE castportal_frames_out_total counter$/m',
+                    $text));
+var_dump(preg_match('/^castportal_frames_out_total\{namespace=' .
+                    '"urn:x-cast:com.google.cast.tp.heartbeat"\} ' .
+                    '[1-9][0-9]*$/m', $text));
+?>
+===END===
+--CLEAN--
+<?php
+@unlink('/tmp/castptl_metrics.phpt.seg');
+?>
+--EXPECTF--
+===START===
+bool(true)
+int(1)
+int(1)
+int(1)
+int(1)
+===END===
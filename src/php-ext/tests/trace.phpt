@@ -0,0 +1,64 @@
+--TEST--
+Verify the request timeline tracing records the spans of the operations.
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+if (getenv('TEST_PHP_EXECUTABLE') === false) {
+    die('skip requires the run-tests executable for the traced request');
+}
+?>
+--FILE--
+===START===
+<?php
+/* The timeline is only written at request shutdown, so trace a subrequest */
+$traceFile = sys_get_temp_dir() . '/castptl_trace.phpt.' . getmypid() .
+             '.json';
+$code = 'cptl_testctl(1);' .
+        '$hndl = cptl_device_connect("localhost", 8009);' .
+        'var_dump(cptl_device_ping($hndl));' .
+        'var_dump(cptl_app_available($hndl));' .
+        '$dev = cptl_device_open("localhost", 8009, ' .
+        '                        array("status" => true));' .
+        'var_dump(is_resource($dev["connection"]));';
+echo shell_exec(escapeshellarg(getenv('TEST_PHP_EXECUTABLE')) . ' ' .
+                getenv('TEST_PHP_EXTRA_ARGS') . ' -d castportal.trace_file=' .
+                escapeshellarg($traceFile) . ' -r ' . escapeshellarg($code));
+
+/* Then check the written timeline (Chrome trace-event format) */
+$trace = json_decode(file_get_contents($traceFile), true);
+$names = array();
+foreach ($trace['traceEvents'] as $event) {
+    if (($event['ph'] != 'X') || ($event['dur'] < 0)) echo "Invalid span\n";
+    $names[$event['name']] = true;
+}
+$names = array_keys($names);
+sort($names);
+var_dump($names);
+?>
+===END===
+--CLEAN--
+<?php
+foreach (glob(sys_get_temp_dir() . '/castptl_trace.phpt.*.json') as $file) {
+    @unlink($file);
+}
+?>
+--EXPECTF--
+===START===
+bool(true)
+bool(true)
+bool(true)
+array(5) {
+  [0]=>
+  string(16) "app.availability"
+  [1]=>
+  string(14) "device.connect"
+  [2]=>
+  string(11) "device.open"
+  [3]=>
+  string(16) "message.callback"
+  [4]=>
+  string(13) "message.parse"
+}
+===END===
@@ -0,0 +1,50 @@
+--TEST--
+Verify concurrent simulated discovery and device processing (ZTS).
+--SKIPIF--
+<?php
+if (!extension_loaded('castptl')) {
+    die('castptl custom extension not installed in build');
+}
+if (!ZEND_THREAD_SAFE) die('skip requires a thread-safe (ZTS) build');
+if (!extension_loaded('parallel')) die('skip requires the parallel extension');
+?>
+--FILE--
+===START===
+<?php
+$worker = function(int $id, int $loops) {
+    /* Test mode is per-thread, mix the modes to detect any leakage */
+    $mode = ($id % 2 == 0) ? 1 : 2;
+    cptl_testctl($mode);
+    $ok = 0;
+    for ($idx = 0; $idx < $loops; $idx++) {
+        /* Interleave (simulated) discovery with the device connections */
+        if ($idx % 10 == 0) {
+            $devices = cptl_discover(CPTL_INET_ALL, 1);
+            if ((!is_array($devices)) || (count($devices) != 2)) continue;
+            if (($devices[0]['name'] != 'Den TV') ||
+                    ($devices[1]['name'] != 'TST Chrome Panel')) continue;
+        }
+        $hndl = cptl_device_connect('localhost', 8009);
+        if ($hndl === false) continue;
+        if (!cptl_device_ping($hndl)) continue;
+        $avail = @cptl_app_available($hndl);
+        if ($avail !== ($mode == 1)) continue;
+        $ok++;
+    }
+    return $ok;
+};
+
+$futures = array();
+for ($id = 0; $id < 8; $id++) {
+    $runtime = new \parallel\Runtime();
+    $futures[] = $runtime->run($worker, array($id, 200));
+}
+$total = 0;
+foreach ($futures as $future) $total += $future->value();
+var_dump($total);
+?>
+===END===
+--EXPECTF--
+===START===
+int(1600)
+===END===
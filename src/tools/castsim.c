@@ -0,0 +1,771 @@
+/*
+ * Simulated cast receiver, a local TLS server speaking the CastV2 framing for
+ * benchmarking the extension over real connections (no cptl_testctl()).
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+/* Namespaces of the supported exchanges */
+#define NS_CONNECTION "urn:x-cast:com.google.cast.tp.connection"
+#define NS_HEARTBEAT "urn:x-cast:com.google.cast.tp.heartbeat"
+#define NS_RECEIVER "urn:x-cast:com.google.cast.receiver"
+#define NS_MEDIA "urn:x-cast:com.google.cast.media"
+#define NS_DEVICE_AUTH "urn:x-cast:com.google.cast.tp.deviceauth"
+
+/* DeviceAuthMessage with an AuthError (INTERNAL_ERROR), no device identity */
+static const uint8_t authErrorResp[] = { 0x1A, 0x02, 0x08, 0x00 };
+
+/* Anything larger than this is not a frame we want to see */
+#define MAX_FRAME_SIZE 65536
+
+/* Behaviour of the simulator, from the command line */
+static struct {
+    const char *bindAddr;
+    int port, count;
+    const char *certFile, *keyFile;
+    int latencyMs, jitterMs, handshakeDelayMs, launchDelayMs;
+    int burst;
+    int failAccept, failHandshake, dropPct, corruptPct, disconnectPct;
+    int unavailable;
+    unsigned int seed;
+    int verbose;
+} config = {
+    "127.0.0.1", 8009, 1, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0
+};
+
+/* Application state of a receiver, shared by its connections (as a device) */
+typedef struct {
+    int fd, port;
+    char runningAppId[64];
+    int sessionCounter;
+    unsigned int acceptRnd;
+} SimReceiver;
+static pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Running totals, reported on exit */
+static struct {
+    int64_t accepted, handshakes, handshakeFailures, framesIn, framesOut;
+    int64_t injectedFailures;
+} totals;
+#define TOTAL_INC(f) __atomic_add_fetch(&(totals.f), 1, __ATOMIC_RELAXED)
+#define TOTAL_ADD(f, v) __atomic_add_fetch(&(totals.f), v, __ATOMIC_RELAXED)
+
+static SSL_CTX *serverCtx = NULL;
+static volatile sig_atomic_t shutdownRequested = 0;
+
+/* Per-connection processing context */
+typedef struct {
+    SimReceiver *receiver;
+    int fd;
+    SSL *ssl;
+    unsigned int rndState;
+    uint8_t *frame;
+} SimConnection;
+
+/* Elements of a decoded CastMessage (pointers into the frame) */
+typedef struct {
+    char *sourceId, *destinationId, *namespace, *payload;
+    uint32_t payloadLen;
+    int payloadType;
+} SimMessage;
+
+/* Percentage roll for the failure injection */
+static int roll(SimConnection *conn, int pct) {
+    return (pct > 0) && ((int) (rand_r(&(conn->rndState)) % 100) < pct);
+}
+
+/* Sleep for the configured latency, plus or minus the jitter */
+static void delay(SimConnection *conn, int baseMs) {
+    int ms = baseMs;
+    struct timespec ts;
+
+    if (config.jitterMs > 0) {
+        ms += (int) (rand_r(&(conn->rndState)) %
+                         (2 * config.jitterMs + 1)) - config.jitterMs;
+    }
+    if (ms <= 0) return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long) (ms % 1000) * 1000000;
+    while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR)) continue;
+}
+
+/*
+ * Self-signed certificate (RSA 2048, as with the device certificates) for
+ * when one isn't provided.  The TLS handshake does not verify the peer, that
+ * is the role of the device authentication exchange, which the simulator
+ * always fails (with an AuthError, there are no device credentials to sign
+ * with).  Benchmarks of a successful cptl_device_auth need real devices.
+ */
+static int generateCertificate(SSL_CTX *ctx) {
+    EVP_PKEY_CTX *keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    EVP_PKEY *key = NULL;
+    X509_NAME *name;
+    X509 *cert = NULL;
+    int rc = -1;
+
+    if ((keyCtx == NULL) || (EVP_PKEY_keygen_init(keyCtx) <= 0) ||
+            (EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048) <= 0) ||
+            (EVP_PKEY_keygen(keyCtx, &key) <= 0)) goto done;
+
+    if ((cert = X509_new()) == NULL) goto done;
+    (void) X509_set_version(cert, 2);
+    (void) ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    (void) X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    (void) X509_gmtime_adj(X509_get_notAfter(cert), 365L * 24 * 3600);
+    (void) X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    (void) X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                      (unsigned char *) "castsim", -1, -1, 0);
+    (void) X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) <= 0) goto done;
+
+    if ((SSL_CTX_use_certificate(ctx, cert) == 1) &&
+            (SSL_CTX_use_PrivateKey(ctx, key) == 1)) rc = 0;
+
+done:
+    if (cert != NULL) X509_free(cert);
+    if (key != NULL) EVP_PKEY_free(key);
+    if (keyCtx != NULL) EVP_PKEY_CTX_free(keyCtx);
+    return rc;
+}
+
+/* Encode a varint into the buffer, returns the number of bytes */
+static int putVarint(uint8_t *buff, uint32_t val) {
+    int len = 0;
+
+    while (val >= 0x80) {
+        buff[len++] = (uint8_t) (val | 0x80);
+        val >>= 7;
+    }
+    buff[len++] = (uint8_t) val;
+    return len;
+}
+
+/* Encode a length-delimited (string) field */
+static int putString(uint8_t *buff, int field, const char *str, size_t len) {
+    int off = 0;
+
+    buff[off++] = (uint8_t) ((field << 3) | 2);
+    off += putVarint(buff + off, (uint32_t) len);
+    (void) memcpy(buff + off, str, len);
+    return off + (int) len;
+}
+
+/* Frame and write a message (binary if payloadType is one), -1 on failure */
+static int sendFrame(SimConnection *conn, const char *sourceId,
+                     const char *destinationId, const char *namespace,
+                     int payloadType, const void *payload, size_t payloadLen) {
+    uint8_t *buff = conn->frame;
+    uint32_t len;
+    int off = 4;
+
+    if (strlen(sourceId) + strlen(destinationId) + strlen(namespace) +
+            payloadLen + 64 > MAX_FRAME_SIZE) return 0;
+
+    /* Protocol version (CASTV2_1_0) is zero, payload follows its type */
+    buff[off++] = 0x08;
+    buff[off++] = 0x00;
+    off += putString(buff + off, 2, sourceId, strlen(sourceId));
+    off += putString(buff + off, 3, destinationId, strlen(destinationId));
+    off += putString(buff + off, 4, namespace, strlen(namespace));
+    buff[off++] = 0x28;
+    buff[off++] = (uint8_t) payloadType;
+    off += putString(buff + off, (payloadType == 0) ? 6 : 7, payload,
+                     payloadLen);
+
+    len = (uint32_t) (off - 4);
+    buff[0] = (uint8_t) (len >> 24);
+    buff[1] = (uint8_t) (len >> 16);
+    buff[2] = (uint8_t) (len >> 8);
+    buff[3] = (uint8_t) len;
+    if (SSL_write(conn->ssl, buff, off) <= 0) return -1;
+    TOTAL_INC(framesOut);
+
+    return 0;
+}
+
+/* Frame and write a string message, returns -1 if the connection failed */
+static int sendMessage(SimConnection *conn, const char *sourceId,
+                       const char *destinationId, const char *namespace,
+                       const char *payload) {
+    return sendFrame(conn, sourceId, destinationId, namespace, 0, payload,
+                     strlen(payload));
+}
+
+/* Read exactly the requested number of bytes, -1 on close or error */
+static int readFully(SimConnection *conn, uint8_t *buff, int len) {
+    int rc, total = 0;
+
+    while (total < len) {
+        rc = SSL_read(conn->ssl, buff + total, len - total);
+        if (rc <= 0) return -1;
+        total += rc;
+    }
+    return 0;
+}
+
+/* Read a varint from the frame, -1 if truncated */
+static int getVarint(uint8_t **ptr, uint8_t *end, uint32_t *val) {
+    int shift = 0;
+
+    *val = 0;
+    while ((*ptr < end) && (shift < 35)) {
+        *val |= ((uint32_t) (**ptr & 0x7F)) << shift;
+        if ((*((*ptr)++) & 0x80) == 0) return 0;
+        shift += 7;
+    }
+    return -1;
+}
+
+/*
+ * Decode the CastMessage fields of interest.  String fields are terminated in
+ * place (shifted back over the field tag) for convenience.
+ */
+static int decodeMessage(uint8_t *frame, uint32_t frameLen, SimMessage *msg) {
+    uint8_t *ptr = frame, *end = frame + frameLen, *start;
+    uint32_t key, val;
+    char *str;
+
+    (void) memset(msg, 0, sizeof(SimMessage));
+    while (ptr < end) {
+        start = ptr;
+        if (getVarint(&ptr, end, &key) < 0) return -1;
+        if ((key & 0x07) == 0) {
+            if (getVarint(&ptr, end, &val) < 0) return -1;
+            if ((key >> 3) == 5) msg->payloadType = (int) val;
+        } else if ((key & 0x07) == 2) {
+            if ((getVarint(&ptr, end, &val) < 0) ||
+                    (val > (uint32_t) (end - ptr))) return -1;
+            str = (char *) start;
+            (void) memmove(str, ptr, val);
+            str[val] = '\0';
+            switch (key >> 3) {
+                case 2: msg->sourceId = str; break;
+                case 3: msg->destinationId = str; break;
+                case 4: msg->namespace = str; break;
+                case 6: msg->payload = str; msg->payloadLen = val; break;
+            }
+            ptr += val;
+        } else {
+            return -1;
+        }
+    }
+
+    return ((msg->sourceId != NULL) && (msg->destinationId != NULL) &&
+                (msg->namespace != NULL)) ? 0 : -1;
+}
+
+/* Minimal JSON extraction, string value for key (no escapes in requests) */
+static int jsonString(const char *json, const char *key, char *out,
+                      size_t outLen) {
+    char pattern[64];
+    const char *ptr, *end;
+
+    (void) snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if ((ptr = strstr(json, pattern)) == NULL) return -1;
+    ptr += strlen(pattern);
+    while ((*ptr == ' ') || (*ptr == ':')) ptr++;
+    if (*(ptr++) != '"') return -1;
+    if ((end = strchr(ptr, '"')) == NULL) return -1;
+    if ((size_t) (end - ptr) >= outLen) return -1;
+    (void) memcpy(out, ptr, end - ptr);
+    out[end - ptr] = '\0';
+    return 0;
+}
+
+/* And the integer value for a key, zero if missing */
+static long jsonInt(const char *json, const char *key) {
+    char pattern[64];
+    const char *ptr;
+
+    (void) snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if ((ptr = strstr(json, pattern)) == NULL) return 0;
+    ptr += strlen(pattern);
+    while ((*ptr == ' ') || (*ptr == ':')) ptr++;
+    return strtol(ptr, NULL, 10);
+}
+
+/* Render the receiver status (with the running application, if any) */
+static void receiverStatus(SimReceiver *receiver, char *out, size_t outLen,
+                           long requestId) {
+    char appId[64];
+    int session;
+
+    (void) pthread_mutex_lock(&stateLock);
+    (void) strcpy(appId, receiver->runningAppId);
+    session = receiver->sessionCounter;
+    (void) pthread_mutex_unlock(&stateLock);
+
+    if (appId[0] == '\0') {
+        (void) snprintf(out, outLen,
+                        "{\"requestId\":%ld,\"status\":{\"applications\":[],"
+                        "\"volume\":{\"level\":0.5,\"muted\":false}},"
+                        "\"type\":\"RECEIVER_STATUS\"}", requestId);
+    } else {
+        (void) snprintf(out, outLen,
+                        "{\"requestId\":%ld,\"status\":{\"applications\":[{"
+                        "\"appId\":\"%s\",\"displayName\":\"Simulated\","
+                        "\"namespaces\":[{\"name\":\"" NS_MEDIA "\"}],"
+                        "\"sessionId\":\"sim-session-%d\","
+                        "\"statusText\":\"Simulated application\","
+                        "\"transportId\":\"sim-transport-%d\"}],"
+                        "\"volume\":{\"level\":0.5,\"muted\":false}},"
+                        "\"type\":\"RECEIVER_STATUS\"}", requestId, appId,
+                        session, session);
+    }
+}
+
+/* Build the response for a receiver namespace request, 0 if none */
+static int receiverResponse(SimReceiver *receiver, SimMessage *msg,
+                            char *out, size_t outLen) {
+    char type[64], appId[64];
+    long requestId = jsonInt(msg->payload, "requestId");
+    const char *ptr, *end;
+    size_t len;
+    int first = 1;
+
+    if (jsonString(msg->payload, "type", type, sizeof(type)) < 0) return 0;
+
+    if (strcmp(type, "GET_APP_AVAILABILITY") == 0) {
+        len = snprintf(out, outLen, "{\"requestId\":%ld,\"responseType\":"
+                                    "\"GET_APP_AVAILABILITY\","
+                                    "\"availability\":{", requestId);
+
+        /* Every application in the request array is answered */
+        ptr = strstr(msg->payload, "\"appId\"");
+        end = (ptr != NULL) ? strchr(ptr, ']') : NULL;
+        if ((ptr != NULL) && (end != NULL)) {
+            ptr = strchr(ptr + 7, '[');
+            while ((ptr != NULL) && (ptr < end) &&
+                       ((ptr = strchr(ptr + 1, '"')) != NULL) && (ptr < end)) {
+                const char *close = strchr(ptr + 1, '"');
+
+                if ((close == NULL) || (close > end) ||
+                        (close - ptr - 1 >= (long) sizeof(appId))) break;
+                (void) memcpy(appId, ptr + 1, close - ptr - 1);
+                appId[close - ptr - 1] = '\0';
+                len += snprintf(out + len, outLen - len, "%s\"%s\":\"%s\"",
+                                (first) ? "" : ",", appId,
+                                (config.unavailable) ? "APP_UNAVAILABLE" :
+                                                       "APP_AVAILABLE");
+                first = 0;
+                ptr = close;
+                if (len >= outLen) return 0;
+            }
+        }
+        (void) snprintf(out + len, outLen - len, "}}");
+        return 1;
+    }
+
+    if (strcmp(type, "GET_STATUS") == 0) {
+        receiverStatus(receiver, out, outLen, requestId);
+        return 1;
+    }
+
+    if (strcmp(type, "LAUNCH") == 0) {
+        if ((jsonString(msg->payload, "appId", appId, sizeof(appId)) < 0) ||
+                (config.unavailable)) {
+            (void) snprintf(out, outLen,
+                            "{\"requestId\":%ld,\"type\":\"LAUNCH_ERROR\","
+                            "\"reason\":\"NOT_FOUND\"}", requestId);
+            return 1;
+        }
+        (void) pthread_mutex_lock(&stateLock);
+        if (strcmp(receiver->runningAppId, appId) != 0) {
+            (void) strcpy(receiver->runningAppId, appId);
+            receiver->sessionCounter++;
+        }
+        (void) pthread_mutex_unlock(&stateLock);
+        return 2;
+    }
+
+    if (strcmp(type, "STOP") == 0) {
+        (void) pthread_mutex_lock(&stateLock);
+        receiver->runningAppId[0] = '\0';
+        (void) pthread_mutex_unlock(&stateLock);
+        receiverStatus(receiver, out, outLen, requestId);
+        return 1;
+    }
+
+    (void) snprintf(out, outLen, "{\"requestId\":%ld,\"type\":"
+                                 "\"INVALID_REQUEST\",\"reason\":"
+                                 "\"INVALID_COMMAND\"}", requestId);
+    return 1;
+}
+
+/* Process a single inbound message, -1 to drop the connection */
+static int handleMessage(SimConnection *conn, SimMessage *msg) {
+    char type[64], response[4096], broadcast[2048];
+    int idx, kind = 0;
+
+    /* Authentication challenges (binary) are refused, see above */
+    if (strcmp(msg->namespace, NS_DEVICE_AUTH) == 0) {
+        return sendFrame(conn, msg->destinationId, msg->sourceId,
+                         msg->namespace, 1, authErrorResp,
+                         sizeof(authErrorResp));
+    }
+    if ((msg->payloadType != 0) || (msg->payload == NULL)) return 0;
+    if (config.verbose) {
+        (void) fprintf(stderr, "[%d] %s -> %s %s: %s\n", conn->fd,
+                       msg->sourceId, msg->destinationId, msg->namespace,
+                       msg->payload);
+    }
+
+    if (strcmp(msg->namespace, NS_CONNECTION) == 0) {
+        if ((jsonString(msg->payload, "type", type, sizeof(type)) == 0) &&
+                (strcmp(type, "CLOSE") == 0)) return -1;
+        return 0;
+    } else if (strcmp(msg->namespace, NS_HEARTBEAT) == 0) {
+        if ((jsonString(msg->payload, "type", type, sizeof(type)) < 0) ||
+                (strcmp(type, "PING") != 0)) return 0;
+        (void) strcpy(response, "{\"type\":\"PONG\"}");
+        kind = 1;
+    } else if (strcmp(msg->namespace, NS_RECEIVER) == 0) {
+        kind = receiverResponse(conn->receiver, msg, response,
+                                sizeof(response));
+    } else if (strcmp(msg->namespace, NS_MEDIA) == 0) {
+        if (jsonInt(msg->payload, "requestId") <= 0) return 0;
+        (void) snprintf(response, sizeof(response),
+                        "{\"requestId\":%ld,\"type\":\"MEDIA_STATUS\","
+                        "\"status\":[{\"mediaSessionId\":1,"
+                        "\"playerState\":\"BUFFERING\"}]}",
+                        jsonInt(msg->payload, "requestId"));
+        kind = 1;
+    }
+    if (kind == 0) return 0;
+
+    /* Injected failures, in order of severity */
+    if (roll(conn, config.disconnectPct)) {
+        TOTAL_INC(injectedFailures);
+        return -1;
+    }
+    if (roll(conn, config.dropPct)) {
+        TOTAL_INC(injectedFailures);
+        return 0;
+    }
+
+    delay(conn, config.latencyMs + ((kind == 2) ? config.launchDelayMs : 0));
+
+    /* Unsolicited status chatter ahead of the response */
+    for (idx = 0; idx < config.burst; idx++) {
+        receiverStatus(conn->receiver, broadcast, sizeof(broadcast), 0);
+        if (sendMessage(conn, "receiver-0", "*", NS_RECEIVER,
+                        broadcast) < 0) return -1;
+    }
+
+    if (roll(conn, config.corruptPct)) {
+        TOTAL_INC(injectedFailures);
+        return (sendMessage(conn, msg->destinationId, msg->sourceId,
+                            msg->namespace, "{\"type\": ") < 0) ? -1 : 0;
+    }
+
+    /* Launches respond with the status of the (now) running application */
+    if (kind == 2) {
+        receiverStatus(conn->receiver, response, sizeof(response),
+                       jsonInt(msg->payload, "requestId"));
+    }
+    return sendMessage(conn, msg->destinationId, msg->sourceId,
+                       msg->namespace, response);
+}
+
+/* Connection thread, handshake and then message processing until closed */
+static void *connectionMain(void *arg) {
+    SimConnection *conn = (SimConnection *) arg;
+    uint8_t lenBuff[4];
+    char src[128], dst[128], ns[128], *payload;
+    SimMessage msg;
+    uint32_t len;
+    int rc;
+
+    if (roll(conn, config.failHandshake)) {
+        TOTAL_INC(injectedFailures);
+        goto done;
+    }
+    delay(conn, config.handshakeDelayMs);
+
+    if (((conn->ssl = SSL_new(serverCtx)) == NULL) ||
+            (SSL_set_fd(conn->ssl, conn->fd) != 1) ||
+            (SSL_accept(conn->ssl) != 1)) {
+        TOTAL_INC(handshakeFailures);
+        goto done;
+    }
+    TOTAL_INC(handshakes);
+
+    conn->frame = (uint8_t *) malloc(MAX_FRAME_SIZE + 4);
+    if (conn->frame == NULL) goto done;
+    while (!shutdownRequested) {
+        if (readFully(conn, lenBuff, 4) < 0) break;
+        len = (((uint32_t) lenBuff[0]) << 24) |
+              (((uint32_t) lenBuff[1]) << 16) |
+              (((uint32_t) lenBuff[2]) << 8) | ((uint32_t) lenBuff[3]);
+        if ((len == 0) || (len > MAX_FRAME_SIZE)) break;
+        if (readFully(conn, conn->frame, (int) len) < 0) break;
+        TOTAL_INC(framesIn);
+
+        if (decodeMessage(conn->frame, len, &msg) < 0) break;
+
+        /* Response framing overwrites the frame, so detach the content */
+        (void) snprintf(src, sizeof(src), "%s", msg.sourceId);
+        (void) snprintf(dst, sizeof(dst), "%s", msg.destinationId);
+        (void) snprintf(ns, sizeof(ns), "%s", msg.namespace);
+        payload = (msg.payload != NULL) ? strdup(msg.payload) : NULL;
+        msg.sourceId = src;
+        msg.destinationId = dst;
+        msg.namespace = ns;
+        msg.payload = payload;
+        rc = handleMessage(conn, &msg);
+        free(payload);
+        if (rc < 0) break;
+    }
+
+done:
+    if (conn->ssl != NULL) {
+        (void) SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    (void) close(conn->fd);
+    free(conn->frame);
+    free(conn);
+    ERR_clear_error();
+    return NULL;
+}
+
+static void onSignal(int sig) {
+    shutdownRequested = 1;
+}
+
+static void usage(const char *prog) {
+    (void) fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -b, --bind ADDR           listen address (127.0.0.1)\n"
+        "  -p, --port PORT           (first) listen port (8009)\n"
+        "  -n, --count N             number of receivers, on consecutive\n"
+        "                            ports from the first (1)\n"
+        "  -c, --cert FILE           PEM certificate (default self-signed)\n"
+        "  -k, --key FILE            PEM private key for the certificate\n"
+        "  -l, --latency MS          delay before each response (0)\n"
+        "  -j, --jitter MS           random +/- variation of the delay (0)\n"
+        "  -H, --handshake-delay MS  delay before the TLS handshake (0)\n"
+        "  -L, --launch-delay MS     additional delay for LAUNCH (0)\n"
+        "  -B, --burst N             unsolicited RECEIVER_STATUS messages\n"
+        "                            sent ahead of each response (0)\n"
+        "  -A, --fail-accept PCT     connections closed on accept (0)\n"
+        "  -F, --fail-handshake PCT  connections closed before TLS (0)\n"
+        "  -D, --drop PCT            requests that get no response (0)\n"
+        "  -C, --corrupt PCT         responses with invalid JSON (0)\n"
+        "  -X, --disconnect PCT      requests answered by a disconnect (0)\n"
+        "  -u, --unavailable         report applications as unavailable\n"
+        "  -s, --seed N              random seed for jitter/failures (1)\n"
+        "  -v, --verbose             log the inbound messages\n", prog);
+}
+
+/**
+ * Main entry point for the simulator, runs until interrupted and then
+ * reports the totals.  For example, to benchmark against 100 receivers (ports
+ * 18009 through 18108) with 20ms +/- 5ms latency and 1% dropped responses:
+ *
+ *   castsim -p 18009 -n 100 -l 20 -j 5 -D 1
+ */
+int main(int argc, char **argv) {
+    static struct option opts[] = {
+        { "bind", required_argument, NULL, 'b' },
+        { "port", required_argument, NULL, 'p' },
+        { "count", required_argument, NULL, 'n' },
+        { "cert", required_argument, NULL, 'c' },
+        { "key", required_argument, NULL, 'k' },
+        { "latency", required_argument, NULL, 'l' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "handshake-delay", required_argument, NULL, 'H' },
+        { "launch-delay", required_argument, NULL, 'L' },
+        { "burst", required_argument, NULL, 'B' },
+        { "fail-accept", required_argument, NULL, 'A' },
+        { "fail-handshake", required_argument, NULL, 'F' },
+        { "drop", required_argument, NULL, 'D' },
+        { "corrupt", required_argument, NULL, 'C' },
+        { "disconnect", required_argument, NULL, 'X' },
+        { "unavailable", no_argument, NULL, 'u' },
+        { "seed", required_argument, NULL, 's' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    SimReceiver *receivers, *receiver;
+    unsigned int connCount = 0;
+    struct sockaddr_in addr;
+    struct pollfd *pfds;
+    struct sigaction sa;
+    SimConnection *conn;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int idx, opt, lfd, fd, one = 1;
+
+    while ((opt = getopt_long(argc, argv, "b:p:n:c:k:l:j:H:L:B:A:F:D:C:X:us:vh",
+                              opts, NULL)) != -1) {
+        switch (opt) {
+            case 'b': config.bindAddr = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'n': config.count = atoi(optarg); break;
+            case 'c': config.certFile = optarg; break;
+            case 'k': config.keyFile = optarg; break;
+            case 'l': config.latencyMs = atoi(optarg); break;
+            case 'j': config.jitterMs = atoi(optarg); break;
+            case 'H': config.handshakeDelayMs = atoi(optarg); break;
+            case 'L': config.launchDelayMs = atoi(optarg); break;
+            case 'B': config.burst = atoi(optarg); break;
+            case 'A': config.failAccept = atoi(optarg); break;
+            case 'F': config.failHandshake = atoi(optarg); break;
+            case 'D': config.dropPct = atoi(optarg); break;
+            case 'C': config.corruptPct = atoi(optarg); break;
+            case 'X': config.disconnectPct = atoi(optarg); break;
+            case 'u': config.unavailable = 1; break;
+            case 's': config.seed = (unsigned int) atoi(optarg); break;
+            case 'v': config.verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+    if ((config.count <= 0) || (config.port + config.count > 65536)) {
+        (void) fprintf(stderr, "Invalid receiver count/port range\n");
+        return 2;
+    }
+    if ((config.certFile == NULL) != (config.keyFile == NULL)) {
+        (void) fprintf(stderr, "Certificate and key must be given together\n");
+        return 2;
+    }
+
+    /* TLS server context, certificate provided or generated */
+    SSL_library_init();
+    SSL_load_error_strings();
+    if ((serverCtx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    if (config.certFile != NULL) {
+        if ((SSL_CTX_use_certificate_chain_file(serverCtx,
+                                                config.certFile) != 1) ||
+                (SSL_CTX_use_PrivateKey_file(serverCtx, config.keyFile,
+                                             SSL_FILETYPE_PEM) != 1)) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+    } else if (generateCertificate(serverCtx) < 0) {
+        (void) fprintf(stderr, "Failed to generate self-signed certificate\n");
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    /* Listening sockets on consecutive ports, localhost by default */
+    receivers = (SimReceiver *) calloc(config.count, sizeof(SimReceiver));
+    pfds = (struct pollfd *) calloc(config.count, sizeof(struct pollfd));
+    if ((receivers == NULL) || (pfds == NULL)) {
+        (void) fprintf(stderr, "Failed to allocate receivers\n");
+        return 1;
+    }
+    (void) memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, config.bindAddr, &(addr.sin_addr)) != 1) {
+        (void) fprintf(stderr, "Invalid bind address '%s'\n", config.bindAddr);
+        return 2;
+    }
+    for (idx = 0; idx < config.count; idx++) {
+        receivers[idx].port = config.port + idx;
+        receivers[idx].acceptRnd = config.seed + idx;
+        addr.sin_port = htons((uint16_t) receivers[idx].port);
+        if (((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+                (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one,
+                            sizeof(one)) < 0) ||
+                (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+                (listen(lfd, 1024) < 0)) {
+            (void) fprintf(stderr, "Unable to listen on %s:%d: %s\n",
+                           config.bindAddr, receivers[idx].port,
+                           strerror(errno));
+            return 1;
+        }
+        receivers[idx].fd = lfd;
+        pfds[idx].fd = lfd;
+        pfds[idx].events = POLLIN;
+    }
+
+    /* Interrupt (no restart) to break out of the wait and report */
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    /* Thread per connection, modest stacks so thousands are feasible */
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    (void) pthread_attr_setstacksize(&attr, 128 * 1024);
+    (void) fprintf(stderr, "castsim listening on %s:%d-%d\n",
+                   config.bindAddr, config.port,
+                   config.port + config.count - 1);
+    while (!shutdownRequested) {
+        if (poll(pfds, config.count, -1) < 0) {
+            if (errno == EINTR) continue;
+            (void) fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+            break;
+        }
+        for (idx = 0; idx < config.count; idx++) {
+            if ((pfds[idx].revents & POLLIN) == 0) continue;
+            receiver = &(receivers[idx]);
+            if ((fd = accept(receiver->fd, NULL, NULL)) < 0) continue;
+            TOTAL_INC(accepted);
+            if ((config.failAccept > 0) &&
+                    ((int) (rand_r(&(receiver->acceptRnd)) % 100) <
+                                                       config.failAccept)) {
+                TOTAL_INC(injectedFailures);
+                (void) close(fd);
+                continue;
+            }
+            (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            conn = (SimConnection *) calloc(1, sizeof(SimConnection));
+            if (conn == NULL) {
+                (void) close(fd);
+                continue;
+            }
+            conn->receiver = receiver;
+            conn->fd = fd;
+            conn->rndState = config.seed + (++connCount);
+            if (pthread_create(&thread, &attr, connectionMain, conn) != 0) {
+                (void) close(fd);
+                free(conn);
+            }
+        }
+    }
+
+    (void) fprintf(stderr, "accepted=%lld handshakes=%lld "
+                           "handshake_failures=%lld frames_in=%lld "
+                           "frames_out=%lld injected_failures=%lld\n",
+                   (long long) totals.accepted, (long long) totals.handshakes,
+                   (long long) totals.handshakeFailures,
+                   (long long) totals.framesIn, (long long) totals.framesOut,
+                   (long long) totals.injectedFailures);
+    for (idx = 0; idx < config.count; idx++) (void) close(receivers[idx].fd);
+    return 0;
+}
@@ -0,0 +1,515 @@
+/*
+ * Micro-benchmarks for the framing and parsing hot paths of the core library
+ * (libcastptl), measured in isolation from the network and the PHP engine.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_core.h"
+#include <getopt.h>
+#include <time.h>
+
+/*
+ * The benchmarks drive the same entry points as the extension:
+ *
+ *   encode/N      castSendMessage() of an N byte (JSON string) payload to a
+ *                 simulated connection (test mode, the frame is encoded and
+ *                 accounted but not written)
+ *   decode/NAME   castProcessFiltered() of a TLS record holding multiple
+ *                 frames, JSON decode and receiver status tracking included
+ *   mdns/NAME     castDiscoverParse() of the captured discovery responses
+ *                 (the cptl_testctl() datasets)
+ *
+ * Each reports ns/op (median of the repeats, with the minimum) and bytes/s of
+ * the frame or packet content.  Results can be saved as a baseline and later
+ * runs compared against it, which is only meaningful for the same host and
+ * build options (there is deliberately no baseline in the source tree).
+ */
+
+/* Maximum plaintext of a TLS record, the limit of a single read burst */
+#define TLS_RECORD_LIMIT 16384
+
+/* Limit on the benchmark cases and the baseline entries */
+#define MAX_CASES 32
+
+/* Settings from the command line */
+static struct {
+    int periodMs;
+    int repeats;
+    const char *filter;
+    const char *saveFile;
+    const char *compareFile;
+    double thresholdPct;
+} config = { 200, 5, NULL, NULL, NULL, 5.0 };
+
+/* Single benchmark case, the op function runs the given iterations */
+typedef struct BenchCase {
+    char name[64];
+    int (*op)(struct BenchCase *bc, long iterations);
+    size_t bytesPerOp;
+    int intArg;
+    uint8_t *data;
+    size_t dataLen;
+    double nsPerOp, nsMin;
+} BenchCase;
+
+static BenchCase cases[MAX_CASES];
+static int caseCount = 0;
+
+/* Simulated device connection and the response count of the decode filter */
+static CastDeviceConnection benchConn;
+static CastMessageFilter matchAll;
+static long responses = 0;
+
+/* Warnings from the core mean a broken case, the numbers would be invalid */
+static long warnings = 0;
+
+static void benchLogger(int level, const char *msg) {
+    if (level == CPTL_LOG_WARNING) warnings++;
+    (void) fprintf(stderr, "cptlbench: %s\n", msg);
+}
+
+static int64_t nowNsec() {
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Sample messages, as issued by a receiver running a media application */
+static const char *receiverStatus =
+    "{\"requestId\":0,\"status\":{\"applications\":[{\"appId\":\"02834648\","
+    "\"displayName\":\"Portal\",\"isIdleScreen\":false,"
+    "\"launchedFromCloud\":false,\"namespaces\":["
+    "{\"name\":\"urn:x-cast:com.google.cast.media\"},"
+    "{\"name\":\"urn:x-cast:com.google.cast.debugoverlay\"}],"
+    "\"sessionId\":\"5a4bc2e0-7d61-4b5e-9a4f-0c2f6e8d3b17\","
+    "\"statusText\":\"Portal\","
+    "\"transportId\":\"5a4bc2e0-7d61-4b5e-9a4f-0c2f6e8d3b17\"}],"
+    "\"userEq\":{},\"volume\":{\"controlType\":\"attenuation\","
+    "\"level\":0.5,\"muted\":false,\"stepInterval\":0.05}},"
+    "\"type\":\"RECEIVER_STATUS\"}";
+
+static const char *mediaStatus =
+    "{\"type\":\"MEDIA_STATUS\",\"status\":[{\"mediaSessionId\":1,"
+    "\"playbackRate\":1,\"playerState\":\"PLAYING\",\"currentTime\":12.5,"
+    "\"supportedMediaCommands\":274447,\"volume\":{\"level\":1,"
+    "\"muted\":false},\"activeTrackIds\":[],\"media\":{"
+    "\"contentId\":\"https://media.example.com/video/bunny.mp4\","
+    "\"streamType\":\"BUFFERED\",\"contentType\":\"video/mp4\","
+    "\"metadata\":{\"type\":0,\"metadataType\":0,\"title\":\"Big Buck Bunny\","
+    "\"images\":[{\"url\":\"https://media.example.com/video/bunny.jpg\"}]},"
+    "\"duration\":596.5},\"currentItemId\":1,\"items\":[{\"itemId\":1,"
+    "\"media\":{\"contentId\":\"https://media.example.com/video/bunny.mp4\"},"
+    "\"autoplay\":true,\"orderId\":0}],\"repeatMode\":\"REPEAT_OFF\"}],"
+    "\"requestId\":0}";
+
+static const char *pong = "{\"type\":\"PONG\"}";
+
+/* Encode of an outbound message (LOAD request padded to the payload size) */
+static int encodeOp(BenchCase *bc, long iterations) {
+    long idx;
+
+    for (idx = 0; idx < iterations; idx++) {
+        if (castSendMessage(&benchConn, TRUE, TRUE, NS_MEDIA,
+                            bc->data, -1) < 0) return -1;
+    }
+
+    return 0;
+}
+
+static int addEncodeCase(int payloadLen) {
+    static const char *prefix =
+        "{\"type\":\"LOAD\",\"requestId\":1,\"media\":{\"contentId\":\"";
+    BenchCase *bc = cases + caseCount;
+    size_t fixedLen = strlen(prefix) + 3;
+    uint8_t frameData[64];
+    WXBuffer frame;
+
+    if ((size_t) payloadLen < fixedLen) payloadLen = (int) fixedLen;
+    bc->data = (uint8_t *) malloc(payloadLen + 1);
+    if (bc->data == NULL) return -1;
+    (void) strcpy((char *) bc->data, prefix);
+    (void) memset(bc->data + strlen(prefix), 'x', payloadLen - fixedLen);
+    (void) strcpy((char *) bc->data + payloadLen - 3, "\"}}");
+    bc->dataLen = payloadLen;
+
+    /* Throughput is of the encoded frame */
+    WXBuffer_InitLocal(&frame, frameData, sizeof(frameData));
+    if (castEncodeFrame(&frame, CPTL_SENDER_SESSION_ID,
+                        CPTL_PORTAL_RECEIVER_ID, castNamespaceName(NS_MEDIA),
+                        bc->data, -1) < 0) return -1;
+    bc->bytesPerOp = frame.length;
+    WXBuffer_Destroy(&frame);
+
+    (void) snprintf(bc->name, sizeof(bc->name), "encode/%d", payloadLen);
+    bc->op = encodeOp;
+    caseCount++;
+    return 0;
+}
+
+/* Decode of an inbound record, every frame is matched (and JSON parsed) */
+static void *countResponse(CastDeviceConnection *conn, void *content,
+                           size_t contentLen) {
+    responses++;
+    return NULL;
+}
+
+static int decodeOp(BenchCase *bc, long iterations) {
+    WXBuffer *rdBuffer = &(benchConn.readBuffer);
+    long idx;
+
+    for (idx = 0; idx < iterations; idx++) {
+        /* Refill per op, as decode rewrites and consumes the buffer */
+        rdBuffer->length = rdBuffer->offset = 0;
+        if (WXBuffer_Append(rdBuffer, bc->data, bc->dataLen,
+                            TRUE) == NULL) return -1;
+        if (castProcessFiltered(&benchConn, &matchAll) != NULL) return -1;
+    }
+
+    return 0;
+}
+
+/* Frames are appended to the case record, NULL message ends the list */
+static int addDecodeCase(const char *name, const char **messages,
+                         int repeat) {
+    BenchCase *bc = cases + caseCount;
+    const char *sourceId, *destId;
+    CastNamespace namespace;
+    WXBuffer record;
+    int idx, frames = 0;
+    size_t mark;
+
+    if (WXBuffer_Init(&record, TLS_RECORD_LIMIT) == NULL) return -1;
+    do {
+        for (idx = 0; messages[idx] != NULL; idx++) {
+            if (messages[idx] == receiverStatus) {
+                namespace = NS_RECEIVER;
+                sourceId = CPTL_RECEIVER_ID;
+                destId = CPTL_SENDER_ID;
+            } else if (messages[idx] == pong) {
+                namespace = NS_HEARTBEAT;
+                sourceId = CPTL_RECEIVER_ID;
+                destId = CPTL_SENDER_ID;
+            } else {
+                namespace = NS_MEDIA;
+                sourceId = "5a4bc2e0-7d61-4b5e-9a4f-0c2f6e8d3b17";
+                destId = CPTL_SENDER_SESSION_ID;
+            }
+            mark = record.length;
+            if (castEncodeFrame(&record, sourceId, destId,
+                                castNamespaceName(namespace),
+                                (void *) messages[idx], -1) < 0) return -1;
+
+            /* Bursts are filled up to (not beyond) a single record */
+            if (record.length > TLS_RECORD_LIMIT) {
+                record.length = mark;
+                repeat = 0;
+                break;
+            }
+            frames++;
+        }
+    } while (--repeat > 0);
+
+    bc->data = (uint8_t *) malloc(record.length);
+    if (bc->data == NULL) return -1;
+    (void) memcpy(bc->data, record.buffer, record.length);
+    bc->dataLen = bc->bytesPerOp = record.length;
+    bc->intArg = frames;
+    WXBuffer_Destroy(&record);
+
+    (void) snprintf(bc->name, sizeof(bc->name), "decode/%s", name);
+    bc->op = decodeOp;
+    caseCount++;
+    return 0;
+}
+
+/* Parse of a discovery response, with the record setup of castDiscover */
+static int mdnsOp(BenchCase *bc, long iterations) {
+    CastDeviceInfo info;
+    long idx;
+
+    for (idx = 0; idx < iterations; idx++) {
+        (void) memset(&info, 0, sizeof(info));
+        (void) strcpy(info.model, "Chromecast");
+        info.port = 8009;
+        if (castDiscoverParse(bc->data, bc->dataLen, &info) != 0) return -1;
+    }
+
+    return 0;
+}
+
+static int addMdnsCase(const char *name, int respIdx) {
+    BenchCase *bc = cases + caseCount;
+
+    bc->data = (uint8_t *) castDiscoverTestResponse(respIdx, &(bc->dataLen));
+    if (bc->data == NULL) return -1;
+    bc->bytesPerOp = bc->dataLen;
+
+    (void) snprintf(bc->name, sizeof(bc->name), "mdns/%s", name);
+    bc->op = mdnsOp;
+    caseCount++;
+    return 0;
+}
+
+/* Check a single op for the expected outcome before timing anything */
+static int verifyCase(BenchCase *bc) {
+    responses = 0;
+    warnings = 0;
+    if ((*(bc->op))(bc, 1) < 0) return -1;
+    if (warnings != 0) return -1;
+    if (bc->op == decodeOp) {
+        if ((responses != bc->intArg) ||
+                (benchConn.readBuffer.length != 0)) return -1;
+    }
+
+    return 0;
+}
+
+/* Time the given iterations, returning the elapsed nanoseconds (or -1) */
+static int64_t timeCase(BenchCase *bc, long iterations) {
+    int64_t start = nowNsec();
+
+    if ((*(bc->op))(bc, iterations) < 0) return -1;
+    return nowNsec() - start;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+    double da = *((const double *) a), db = *((const double *) b);
+    return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+/* Calibrate the iterations to the period, then take the repeats */
+static int runCase(BenchCase *bc) {
+    int64_t elapsed, target = ((int64_t) config.periodMs) * 1000000;
+    double samples[64];
+    long iterations = 1;
+    int idx;
+
+    while (TRUE) {
+        if ((elapsed = timeCase(bc, iterations)) < 0) return -1;
+        if (elapsed >= target / 10) break;
+        iterations *= 2;
+    }
+    if (elapsed < 1) elapsed = 1;
+    iterations = (long) ((double) iterations * target / elapsed);
+    if (iterations < 1) iterations = 1;
+
+    for (idx = 0; idx < config.repeats; idx++) {
+        if ((elapsed = timeCase(bc, iterations)) < 0) return -1;
+        samples[idx] = (double) elapsed / iterations;
+    }
+    if (warnings != 0) return -1;
+
+    qsort(samples, config.repeats, sizeof(double), cmpDouble);
+    bc->nsPerOp = samples[config.repeats / 2];
+    bc->nsMin = samples[0];
+    return 0;
+}
+
+/* Baseline entries, as saved by a prior run */
+static struct {
+    char name[64];
+    double bytesPerOp, nsPerOp;
+} baseline[MAX_CASES];
+static int baselineCount = 0;
+
+static int loadBaseline(const char *fileName) {
+    char line[256];
+    FILE *fp;
+
+    if ((fp = fopen(fileName, "r")) == NULL) {
+        (void) fprintf(stderr, "Unable to open baseline '%s'\n", fileName);
+        return -1;
+    }
+    while ((fgets(line, sizeof(line), fp) != NULL) &&
+                (baselineCount < MAX_CASES)) {
+        if ((line[0] == '#') || (line[0] == '\n')) continue;
+        if (sscanf(line, "%63s %lf %lf", baseline[baselineCount].name,
+                   &(baseline[baselineCount].bytesPerOp),
+                   &(baseline[baselineCount].nsPerOp)) == 3) {
+            baselineCount++;
+        }
+    }
+    (void) fclose(fp);
+
+    return 0;
+}
+
+static int saveBaseline(const char *fileName) {
+    FILE *fp;
+    int idx;
+
+    if ((fp = fopen(fileName, "w")) == NULL) {
+        (void) fprintf(stderr, "Unable to write baseline '%s'\n", fileName);
+        return -1;
+    }
+    (void) fprintf(fp, "# cptlbench baseline: name bytes_per_op ns_per_op\n");
+    for (idx = 0; idx < caseCount; idx++) {
+        if (cases[idx].nsPerOp <= 0.0) continue;
+        (void) fprintf(fp, "%s %zu %.2f\n", cases[idx].name,
+                       cases[idx].bytesPerOp, cases[idx].nsPerOp);
+    }
+    if (fclose(fp) != 0) {
+        (void) fprintf(stderr, "Failed to write baseline '%s'\n", fileName);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Report a case, with the comparison to the baseline if loaded */
+static int reportCase(BenchCase *bc) {
+    double delta;
+    int idx;
+
+    (void) printf("%-18s %8zu %10.1f %10.1f %10.2f", bc->name, bc->bytesPerOp,
+                  bc->nsPerOp, bc->nsMin,
+                  bc->bytesPerOp * 1000.0 / bc->nsPerOp);
+    if (config.compareFile == NULL) {
+        (void) printf("\n");
+        return 0;
+    }
+
+    for (idx = 0; idx < baselineCount; idx++) {
+        if (strcmp(baseline[idx].name, bc->name) == 0) break;
+    }
+    if (idx == baselineCount) {
+        (void) printf(" %10s\n", "new");
+        return 0;
+    }
+    delta = 100.0 * (bc->nsPerOp - baseline[idx].nsPerOp) /
+                                                   baseline[idx].nsPerOp;
+    if (baseline[idx].bytesPerOp != (double) bc->bytesPerOp) {
+        /* Different inputs, the times are not comparable */
+        (void) printf(" %10.1f %+7.1f%% (bytes/op differ)\n",
+                      baseline[idx].nsPerOp, delta);
+        return 0;
+    }
+    (void) printf(" %10.1f %+7.1f%%%s\n", baseline[idx].nsPerOp, delta,
+                  (delta > config.thresholdPct) ? " REGRESSION" : "");
+    return (delta > config.thresholdPct) ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    (void) fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -t, --period MS           minimum duration of each repeat (200)\n"
+        "  -r, --repeats N           timed repeats, median is reported (5)\n"
+        "  -f, --filter STR          only run cases with names containing\n"
+        "                            the string (e.g. decode/)\n"
+        "  -s, --save FILE           save the results as a baseline\n"
+        "  -c, --compare FILE        compare to a baseline, exits 1 if any\n"
+        "                            case is slower beyond the threshold\n"
+        "  -T, --threshold PCT       regression threshold for -c (5)\n",
+        prog);
+}
+
+/**
+ * Main entry point for the micro-benchmarks, runs the (selected) cases and
+ * reports/saves/compares the results.  For example, to measure a change:
+ *
+ *   cptlbench -s before.txt
+ *   (rebuild with the change)
+ *   cptlbench -c before.txt
+ */
+int main(int argc, char **argv) {
+    static struct option opts[] = {
+        { "period", required_argument, NULL, 't' },
+        { "repeats", required_argument, NULL, 'r' },
+        { "filter", required_argument, NULL, 'f' },
+        { "save", required_argument, NULL, 's' },
+        { "compare", required_argument, NULL, 'c' },
+        { "threshold", required_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    /* Typical status exchange and a burst of (queued) media updates */
+    const char *statusRecord[] = { receiverStatus, mediaStatus, pong, NULL };
+    const char *mediaBurst[] = { mediaStatus, NULL };
+    static int payloadLens[] = { 64, 256, 1024, 4096, 16384 };
+    CastCoreContext ctx;
+    int opt, idx, rc = 0;
+
+    while ((opt = getopt_long(argc, argv, "t:r:f:s:c:T:h",
+                              opts, NULL)) != -1) {
+        switch (opt) {
+            case 't': config.periodMs = atoi(optarg); break;
+            case 'r': config.repeats = atoi(optarg); break;
+            case 'f': config.filter = optarg; break;
+            case 's': config.saveFile = optarg; break;
+            case 'c': config.compareFile = optarg; break;
+            case 'T': config.thresholdPct = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+    if ((config.periodMs <= 0) || (config.repeats <= 0) ||
+            (config.repeats > 64)) {
+        (void) fprintf(stderr, "Period must be positive, repeats 1 to 64\n");
+        return 2;
+    }
+    if ((config.compareFile != NULL) &&
+            (loadBaseline(config.compareFile) < 0)) return 2;
+
+    /* Standalone host of the core, test mode bypasses the socket writes */
+    (void) memset(&ctx, 0, sizeof(ctx));
+    castCoreConfigDefaults(&(ctx.config));
+    castCoreBind(&ctx);
+    if (castCoreStartup(NULL, benchLogger) < 0) return 1;
+    castCoreRequestBegin();
+    CPTL_CTX(testMode) = 1;
+    if (WXBuffer_Init(&(benchConn.readBuffer), TLS_RECORD_LIMIT) == NULL) {
+        (void) fprintf(stderr, "Unable to allocate the read buffer\n");
+        return 1;
+    }
+    matchAll.forSenderSession = matchAll.fromPortalReceiver = -1;
+    matchAll.namespace = NS_ANY;
+    matchAll.expJsonResponse = -1;
+    matchAll.responseCallback = countResponse;
+
+    for (idx = 0; idx < (int) (sizeof(payloadLens) / sizeof(int)); idx++) {
+        if (addEncodeCase(payloadLens[idx]) < 0) rc = -1;
+    }
+    if ((addDecodeCase("status", statusRecord, 1) < 0) ||
+            (addDecodeCase("burst", mediaBurst, 1000) < 0) ||
+            (addMdnsCase("v4", 0) < 0) || (addMdnsCase("v6", 1) < 0)) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        (void) fprintf(stderr, "Unable to set up the benchmark cases\n");
+        return 1;
+    }
+
+    (void) printf("period=%dms repeats=%d\n", config.periodMs,
+                  config.repeats);
+    (void) printf("%-18s %8s %10s %10s %10s", "benchmark", "bytes/op",
+                  "ns/op", "min", "MB/s");
+    if (config.compareFile != NULL) {
+        (void) printf(" %10s %8s", "base", "delta");
+    }
+    (void) printf("\n");
+
+    for (idx = 0; idx < caseCount; idx++) {
+        if ((config.filter != NULL) &&
+                (strstr(cases[idx].name, config.filter) == NULL)) continue;
+        if ((verifyCase(cases + idx) < 0) || (runCase(cases + idx) < 0)) {
+            (void) fprintf(stderr, "%s: failed, no result\n",
+                           cases[idx].name);
+            rc = 1;
+            continue;
+        }
+        if (reportCase(cases + idx) != 0) rc = 1;
+    }
+
+    if ((config.saveFile != NULL) && (saveBaseline(config.saveFile) < 0)) {
+        rc = 1;
+    }
+    WXBuffer_Destroy(&(benchConn.readBuffer));
+    castCoreRequestEnd();
+    castCoreShutdown();
+
+    return rc;
+}
@@ -0,0 +1,45 @@
+/*
+ * Standalone reader for the cast portal shared metrics segment, aggregating
+ * the counters of all of the worker processes in Prometheus text format.
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#include "castptl_metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Writer callback for the metrics formatter, straight to the output stream */
+static void writeMetrics(void *ctx, const char *text, size_t len) {
+    (void) fwrite(text, 1, len, (FILE *) ctx);
+}
+
+/**
+ * Main entry point for the reader, renders the segment named by the argument
+ * (the castportal.metrics_file setting) to standard output.  Suitable for a
+ * node exporter textfile collector or an inetd/CGI style scrape endpoint.
+ */
+int main(int argc, char **argv) {
+    const char *errMsg = NULL;
+    CastMetricsHeader *hdr;
+    size_t mapLen;
+
+    if ((argc != 2) || (strcmp(argv[1], "-h") == 0)) {
+        (void) fprintf(stderr, "Usage: %s <metrics-file>\n", argv[0]);
+        return 2;
+    }
+
+    hdr = castMetricsOpen(argv[1], &mapLen, &errMsg);
+    if (hdr == NULL) {
+        (void) fprintf(stderr, "Unable to open metrics segment '%s': %s\n",
+                       argv[1], errMsg);
+        return 1;
+    }
+
+    castMetricsFormat(hdr, writeMetrics, stdout);
+    (void) munmap(hdr, mapLen);
+
+    return (fflush(stdout) == 0) ? 0 : 1;
+}
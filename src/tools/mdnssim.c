@@ -0,0 +1,516 @@
+/*
+ * Simulated population of cast devices answering the mDNS discovery query, for
+ * discovery scaling tests (no cptl_testctl() fixed responses).
+ *
+ * Copyright (C) 2016-2019 J.M. Heisz.  All Rights Reserved.
+ * See the LICENSE file accompanying the distribution your rights to use
+ * this software.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * The querier (castDiscover) sends from an ephemeral port, so answers are
+ * legacy unicast (RFC6762, section 6.7) to the query source, with the query
+ * transaction id.  Device addresses are taken from the source of the answer,
+ * so each simulated device answers from its own loopback address (127/8 is
+ * local in its entirety on Linux), selected per packet through IP_PKTINFO.
+ *
+ * Multicast must be enabled on the loopback interface, ideally within a
+ * network namespace so real devices (and the rest of the host) are excluded:
+ *
+ *   ip netns add castsim
+ *   ip netns exec castsim ip link set lo up multicast on
+ *   ip netns exec castsim ip route add 224.0.0.0/4 dev lo
+ *   ip netns exec castsim mdnssim -n 1000 &
+ *   ip netns exec castsim php ... bench/discovery_bench.php --external
+ */
+
+#define MDNS_PORT 5353
+#define MDNS_MSG_LIMIT 9000
+
+/* Device answers are less than 400 bytes, this many fit in a packet */
+#define MAX_PACK 22
+
+/* Behaviour of the simulator, from the command line */
+static struct {
+    int devices;
+    const char *interfaceAddr;
+    struct in_addr baseAddr;
+    int castPort, sequentialPorts;
+    int delayMs, spreadMs, lossPct, pack;
+    uint32_t ttl, txtTtl;
+    unsigned int seed;
+    int verbose;
+} config = {
+    100, "127.0.0.1", { 0 }, 8009, 0, 0, 100, 0, 1, 120, 4500, 1, 0
+};
+
+/* Answers pending transmission, scheduled per query */
+typedef struct {
+    int64_t due;
+    int device;
+    uint16_t txnId;
+    struct sockaddr_in dest;
+} PendingAnswer;
+
+static PendingAnswer *pending = NULL;
+static int pendingCount = 0, pendingAlloc = 0;
+
+/* Running totals, reported on exit */
+static struct {
+    int64_t queries, ignored, packets, answers, lost;
+} totals;
+
+static volatile sig_atomic_t shutdownRequested = 0;
+
+static int64_t nowUsec() {
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Loopback address of the indexed device */
+static struct in_addr deviceAddr(int device) {
+    struct in_addr addr;
+
+    addr.s_addr = htonl(ntohl(config.baseAddr.s_addr) + (uint32_t) device);
+    return addr;
+}
+
+/* Buffer append helpers, the packet limit is checked by the caller */
+static uint8_t *put16(uint8_t *ptr, uint16_t val) {
+    *(ptr++) = (uint8_t) (val >> 8);
+    *(ptr++) = (uint8_t) val;
+    return ptr;
+}
+static uint8_t *put32(uint8_t *ptr, uint32_t val) {
+    ptr = put16(ptr, (uint16_t) (val >> 16));
+    return put16(ptr, (uint16_t) val);
+}
+static uint8_t *putLabel(uint8_t *ptr, const char *label) {
+    size_t len = strlen(label);
+
+    *(ptr++) = (uint8_t) len;
+    (void) memcpy(ptr, label, len);
+    return ptr + len;
+}
+static uint8_t *putPointer(uint8_t *ptr, size_t offset) {
+    return put16(ptr, (uint16_t) (0xC000 | offset));
+}
+
+/* Offsets of the names in the packet, for compression */
+#define SERVICE_NAME_OFFSET 12
+#define LOCAL_NAME_OFFSET (SERVICE_NAME_OFFSET + 1 + 11 + 1 + 4)
+
+/*
+ * Append the answer (PTR) records for the devices, followed by the additional
+ * records (TXT, SRV, A) for each, in the form of a real device response.  The
+ * header counts are updated accordingly.
+ */
+static size_t buildAnswer(uint8_t *packet, uint16_t txnId, int *devices,
+                          int count) {
+    uint8_t *ptr = packet, *lenPtr, *start;
+    size_t instanceOffset[MAX_PACK];
+    char label[64], txt[96];
+    struct in_addr addr;
+    int idx, dev;
+
+    ptr = put16(ptr, txnId);
+    ptr = put16(ptr, 0x8400);
+    ptr = put16(ptr, 0);
+    ptr = put16(ptr, (uint16_t) count);
+    ptr = put16(ptr, 0);
+    ptr = put16(ptr, (uint16_t) (3 * count));
+
+    /* Service name appears once, the rest are references to it */
+    for (idx = 0; idx < count; idx++) {
+        if (idx == 0) {
+            ptr = putLabel(ptr, "_googlecast");
+            ptr = putLabel(ptr, "_tcp");
+            ptr = putLabel(ptr, "local");
+            *(ptr++) = 0;
+        } else {
+            ptr = putPointer(ptr, SERVICE_NAME_OFFSET);
+        }
+        ptr = put16(ptr, 0x0C);
+        ptr = put16(ptr, 0x0001);
+        ptr = put32(ptr, config.ttl);
+        lenPtr = ptr;
+        ptr += 2;
+        instanceOffset[idx] = ptr - packet;
+        (void) snprintf(label, sizeof(label), "Chromecast-sim%08x",
+                        (unsigned int) devices[idx]);
+        ptr = putLabel(ptr, label);
+        ptr = putPointer(ptr, SERVICE_NAME_OFFSET);
+        (void) put16(lenPtr, (uint16_t) (ptr - lenPtr - 2));
+    }
+
+    for (idx = 0; idx < count; idx++) {
+        dev = devices[idx];
+
+        /* TXT, the identifier, friendly name and model are significant */
+        ptr = putPointer(ptr, instanceOffset[idx]);
+        ptr = put16(ptr, 0x10);
+        ptr = put16(ptr, 0x8001);
+        ptr = put32(ptr, config.txtTtl);
+        lenPtr = ptr;
+        ptr += 2;
+        (void) snprintf(txt, sizeof(txt), "id=%08x%024x",
+                        (unsigned int) dev, 0x5137u);
+        ptr = putLabel(ptr, txt);
+        (void) snprintf(txt, sizeof(txt), "cd=%032X", (unsigned int) dev);
+        ptr = putLabel(ptr, txt);
+        ptr = putLabel(ptr, "ve=05");
+        ptr = putLabel(ptr, "md=Chromecast");
+        ptr = putLabel(ptr, "ic=/setup/icon.png");
+        (void) snprintf(txt, sizeof(txt), "fn=Simulated %d", dev);
+        ptr = putLabel(ptr, txt);
+        ptr = putLabel(ptr, "ca=4101");
+        ptr = putLabel(ptr, "st=0");
+        ptr = putLabel(ptr, "nf=1");
+        ptr = putLabel(ptr, "rs=");
+        (void) put16(lenPtr, (uint16_t) (ptr - lenPtr - 2));
+
+        /* SRV, port of interest and the target host name */
+        ptr = putPointer(ptr, instanceOffset[idx]);
+        ptr = put16(ptr, 0x21);
+        ptr = put16(ptr, 0x8001);
+        ptr = put32(ptr, config.ttl);
+        lenPtr = ptr;
+        ptr += 2;
+        ptr = put16(ptr, 0);
+        ptr = put16(ptr, 0);
+        ptr = put16(ptr, (uint16_t) (config.castPort +
+                                 ((config.sequentialPorts) ? dev : 0)));
+        start = ptr;
+        (void) snprintf(label, sizeof(label), "sim-%08x", (unsigned int) dev);
+        ptr = putLabel(ptr, label);
+        ptr = putPointer(ptr, LOCAL_NAME_OFFSET);
+        (void) put16(lenPtr, (uint16_t) (ptr - lenPtr - 2));
+
+        /* A, for the target host */
+        ptr = putPointer(ptr, start - packet);
+        ptr = put16(ptr, 0x01);
+        ptr = put16(ptr, 0x8001);
+        ptr = put32(ptr, config.ttl);
+        ptr = put16(ptr, 4);
+        addr = deviceAddr(dev);
+        (void) memcpy(ptr, &addr, 4);
+        ptr += 4;
+    }
+
+    return ptr - packet;
+}
+
+/* Send a packet to the querier from the address of the (first) device */
+static void sendAnswer(int fd, PendingAnswer *answers, int count) {
+    uint8_t packet[MDNS_MSG_LIMIT];
+    int devices[MAX_PACK], idx;
+    char cbuf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct in_pktinfo *pktInfo;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+
+    for (idx = 0; idx < count; idx++) devices[idx] = answers[idx].device;
+    iov.iov_base = packet;
+    iov.iov_len = buildAnswer(packet, answers[0].txnId, devices, count);
+
+    (void) memset(&msg, 0, sizeof(msg));
+    (void) memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_name = &(answers[0].dest);
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    pktInfo = (struct in_pktinfo *) CMSG_DATA(cmsg);
+    pktInfo->ipi_spec_dst = deviceAddr(answers[0].device);
+
+    if (sendmsg(fd, &msg, 0) < 0) {
+        (void) fprintf(stderr, "Answer send failed: %s\n", strerror(errno));
+        return;
+    }
+    totals.packets++;
+    totals.answers += count;
+}
+
+static int compareDue(const void *a, const void *b) {
+    int64_t diff = ((PendingAnswer *) a)->due - ((PendingAnswer *) b)->due;
+
+    return (diff < 0) ? -1 : ((diff > 0) ? 1 : 0);
+}
+
+/* Schedule the answers of every device (less the losses) for the query */
+static void scheduleAnswers(uint16_t txnId, struct sockaddr_in *src) {
+    int64_t base = nowUsec() + ((int64_t) config.delayMs) * 1000;
+    PendingAnswer *answer;
+    int dev;
+
+    if (pendingCount + config.devices > pendingAlloc) {
+        pendingAlloc = pendingCount + config.devices;
+        pending = (PendingAnswer *) realloc(pending, pendingAlloc *
+                                                  sizeof(PendingAnswer));
+        if (pending == NULL) {
+            (void) fprintf(stderr, "Failed to allocate answer schedule\n");
+            exit(1);
+        }
+    }
+    for (dev = 0; dev < config.devices; dev++) {
+        if ((config.lossPct > 0) &&
+                ((rand() % 100) < config.lossPct)) {
+            totals.lost++;
+            continue;
+        }
+        answer = &(pending[pendingCount++]);
+        answer->due = base;
+        if (config.spreadMs > 0) {
+            answer->due += ((int64_t) (rand() % (config.spreadMs * 1000 + 1)));
+        }
+        answer->device = dev;
+        answer->txnId = txnId;
+        answer->dest = *src;
+    }
+    qsort(pending, pendingCount, sizeof(PendingAnswer), compareDue);
+}
+
+/* Dispatch everything that is due, packed if so configured */
+static void dispatchAnswers(int fd) {
+    int64_t now = nowUsec();
+    int count = 0, batch;
+
+    while ((count < pendingCount) && (pending[count].due <= now)) {
+        /* Packed answers must share the query they're answering */
+        for (batch = 1; (batch < config.pack) &&
+                        (count + batch < pendingCount) &&
+                        (pending[count + batch].due <= now) &&
+                        (pending[count + batch].txnId ==
+                                             pending[count].txnId) &&
+                        (memcmp(&(pending[count + batch].dest),
+                                &(pending[count].dest),
+                                sizeof(struct sockaddr_in)) == 0); batch++) {
+            continue;
+        }
+        sendAnswer(fd, pending + count, batch);
+        count += batch;
+    }
+    if (count > 0) {
+        pendingCount -= count;
+        (void) memmove(pending, pending + count,
+                       pendingCount * sizeof(PendingAnswer));
+    }
+}
+
+/* Determine if the packet is a query for the cast service (PTR) */
+static int isCastQuery(uint8_t *packet, ssize_t len) {
+    static const uint8_t qname[] = "\x0b_googlecast\x04_tcp\x05local";
+    uint16_t flags, questions;
+
+    if (len < 12 + (ssize_t) sizeof(qname) + 4) return 0;
+    flags = (uint16_t) ((packet[2] << 8) | packet[3]);
+    questions = (uint16_t) ((packet[4] << 8) | packet[5]);
+    if (((flags & 0x8000) != 0) || (questions < 1)) return 0;
+
+    /* Only the first question is considered, as with the cast query */
+    if (memcmp(packet + 12, qname, sizeof(qname)) != 0) return 0;
+    return ((packet[12 + sizeof(qname)] == 0x00) &&
+                (packet[12 + sizeof(qname) + 1] == 0x0C));
+}
+
+static void onSignal(int sig) {
+    shutdownRequested = 1;
+}
+
+static void usage(const char *prog) {
+    (void) fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n, --devices N           number of simulated devices (100)\n"
+        "  -i, --interface ADDR      multicast interface address (127.0.0.1)\n"
+        "  -a, --addr-base ADDR      address of the first device, the rest\n"
+        "                            follow consecutively (127.1.0.1)\n"
+        "  -p, --cast-port PORT      advertised (SRV) cast port (8009)\n"
+        "  -P, --sequential-ports    advertise consecutive ports from the\n"
+        "                            cast port (for castsim -n)\n"
+        "  -d, --delay MS            delay before the first answer (0)\n"
+        "  -S, --spread MS           answers spread (uniformly) over this\n"
+        "                            period after the delay (100)\n"
+        "  -l, --loss PCT            answers lost (not sent) (0)\n"
+        "  -k, --pack N              answers packed per packet (1)\n"
+        "  -t, --ttl SECS            PTR/SRV/A record TTL (120)\n"
+        "  -T, --txt-ttl SECS        TXT record TTL (4500)\n"
+        "  -s, --seed N              random seed for spread/loss (1)\n"
+        "  -v, --verbose             log the received queries\n", prog);
+}
+
+/**
+ * Main entry point for the simulator, answers discovery queries until
+ * interrupted and then reports the totals.  For example, 1000 devices
+ * answering within 250ms, with 2% of the answers lost:
+ *
+ *   mdnssim -n 1000 -S 250 -l 2
+ */
+int main(int argc, char **argv) {
+    static struct option opts[] = {
+        { "devices", required_argument, NULL, 'n' },
+        { "interface", required_argument, NULL, 'i' },
+        { "addr-base", required_argument, NULL, 'a' },
+        { "cast-port", required_argument, NULL, 'p' },
+        { "sequential-ports", no_argument, NULL, 'P' },
+        { "delay", required_argument, NULL, 'd' },
+        { "spread", required_argument, NULL, 'S' },
+        { "loss", required_argument, NULL, 'l' },
+        { "pack", required_argument, NULL, 'k' },
+        { "ttl", required_argument, NULL, 't' },
+        { "txt-ttl", required_argument, NULL, 'T' },
+        { "seed", required_argument, NULL, 's' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *addrBase = "127.1.0.1";
+    uint8_t packet[MDNS_MSG_LIMIT];
+    struct sockaddr_in addr, src;
+    struct sigaction sa;
+    struct ip_mreq mreq;
+    struct pollfd pfd;
+    socklen_t srcLen;
+    int opt, fd, timeout, one = 1;
+    ssize_t len;
+
+    while ((opt = getopt_long(argc, argv, "n:i:a:p:Pd:S:l:k:t:T:s:vh",
+                              opts, NULL)) != -1) {
+        switch (opt) {
+            case 'n': config.devices = atoi(optarg); break;
+            case 'i': config.interfaceAddr = optarg; break;
+            case 'a': addrBase = optarg; break;
+            case 'p': config.castPort = atoi(optarg); break;
+            case 'P': config.sequentialPorts = 1; break;
+            case 'd': config.delayMs = atoi(optarg); break;
+            case 'S': config.spreadMs = atoi(optarg); break;
+            case 'l': config.lossPct = atoi(optarg); break;
+            case 'k': config.pack = atoi(optarg); break;
+            case 't': config.ttl = (uint32_t) strtoul(optarg, NULL, 10); break;
+            case 'T': config.txtTtl = (uint32_t) strtoul(optarg, NULL, 10);
+                      break;
+            case 's': config.seed = (unsigned int) atoi(optarg); break;
+            case 'v': config.verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+    if ((config.devices <= 0) || (config.devices > 65000)) {
+        (void) fprintf(stderr, "Device count must be from 1 to 65000\n");
+        return 2;
+    }
+    if ((config.pack < 1) || (config.pack > MAX_PACK)) {
+        (void) fprintf(stderr, "Answer packing must be from 1 to %d\n",
+                       MAX_PACK);
+        return 2;
+    }
+    if (inet_pton(AF_INET, addrBase, &(config.baseAddr)) != 1) {
+        (void) fprintf(stderr, "Invalid device address base '%s'\n", addrBase);
+        return 2;
+    }
+    srand(config.seed);
+
+    /* Shared with any other responder on the host (or namespace) */
+    if (((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) ||
+            (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) ||
+            (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)) {
+        (void) fprintf(stderr, "Unable to create socket: %s\n",
+                       strerror(errno));
+        return 1;
+    }
+    (void) memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MDNS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    (void) memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr.s_addr = htonl(0xE00000FB /* 224.0.0.251 */);
+    if (inet_pton(AF_INET, config.interfaceAddr,
+                  &(mreq.imr_interface)) != 1) {
+        (void) fprintf(stderr, "Invalid interface address '%s'\n",
+                       config.interfaceAddr);
+        return 2;
+    }
+    if ((bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+            (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                        sizeof(mreq)) < 0)) {
+        (void) fprintf(stderr, "Unable to join mDNS group on %s: %s\n",
+                       config.interfaceAddr, strerror(errno));
+        return 1;
+    }
+
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGTERM, &sa, NULL);
+
+    (void) fprintf(stderr, "mdnssim listening for %d devices on %s\n",
+                   config.devices, config.interfaceAddr);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!shutdownRequested) {
+        /* Wake for the next scheduled answer, if any */
+        timeout = -1;
+        if (pendingCount > 0) {
+            timeout = (int) ((pending[0].due - nowUsec() + 999) / 1000);
+            if (timeout < 0) timeout = 0;
+        }
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            (void) fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (pfd.revents & POLLIN) {
+            srcLen = sizeof(src);
+            len = recvfrom(fd, packet, sizeof(packet), 0,
+                           (struct sockaddr *) &src, &srcLen);
+            /* Only legacy unicast queries (as castDiscover) are answered */
+            if ((len > 0) && (ntohs(src.sin_port) != MDNS_PORT) &&
+                    (isCastQuery(packet, len))) {
+                totals.queries++;
+                if (config.verbose) {
+                    (void) fprintf(stderr, "Query %04x from %s:%d\n",
+                                   (packet[0] << 8) | packet[1],
+                                   inet_ntoa(src.sin_addr),
+                                   ntohs(src.sin_port));
+                }
+                scheduleAnswers((uint16_t) ((packet[0] << 8) | packet[1]),
+                                &src);
+            } else if (len > 0) {
+                totals.ignored++;
+            }
+        }
+
+        dispatchAnswers(fd);
+    }
+
+    (void) fprintf(stderr, "queries=%lld ignored=%lld packets=%lld "
+                           "answers=%lld lost=%lld\n",
+                   (long long) totals.queries, (long long) totals.ignored,
+                   (long long) totals.packets, (long long) totals.answers,
+                   (long long) totals.lost);
+    (void) close(fd);
+    return 0;
+}